@@ -169,6 +169,8 @@ typedef struct ngx_http_lua_posted_thread_s  ngx_http_lua_posted_thread_t;
 typedef struct ngx_http_lua_balancer_peer_data_s
     ngx_http_lua_balancer_peer_data_t;
 
+typedef struct ngx_http_lua_dns_cache_s  ngx_http_lua_dns_cache_t;
+
 typedef ngx_int_t (*ngx_http_lua_main_conf_handler_pt)(ngx_log_t *log,
     ngx_http_lua_main_conf_t *lmcf, lua_State *L);
 
@@ -225,6 +227,8 @@ struct ngx_http_lua_main_conf_s {
 
     ngx_array_t         *shdict_zones; /* shm zones of "shdict" */
 
+    ngx_str_t            singleflight_dict;
+
     ngx_array_t         *preload_hooks; /* of ngx_http_lua_preload_hook_t */
 
     ngx_flag_t           postponed_to_rewrite_phase_end;
@@ -412,6 +416,8 @@ typedef struct {
 
     ngx_uint_t                       pool_size;
 
+    ngx_http_lua_dns_cache_t        *dns_cache;
+
     ngx_flag_t                       transform_underscores_in_resp_headers;
     ngx_flag_t                       log_socket_errors;
     ngx_flag_t                       check_client_abort;
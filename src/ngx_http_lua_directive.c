@@ -76,7 +76,17 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_lua_main_conf_t   *lmcf = conf;
 
-    ngx_str_t                  *value, name;
+    ngx_str_t                  *value, name, v;
+    ngx_uint_t                  i;
+    ngx_int_t                   nshards, nevents, nl1;
+    ngx_uint_t                  read_mostly;
+    ngx_uint_t                  hugepages;
+    ngx_uint_t                  index;
+    ngx_uint_t                  policy;
+    ngx_uint_t                  expiry;
+    ngx_str_t                   persist;
+    ngx_msec_t                  persist_interval;
+    ssize_t                     compress;
     ngx_shm_zone_t             *zone;
     ngx_shm_zone_t            **zp;
     ngx_http_lua_shdict_ctx_t  *ctx;
@@ -116,6 +126,227 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    nshards = 1;
+    read_mostly = 0;
+    hugepages = 0;
+    index = NGX_HTTP_LUA_SHDICT_INDEX_RBTREE;
+    policy = NGX_HTTP_LUA_SHDICT_POLICY_LRU;
+    expiry = NGX_HTTP_LUA_SHDICT_EXPIRY_LRU;
+    nevents = 0;
+    nl1 = 0;
+    compress = 0;
+    ngx_str_null(&persist);
+    persist_interval = 0;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            nshards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (nshards == NGX_ERROR || nshards < 1 || nshards > 256) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict shards \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+            if (nshards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "lua shared dict shards require atomic "
+                                   "operations support");
+                return NGX_CONF_ERROR;
+            }
+#endif
+
+            if (size / nshards <= 8191) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "lua shared dict size \"%V\" is too small "
+                                   "for \"%V\"", &value[2], &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "read_mostly") == 0) {
+            read_mostly = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "hugepages") == 0) {
+#if (NGX_LINUX && defined MADV_HUGEPAGE)
+            hugepages = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "lua shared dict hugepages are not supported "
+                               "on this platform, ignored");
+#endif
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "index=rbtree") == 0) {
+            index = NGX_HTTP_LUA_SHDICT_INDEX_RBTREE;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "index=hash") == 0) {
+            index = NGX_HTTP_LUA_SHDICT_INDEX_HASH;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "policy=lru") == 0) {
+            policy = NGX_HTTP_LUA_SHDICT_POLICY_LRU;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "policy=tinylfu") == 0) {
+            policy = NGX_HTTP_LUA_SHDICT_POLICY_TINYLFU;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "expiry=lru") == 0) {
+            expiry = NGX_HTTP_LUA_SHDICT_EXPIRY_LRU;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "expiry=wheel") == 0) {
+            expiry = NGX_HTTP_LUA_SHDICT_EXPIRY_WHEEL;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "events=", 7) == 0) {
+
+            nevents = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+            if (nevents == NGX_ERROR || nevents < 16 || nevents > 65536) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict events \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_EVENTFD)
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared dict events require eventfd "
+                               "support");
+            return NGX_CONF_ERROR;
+#endif
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "compress=", 9) == 0) {
+
+            v.data = value[i].data + 9;
+            v.len = value[i].len - 9;
+
+            compress = ngx_parse_size(&v);
+
+            if (compress == NGX_ERROR || compress == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict compress \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_ZLIB)
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared dict compress requires zlib, "
+                               "which nginx was built without");
+            return NGX_CONF_ERROR;
+#endif
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "l1=", 3) == 0) {
+
+            nl1 = ngx_atoi(value[i].data + 3, value[i].len - 3);
+
+            if (nl1 == NGX_ERROR || nl1 < 1 || nl1 > 1048576) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict l1 \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "persist=", 8) == 0) {
+
+            persist.data = value[i].data + 8;
+            persist.len = value[i].len - 8;
+
+            if (persist.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict persist \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &persist, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "persist_interval=", 17) == 0) {
+
+            v.data = value[i].data + 17;
+            v.len = value[i].len - 17;
+
+            persist_interval = ngx_parse_time(&v, 0);
+
+            if (persist_interval == (ngx_msec_t) NGX_ERROR
+                || persist_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict persist_interval "
+                                   "\"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid lua shared dict index \"%V\"",
+                               &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "policy=", 7) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid lua shared dict policy \"%V\"",
+                               &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "expiry=", 7) == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid lua shared dict expiry \"%V\"",
+                               &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lua shared dict parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (persist_interval && persist.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua shared dict persist_interval requires "
+                           "persist");
+        return NGX_CONF_ERROR;
+    }
+
     ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_shdict_ctx_t));
     if (ctx == NULL) {
         return NGX_CONF_ERROR;
@@ -124,6 +355,57 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ctx->name = name;
     ctx->main_conf = lmcf;
     ctx->log = &cf->cycle->new_log;
+    ctx->nshards = (ngx_uint_t) nshards;
+    ctx->read_mostly = read_mostly;
+    ctx->hugepages = hugepages;
+    ctx->index = index;
+    ctx->policy = policy;
+    ctx->expiry = expiry;
+    ctx->persist = persist;
+    ctx->persist_interval = persist_interval;
+    ctx->compress = (size_t) compress;
+    ctx->l1_size = (ngx_uint_t) nl1;
+
+    if (nevents) {
+        ctx->notify = ngx_pcalloc(cf->pool,
+                                  sizeof(ngx_http_lua_shdict_notify_t));
+        if (ctx->notify == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        for (ctx->notify->size = 16;
+             ctx->notify->size < (ngx_uint_t) nevents;
+             ctx->notify->size <<= 1)
+        {
+            /* void */
+        }
+
+        ngx_queue_init(&ctx->notify->waiters);
+    }
+
+    if (nshards == 1) {
+        ctx->shards = ctx;
+
+    } else {
+        ctx->shards = ngx_pcalloc(cf->pool,
+                                  sizeof(ngx_http_lua_shdict_ctx_t) * nshards);
+        if (ctx->shards == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        for (i = 0; i < (ngx_uint_t) nshards; i++) {
+            ctx->shards[i].name = name;
+            ctx->shards[i].main_conf = lmcf;
+            ctx->shards[i].log = ctx->log;
+            ctx->shards[i].nshards = 1;
+            ctx->shards[i].shards = &ctx->shards[i];
+            ctx->shards[i].read_mostly = read_mostly;
+            ctx->shards[i].index = index;
+            ctx->shards[i].policy = policy;
+            ctx->shards[i].expiry = expiry;
+            ctx->shards[i].notify = ctx->notify;
+        }
+    }
 
     zone = ngx_http_lua_shared_memory_add(cf, &name, (size_t) size,
                                           &ngx_http_lua_module);
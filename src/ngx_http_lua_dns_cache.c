@@ -0,0 +1,735 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_dns_cache.h"
+#include "ngx_http_lua_shdict.h"
+#include "ngx_http_lua_util.h"
+
+
+#define NGX_HTTP_LUA_DNS_CACHE_NEGATIVE   5
+#define NGX_HTTP_LUA_DNS_CACHE_VALID      30  /* when the TTL is unknown */
+#define NGX_HTTP_LUA_DNS_CACHE_MAX_ADDRS  32
+#define NGX_HTTP_LUA_DNS_CACHE_MAX_NAME   255
+
+#define NGX_HTTP_LUA_DNS_CACHE_SOCKLEN                                       \
+    ngx_align(NGX_SOCKADDRLEN, NGX_ALIGNMENT)
+
+
+typedef struct {
+    ngx_str_node_t               sn;  /* keyed by the crc32 of the name */
+    ngx_queue_t                  queue;
+    time_t                       expires;
+    ngx_int_t                    state;  /* the resolver error, or 0 */
+    ngx_uint_t                   naddrs;
+    ngx_resolver_addr_t         *addrs;
+    unsigned                     refreshing:1;
+} ngx_http_lua_dns_cache_node_t;
+
+
+/*
+ * the value of a name in the lua_shared_dict zone: this header, then the
+ * socklen and the sockaddr of each address
+ */
+
+typedef struct {
+    int64_t                      expires;
+    int32_t                      state;
+    uint32_t                     naddrs;
+} ngx_http_lua_dns_cache_shared_t;
+
+
+#define NGX_HTTP_LUA_DNS_CACHE_SHARED_LEN                                    \
+    (sizeof(ngx_http_lua_dns_cache_shared_t)                                 \
+     + NGX_HTTP_LUA_DNS_CACHE_MAX_ADDRS                                      \
+       * (sizeof(uint32_t) + NGX_SOCKADDRLEN))
+
+
+static ngx_http_lua_dns_cache_node_t *ngx_http_lua_dns_cache_find(
+    ngx_http_lua_dns_cache_t *cache, ngx_str_t *name);
+static ngx_http_lua_dns_cache_node_t *ngx_http_lua_dns_cache_add(
+    ngx_http_lua_dns_cache_t *cache, ngx_str_t *name, ngx_int_t state,
+    time_t expires, ngx_resolver_addr_t *addrs, ngx_uint_t naddrs);
+static void ngx_http_lua_dns_cache_delete(ngx_http_lua_dns_cache_t *cache,
+    ngx_http_lua_dns_cache_node_t *node);
+static void ngx_http_lua_dns_cache_refresh(ngx_http_request_t *r,
+    ngx_http_lua_dns_cache_t *cache, ngx_http_lua_dns_cache_node_t *node);
+static void ngx_http_lua_dns_cache_refresh_handler(ngx_resolver_ctx_t *ctx);
+static ngx_shm_zone_t *ngx_http_lua_dns_cache_zone(
+    ngx_http_lua_dns_cache_t *cache);
+static size_t ngx_http_lua_dns_cache_shared_key(u_char *key, ngx_str_t *name);
+static ngx_http_lua_dns_cache_node_t *ngx_http_lua_dns_cache_shared_get(
+    ngx_http_lua_dns_cache_t *cache, ngx_str_t *name);
+static void ngx_http_lua_dns_cache_shared_set(ngx_http_lua_dns_cache_t *cache,
+    ngx_http_lua_dns_cache_node_t *node);
+
+
+char *
+ngx_http_lua_socket_dns_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_lua_loc_conf_t    *llcf = conf;
+
+    time_t                      t;
+    ngx_int_t                   max;
+    ngx_str_t                  *value, s;
+    ngx_uint_t                  i;
+    ngx_http_lua_dns_cache_t   *cache;
+
+    if (llcf->dns_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts > 2) {
+            i = 2;
+            goto invalid;
+        }
+
+        llcf->dns_cache = NULL;
+        return NGX_CONF_OK;
+    }
+
+    max = ngx_atoi(value[1].data, value[1].len);
+
+    if (max == NGX_ERROR || max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lua socket dns cache size \"%V\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_dns_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     cache->valid = 0;
+     *     cache->stale = 0;
+     *     cache->shared = { 0, NULL };
+     *     cache->zone = NULL;
+     */
+
+    cache->max = max;
+    cache->negative = NGX_HTTP_LUA_DNS_CACHE_NEGATIVE;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            t = ngx_parse_time(&s, 1);
+            if (t == (time_t) NGX_ERROR || t == 0) {
+                goto invalid;
+            }
+
+            cache->valid = t;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "negative=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            t = ngx_parse_time(&s, 1);
+            if (t == (time_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            cache->negative = t;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "stale=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            t = ngx_parse_time(&s, 1);
+            if (t == (time_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            cache->stale = t;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shared=", 7) == 0) {
+
+            cache->shared.len = value[i].len - 7;
+            cache->shared.data = value[i].data + 7;
+
+            if (cache->shared.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->queue);
+
+    llcf->dns_cache = cache;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * returns NGX_OK with one of the addresses of the name, picked at random
+ * and copied to the request pool, NGX_DONE with the resolver error of a
+ * negative entry, and NGX_DECLINED when the name has to be resolved
+ */
+
+ngx_int_t
+ngx_http_lua_dns_cache_lookup(ngx_http_request_t *r,
+    ngx_http_lua_dns_cache_t *cache, ngx_str_t *name, ngx_addr_t *addr,
+    ngx_int_t *state)
+{
+    time_t                          now;
+    ngx_uint_t                      i;
+    ngx_resolver_addr_t            *a;
+    ngx_http_lua_dns_cache_node_t  *node;
+
+    now = ngx_time();
+
+    node = ngx_http_lua_dns_cache_find(cache, name);
+
+    if (node == NULL && cache->shared.len) {
+        node = ngx_http_lua_dns_cache_shared_get(cache, name);
+    }
+
+    if (node == NULL) {
+        goto miss;
+    }
+
+    if (now >= node->expires
+        && (node->state || now >= node->expires + cache->stale))
+    {
+        ngx_http_lua_dns_cache_delete(cache, node);
+        goto miss;
+    }
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&cache->queue, &node->queue);
+
+    if (node->state) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua dns cache negative hit for \"%V\"", name);
+
+        cache->negative_hits++;
+        *state = node->state;
+        return NGX_DONE;
+    }
+
+    i = (node->naddrs == 1) ? 0 : ngx_random() % node->naddrs;
+
+    a = &node->addrs[i];
+
+    addr->sockaddr = ngx_palloc(r->pool, a->socklen);
+    if (addr->sockaddr == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(addr->sockaddr, a->sockaddr, a->socklen);
+    addr->socklen = a->socklen;
+
+    if (now < node->expires) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua dns cache hit for \"%V\"", name);
+
+        cache->hits++;
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua dns cache stale hit for \"%V\"", name);
+
+    cache->stale_hits++;
+
+    if (!node->refreshing) {
+        ngx_http_lua_dns_cache_refresh(r, cache, node);
+    }
+
+    return NGX_OK;
+
+miss:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua dns cache miss for \"%V\"", name);
+
+    cache->misses++;
+    return NGX_DECLINED;
+}
+
+
+void
+ngx_http_lua_dns_cache_update(ngx_http_lua_dns_cache_t *cache,
+    ngx_resolver_ctx_t *ctx)
+{
+    time_t                          expires;
+    ngx_http_lua_dns_cache_node_t  *node;
+
+    if (ctx->state == NGX_OK && ctx->naddrs) {
+
+        if (cache->valid) {
+            expires = ngx_time() + cache->valid;
+
+        } else {
+#if (nginx_version >= 1013000)
+            expires = ctx->valid;
+#else
+            expires = ngx_time() + NGX_HTTP_LUA_DNS_CACHE_VALID;
+#endif
+        }
+
+        node = ngx_http_lua_dns_cache_add(cache, &ctx->name, 0, expires,
+                                          ctx->addrs, ctx->naddrs);
+
+    } else if (ctx->state == NGX_RESOLVE_NXDOMAIN && cache->negative) {
+        node = ngx_http_lua_dns_cache_add(cache, &ctx->name, ctx->state,
+                                          ngx_time() + cache->negative,
+                                          NULL, 0);
+
+    } else {
+        node = ngx_http_lua_dns_cache_find(cache, &ctx->name);
+        if (node == NULL) {
+            return;
+        }
+
+        if (ctx->state == NGX_RESOLVE_NXDOMAIN) {
+            ngx_http_lua_dns_cache_delete(cache, node);
+            return;
+        }
+
+        /* a stale answer is still used until the stale time is over */
+
+        node->refreshing = 0;
+        return;
+    }
+
+    if (node && cache->shared.len) {
+        ngx_http_lua_dns_cache_shared_set(cache, node);
+    }
+}
+
+
+int
+ngx_http_lua_dns_cache_stats(lua_State *L)
+{
+    ngx_http_request_t         *r;
+    ngx_http_lua_loc_conf_t    *llcf;
+    ngx_http_lua_dns_cache_t   *cache;
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    cache = llcf->dns_cache;
+
+    if (cache == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "dns cache disabled");
+        return 2;
+    }
+
+    lua_createtable(L, 0 /* narr */, 5 /* nrec */);
+
+    lua_pushinteger(L, (lua_Integer) cache->hits);
+    lua_setfield(L, -2, "hits");
+
+    lua_pushinteger(L, (lua_Integer) cache->stale_hits);
+    lua_setfield(L, -2, "stale");
+
+    lua_pushinteger(L, (lua_Integer) cache->negative_hits);
+    lua_setfield(L, -2, "negative");
+
+    lua_pushinteger(L, (lua_Integer) cache->misses);
+    lua_setfield(L, -2, "misses");
+
+    lua_pushinteger(L, (lua_Integer) cache->entries);
+    lua_setfield(L, -2, "entries");
+
+    return 1;
+}
+
+
+static ngx_http_lua_dns_cache_node_t *
+ngx_http_lua_dns_cache_find(ngx_http_lua_dns_cache_t *cache, ngx_str_t *name)
+{
+    uint32_t  hash;
+
+    hash = ngx_crc32_long(name->data, name->len);
+
+    return (ngx_http_lua_dns_cache_node_t *)
+               ngx_str_rbtree_lookup(&cache->rbtree, name, hash);
+}
+
+
+static ngx_http_lua_dns_cache_node_t *
+ngx_http_lua_dns_cache_add(ngx_http_lua_dns_cache_t *cache, ngx_str_t *name,
+    ngx_int_t state, time_t expires, ngx_resolver_addr_t *addrs,
+    ngx_uint_t naddrs)
+{
+    u_char                         *p;
+    ngx_uint_t                      i;
+    ngx_queue_t                    *q;
+    ngx_http_lua_dns_cache_node_t  *node;
+
+    node = ngx_http_lua_dns_cache_find(cache, name);
+    if (node) {
+        ngx_http_lua_dns_cache_delete(cache, node);
+    }
+
+    if (naddrs > NGX_HTTP_LUA_DNS_CACHE_MAX_ADDRS) {
+        naddrs = NGX_HTTP_LUA_DNS_CACHE_MAX_ADDRS;
+    }
+
+    /* the addresses, their sockaddrs and the name follow the node */
+
+    node = ngx_alloc(sizeof(ngx_http_lua_dns_cache_node_t)
+                     + naddrs * (sizeof(ngx_resolver_addr_t)
+                                 + NGX_HTTP_LUA_DNS_CACHE_SOCKLEN)
+                     + name->len, ngx_cycle->log);
+    if (node == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(node, sizeof(ngx_http_lua_dns_cache_node_t));
+
+    node->addrs = (ngx_resolver_addr_t *) (node + 1);
+    p = (u_char *) &node->addrs[naddrs];
+
+    for (i = 0; i < naddrs; i++) {
+        ngx_memzero(&node->addrs[i], sizeof(ngx_resolver_addr_t));
+
+        node->addrs[i].sockaddr = (struct sockaddr *) p;
+        node->addrs[i].socklen = addrs[i].socklen;
+
+        ngx_memcpy(p, addrs[i].sockaddr, addrs[i].socklen);
+        p += NGX_HTTP_LUA_DNS_CACHE_SOCKLEN;
+    }
+
+    node->sn.str.len = name->len;
+    node->sn.str.data = p;
+    ngx_memcpy(p, name->data, name->len);
+
+    node->sn.node.key = ngx_crc32_long(name->data, name->len);
+
+    node->expires = expires;
+    node->state = state;
+    node->naddrs = naddrs;
+
+    ngx_rbtree_insert(&cache->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&cache->queue, &node->queue);
+
+    if (++cache->entries > cache->max) {
+        q = ngx_queue_last(&cache->queue);
+        ngx_http_lua_dns_cache_delete(cache,
+            ngx_queue_data(q, ngx_http_lua_dns_cache_node_t, queue));
+    }
+
+    return node;
+}
+
+
+static void
+ngx_http_lua_dns_cache_delete(ngx_http_lua_dns_cache_t *cache,
+    ngx_http_lua_dns_cache_node_t *node)
+{
+    ngx_rbtree_delete(&cache->rbtree, &node->sn.node);
+    ngx_queue_remove(&node->queue);
+
+    cache->entries--;
+
+    ngx_free(node);
+}
+
+
+static void
+ngx_http_lua_dns_cache_refresh(ngx_http_request_t *r,
+    ngx_http_lua_dns_cache_t *cache, ngx_http_lua_dns_cache_node_t *node)
+{
+    ngx_str_t                   name;
+    ngx_resolver_ctx_t         *rctx, temp;
+    ngx_http_core_loc_conf_t   *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    temp.name = node->sn.str;
+
+    rctx = ngx_resolve_start(clcf->resolver, &temp);
+    if (rctx == NULL || rctx == NGX_NO_RESOLVER) {
+        return;
+    }
+
+    /* the name outlives the node, which the answer may replace */
+
+    name.len = node->sn.str.len;
+    name.data = ngx_alloc(name.len, ngx_cycle->log);
+    if (name.data == NULL) {
+        ngx_resolve_name_done(rctx);
+        return;
+    }
+
+    ngx_memcpy(name.data, node->sn.str.data, name.len);
+
+    rctx->name = name;
+    rctx->handler = ngx_http_lua_dns_cache_refresh_handler;
+    rctx->data = cache;
+    rctx->timeout = clcf->resolver_timeout;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua dns cache refresh \"%V\"", &name);
+
+    node->refreshing = 1;
+
+    /* the handler could have been called by now */
+
+    if (ngx_resolve_name(rctx) != NGX_OK) {
+        node = ngx_http_lua_dns_cache_find(cache, &name);
+        if (node) {
+            node->refreshing = 0;
+        }
+
+        ngx_free(name.data);
+    }
+}
+
+
+static void
+ngx_http_lua_dns_cache_refresh_handler(ngx_resolver_ctx_t *ctx)
+{
+    u_char                     *name;
+    ngx_http_lua_dns_cache_t   *cache;
+
+    cache = ctx->data;
+    name = ctx->name.data;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua dns cache refreshed \"%V\": %i, naddrs: %ui",
+                   &ctx->name, ctx->state, ctx->naddrs);
+
+    ngx_http_lua_dns_cache_update(cache, ctx);
+
+    ngx_resolve_name_done(ctx);
+
+    ngx_free(name);
+}
+
+
+static ngx_shm_zone_t *
+ngx_http_lua_dns_cache_zone(ngx_http_lua_dns_cache_t *cache)
+{
+    if (cache->zone) {
+        return cache->zone;
+    }
+
+    cache->zone = ngx_http_lua_find_zone(cache->shared.data,
+                                         cache->shared.len);
+
+    if (cache->zone == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "lua_socket_dns_cache: lua_shared_dict \"%V\" "
+                      "not found", &cache->shared);
+
+        /* the cache of this worker goes on without it */
+        cache->shared.len = 0;
+    }
+
+    return cache->zone;
+}
+
+
+static size_t
+ngx_http_lua_dns_cache_shared_key(u_char *key, ngx_str_t *name)
+{
+    u_char  *p;
+
+    p = ngx_cpymem(key, "dns:", sizeof("dns:") - 1);
+    p = ngx_cpymem(p, name->data, name->len);
+
+    return p - key;
+}
+
+
+static ngx_http_lua_dns_cache_node_t *
+ngx_http_lua_dns_cache_shared_get(ngx_http_lua_dns_cache_t *cache,
+    ngx_str_t *name)
+{
+    u_char                            *p, *last;
+    u_char                             key[sizeof("dns:") - 1
+                                           + NGX_HTTP_LUA_DNS_CACHE_MAX_NAME];
+    u_char                             buf[NGX_HTTP_LUA_DNS_CACHE_SHARED_LEN];
+    size_t                             klen;
+    uint32_t                           len;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i;
+    ngx_shm_zone_t                    *zone;
+    ngx_resolver_addr_t                addrs[NGX_HTTP_LUA_DNS_CACHE_MAX_ADDRS];
+    ngx_http_lua_value_t               value;
+    ngx_http_lua_dns_cache_shared_t    hdr;
+
+    if (name->len > NGX_HTTP_LUA_DNS_CACHE_MAX_NAME) {
+        return NULL;
+    }
+
+    zone = ngx_http_lua_dns_cache_zone(cache);
+    if (zone == NULL) {
+        return NULL;
+    }
+
+    klen = ngx_http_lua_dns_cache_shared_key(key, name);
+
+    value.value.s.data = buf;
+    value.value.s.len = sizeof(buf);
+
+    rc = ngx_http_lua_shared_dict_get(zone, key, klen, &value);
+    if (rc != NGX_OK) {
+        return NULL;
+    }
+
+    if (value.type != LUA_TSTRING || value.value.s.len < sizeof(hdr)) {
+        goto invalid;
+    }
+
+    ngx_memcpy(&hdr, buf, sizeof(hdr));
+
+    if (hdr.naddrs > NGX_HTTP_LUA_DNS_CACHE_MAX_ADDRS
+        || (hdr.state == 0 && hdr.naddrs == 0))
+    {
+        goto invalid;
+    }
+
+    p = buf + sizeof(hdr);
+    last = buf + value.value.s.len;
+
+    for (i = 0; i < hdr.naddrs; i++) {
+
+        if ((size_t) (last - p) < sizeof(uint32_t)) {
+            goto invalid;
+        }
+
+        ngx_memcpy(&len, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+
+        if (len > NGX_SOCKADDRLEN || len > (size_t) (last - p)) {
+            goto invalid;
+        }
+
+        addrs[i].sockaddr = (struct sockaddr *) p;
+        addrs[i].socklen = len;
+
+        p += len;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua dns cache got \"%V\" from the shared dict", name);
+
+    return ngx_http_lua_dns_cache_add(cache, name, hdr.state,
+                                      (time_t) hdr.expires, addrs,
+                                      hdr.naddrs);
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "lua_socket_dns_cache: bad value of \"%V\" in "
+                  "lua_shared_dict \"%V\"", name, &cache->shared);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_lua_dns_cache_shared_set(ngx_http_lua_dns_cache_t *cache,
+    ngx_http_lua_dns_cache_node_t *node)
+{
+    int                                forcible;
+    char                              *errmsg;
+    u_char                            *p;
+    u_char                             key[sizeof("dns:") - 1
+                                           + NGX_HTTP_LUA_DNS_CACHE_MAX_NAME];
+    u_char                             buf[NGX_HTTP_LUA_DNS_CACHE_SHARED_LEN];
+    size_t                             klen;
+    time_t                             exptime;
+    uint32_t                           len;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i;
+    ngx_shm_zone_t                    *zone;
+    ngx_http_lua_dns_cache_shared_t    hdr;
+
+    if (node->sn.str.len > NGX_HTTP_LUA_DNS_CACHE_MAX_NAME) {
+        return;
+    }
+
+    /* the other workers still serve the stale answers from the zone */
+
+    exptime = node->expires - ngx_time() + (node->state ? 0 : cache->stale);
+    if (exptime <= 0) {
+        return;
+    }
+
+    zone = ngx_http_lua_dns_cache_zone(cache);
+    if (zone == NULL) {
+        return;
+    }
+
+    klen = ngx_http_lua_dns_cache_shared_key(key, &node->sn.str);
+
+    hdr.expires = node->expires;
+    hdr.state = (int32_t) node->state;
+    hdr.naddrs = (uint32_t) node->naddrs;
+
+    p = ngx_cpymem(buf, &hdr, sizeof(hdr));
+
+    for (i = 0; i < node->naddrs; i++) {
+        len = node->addrs[i].socklen;
+
+        p = ngx_cpymem(p, &len, sizeof(uint32_t));
+        p = ngx_cpymem(p, node->addrs[i].sockaddr, len);
+    }
+
+    errmsg = NULL;
+
+    rc = ngx_http_lua_ffi_shdict_store(zone, 0, key, klen, LUA_TSTRING, buf,
+                                       p - buf, 0, (long) exptime * 1000, 0,
+                                       &errmsg, &forcible);
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "lua_socket_dns_cache: failed to store \"%V\" in "
+                      "lua_shared_dict \"%V\": %s", &node->sn.str,
+                      &cache->shared, errmsg ? errmsg : "unknown error");
+    }
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
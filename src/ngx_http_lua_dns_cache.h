@@ -0,0 +1,49 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_LUA_DNS_CACHE_H_INCLUDED_
+#define _NGX_HTTP_LUA_DNS_CACHE_H_INCLUDED_
+
+
+#include "ngx_http_lua_common.h"
+
+
+/* one cache per lua_socket_dns_cache directive, private to each worker */
+struct ngx_http_lua_dns_cache_s {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;  /* the least recently used last */
+
+    ngx_uint_t                   max;
+    ngx_uint_t                   entries;
+
+    time_t                       valid;  /* 0 for the TTL of the answers */
+    time_t                       negative;
+    time_t                       stale;
+
+    ngx_str_t                    shared;  /* the lua_shared_dict name */
+    ngx_shm_zone_t              *zone;
+
+    ngx_uint_t                   hits;
+    ngx_uint_t                   stale_hits;
+    ngx_uint_t                   negative_hits;
+    ngx_uint_t                   misses;
+};
+
+
+char *ngx_http_lua_socket_dns_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_lua_dns_cache_lookup(ngx_http_request_t *r,
+    ngx_http_lua_dns_cache_t *cache, ngx_str_t *name, ngx_addr_t *addr,
+    ngx_int_t *state);
+void ngx_http_lua_dns_cache_update(ngx_http_lua_dns_cache_t *cache,
+    ngx_resolver_ctx_t *ctx);
+int ngx_http_lua_dns_cache_stats(lua_State *L);
+
+
+#endif /* _NGX_HTTP_LUA_DNS_CACHE_H_INCLUDED_ */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -12,6 +12,7 @@
 
 #include "ngx_http_lua_exitworkerby.h"
 #include "ngx_http_lua_util.h"
+#include "ngx_http_lua_shdict.h"
 
 
 void
@@ -24,8 +25,13 @@ ngx_http_lua_exit_worker(ngx_cycle_t *cycle)
     ngx_http_conf_ctx_t         *conf_ctx;
 
     lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
-    if (lmcf == NULL
-        || lmcf->exit_worker_handler == NULL
+    if (lmcf == NULL) {
+        return;
+    }
+
+    ngx_http_lua_shdict_exit_worker(cycle, lmcf);
+
+    if (lmcf->exit_worker_handler == NULL
         || lmcf->lua == NULL
 #if !(NGX_WIN32)
         || (ngx_process == NGX_PROCESS_HELPER
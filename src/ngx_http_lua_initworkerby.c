@@ -13,6 +13,7 @@
 #include "ngx_http_lua_initworkerby.h"
 #include "ngx_http_lua_util.h"
 #include "ngx_http_lua_pipe.h"
+#include "ngx_http_lua_shdict.h"
 
 
 static u_char *ngx_http_lua_log_init_worker_error(ngx_log_t *log,
@@ -81,6 +82,10 @@ ngx_http_lua_init_worker(ngx_cycle_t *cycle)
     }
 #endif
 
+    if (ngx_http_lua_shdict_init_worker(cycle, lmcf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     if (lmcf->init_worker_handler == NULL) {
         return NGX_OK;
     }
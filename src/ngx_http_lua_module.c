@@ -31,6 +31,8 @@
 #include "ngx_http_lua_ssl_session_fetchby.h"
 #include "ngx_http_lua_headers.h"
 #include "ngx_http_lua_pipe.h"
+#include "ngx_http_lua_shdict.h"
+#include "ngx_http_lua_dns_cache.h"
 
 
 static void *ngx_http_lua_create_main_conf(ngx_conf_t *cf);
@@ -116,12 +118,19 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       NULL },
 
     { ngx_string("lua_shared_dict"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_lua_shared_dict,
       0,
       0,
       NULL },
 
+    { ngx_string("lua_singleflight_dict"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_lua_main_conf_t, singleflight_dict),
+      NULL },
+
     { ngx_string("lua_capture_error_log"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
       ngx_http_lua_capture_error_log,
@@ -518,6 +527,14 @@ static ngx_command_t ngx_http_lua_cmds[] = {
       offsetof(ngx_http_lua_loc_conf_t, pool_size),
       NULL },
 
+    { ngx_string("lua_socket_dns_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
+          |NGX_CONF_1MORE,
+      ngx_http_lua_socket_dns_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("lua_socket_read_timeout"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF
           |NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
@@ -676,7 +693,7 @@ ngx_module_t ngx_http_lua_module = {
     NULL,                       /*  init thread */
     NULL,                       /*  exit thread */
     ngx_http_lua_exit_worker,   /*  exit process */
-    NULL,                       /*  exit master */
+    ngx_http_lua_shdict_exit_master,  /*  exit master */
     NGX_MODULE_V1_PADDING
 };
 
@@ -943,6 +960,7 @@ ngx_http_lua_create_main_conf(ngx_conf_t *cf)
      *      lmcf->init_src = { 0, NULL };
      *      lmcf->shm_zones_inited = 0;
      *      lmcf->shdict_zones = NULL;
+     *      lmcf->singleflight_dict = { 0, NULL };
      *      lmcf->preload_hooks = NULL;
      *      lmcf->requires_header_filter = 0;
      *      lmcf->requires_body_filter = 0;
@@ -1256,6 +1274,7 @@ ngx_http_lua_create_loc_conf(ngx_conf_t *cf)
     conf->send_lowat = NGX_CONF_UNSET_SIZE;
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
     conf->pool_size = NGX_CONF_UNSET_UINT;
+    conf->dns_cache = NGX_CONF_UNSET_PTR;
 
     conf->transform_underscores_in_resp_headers = NGX_CONF_UNSET;
     conf->log_socket_errors = NGX_CONF_UNSET;
@@ -1384,6 +1403,8 @@ ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_uint_value(conf->pool_size, prev->pool_size, 30);
 
+    ngx_conf_merge_ptr_value(conf->dns_cache, prev->dns_cache, NULL);
+
     ngx_conf_merge_value(conf->transform_underscores_in_resp_headers,
                          prev->transform_underscores_in_resp_headers, 1);
 
@@ -14,21 +14,195 @@
 #include "ngx_http_lua_util.h"
 #include "ngx_http_lua_api.h"
 
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+
+#if (NGX_HAVE_EVENTFD && NGX_HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#endif
+
 
+static ngx_int_t ngx_http_lua_shdict_init_shard(
+    ngx_http_lua_shdict_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_shdict_init_notify(
+    ngx_http_lua_shdict_ctx_t *ctx);
+static void ngx_http_lua_shdict_notify_cleanup(void *data);
+static void ngx_http_lua_shdict_notify(ngx_http_lua_shdict_ctx_t *ctx,
+    u_char *key, size_t key_len);
+static void ngx_http_lua_shdict_notify_push(ngx_http_lua_shdict_ctx_t *ctx);
+static void ngx_http_lua_shdict_notify_workers(ngx_http_lua_shdict_ctx_t *ctx);
+static void ngx_http_lua_shdict_notify_handler(ngx_event_t *ev);
+static void ngx_http_lua_shdict_notify_timeout(ngx_event_t *ev);
+static void ngx_http_lua_shdict_notify_wake(ngx_http_lua_co_ctx_t *coctx,
+    ngx_uint_t timedout);
+static ngx_int_t ngx_http_lua_shdict_notify_resume(ngx_http_request_t *r);
+static void ngx_http_lua_shdict_notify_waiter_cleanup(void *data);
+static void ngx_http_lua_shdict_push_events(lua_State *L,
+    ngx_http_lua_shdict_notify_t *notify, uint64_t cursor);
+static ngx_int_t ngx_http_lua_shdict_lpop_copy(ngx_http_lua_shdict_ctx_t *ctx,
+    uint32_t hash, ngx_str_t *key, int *value_type, ngx_str_t *value,
+    char **err);
+static void ngx_http_lua_shdict_push_popped(lua_State *L, int value_type,
+    ngx_str_t *value);
 static int ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx,
     ngx_uint_t n);
-static ngx_int_t ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone,
+static void ngx_http_lua_shdict_free_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static ngx_http_lua_shdict_counter_t *ngx_http_lua_shdict_counter_alloc(
+    ngx_http_lua_shdict_ctx_t *ctx);
+static double ngx_http_lua_shdict_counter_sum(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd);
+static void ngx_http_lua_shdict_wheel_update(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd);
+static ngx_uint_t ngx_http_lua_shdict_wheel_advance(
+    ngx_http_lua_shdict_ctx_t *ctx, uint64_t now);
+static void ngx_http_lua_shdict_wheel_handler(ngx_event_t *ev);
+static void ngx_http_lua_shdict_sketch_add(ngx_http_lua_shdict_shctx_t *sh,
+    uint32_t hash, ngx_uint_t age);
+static ngx_uint_t ngx_http_lua_shdict_sketch_estimate(
+    ngx_http_lua_shdict_shctx_t *sh, uint32_t hash);
+static ngx_int_t ngx_http_lua_shdict_admit(ngx_http_lua_shdict_ctx_t *ctx,
+    uint32_t hash);
+static ngx_int_t ngx_http_lua_shdict_lookup(ngx_http_lua_shdict_ctx_t *ctx,
     ngx_uint_t hash, u_char *kdata, size_t klen,
     ngx_http_lua_shdict_node_t **sdp);
+static ngx_int_t ngx_http_lua_shdict_peek_lock_free(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t hash, u_char *kdata,
+    size_t klen, ngx_http_lua_shdict_node_t **sdp);
+static ngx_int_t ngx_http_lua_shdict_get_lock_free(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash, u_char *key,
+    size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int get_stale, int *is_stale);
+static void ngx_http_lua_shdict_lock_free_done(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash, u_char *key,
+    size_t key_len, ngx_uint_t hit);
+static ngx_int_t ngx_http_lua_shdict_get_locked(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash, u_char *key,
+    size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int get_stale, int *is_stale, char **err);
 static int ngx_http_lua_shdict_flush_expired(lua_State *L);
 static int ngx_http_lua_shdict_get_keys(lua_State *L);
+static int ngx_http_lua_shdict_scan(lua_State *L);
+static ngx_int_t ngx_http_lua_shdict_scan_shard(
+    ngx_http_lua_shdict_ctx_t *shard, uint64_t *pos, ngx_uint_t count,
+    ngx_int_t (*visit)(ngx_http_lua_shdict_node_t *sd, void *data),
+    void *data);
+static ngx_int_t ngx_http_lua_shdict_scan_key(ngx_http_lua_shdict_node_t *sd,
+    void *data);
+static ngx_rbtree_node_t *ngx_http_lua_shdict_rbtree_next(ngx_rbtree_t *tree,
+    ngx_rbtree_node_t *node);
+static ngx_rbtree_node_t *ngx_http_lua_shdict_rbtree_prev(ngx_rbtree_t *tree,
+    ngx_rbtree_node_t *node);
+static int ngx_http_lua_shdict_get_multi(lua_State *L);
+static int ngx_http_lua_shdict_set_multi(lua_State *L);
+static int ngx_http_lua_shdict_stats(lua_State *L);
+static int ngx_http_lua_shdict_incr_fast(lua_State *L);
+static int ngx_http_lua_shdict_get_sum(lua_State *L);
+static int ngx_http_lua_shdict_watch(lua_State *L);
+static int ngx_http_lua_shdict_events(lua_State *L);
+static int ngx_http_lua_shdict_wait_events(lua_State *L);
 static int ngx_http_lua_shdict_lpush(lua_State *L);
 static int ngx_http_lua_shdict_rpush(lua_State *L);
 static int ngx_http_lua_shdict_push_helper(lua_State *L, int flags);
+static ngx_int_t ngx_http_lua_shdict_push_locked(
+    ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash, ngx_str_t *key,
+    int value_type, ngx_str_t *value, int flags, ngx_uint_t *len);
 static int ngx_http_lua_shdict_lpop(lua_State *L);
 static int ngx_http_lua_shdict_rpop(lua_State *L);
 static int ngx_http_lua_shdict_pop_helper(lua_State *L, int flags);
 static int ngx_http_lua_shdict_llen(lua_State *L);
+static int ngx_http_lua_shdict_item_args(lua_State *L, int nargs,
+    ngx_shm_zone_t **zone, ngx_str_t *key, ngx_str_t *field);
+static ngx_int_t ngx_http_lua_shdict_item_open(ngx_http_lua_shdict_ctx_t *ctx,
+    uint32_t hash, ngx_str_t *key, int value_type, ngx_uint_t create,
+    ngx_http_lua_shdict_node_t **sdp, char **err);
+static void ngx_http_lua_shdict_item_drop(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd);
+static ngx_http_lua_shdict_field_node_t *ngx_http_lua_shdict_field_find(
+    ngx_http_lua_shdict_node_t *sd, ngx_str_t *field);
+static ngx_int_t ngx_http_lua_shdict_field_store(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_http_lua_shdict_node_t *sd,
+    ngx_str_t *field, int value_type, ngx_str_t *value);
+static void ngx_http_lua_shdict_push_field(lua_State *L,
+    ngx_http_lua_shdict_field_node_t *fnode);
+static int ngx_http_lua_shdict_hset(lua_State *L);
+static int ngx_http_lua_shdict_hdel(lua_State *L);
+static int ngx_http_lua_shdict_hget(lua_State *L);
+static int ngx_http_lua_shdict_hincr(lua_State *L);
+static int ngx_http_lua_shdict_hgetall(lua_State *L);
+static void ngx_http_lua_shdict_zscore_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_lua_shdict_zname_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_lua_shdict_zmember_t *ngx_http_lua_shdict_zmember_find(
+    ngx_http_lua_shdict_zset_t *zset, ngx_str_t *member, uint32_t hash);
+static ngx_rbtree_node_t *ngx_http_lua_shdict_zset_first(
+    ngx_http_lua_shdict_zset_t *zset, double min);
+static void ngx_http_lua_shdict_zmember_delete(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd, ngx_http_lua_shdict_zmember_t *zm);
+static void ngx_http_lua_shdict_zset_free(ngx_slab_pool_t *shpool,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static int ngx_http_lua_shdict_zset_member(lua_State *L, int index,
+    ngx_str_t *member);
+static int ngx_http_lua_shdict_zadd(lua_State *L);
+static int ngx_http_lua_shdict_zrem(lua_State *L);
+static int ngx_http_lua_shdict_zremrangebyscore(lua_State *L);
+static int ngx_http_lua_shdict_zcount(lua_State *L);
+static int ngx_http_lua_shdict_ztop(lua_State *L);
+static ssize_t ngx_http_lua_shdict_encode(lua_State *L, int index, u_char *p,
+    ngx_uint_t depth, char **err);
+static u_char *ngx_http_lua_shdict_decode(lua_State *L, u_char *p,
+    u_char *last, ngx_uint_t depth);
+static int ngx_http_lua_shdict_set_table(lua_State *L);
+static int ngx_http_lua_shdict_get_table(lua_State *L);
+static ngx_int_t ngx_http_lua_shdict_l1_init(ngx_http_lua_shdict_ctx_t *ctx);
+static void ngx_http_lua_shdict_l1_values(lua_State *L,
+    ngx_http_lua_shdict_l1_t *l1);
+static ngx_http_lua_shdict_l1_entry_t *ngx_http_lua_shdict_l1_find(
+    ngx_http_lua_shdict_l1_t *l1, uint32_t hash, ngx_str_t *key);
+static ngx_uint_t ngx_http_lua_shdict_l1_valid(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_l1_entry_t *e);
+static void ngx_http_lua_shdict_l1_drop(lua_State *L,
+    ngx_http_lua_shdict_l1_t *l1, ngx_http_lua_shdict_l1_entry_t *e);
+static void ngx_http_lua_shdict_l1_store(lua_State *L,
+    ngx_http_lua_shdict_l1_t *l1, ngx_http_lua_shdict_l1_entry_t *e,
+    ngx_http_lua_shdict_node_t *sd, uint32_t hash, ngx_str_t *key,
+    uint32_t version, uint32_t flags);
+static int ngx_http_lua_shdict_l1_get(lua_State *L);
+static int ngx_http_lua_shdict_blpop(lua_State *L);
+#if (nginx_version >= 1011007)
+static size_t ngx_http_lua_shdict_chunk_usage(ngx_slab_pool_t *pool, u_char *p,
+    ngx_uint_t *used, ngx_uint_t *total);
+static ngx_int_t ngx_http_lua_shdict_relocate(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static ngx_uint_t ngx_http_lua_shdict_compact_shard(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t count);
+static int ngx_http_lua_shdict_fragmentation(lua_State *L);
+static int ngx_http_lua_shdict_compact(lua_State *L);
+#endif
+static ngx_int_t ngx_http_lua_shdict_compress(u_char *data, size_t len,
+    u_char **out, size_t *out_len);
+static ngx_int_t ngx_http_lua_shdict_inflate(u_char *src, size_t src_len,
+    u_char *dst, size_t *len);
+static ngx_int_t ngx_http_lua_shdict_decompress(
+    ngx_http_lua_shdict_ctx_t *ctx, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, char **err);
+static u_char *ngx_http_lua_shdict_compress_value(
+    ngx_http_lua_shdict_ctx_t *ctx, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, uint64_t *usec);
+static void ngx_http_lua_shdict_compress_stats(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_int_t rc, u_char *buf, size_t raw_len, size_t len, uint64_t usec);
+static ngx_int_t ngx_http_lua_shdict_load(ngx_http_lua_shdict_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_shdict_save(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_uint_t exiting, ngx_log_t *log);
+static void ngx_http_lua_shdict_persist_handler(ngx_event_t *ev);
+#if (NGX_LINUX && defined MADV_HUGEPAGE)
+static void ngx_http_lua_shdict_hugepages(ngx_shm_zone_t *shm_zone,
+    ngx_log_t *log);
+#endif
 
 
 static ngx_inline ngx_shm_zone_t *ngx_http_lua_shdict_get_zone(lua_State *L,
@@ -44,17 +218,196 @@ static ngx_inline ngx_shm_zone_t *ngx_http_lua_shdict_get_zone(lua_State *L,
 #define NGX_HTTP_LUA_SHDICT_RIGHT       0x0002
 
 
+/* the number of optimistic attempts before falling back to the lock */
+#define NGX_HTTP_LUA_SHDICT_READ_TRIES  4
+
+/* one in so many lock-free hits moves the node to the LRU head */
+#define NGX_HTTP_LUA_SHDICT_LRU_SAMPLE  64
+
+/* the number of keys visited by a scan call by default */
+#define NGX_HTTP_LUA_SHDICT_SCAN_COUNT  100
+
+/* the number of keys visited in every shard by a compact call by default */
+#define NGX_HTTP_LUA_SHDICT_COMPACT_COUNT  100
+
+/* the inline buffer of every get_multi item, longer strings are allocated */
+#define NGX_HTTP_LUA_SHDICT_MULTI_BUF   32
+
+/* the nesting limit of the tables stored by set_table, which stops cycles */
+#define NGX_HTTP_LUA_SHDICT_TABLE_DEPTH 32
+
+/* the stack buffer tables are decoded from, larger ones go to a userdata */
+#define NGX_HTTP_LUA_SHDICT_TABLE_BUF   1024
+
+/* pool bytes per slot of the open-addressing index */
+#define NGX_HTTP_LUA_SHDICT_SLOT_BYTES  128
+
+/* pool bytes per counter of the frequency sketch, and the counter limit */
+#define NGX_HTTP_LUA_SHDICT_SKETCH_BYTES  32
+#define NGX_HTTP_LUA_SHDICT_SKETCH_MAX    15
+
+/*
+ * the timing wheel has 4 levels of 64 buckets, the first one with a tick
+ * of 16ms, so that it spans about 3 days before entries need to be
+ * cascaded from its last bucket again
+ */
+#define NGX_HTTP_LUA_SHDICT_WHEEL_LEVELS    4
+#define NGX_HTTP_LUA_SHDICT_WHEEL_BITS      6
+#define NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS     64  /* 1 << WHEEL_BITS */
+#define NGX_HTTP_LUA_SHDICT_WHEEL_TICK      4  /* log2 of the tick in ms */
+
+/* how often every worker advances the wheels, and how far at most */
+#define NGX_HTTP_LUA_SHDICT_WHEEL_INTERVAL  100
+#define NGX_HTTP_LUA_SHDICT_WHEEL_TICKS     1024
+#define NGX_HTTP_LUA_SHDICT_WHEEL_BATCH     256
+
+/* the page types and bitmaps of the slab allocator, as in ngx_slab.c */
+#define NGX_HTTP_LUA_SHDICT_SLAB_PAGE_MASK   3
+#define NGX_HTTP_LUA_SHDICT_SLAB_BIG         1
+#define NGX_HTTP_LUA_SHDICT_SLAB_EXACT       2
+#define NGX_HTTP_LUA_SHDICT_SLAB_SMALL       3
+#define NGX_HTTP_LUA_SHDICT_SLAB_SHIFT_MASK  0x0f
+
+#if (NGX_PTR_SIZE == 4)
+#define NGX_HTTP_LUA_SHDICT_SLAB_MAP_SHIFT   16
+#else
+#define NGX_HTTP_LUA_SHDICT_SLAB_MAP_SHIFT   32
+#endif
+
+#define NGX_HTTP_LUA_SHDICT_THP_SHMEM                                        \
+    "/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+
+#define NGX_HTTP_LUA_SHDICT_SNAPSHOT_SIGNATURE  "LUASHDCT"
+#define NGX_HTTP_LUA_SHDICT_SNAPSHOT_VERSION    1
+#define NGX_HTTP_LUA_SHDICT_SNAPSHOT_BUF        65536
+
+/* the keys copied under the lock at a time by the periodic snapshots */
+#define NGX_HTTP_LUA_SHDICT_SNAPSHOT_BATCH      256
+
+
+#define ngx_http_lua_shdict_in_pool(ctx, p, size)                            \
+    ((u_char *) (p) >= (ctx)->shpool->start                                  \
+     && (u_char *) (p) + (size) <= (ctx)->shpool->end)
+
+
+#define ngx_http_lua_shdict_slot_node(ctx, slot)                             \
+    ((ngx_rbtree_node_t *) ((u_char *) (ctx)->shpool                         \
+                            + ((size_t) (slot)->node << 3)))
+
+#define ngx_http_lua_shdict_node_slot(ctx, node)                             \
+    ((uint32_t) (((u_char *) (node) - (u_char *) (ctx)->shpool) >> 3))
+
+/* in expiry=wheel zones, every node is preceded by its link in the wheel */
+#define ngx_http_lua_shdict_node_timer(node)                                 \
+    ((ngx_queue_t *) ((u_char *) (node) - sizeof(ngx_queue_t)))
+
+#define ngx_http_lua_shdict_timer_node(q)                                    \
+    ((ngx_rbtree_node_t *) ((u_char *) (q) + sizeof(ngx_queue_t)))
+
+#define ngx_http_lua_shdict_counter_cell(ctx, ref)                           \
+    ((ngx_http_lua_shdict_counter_t *) ((u_char *) (ctx)->shpool             \
+                                        + ((size_t) (ref)->cell << 3)))
+
+#define ngx_http_lua_shdict_counter_slot(cell, i)                            \
+    ((ngx_http_lua_shdict_counter_slot_t *)                                  \
+         ((u_char *) (cell) + ((i) + 1) * NGX_CPU_CACHE_LINE))
+
+/* the index is never filled above 7/8, so that probing always stops */
+#define ngx_http_lua_shdict_index_full(ctx)                                  \
+    ((ctx)->sh->nentries >= (ctx)->sh->mask + 1 - (((ctx)->sh->mask + 1) >> 3))
+
+
 enum {
     SHDICT_USERDATA_INDEX = 1,
 };
 
 
+/*
+ * a snapshot is the header followed by one record per key, each one
+ * followed by the key and the value, and a record with an empty key;
+ * everything is in host byte order
+ */
+
+typedef struct {
+    u_char                       signature[8];
+    uint32_t                     version;
+    uint32_t                     record_size;
+} ngx_http_lua_shdict_snapshot_header_t;
+
+
+typedef struct {
+    uint64_t                     expires;  /* absolute, in ms, or 0 */
+    uint32_t                     value_len;
+    uint32_t                     user_flags;
+    uint16_t                     key_len;
+    uint8_t                      value_type;
+    u_char                       reserved[5];
+} ngx_http_lua_shdict_snapshot_record_t;
+
+
+/* a light thread waiting in wait_events or blpop */
+typedef struct {
+    ngx_queue_t                     queue;
+    ngx_http_lua_co_ctx_t          *coctx;
+    ngx_http_lua_shdict_notify_t   *notify;
+    uint64_t                        cursor;  /* of the events, or of the
+                                                pushes for blpop */
+
+    /* blpop only, the key being allocated along with the waiter */
+    ngx_http_lua_shdict_ctx_t      *shard;
+    uint32_t                        hash;
+    ngx_str_t                       key;
+    int                             value_type;
+    ngx_str_t                       value;  /* popped, ngx_alloc()ed */
+    char                           *err;
+
+    unsigned                        timedout:1;
+    unsigned                        pop:1;
+} ngx_http_lua_shdict_waiter_t;
+
+
+/* the value of a counter node */
+typedef struct {
+    uint32_t                     cell;  /* offset of the cell in the pool,
+                                           in 8-byte units */
+    uint32_t                     gen;
+} ngx_http_lua_shdict_counter_ref_t;
+
+
+typedef struct {
+    ngx_fd_t                     fd;
+    u_char                      *name;
+    u_char                      *start;
+    u_char                      *pos;
+    u_char                      *last;
+    u_char                      *end;
+} ngx_http_lua_shdict_snapshot_buf_t;
+
+
+/* the state of a scan call, or of a batch of a periodic snapshot */
+typedef struct {
+    uint64_t                             now;
+
+    lua_State                           *L;
+    int                                  total;
+
+    ngx_http_lua_shdict_snapshot_buf_t  *b;
+    ngx_uint_t                           saved;
+    ngx_log_t                           *log;
+} ngx_http_lua_shdict_visit_t;
+
+
 enum {
     SHDICT_TNIL = 0,        /* same as LUA_TNIL */
     SHDICT_TBOOLEAN = 1,    /* same as LUA_TBOOLEAN */
     SHDICT_TNUMBER = 3,     /* same as LUA_TNUMBER */
     SHDICT_TSTRING = 4,     /* same as LUA_TSTRING */
     SHDICT_TLIST = 5,
+    SHDICT_TCOUNTER = 6,
+    SHDICT_THASH = 7,
+    SHDICT_TZSET = 8,
+    SHDICT_TCOMPRESSED = 9,  /* a string, see ngx_http_lua_shdict_compress */
+    SHDICT_TTABLE = 10,      /* see ngx_http_lua_shdict_encode */
 };
 
 
@@ -66,44 +419,134 @@ ngx_http_lua_shdict_get_list_head(ngx_http_lua_shdict_node_t *sd, size_t len)
 }
 
 
+static ngx_inline ngx_http_lua_shdict_zset_t *
+ngx_http_lua_shdict_get_zset(ngx_http_lua_shdict_node_t *sd)
+{
+    return (ngx_http_lua_shdict_zset_t *)
+               ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
+}
+
+
+/* the member of a node of the by_score tree of a sorted set */
+
+static ngx_inline ngx_http_lua_shdict_zmember_t *
+ngx_http_lua_shdict_zmember(ngx_rbtree_node_t *node)
+{
+    return (ngx_http_lua_shdict_zmember_t *)
+               ((u_char *) node
+                - offsetof(ngx_http_lua_shdict_zmember_t, by_score));
+}
+
+
+/*
+ * gives the value of a node a new version, which tells the l1 caches of
+ * the processes that their copies are stale, see ngx_http_lua_shdict_l1_valid
+ */
+
+static ngx_inline void
+ngx_http_lua_shdict_new_version(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    /* 0 is left for the freed nodes and those never cached */
+
+    if (++ctx->sh->version == 0) {
+        ctx->sh->version = 1;
+    }
+
+    sd->version = ctx->sh->version;
+}
+
+
+static ngx_inline uint64_t
+ngx_http_lua_shdict_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
 ngx_int_t
 ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_lua_shdict_ctx_t  *octx = data;
 
-    size_t                      len;
+    size_t                      len, size;
+    ngx_uint_t                  i;
+    ngx_slab_pool_t           **pools;
     ngx_http_lua_shdict_ctx_t  *ctx;
 
     dd("init zone");
 
     ctx = shm_zone->data;
 
+#if (NGX_LINUX && defined MADV_HUGEPAGE)
+    if (ctx->hugepages) {
+        ngx_http_lua_shdict_hugepages(shm_zone, ctx->log);
+    }
+#endif
+
     if (octx) {
+        if (octx->nshards != ctx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                          "lua_shared_dict \"%V\" cannot change its number "
+                          "of shards from %ui to %ui on reload", &ctx->name,
+                          octx->nshards, ctx->nshards);
+            return NGX_ERROR;
+        }
+
+        if (octx->index != ctx->index) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                          "lua_shared_dict \"%V\" cannot change its index "
+                          "on reload", &ctx->name);
+            return NGX_ERROR;
+        }
+
+        if (octx->policy != ctx->policy) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                          "lua_shared_dict \"%V\" cannot change its policy "
+                          "on reload", &ctx->name);
+            return NGX_ERROR;
+        }
+
+        if (octx->expiry != ctx->expiry) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                          "lua_shared_dict \"%V\" cannot change its expiry "
+                          "on reload", &ctx->name);
+            return NGX_ERROR;
+        }
+
         ctx->sh = octx->sh;
         ctx->shpool = octx->shpool;
 
-        return NGX_OK;
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->shards[i].sh = octx->shards[i].sh;
+            ctx->shards[i].shpool = octx->shards[i].shpool;
+        }
+
+        return ngx_http_lua_shdict_init_notify(ctx);
     }
 
     ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
 
-        return NGX_OK;
-    }
-
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_lua_shdict_shctx_t));
-    if (ctx->sh == NULL) {
-        return NGX_ERROR;
-    }
+        if (ctx->nshards == 1) {
+            ctx->sh = ctx->shpool->data;
+            return ngx_http_lua_shdict_init_notify(ctx);
+        }
 
-    ctx->shpool->data = ctx->sh;
+        pools = ctx->shpool->data;
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_lua_shdict_rbtree_insert_value);
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->shards[i].shpool = pools[i];
+            ctx->shards[i].sh = pools[i]->data;
+        }
 
-    ngx_queue_init(&ctx->sh->lru_queue);
+        return ngx_http_lua_shdict_init_notify(ctx);
+    }
 
     len = sizeof(" in lua_shared_dict zone \"\"") + shm_zone->shm.name.len;
 
@@ -117,1435 +560,8943 @@ ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 
     ctx->shpool->log_nomem = 0;
 
-    return NGX_OK;
-}
+    if (ctx->nshards == 1) {
+        if (ngx_http_lua_shdict_init_shard(ctx) != NGX_OK
+            || ngx_http_lua_shdict_init_notify(ctx) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
 
+        return ngx_http_lua_shdict_load(ctx);
+    }
 
-void
-ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
-{
-    ngx_rbtree_node_t           **p;
-    ngx_http_lua_shdict_node_t   *sdn, *sdnt;
+    /*
+     * each shard gets its own slab pool, carved out of the zone's one,
+     * so that it has a mutex, an rbtree and an LRU queue of its own
+     */
 
-    for ( ;; ) {
+    pools = ngx_slab_alloc(ctx->shpool,
+                           sizeof(ngx_slab_pool_t *) * ctx->nshards);
+    if (pools == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (node->key < temp->key) {
+    ctx->shpool->data = pools;
 
-            p = &temp->left;
+    size = (ctx->shpool->pfree / ctx->nshards) << ngx_pagesize_shift;
 
-        } else if (node->key > temp->key) {
+    for (i = 0; i < ctx->nshards; i++) {
+        pools[i] = ngx_slab_alloc(ctx->shpool, size);
+        if (pools[i] == NULL) {
+            return NGX_ERROR;
+        }
 
-            p = &temp->right;
+        pools[i]->end = (u_char *) pools[i] + size;
+        pools[i]->min_shift = 3;
+        pools[i]->addr = pools[i];
 
-        } else { /* node->key == temp->key */
+        if (ngx_shmtx_create(&pools[i]->mutex, &pools[i]->lock, NULL)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
 
-            sdn = (ngx_http_lua_shdict_node_t *) &node->color;
-            sdnt = (ngx_http_lua_shdict_node_t *) &temp->color;
+        ngx_slab_init(pools[i]);
 
-            p = ngx_memn2cmp(sdn->data, sdnt->data, sdn->key_len,
-                             sdnt->key_len) < 0 ? &temp->left : &temp->right;
-        }
+        pools[i]->log_ctx = ctx->shpool->log_ctx;
+        pools[i]->log_nomem = 0;
 
-        if (*p == sentinel) {
-            break;
+        ctx->shards[i].shpool = pools[i];
+
+        if (ngx_http_lua_shdict_init_shard(&ctx->shards[i]) != NGX_OK) {
+            return NGX_ERROR;
         }
+    }
 
-        temp = *p;
+    if (ngx_http_lua_shdict_init_notify(ctx) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    return ngx_http_lua_shdict_load(ctx);
 }
 
 
-static ngx_int_t
-ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
-    u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
+#if (NGX_LINUX && defined MADV_HUGEPAGE)
+
+/*
+ * asks for transparent huge pages for the zone, which nginx has mapped with
+ * normal pages: the pages faulted in from now on, and the others once the
+ * kernel collapses them, are then huge ones, so that random lookups in big
+ * zones miss the TLB much less often
+ */
+
+static void
+ngx_http_lua_shdict_hugepages(ngx_shm_zone_t *shm_zone, ngx_log_t *log)
 {
-    ngx_int_t                    rc;
-    ngx_time_t                  *tp;
-    uint64_t                     now;
-    int64_t                      ms;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
+    u_char    buf[64];
+    ssize_t   n;
+    ngx_fd_t  fd;
 
-    ctx = shm_zone->data;
+    if (madvise((void *) shm_zone->shm.addr, shm_zone->shm.size,
+                MADV_HUGEPAGE)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                      "madvise(MADV_HUGEPAGE) failed for lua_shared_dict "
+                      "\"%V\", using normal pages", &shm_zone->shm.name);
+        return;
+    }
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    /* the shared memory only gets huge pages when the kernel allows it */
 
-    while (node != sentinel) {
+    fd = ngx_open_file(NGX_HTTP_LUA_SHDICT_THP_SHMEM, NGX_FILE_RDONLY,
+                       NGX_FILE_OPEN, 0);
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+    if (fd == NGX_INVALID_FILE) {
+        return;
+    }
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
+    n = ngx_read_fd(fd, buf, sizeof(buf) - 1);
 
-        /* hash == node->key */
+    (void) ngx_close_file(fd);
 
-        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+    if (n <= 0) {
+        return;
+    }
 
-        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+    buf[n] = '\0';
 
-        if (rc == 0) {
-            ngx_queue_remove(&sd->queue);
-            ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    if (ngx_strstr(buf, "[never]") || ngx_strstr(buf, "[deny]")) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                      "transparent huge pages are disabled for shared memory "
+                      "in \"%s\", lua_shared_dict \"%V\" uses normal pages",
+                      NGX_HTTP_LUA_SHDICT_THP_SHMEM, &shm_zone->shm.name);
+    }
+}
 
-            *sdp = sd;
+#endif
 
-            dd("node expires: %lld", (long long) sd->expires);
 
-            if (sd->expires != 0) {
-                tp = ngx_timeofday();
+static ngx_int_t
+ngx_http_lua_shdict_init_shard(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    size_t       size;
+    ngx_uint_t   i, n, nslots, ncounters;
+    ngx_time_t  *tp;
 
-                now = (uint64_t) tp->sec * 1000 + tp->msec;
-                ms = sd->expires - now;
+    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_lua_shdict_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
 
-                dd("time to live: %lld", (long long) ms);
+    ctx->shpool->data = ctx->sh;
 
-                if (ms < 0) {
-                    dd("node already expired");
-                    return NGX_DONE;
-                }
-            }
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_lua_shdict_rbtree_insert_value);
 
-            return NGX_OK;
+    ngx_queue_init(&ctx->sh->lru_queue);
+
+    ctx->sh->seq = 0;
+    ctx->sh->version = 0;
+    ctx->sh->slots = NULL;
+    ctx->sh->mask = 0;
+    ctx->sh->nentries = 0;
+    ctx->sh->sketch = NULL;
+    ctx->sh->sketch_mask = 0;
+    ctx->sh->sketch_adds = 0;
+    ctx->sh->wheel = NULL;
+    ctx->sh->wheel_tick = 0;
+    ctx->sh->counters = NULL;
+    ctx->sh->ring = NULL;
+    ctx->sh->compact_cursor = 0;
+
+    ngx_memzero(&ctx->sh->stats, sizeof(ngx_http_lua_shdict_stats_t));
+
+    ctx->sh->decompressed = 0;
+    ctx->sh->decompress_usec = 0;
+
+    if (ctx->expiry == NGX_HTTP_LUA_SHDICT_EXPIRY_WHEEL) {
+        n = NGX_HTTP_LUA_SHDICT_WHEEL_LEVELS * NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS;
+
+        ctx->sh->wheel = ngx_slab_alloc(ctx->shpool, n * sizeof(ngx_queue_t));
+        if (ctx->sh->wheel == NULL) {
+            return NGX_ERROR;
         }
 
-        node = (rc < 0) ? node->left : node->right;
+        for (i = 0; i < n; i++) {
+            ngx_queue_init(&ctx->sh->wheel[i]);
+        }
+
+        tp = ngx_timeofday();
+
+        ctx->sh->wheel_tick = ((uint64_t) tp->sec * 1000 + tp->msec)
+                              >> NGX_HTTP_LUA_SHDICT_WHEEL_TICK;
     }
 
-    *sdp = NULL;
+    if (ctx->policy == NGX_HTTP_LUA_SHDICT_POLICY_TINYLFU) {
+        n = (ctx->shpool->end - (u_char *) ctx->shpool)
+            / NGX_HTTP_LUA_SHDICT_SKETCH_BYTES;
 
-    return NGX_DECLINED;
-}
+        for (ncounters = 64; ncounters < n; ncounters <<= 1) {
+            /* void */
+        }
 
+        ctx->sh->sketch = ngx_slab_alloc(ctx->shpool, ncounters);
+        if (ctx->sh->sketch == NULL) {
+            return NGX_ERROR;
+        }
 
-static int
-ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
-{
-    ngx_time_t                      *tp;
-    uint64_t                         now;
-    ngx_queue_t                     *q, *list_queue, *lq;
-    int64_t                          ms;
-    ngx_rbtree_node_t               *node;
-    ngx_http_lua_shdict_node_t      *sd;
-    int                              freed = 0;
-    ngx_http_lua_shdict_list_node_t *lnode;
+        ngx_memzero(ctx->sh->sketch, ncounters);
 
-    tp = ngx_timeofday();
+        ctx->sh->sketch_mask = ncounters - 1;
+    }
 
-    now = (uint64_t) tp->sec * 1000 + tp->msec;
+    if (ctx->index != NGX_HTTP_LUA_SHDICT_INDEX_HASH) {
+        return NGX_OK;
+    }
 
     /*
-     * n == 1 deletes one or two expired entries
-     * n == 0 deletes oldest entry by force
-     *        and one or two zero rate entries
+     * a node never takes less than the smallest slab chunk it fits in,
+     * so one slot per NGX_HTTP_LUA_SHDICT_SLOT_BYTES of the pool, rounded
+     * up to a power of two, roughly fits a zone full of tiny items
      */
 
-    while (n < 3) {
+    n = (ctx->shpool->end - (u_char *) ctx->shpool)
+        / NGX_HTTP_LUA_SHDICT_SLOT_BYTES;
 
-        if (ngx_queue_empty(&ctx->sh->lru_queue)) {
-            return freed;
-        }
+    for (nslots = 64; nslots < n; nslots <<= 1) {
+        /* void */
+    }
 
-        q = ngx_queue_last(&ctx->sh->lru_queue);
+    size = nslots * sizeof(ngx_http_lua_shdict_slot_t);
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+    ctx->sh->slots = ngx_slab_alloc(ctx->shpool, size);
+    if (ctx->sh->slots == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (n++ != 0) {
+    ngx_memzero(ctx->sh->slots, size);
 
-            if (sd->expires == 0) {
-                return freed;
-            }
+    ctx->sh->mask = nslots - 1;
 
-            ms = sd->expires - now;
-            if (ms > 0) {
-                return freed;
-            }
-        }
+    return NGX_OK;
+}
 
-        if (sd->value_type == SHDICT_TLIST) {
-            list_queue = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
 
-            for (lq = ngx_queue_head(list_queue);
-                 lq != ngx_queue_sentinel(list_queue);
-                 lq = ngx_queue_next(lq))
-            {
-                lnode = ngx_queue_data(lq, ngx_http_lua_shdict_list_node_t,
-                                       queue);
+static ngx_int_t
+ngx_http_lua_shdict_init_notify(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    ngx_fd_t                       fd;
+    ngx_uint_t                     n;
+    ngx_cycle_t                   *cycle;
+    ngx_slab_pool_t               *shpool;
+    ngx_core_conf_t               *ccf;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_lua_shdict_ring_t    *ring;
+    ngx_http_lua_shdict_shctx_t   *sh;
+    ngx_http_lua_shdict_notify_t  *notify;
+
+    notify = ctx->notify;
+
+    if (notify == NULL) {
+        return NGX_OK;
+    }
 
-                ngx_slab_free_locked(ctx->shpool, lnode);
-            }
-        }
+    sh = ctx->shards[0].sh;
+    shpool = ctx->shards[0].shpool;
 
-        ngx_queue_remove(q);
+    ring = sh->ring;
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+    if (ring == NULL) {
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        /*
+         * the workers of an old configuration without events=N may still
+         * be running, they never look at the ring though
+         */
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ring = ngx_slab_alloc(shpool, sizeof(ngx_http_lua_shdict_ring_t));
+        if (ring == NULL) {
+            return NGX_ERROR;
+        }
 
-        freed++;
-    }
+        ngx_memzero(ring, sizeof(ngx_http_lua_shdict_ring_t));
 
-    return freed;
-}
+        ring->events = ngx_slab_alloc(shpool, notify->size
+                                      * sizeof(ngx_http_lua_shdict_event_t));
+        if (ring->events == NULL) {
+            return NGX_ERROR;
+        }
 
+        if (ngx_shmtx_create(&ring->mutex, &ring->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
-void
-ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
-{
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_uint_t                   i;
-    ngx_shm_zone_t             **zone;
-    ngx_shm_zone_t             **zone_udata;
+        ring->next = 1;
+        ring->mask = notify->size - 1;
 
-    if (lmcf->shdict_zones != NULL) {
-        lua_createtable(L, 0, lmcf->shdict_zones->nelts /* nrec */);
-                /* ngx.shared */
+        ngx_memory_barrier();
 
-        lua_createtable(L, 0 /* narr */, 22 /* nrec */); /* shared mt */
+        sh->ring = ring;
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_lpush);
-        lua_setfield(L, -2, "lpush");
+    } else if (ring->mask + 1 != notify->size) {
+        ngx_log_error(NGX_LOG_EMERG, ctx->log, 0,
+                      "lua_shared_dict \"%V\" cannot change its number "
+                      "of events on reload", &ctx->name);
+        return NGX_ERROR;
+    }
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_rpush);
-        lua_setfield(L, -2, "rpush");
+    notify->ring = ring;
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_lpop);
-        lua_setfield(L, -2, "lpop");
+    notify->events = ngx_palloc(ctx->main_conf->cycle->pool, notify->size
+                                * sizeof(ngx_http_lua_shdict_event_t));
+    if (notify->events == NULL) {
+        return NGX_ERROR;
+    }
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_rpop);
-        lua_setfield(L, -2, "rpop");
+    /*
+     * the eventfds are created here, in the master process, so that every
+     * worker inherits those of all the others
+     */
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_llen);
-        lua_setfield(L, -2, "llen");
+    cycle = ctx->main_conf->cycle;
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_flush_expired);
-        lua_setfield(L, -2, "flush_expired");
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
 
-        lua_pushcfunction(L, ngx_http_lua_shdict_get_keys);
-        lua_setfield(L, -2, "get_keys");
+    n = ccf->master ? (ngx_uint_t) ccf->worker_processes : 1;
+    n = ngx_min(n, NGX_MAX_PROCESSES);
 
-        lua_pushvalue(L, -1); /* shared mt mt */
-        lua_setfield(L, -2, "__index"); /* shared mt */
+    notify->fds = ngx_palloc(cycle->pool, n * sizeof(ngx_fd_t));
+    if (notify->fds == NULL) {
+        return NGX_ERROR;
+    }
 
-        zone = lmcf->shdict_zones->elts;
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
 
-        for (i = 0; i < lmcf->shdict_zones->nelts; i++) {
-            ctx = zone[i]->data;
+    cln->handler = ngx_http_lua_shdict_notify_cleanup;
+    cln->data = notify;
 
-            lua_pushlstring(L, (char *) ctx->name.data, ctx->name.len);
-                /* shared mt key */
+    for (notify->nfds = 0; notify->nfds < n; notify->nfds++) {
 
-            lua_createtable(L, 1 /* narr */, 0 /* nrec */);
-                /* table of zone[i] */
-            zone_udata = lua_newuserdata(L, sizeof(ngx_shm_zone_t *));
-                /* shared mt key ud */
-            *zone_udata = zone[i];
-            lua_rawseti(L, -2, SHDICT_USERDATA_INDEX); /* {zone[i]} */
-            lua_pushvalue(L, -3); /* shared mt key ud mt */
-            lua_setmetatable(L, -2); /* shared mt key ud */
-            lua_rawset(L, -4); /* shared mt */
+#if (NGX_HAVE_EVENTFD)
+#if (NGX_HAVE_SYS_EVENTFD_H)
+        fd = eventfd(0, 0);
+#else
+        fd = syscall(SYS_eventfd, 0);
+#endif
+#else
+        fd = -1;  /* not reached, events=N requires eventfd */
+#endif
+
+        if (fd == -1) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, ngx_errno,
+                          "eventfd() for lua_shared_dict \"%V\" failed",
+                          &ctx->name);
+            return NGX_ERROR;
         }
 
-        lua_pop(L, 1); /* shared */
+        if (ngx_nonblocking(fd) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, ctx->log, ngx_socket_errno,
+                          ngx_nonblocking_n " eventfd failed");
+            (void) close(fd);
+            return NGX_ERROR;
+        }
 
-    } else {
-        lua_newtable(L);    /* ngx.shared */
+        notify->fds[notify->nfds] = fd;
     }
 
-    lua_setfield(L, -2, "shared");
+    return NGX_OK;
 }
 
 
-static ngx_inline ngx_shm_zone_t *
-ngx_http_lua_shdict_get_zone(lua_State *L, int index)
+static void
+ngx_http_lua_shdict_notify_cleanup(void *data)
 {
-    ngx_shm_zone_t      *zone;
-    ngx_shm_zone_t     **zone_udata;
-
-    lua_rawgeti(L, index, SHDICT_USERDATA_INDEX);
-    zone_udata = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-
-    if (zone_udata == NULL) {
-        return NULL;
-    }
+    ngx_http_lua_shdict_notify_t  *notify = data;
 
-    zone = *zone_udata;
-    return zone;
-}
+    ngx_uint_t  i;
 
+    for (i = 0; i < notify->nfds; i++) {
 
-static int
-ngx_http_lua_shdict_flush_expired(lua_State *L)
-{
-    ngx_queue_t                     *q, *prev, *list_queue, *lq;
-    ngx_http_lua_shdict_node_t      *sd;
-    ngx_http_lua_shdict_ctx_t       *ctx;
-    ngx_shm_zone_t                  *zone;
-    ngx_time_t                      *tp;
-    int                              freed = 0;
-    int                              attempts = 0;
-    ngx_rbtree_node_t               *node;
-    uint64_t                         now;
-    int                              n;
-    ngx_http_lua_shdict_list_node_t *lnode;
+        /* this worker's own eventfd is closed with its connection */
 
-    n = lua_gettop(L);
+        if (notify->fds[i] == -1) {
+            continue;
+        }
 
-    if (n != 1 && n != 2) {
-        return luaL_error(L, "expecting 1 or 2 argument(s), but saw %d", n);
+        if (close(notify->fds[i]) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
     }
 
-    luaL_checktype(L, 1, LUA_TTABLE);
+    notify->nfds = 0;
+}
 
-    zone = ngx_http_lua_shdict_get_zone(L, 1);
-    if (zone == NULL) {
-        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
-    }
 
-    if (n == 2) {
-        attempts = luaL_checkint(L, 2);
-    }
+/*
+ * called with the shard of the key locked, a key_len of 0 stands for all the
+ * keys of the zone
+ */
 
-    ctx = zone->data;
+static void
+ngx_http_lua_shdict_notify(ngx_http_lua_shdict_ctx_t *ctx, u_char *key,
+    size_t key_len)
+{
+    ngx_uint_t                     i, n;
+    ngx_http_lua_shdict_ring_t    *ring;
+    ngx_http_lua_shdict_event_t   *ev;
+    ngx_http_lua_shdict_watch_t   *w;
+    ngx_http_lua_shdict_notify_t  *notify;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    notify = ctx->notify;
 
-    if (ngx_queue_empty(&ctx->sh->lru_queue)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushnumber(L, 0);
-        return 1;
+    if (notify == NULL || notify->ring == NULL) {
+        return;
     }
 
-    tp = ngx_timeofday();
-
-    now = (uint64_t) tp->sec * 1000 + tp->msec;
-
-    q = ngx_queue_last(&ctx->sh->lru_queue);
-
-    while (q != ngx_queue_sentinel(&ctx->sh->lru_queue)) {
-        prev = ngx_queue_prev(q);
+    ring = notify->ring;
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+    n = ring->nwatches;
 
-        if (sd->expires != 0 && sd->expires <= now) {
+    if (n == 0) {
+        return;
+    }
 
-            if (sd->value_type == SHDICT_TLIST) {
-                list_queue = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
+    ngx_memory_barrier();
 
-                for (lq = ngx_queue_head(list_queue);
-                     lq != ngx_queue_sentinel(list_queue);
-                     lq = ngx_queue_next(lq))
-                {
-                    lnode = ngx_queue_data(lq, ngx_http_lua_shdict_list_node_t,
-                                           queue);
+    if (key_len) {
+        for (i = 0; i < n; i++) {
+            w = &ring->watches[i];
 
-                    ngx_slab_free_locked(ctx->shpool, lnode);
-                }
+            if (w->len <= key_len && ngx_memcmp(w->data, key, w->len) == 0) {
+                break;
             }
+        }
 
-            ngx_queue_remove(q);
+        if (i == n) {
+            return;
+        }
+    }
 
-            node = (ngx_rbtree_node_t *)
-                ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+    ngx_shmtx_lock(&ring->mutex);
 
-            ngx_rbtree_delete(&ctx->sh->rbtree, node);
-            ngx_slab_free_locked(ctx->shpool, node);
-            freed++;
+    ev = &ring->events[ring->next & ring->mask];
 
-            if (attempts && freed == attempts) {
-                break;
-            }
-        }
+    ev->key_len = (uint16_t) key_len;
+    ngx_memcpy(ev->key, key, ngx_min(key_len, NGX_HTTP_LUA_SHDICT_EVENT_KEY));
 
-        q = prev;
-    }
+    ring->next++;
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_shmtx_unlock(&ring->mutex);
 
-    lua_pushnumber(L, freed);
-    return 1;
+    ngx_http_lua_shdict_notify_workers(ctx);
 }
 
 
 /*
- * This trades CPU for memory. This is potentially slow. O(2n)
+ * called with the shard of the list locked after every push, whatever the
+ * watches, to wake up the light threads waiting in blpop
  */
 
-static int
-ngx_http_lua_shdict_get_keys(lua_State *L)
+static void
+ngx_http_lua_shdict_notify_push(ngx_http_lua_shdict_ctx_t *ctx)
 {
-    ngx_queue_t                 *q, *prev;
-    ngx_http_lua_shdict_node_t  *sd;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_shm_zone_t              *zone;
-    ngx_time_t                  *tp;
-    int                          total = 0;
-    int                          attempts = 1024;
-    uint64_t                     now;
-    int                          n;
-
-    n = lua_gettop(L);
-
-    if (n != 1 && n != 2) {
-        return luaL_error(L, "expecting 1 or 2 argument(s), "
-                          "but saw %d", n);
+    if (ctx->notify == NULL || ctx->notify->ring == NULL) {
+        return;
     }
 
-    luaL_checktype(L, 1, LUA_TTABLE);
+    (void) ngx_atomic_fetch_add(&ctx->notify->ring->pushes, 1);
 
-    zone = ngx_http_lua_shdict_get_zone(L, 1);
-    if (zone == NULL) {
-        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
-    }
+    ngx_http_lua_shdict_notify_workers(ctx);
+}
 
-    if (n == 2) {
-        attempts = luaL_checkint(L, 2);
-    }
 
-    ctx = zone->data;
+static void
+ngx_http_lua_shdict_notify_workers(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    uint64_t                       v;
+    ngx_uint_t                     i;
+    ngx_http_lua_shdict_ring_t    *ring;
+    ngx_http_lua_shdict_notify_t  *notify;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    notify = ctx->notify;
+    ring = notify->ring;
 
-    if (ngx_queue_empty(&ctx->sh->lru_queue)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_createtable(L, 0, 0);
-        return 1;
-    }
+    /* the workers arm themselves before looking at the ring */
 
-    tp = ngx_timeofday();
+    ngx_memory_barrier();
 
-    now = (uint64_t) tp->sec * 1000 + tp->msec;
+    for (i = 0; i < notify->nfds; i++) {
+        if (!ring->armed[i] || !ngx_atomic_cmp_set(&ring->armed[i], 1, 0)) {
+            continue;
+        }
 
-    /* first run through: get total number of elements we need to allocate */
+        v = 1;
 
-    q = ngx_queue_last(&ctx->sh->lru_queue);
+        if (write(notify->fds[i], &v, sizeof(uint64_t)) != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          "write() to eventfd of lua_shared_dict \"%V\" "
+                          "failed", &ctx->name);
+        }
+    }
+}
 
-    while (q != ngx_queue_sentinel(&ctx->sh->lru_queue)) {
-        prev = ngx_queue_prev(q);
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+void
+ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_lua_shdict_node_t   *sdn, *sdnt;
 
-        if (sd->expires == 0 || sd->expires > now) {
-            total++;
-            if (attempts && total == attempts) {
-                break;
-            }
-        }
+    for ( ;; ) {
 
-        q = prev;
-    }
+        if (node->key < temp->key) {
 
-    lua_createtable(L, total, 0);
+            p = &temp->left;
 
-    /* second run through: add keys to table */
+        } else if (node->key > temp->key) {
 
-    total = 0;
-    q = ngx_queue_last(&ctx->sh->lru_queue);
+            p = &temp->right;
 
-    while (q != ngx_queue_sentinel(&ctx->sh->lru_queue)) {
-        prev = ngx_queue_prev(q);
+        } else { /* node->key == temp->key */
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+            sdn = (ngx_http_lua_shdict_node_t *) &node->color;
+            sdnt = (ngx_http_lua_shdict_node_t *) &temp->color;
 
-        if (sd->expires == 0 || sd->expires > now) {
-            lua_pushlstring(L, (char *) sd->data, sd->key_len);
-            lua_rawseti(L, -2, ++total);
-            if (attempts && total == attempts) {
-                break;
-            }
+            p = ngx_memn2cmp(sdn->data, sdnt->data, sdn->key_len,
+                             sdnt->key_len) < 0 ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
         }
 
-        q = prev;
+        temp = *p;
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
-
-    /* table is at top of stack */
-    return 1;
-}
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
 
-ngx_int_t
-ngx_http_lua_shared_dict_get(ngx_shm_zone_t *zone, u_char *key_data,
-    size_t key_len, ngx_http_lua_value_t *value)
+static ngx_rbtree_node_t *
+ngx_http_lua_shdict_alloc_node(ngx_http_lua_shdict_ctx_t *ctx, size_t size)
 {
-    u_char                      *data;
-    size_t                       len;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-
-    if (zone == NULL) {
-        return NGX_ERROR;
-    }
-
-    hash = ngx_crc32_short(key_data, key_len);
+    ngx_queue_t        *q;
+    ngx_rbtree_node_t  *node;
 
-    ctx = zone->data;
+    /*
+     * a full index is reported as a memory shortage, so that the callers
+     * evict the least recently used items to make room, just like they do
+     * when the slab pool runs out of memory
+     */
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    if (ctx->sh->slots && ngx_http_lua_shdict_index_full(ctx)) {
+        node = NULL;
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key_data, key_len, &sd);
+    } else if (ctx->sh->wheel) {
+        q = ngx_slab_alloc_locked(ctx->shpool, sizeof(ngx_queue_t) + size);
 
-    dd("shdict lookup returned %d", (int) rc);
+        if (q == NULL) {
+            node = NULL;
 
-    if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        } else {
+            q->next = NULL;  /* not in the wheel */
+            node = ngx_http_lua_shdict_timer_node(q);
+        }
 
-        return rc;
+    } else {
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
     }
 
-    /* rc == NGX_OK */
+    if (node == NULL) {
+        ctx->sh->stats.alloc_failures++;
+        return NULL;
+    }
 
-    value->type = sd->value_type;
+    ((ngx_http_lua_shdict_node_t *) &node->color)->version = 0;
 
-    dd("type: %d", (int) value->type);
+    return node;
+}
 
-    data = sd->data + sd->key_len;
-    len = (size_t) sd->value_len;
 
-    switch (value->type) {
+static void
+ngx_http_lua_shdict_free_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_queue_t                        *q, *queue;
+    ngx_http_lua_shdict_node_t         *sd;
+    ngx_http_lua_shdict_zset_t         *zset;
+    ngx_http_lua_shdict_counter_t      *cell;
+    ngx_http_lua_shdict_field_node_t   *fnode;
+    ngx_http_lua_shdict_counter_ref_t   ref;
 
-    case SHDICT_TSTRING:
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
-        if (value->value.s.data == NULL || value->value.s.len == 0) {
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "no string buffer "
-                          "initialized");
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            return NGX_ERROR;
-        }
+    /* the freed memory must not look like the value to the l1 caches */
 
-        if (len > value->value.s.len) {
-            len = value->value.s.len;
+    sd->version = 0;
 
-        } else {
-            value->value.s.len = len;
-        }
+    if (sd->value_type == SHDICT_THASH) {
+        queue = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
 
-        ngx_memcpy(value->value.s.data, data, len);
-        break;
+        while (!ngx_queue_empty(queue)) {
+            q = ngx_queue_head(queue);
+            ngx_queue_remove(q);
 
-    case SHDICT_TNUMBER:
+            fnode = ngx_queue_data(q, ngx_http_lua_shdict_field_node_t, queue);
+            ngx_slab_free_locked(ctx->shpool, fnode);
+        }
+    }
 
-        if (len != sizeof(double)) {
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "bad lua number "
-                          "value size found for key %*s: %lu", key_len,
-                          key_data, (unsigned long) len);
+    if (sd->value_type == SHDICT_TZSET) {
+        zset = ngx_http_lua_shdict_get_zset(sd);
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            return NGX_ERROR;
-        }
+        ngx_http_lua_shdict_zset_free(ctx->shpool, zset->by_score.root,
+                                      zset->by_score.sentinel);
+    }
 
-        ngx_memcpy(&value->value.b, data, len);
-        break;
+    if (sd->value_type == SHDICT_TCOUNTER) {
+        ngx_memcpy(&ref, sd->data + sd->key_len, sizeof(ref));
 
-    case SHDICT_TBOOLEAN:
+        /* the values left in the slots are stale from now on */
 
-        if (len != sizeof(u_char)) {
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "bad lua boolean "
-                          "value size found for key %*s: %lu", key_len,
-                          key_data, (unsigned long) len);
+        cell = ngx_http_lua_shdict_counter_cell(ctx, &ref);
+        cell->gen++;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            return NGX_ERROR;
-        }
+        cell->next = ctx->sh->counters;
+        ctx->sh->counters = cell;
+    }
 
-        value->value.b = *data;
-        break;
+    if (ctx->sh->wheel == NULL) {
+        ngx_slab_free_locked(ctx->shpool, node);
+        return;
+    }
 
-    default:
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "bad lua value type "
-                      "found for key %*s: %d", key_len, key_data,
-                      (int) value->type);
+    q = ngx_http_lua_shdict_node_timer(node);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        return NGX_ERROR;
+    if (q->next) {
+        ngx_queue_remove(q);
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
-    return NGX_OK;
+    ngx_slab_free_locked(ctx->shpool, q);
 }
 
 
-static int
-ngx_http_lua_shdict_lpush(lua_State *L)
+static ngx_http_lua_shdict_counter_t *
+ngx_http_lua_shdict_counter_alloc(ngx_http_lua_shdict_ctx_t *ctx)
 {
-    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
-}
+    ngx_uint_t                           i, nslots;
+    ngx_core_conf_t                     *ccf;
+    ngx_http_lua_shdict_counter_t       *cell;
+    ngx_http_lua_shdict_counter_slot_t  *slot;
 
+    cell = ctx->sh->counters;
 
-static int
-ngx_http_lua_shdict_rpush(lua_State *L)
-{
-    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
-}
+    if (cell) {
+        ctx->sh->counters = cell->next;
+        return cell;
+    }
 
+    /*
+     * the worker count may not be known yet when init_by_lua* runs, the
+     * cells created there then only get the shared slot
+     */
 
-static int
-ngx_http_lua_shdict_push_helper(lua_State *L, int flags)
-{
-    int                              n;
-    ngx_str_t                        key;
-    uint32_t                         hash;
-    ngx_int_t                        rc;
-    ngx_http_lua_shdict_ctx_t       *ctx;
-    ngx_http_lua_shdict_node_t      *sd;
-    ngx_str_t                        value;
-    int                              value_type;
-    double                           num;
-    ngx_rbtree_node_t               *node;
-    ngx_shm_zone_t                  *zone;
-    ngx_queue_t                     *queue, *q;
-    ngx_http_lua_shdict_list_node_t *lnode;
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ctx->main_conf->cycle->conf_ctx,
+                                           ngx_core_module);
 
-    n = lua_gettop(L);
+    nslots = 1;
 
-    if (n != 3) {
-        return luaL_error(L, "expecting 3 arguments, "
-                          "but only seen %d", n);
+    if (ccf->worker_processes > 0) {
+        nslots += ccf->worker_processes;
     }
 
-    if (lua_type(L, 1) != LUA_TTABLE) {
-        return luaL_error(L, "bad \"zone\" argument");
-    }
+    /* the slab allocator aligns the chunks to their size */
 
-    zone = ngx_http_lua_shdict_get_zone(L, 1);
-    if (zone == NULL) {
-        return luaL_error(L, "bad \"zone\" argument");
+    cell = ngx_slab_alloc_locked(ctx->shpool,
+                                 (nslots + 1) * NGX_CPU_CACHE_LINE);
+    if (cell == NULL) {
+        ctx->sh->stats.alloc_failures++;
+        return NULL;
     }
 
-    ctx = zone->data;
+    cell->next = NULL;
+    cell->gen = 0;
+    cell->nslots = (uint32_t) nslots;
 
-    if (lua_isnil(L, 2)) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "nil key");
-        return 2;
+    for (i = 0; i < nslots; i++) {
+        slot = ngx_http_lua_shdict_counter_slot(cell, i);
+        slot->value = 0;
+        slot->gen = 0;
     }
 
-    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+    return cell;
+}
 
-    if (key.len == 0) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "empty key");
-        return 2;
-    }
 
-    if (key.len > 65535) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "key too long");
-        return 2;
+/* the slot of the current process, the last one is shared under the lock */
+
+static ngx_inline ngx_uint_t
+ngx_http_lua_shdict_counter_own_slot(ngx_http_lua_shdict_counter_t *cell)
+{
+    if ((ngx_process == NGX_PROCESS_WORKER
+         || ngx_process == NGX_PROCESS_SINGLE)
+        && !ngx_exiting
+        && ngx_worker + 1 < cell->nslots)
+    {
+        return ngx_worker;
     }
 
-    hash = ngx_crc32_short(key.data, key.len);
+    return cell->nslots - 1;
+}
 
-    value_type = lua_type(L, 3);
 
-    switch (value_type) {
+static double
+ngx_http_lua_shdict_counter_sum(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    int64_t                              sum;
+    ngx_uint_t                           i;
+    ngx_http_lua_shdict_counter_t       *cell;
+    ngx_http_lua_shdict_counter_ref_t    ref;
+    ngx_http_lua_shdict_counter_slot_t  *slot;
 
-    case SHDICT_TSTRING:
-        value.data = (u_char *) lua_tolstring(L, 3, &value.len);
-        break;
+    ngx_memcpy(&ref, sd->data + sd->key_len, sizeof(ref));
 
-    case SHDICT_TNUMBER:
-        value.len = sizeof(double);
-        num = lua_tonumber(L, 3);
-        value.data = (u_char *) &num;
-        break;
+    cell = ngx_http_lua_shdict_counter_cell(ctx, &ref);
 
-    default:
-        lua_pushnil(L);
-        lua_pushliteral(L, "bad value type");
-        return 2;
-    }
+    sum = 0;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    for (i = 0; i < cell->nslots; i++) {
+        slot = ngx_http_lua_shdict_counter_slot(cell, i);
 
-#if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
-#endif
+        /* the slots not written since the cell was reused are stale */
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len, &sd);
+        if (slot->gen == ref.gen) {
+            sum += (ngx_atomic_int_t) slot->value;
+        }
+    }
 
-    dd("shdict lookup returned %d", (int) rc);
+    return (double) sum;
+}
 
-    /* exists but expired */
 
-    if (rc == NGX_DONE) {
+/* (re)files the node in the wheel after its expiration time changed */
 
-        if (sd->value_type != SHDICT_TLIST) {
-            /* TODO: reuse when length matched */
+static void
+ngx_http_lua_shdict_wheel_update(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    uint64_t            t, tick, delta;
+    ngx_uint_t          level;
+    ngx_queue_t        *q;
+    ngx_rbtree_node_t  *node;
 
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                           "lua shared dict push: found old entry and value "
-                           "type not matched, remove it first");
+    if (ctx->sh->wheel == NULL) {
+        return;
+    }
 
-            ngx_queue_remove(&sd->queue);
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
 
-            node = (ngx_rbtree_node_t *)
-                        ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+    q = ngx_http_lua_shdict_node_timer(node);
 
-            ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    if (q->next) {
+        ngx_queue_remove(q);
+        q->next = NULL;
+    }
 
-            ngx_slab_free_locked(ctx->shpool, node);
+    if (sd->expires == 0) {
+        return;
+    }
 
-            dd("go to init_list");
-            goto init_list;
-        }
+    /* the first tick at which the node is surely expired */
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                       "lua shared dict push: found old entry and value "
-                       "type matched, reusing it");
+    t = (sd->expires + (1 << NGX_HTTP_LUA_SHDICT_WHEEL_TICK) - 1)
+        >> NGX_HTTP_LUA_SHDICT_WHEEL_TICK;
 
-        sd->expires = 0;
+    tick = ctx->sh->wheel_tick;
 
-        /* free list nodes */
+    if (t < tick) {
+        t = tick;
+    }
 
-        queue = ngx_http_lua_shdict_get_list_head(sd, key.len);
+    delta = t - tick;
 
-        for (q = ngx_queue_head(queue);
-             q != ngx_queue_sentinel(queue);
-             q = ngx_queue_next(q))
-        {
-            /* TODO: reuse matched size list node */
-            lnode = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
-            ngx_slab_free_locked(ctx->shpool, lnode);
+    for (level = 0; level < NGX_HTTP_LUA_SHDICT_WHEEL_LEVELS - 1; level++) {
+        if (delta >> ((level + 1) * NGX_HTTP_LUA_SHDICT_WHEEL_BITS) == 0) {
+            break;
         }
+    }
 
-        ngx_queue_init(queue);
-
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    if (delta >> (NGX_HTTP_LUA_SHDICT_WHEEL_LEVELS
+                  * NGX_HTTP_LUA_SHDICT_WHEEL_BITS))
+    {
+        /* too far away, park it in the farthest bucket for now */
 
-        dd("go to push_node");
-        goto push_node;
+        t = tick + ((uint64_t) 1 << (NGX_HTTP_LUA_SHDICT_WHEEL_LEVELS
+                                     * NGX_HTTP_LUA_SHDICT_WHEEL_BITS)) - 1;
     }
 
-    /* exists and not expired */
+    t = (t >> (level * NGX_HTTP_LUA_SHDICT_WHEEL_BITS))
+        & (NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS - 1);
 
-    if (rc == NGX_OK) {
+    ngx_queue_insert_tail(&ctx->sh->wheel[level
+                                          * NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS
+                                          + t], q);
+}
 
-        if (sd->value_type != SHDICT_TLIST) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-            lua_pushnil(L);
-            lua_pushliteral(L, "value not a list");
-            return 2;
-        }
+/*
+ * moves the wheel up to the current tick, cascading the buckets of the
+ * upper levels down as their time comes and reclaiming the expired nodes,
+ * but never more than NGX_HTTP_LUA_SHDICT_WHEEL_BATCH of them at once
+ */
 
-        queue = ngx_http_lua_shdict_get_list_head(sd, key.len);
+static ngx_uint_t
+ngx_http_lua_shdict_wheel_advance(ngx_http_lua_shdict_ctx_t *ctx,
+    uint64_t now)
+{
+    uint64_t                          tick, target;
+    ngx_uint_t                        level, slot, ticks, freed;
+    ngx_queue_t                      *wheel, *bucket, *q, *lq, *list_queue;
+    ngx_queue_t                       cascade;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_shdict_node_t       *sd;
+    ngx_http_lua_shdict_list_node_t  *lnode;
+
+    wheel = ctx->sh->wheel;
+    target = now >> NGX_HTTP_LUA_SHDICT_WHEEL_TICK;
+    freed = 0;
+
+    for (ticks = 0;
+         ctx->sh->wheel_tick <= target
+         && ticks < NGX_HTTP_LUA_SHDICT_WHEEL_TICKS;
+         ticks++)
+    {
+        tick = ctx->sh->wheel_tick;
+        slot = tick & (NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS - 1);
+
+        /*
+         * whenever the bucket index of a level wraps to 0, the current
+         * bucket of the next level is due and gets refiled below; doing it
+         * again after an interrupted tick only refiles its new nodes
+         */
+
+        for (level = 1;
+             slot == 0 && level < NGX_HTTP_LUA_SHDICT_WHEEL_LEVELS;
+             level++)
+        {
+            slot = (tick >> (level * NGX_HTTP_LUA_SHDICT_WHEEL_BITS))
+                   & (NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS - 1);
 
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+            bucket = &wheel[level * NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS + slot];
 
-        dd("go to push_node");
-        goto push_node;
-    }
+            if (ngx_queue_empty(bucket)) {
+                continue;
+            }
 
-    /* rc == NGX_DECLINED, not found */
+            ngx_queue_init(&cascade);
+            ngx_queue_add(&cascade, bucket);
+            ngx_queue_init(bucket);
 
-init_list:
+            while (!ngx_queue_empty(&cascade)) {
+                q = ngx_queue_head(&cascade);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "lua shared dict list: creating a new entry");
+                ngx_queue_remove(q);
+                q->next = NULL;
 
-    /* NOTICE: we assume the begin point aligned in slab, be careful */
-    n = offsetof(ngx_rbtree_node_t, color)
-        + offsetof(ngx_http_lua_shdict_node_t, data)
-        + key.len
-        + sizeof(ngx_queue_t);
+                node = ngx_http_lua_shdict_timer_node(q);
+                sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
-    dd("length before aligned: %d", n);
+                ngx_http_lua_shdict_wheel_update(ctx, sd);
+            }
+        }
 
-    n = (int) (uintptr_t) ngx_align_ptr(n, NGX_ALIGNMENT);
+        bucket = &wheel[tick & (NGX_HTTP_LUA_SHDICT_WHEEL_SLOTS - 1)];
 
-    dd("length after aligned: %d", n);
+        while (!ngx_queue_empty(bucket)) {
 
-    node = ngx_slab_alloc_locked(ctx->shpool, n);
+            if (freed == NGX_HTTP_LUA_SHDICT_WHEEL_BATCH) {
+                return freed;
+            }
 
-    if (node == NULL) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            q = ngx_queue_head(bucket);
 
-        lua_pushboolean(L, 0);
-        lua_pushliteral(L, "no memory");
-        return 2;
-    }
+            node = ngx_http_lua_shdict_timer_node(q);
+            sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
-    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+            if (sd->expires > now) {
+                /* cannot happen as long as the ticks are rounded up */
+                ngx_http_lua_shdict_wheel_update(ctx, sd);
+                continue;
+            }
 
-    queue = ngx_http_lua_shdict_get_list_head(sd, key.len);
-
-    node->key = hash;
-    sd->key_len = (u_short) key.len;
+            if (sd->value_type == SHDICT_TLIST) {
+                list_queue = ngx_http_lua_shdict_get_list_head(sd,
+                                                               sd->key_len);
 
-    sd->expires = 0;
+                for (lq = ngx_queue_head(list_queue);
+                     lq != ngx_queue_sentinel(list_queue);
+                     lq = ngx_queue_next(lq))
+                {
+                    lnode = ngx_queue_data(lq,
+                                           ngx_http_lua_shdict_list_node_t,
+                                           queue);
 
-    sd->value_len = 0;
+                    ngx_slab_free_locked(ctx->shpool, lnode);
+                }
+            }
 
-    dd("setting value type to %d", (int) SHDICT_TLIST);
+            ngx_queue_remove(&sd->queue);
 
-    sd->value_type = (uint8_t) SHDICT_TLIST;
+            ngx_http_lua_shdict_delete_node(ctx, node);
+            ngx_http_lua_shdict_free_node(ctx, node);
 
-    ngx_memcpy(sd->data, key.data, key.len);
+            ctx->sh->stats.expired++;
+            freed++;
+        }
 
-    ngx_queue_init(queue);
+        ctx->sh->wheel_tick++;
+    }
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    return freed;
+}
 
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
 
-push_node:
+static ngx_event_t  ngx_http_lua_shdict_wheel_event;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "lua shared dict list: creating a new list node");
 
-    n = offsetof(ngx_http_lua_shdict_list_node_t, data)
-        + value.len;
+ngx_int_t
+ngx_http_lua_shdict_init_worker(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_uint_t                     i, wheel;
+    ngx_event_t                   *ev;
+    ngx_shm_zone_t               **zone;
+    ngx_connection_t              *c;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_notify_t  *notify;
+
+    if (lmcf->shdict_zones == NULL) {
+        return NGX_OK;
+    }
 
-    dd("list node length: %d", n);
+    zone = lmcf->shdict_zones->elts;
+    wheel = 0;
 
-    lnode = ngx_slab_alloc_locked(ctx->shpool, n);
+    for (i = 0; i < lmcf->shdict_zones->nelts; i++) {
+        ctx = zone[i]->data;
 
-    if (lnode == NULL) {
+        if (ctx->expiry == NGX_HTTP_LUA_SHDICT_EXPIRY_WHEEL) {
+            wheel = 1;
+        }
 
-        if (sd->value_len == 0) {
+        notify = ctx->notify;
 
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                           "lua shared dict list: no memory for create"
-                           " list node and list empty, remove it");
+        if (notify == NULL
+            || (ngx_process != NGX_PROCESS_WORKER
+                && ngx_process != NGX_PROCESS_SINGLE)
+            || (ngx_uint_t) ngx_worker >= notify->nfds)
+        {
+            continue;
+        }
 
-            ngx_queue_remove(&sd->queue);
+        c = ngx_get_connection(notify->fds[ngx_worker], cycle->log);
+        if (c == NULL) {
+            return NGX_ERROR;
+        }
 
-            node = (ngx_rbtree_node_t *)
-                        ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+        c->data = notify;
+        c->log = cycle->log;
 
-            ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        c->read->handler = ngx_http_lua_shdict_notify_handler;
+        c->read->log = cycle->log;
 
-            ngx_slab_free_locked(ctx->shpool, node);
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            ngx_free_connection(c);
+            return NGX_ERROR;
         }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-
-        lua_pushboolean(L, 0);
-        lua_pushliteral(L, "no memory");
-        return 2;
+        notify->conn = c;
     }
 
-    dd("setting list length to %d", sd->value_len + 1);
+    if (ngx_worker == 0
+        && (ngx_process == NGX_PROCESS_WORKER
+            || ngx_process == NGX_PROCESS_SINGLE))
+    {
+        for (i = 0; i < lmcf->shdict_zones->nelts; i++) {
+            ctx = zone[i]->data;
 
-    sd->value_len = sd->value_len + 1;
+            if (ctx->persist_interval == 0) {
+                continue;
+            }
 
-    dd("setting list node value length to %d", (int) value.len);
+            ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+            if (ev == NULL) {
+                return NGX_ERROR;
+            }
 
-    lnode->value_len = (uint32_t) value.len;
+            ev->handler = ngx_http_lua_shdict_persist_handler;
+            ev->data = ctx;
+            ev->log = cycle->log;
+#if (nginx_version >= 1007011)
+            ev->cancelable = 1;
+#endif
 
-    dd("setting list node value type to %d", value_type);
+            ngx_add_timer(ev, ctx->persist_interval);
+        }
+    }
 
-    lnode->value_type = (uint8_t) value_type;
+    if (!wheel) {
+        return NGX_OK;
+    }
 
-    ngx_memcpy(lnode->data, value.data, value.len);
+    ev = &ngx_http_lua_shdict_wheel_event;
 
-    if (flags == NGX_HTTP_LUA_SHDICT_LEFT) {
-        ngx_queue_insert_head(queue, &lnode->queue);
+    ngx_memzero(ev, sizeof(ngx_event_t));
 
-    } else {
-        ngx_queue_insert_tail(queue, &lnode->queue);
-    }
+    ev->handler = ngx_http_lua_shdict_wheel_handler;
+    ev->data = lmcf;
+    ev->log = cycle->log;
+#if (nginx_version >= 1007011)
+    ev->cancelable = 1;
+#endif
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_add_timer(ev, NGX_HTTP_LUA_SHDICT_WHEEL_INTERVAL);
 
-    lua_pushnumber(L, sd->value_len);
-    return 1;
+    return NGX_OK;
 }
 
 
-static int
-ngx_http_lua_shdict_lpop(lua_State *L)
+void
+ngx_http_lua_shdict_exit_worker(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf)
 {
-    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
-}
+    ngx_uint_t                     i;
+    ngx_shm_zone_t               **zone;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_notify_t  *notify;
 
+    if (lmcf->shdict_zones == NULL) {
+        return;
+    }
 
-static int
-ngx_http_lua_shdict_rpop(lua_State *L)
-{
-    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
-}
+    zone = lmcf->shdict_zones->elts;
 
+    for (i = 0; i < lmcf->shdict_zones->nelts; i++) {
+        ctx = zone[i]->data;
+        notify = ctx->notify;
 
-static int
-ngx_http_lua_shdict_pop_helper(lua_State *L, int flags)
-{
-    int                              n;
-    ngx_str_t                        name;
-    ngx_str_t                        key;
-    uint32_t                         hash;
-    ngx_int_t                        rc;
-    ngx_http_lua_shdict_ctx_t       *ctx;
-    ngx_http_lua_shdict_node_t      *sd;
-    ngx_str_t                        value;
-    int                              value_type;
-    double                           num;
-    ngx_rbtree_node_t               *node;
-    ngx_shm_zone_t                  *zone;
-    ngx_queue_t                     *queue;
-    ngx_http_lua_shdict_list_node_t *lnode;
+        if (notify == NULL || notify->conn == NULL) {
+            continue;
+        }
 
-    n = lua_gettop(L);
+        /*
+         * the connection is closed before nginx looks for the connections
+         * left open by an exiting worker, and the fd is left out of the
+         * cleanup of the cycle pool
+         */
 
-    if (n != 2) {
-        return luaL_error(L, "expecting 2 arguments, "
-                          "but only seen %d", n);
-    }
+        notify->fds[ngx_worker] = -1;
 
-    if (lua_type(L, 1) != LUA_TTABLE) {
-        return luaL_error(L, "bad \"zone\" argument");
+        ngx_close_connection(notify->conn);
+        notify->conn = NULL;
     }
+}
 
-    zone = ngx_http_lua_shdict_get_zone(L, 1);
-    if (zone == NULL) {
-        return luaL_error(L, "bad \"zone\" argument");
-    }
 
-    ctx = zone->data;
-    name = ctx->name;
+static void
+ngx_http_lua_shdict_persist_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_shdict_ctx_t  *ctx;
 
-    if (lua_isnil(L, 2)) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "nil key");
-        return 2;
+    if (ngx_exiting) {
+        return;
     }
 
-    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
-
-    if (key.len == 0) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "empty key");
-        return 2;
-    }
+    ctx = ev->data;
 
-    if (key.len > 65535) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "key too long");
-        return 2;
-    }
+    (void) ngx_http_lua_shdict_save(ctx, 0, ev->log);
 
-    hash = ngx_crc32_short(key.data, key.len);
+    ngx_add_timer(ev, ctx->persist_interval);
+}
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
 
-#if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
-#endif
+static void
+ngx_http_lua_shdict_wheel_handler(ngx_event_t *ev)
+{
+    uint64_t                     now;
+    ngx_uint_t                   i, j, freed;
+    ngx_time_t                  *tp;
+    ngx_shm_zone_t             **zone;
+    ngx_http_lua_shdict_ctx_t   *ctx, *shard;
+    ngx_http_lua_main_conf_t    *lmcf;
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len, &sd);
+    if (ngx_exiting) {
+        return;
+    }
 
-    dd("shdict lookup returned %d", (int) rc);
+    lmcf = ev->data;
+    zone = lmcf->shdict_zones->elts;
 
-    if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushnil(L);
-        return 1;
-    }
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
 
-    /* rc == NGX_OK */
+    for (i = 0; i < lmcf->shdict_zones->nelts; i++) {
+        ctx = zone[i]->data;
 
-    if (sd->value_type != SHDICT_TLIST) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        if (ctx->expiry != NGX_HTTP_LUA_SHDICT_EXPIRY_WHEEL) {
+            continue;
+        }
 
-        lua_pushnil(L);
-        lua_pushliteral(L, "value not a list");
-        return 2;
-    }
+        for (j = 0; j < ctx->nshards; j++) {
+            shard = &ctx->shards[j];
 
-    if (sd->value_len <= 0) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            /* a busy shard is left to another worker or the next run */
 
-        return luaL_error(L, "bad lua list length found for key %s "
-                          "in shared_dict %s: %lu", key.data, name.data,
-                          (unsigned long) sd->value_len);
-    }
+            if (!ngx_http_lua_shdict_trylock(shard)) {
+                continue;
+            }
 
-    queue = ngx_http_lua_shdict_get_list_head(sd, key.len);
+            freed = ngx_http_lua_shdict_wheel_advance(shard, now);
 
-    if (flags == NGX_HTTP_LUA_SHDICT_LEFT) {
-        queue = ngx_queue_head(queue);
+            ngx_http_lua_shdict_unlock(shard);
 
-    } else {
-        queue = ngx_queue_last(queue);
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                           "lua shared dict \"%V\": %ui expired items "
+                           "reclaimed", &ctx->name, freed);
+        }
     }
 
-    lnode = ngx_queue_data(queue, ngx_http_lua_shdict_list_node_t, queue);
-
-    value_type = lnode->value_type;
+    ngx_add_timer(ev, NGX_HTTP_LUA_SHDICT_WHEEL_INTERVAL);
+}
 
-    dd("data: %p", lnode->data);
-    dd("value len: %d", (int) sd->value_len);
 
-    value.data = lnode->data;
-    value.len = (size_t) lnode->value_len;
+static void
+ngx_http_lua_shdict_notify_handler(ngx_event_t *ev)
+{
+    ssize_t                         n;
+    uint64_t                        next, pushes, v;
+    ngx_int_t                       rc;
+    ngx_queue_t                     ready, *q, *nq;
+    ngx_connection_t               *c;
+    ngx_http_lua_shdict_ring_t     *ring;
+    ngx_http_lua_shdict_waiter_t   *waiter;
+    ngx_http_lua_shdict_notify_t   *notify;
+
+    c = ev->data;
+    notify = c->data;
+    ring = notify->ring;
+
+    n = read(c->fd, &v, sizeof(uint64_t));
+
+    if (n == -1 && ngx_errno != NGX_EAGAIN) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                      "read() from eventfd of lua_shared_dict failed");
+    }
 
-    switch (value_type) {
+    ngx_shmtx_lock(&ring->mutex);
+    next = ring->next;
+    ngx_shmtx_unlock(&ring->mutex);
 
-    case SHDICT_TSTRING:
+    pushes = ring->pushes;
 
-        lua_pushlstring(L, (char *) value.data, value.len);
-        break;
+    ngx_queue_init(&ready);
 
-    case SHDICT_TNUMBER:
+    for (q = ngx_queue_head(&notify->waiters);
+         q != ngx_queue_sentinel(&notify->waiters);
+         q = nq)
+    {
+        nq = ngx_queue_next(q);
 
-        if (value.len != sizeof(double)) {
+        waiter = ngx_queue_data(q, ngx_http_lua_shdict_waiter_t, queue);
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        if (!waiter->pop) {
+            if (waiter->cursor < next) {
+                ngx_queue_remove(q);
+                ngx_queue_insert_tail(&ready, q);
+            }
 
-            return luaL_error(L, "bad lua list node number value size found "
-                              "for key %s in shared_dict %s: %lu", key.data,
-                              name.data, (unsigned long) value.len);
+            continue;
         }
 
-        ngx_memcpy(&num, value.data, sizeof(double));
+        if (waiter->cursor == pushes) {
+            continue;
+        }
 
-        lua_pushnumber(L, num);
-        break;
+        /*
+         * the value is popped here, in the order the threads started
+         * waiting, so that a thread is only woken up with a value of its own
+         */
 
-    default:
+        waiter->cursor = pushes;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        rc = ngx_http_lua_shdict_lpop_copy(waiter->shard, waiter->hash,
+                                           &waiter->key, &waiter->value_type,
+                                           &waiter->value, &waiter->err);
 
-        return luaL_error(L, "bad list node value type found for key %s in "
-                          "shared_dict %s: %d", key.data, name.data,
-                          value_type);
+        if (rc != NGX_DECLINED) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_tail(&ready, q);
+        }
     }
 
-    ngx_queue_remove(queue);
-
-    ngx_slab_free_locked(ctx->shpool, lnode);
+    if (!ngx_queue_empty(&notify->waiters)) {
+        ring->armed[ngx_worker] = 1;
 
-    if (sd->value_len == 1) {
+        ngx_memory_barrier();
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                       "lua shared dict list: empty node after pop, "
-                       "remove it");
+        ngx_shmtx_lock(&ring->mutex);
 
-        ngx_queue_remove(&sd->queue);
+        if (ring->next != next || ring->pushes != pushes) {
+            /* missed while not armed */
+            ngx_post_event(ev, &ngx_posted_events);
+        }
 
-        node = (ngx_rbtree_node_t *)
-                    ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+        ngx_shmtx_unlock(&ring->mutex);
+    }
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    /* the resumed threads may abort the other ready ones */
 
-        ngx_slab_free_locked(ctx->shpool, node);
+    while (!ngx_queue_empty(&ready)) {
+        q = ngx_queue_head(&ready);
+        waiter = ngx_queue_data(q, ngx_http_lua_shdict_waiter_t, queue);
 
-    } else {
-        sd->value_len = sd->value_len - 1;
+        ngx_http_lua_shdict_notify_wake(waiter->coctx, 0);
+    }
 
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "failed to handle the eventfd of lua_shared_dict");
     }
+}
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-    return 1;
+static void
+ngx_http_lua_shdict_notify_timeout(ngx_event_t *ev)
+{
+    ngx_http_lua_shdict_notify_wake(ev->data, 1);
 }
 
 
-static int
-ngx_http_lua_shdict_llen(lua_State *L)
+static void
+ngx_http_lua_shdict_notify_wake(ngx_http_lua_co_ctx_t *coctx,
+    ngx_uint_t timedout)
 {
-    int                          n;
-    ngx_str_t                    key;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-    ngx_shm_zone_t              *zone;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_lua_ctx_t            *ctx;
+    ngx_http_lua_shdict_waiter_t  *waiter;
 
-    n = lua_gettop(L);
+    waiter = coctx->data;
+    waiter->timedout = timedout;
 
-    if (n != 2) {
-        return luaL_error(L, "expecting 2 arguments, "
-                          "but only seen %d", n);
-    }
+    ngx_queue_remove(&waiter->queue);
 
-    if (lua_type(L, 1) != LUA_TTABLE) {
-        return luaL_error(L, "bad \"zone\" argument");
-    }
+    coctx->cleanup = NULL;
 
-    zone = ngx_http_lua_shdict_get_zone(L, 1);
-    if (zone == NULL) {
-        return luaL_error(L, "bad \"zone\" argument");
+    if (coctx->sleep.timer_set) {
+        ngx_del_timer(&coctx->sleep);
     }
 
-    ctx = zone->data;
+    r = ngx_http_lua_get_req(coctx->co);
+    c = r->connection;
 
-    if (lua_isnil(L, 2)) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "nil key");
-        return 2;
-    }
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    ngx_http_lua_assert(ctx != NULL);
 
-    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+    ctx->cur_co_ctx = coctx;
 
-    if (key.len == 0) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "empty key");
-        return 2;
-    }
+    if (ctx->entered_content_phase) {
+        (void) ngx_http_lua_shdict_notify_resume(r);
 
-    if (key.len > 65535) {
-        lua_pushnil(L);
-        lua_pushliteral(L, "key too long");
-        return 2;
+    } else {
+        ctx->resume_handler = ngx_http_lua_shdict_notify_resume;
+        ngx_http_core_run_phases(r);
     }
 
-    hash = ngx_crc32_short(key.data, key.len);
+    ngx_http_run_posted_requests(c);
+}
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
 
-#if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
-#endif
+static ngx_int_t
+ngx_http_lua_shdict_notify_resume(ngx_http_request_t *r)
+{
+    int                            nret;
+    lua_State                     *vm;
+    ngx_int_t                      rc;
+    ngx_uint_t                     nreqs;
+    ngx_connection_t              *c;
+    ngx_http_lua_ctx_t            *ctx;
+    ngx_http_lua_co_ctx_t         *coctx;
+    ngx_http_lua_shdict_waiter_t  *waiter;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key.data, key.len, &sd);
+    ctx->resume_handler = ngx_http_lua_wev_handler;
 
-    dd("shdict lookup returned %d", (int) rc);
+    c = r->connection;
+    vm = ngx_http_lua_get_lua_vm(r, ctx);
+    nreqs = c->requests;
 
-    if (rc == NGX_OK) {
+    coctx = ctx->cur_co_ctx;
+    waiter = coctx->data;
 
-        if (sd->value_type != SHDICT_TLIST) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+    nret = 2;
 
-            lua_pushnil(L);
-            lua_pushliteral(L, "value not a list");
-            return 2;
-        }
+    if (waiter->timedout) {
+        lua_pushnil(coctx->co);
+        lua_pushliteral(coctx->co, "timeout");
 
-        ngx_queue_remove(&sd->queue);
-        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    } else if (!waiter->pop) {
+        ngx_http_lua_shdict_push_events(coctx->co, waiter->notify,
+                                        waiter->cursor);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    } else if (waiter->err) {
+        lua_pushnil(coctx->co);
+        lua_pushstring(coctx->co, waiter->err);
 
-        lua_pushnumber(L, (lua_Number) sd->value_len);
-        return 1;
+    } else {
+        ngx_http_lua_shdict_push_popped(coctx->co, waiter->value_type,
+                                        &waiter->value);
+        ngx_free(waiter->value.data);
+        nret = 1;
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_free(waiter);
+    coctx->data = NULL;
 
-    lua_pushnumber(L, 0);
-    return 1;
-}
+    rc = ngx_http_lua_run_thread(vm, r, ctx, nret);
 
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua run thread returned %d", rc);
 
-ngx_shm_zone_t *
-ngx_http_lua_find_zone(u_char *name_data, size_t name_len)
-{
-    ngx_str_t                       *name;
-    ngx_uint_t                       i;
-    ngx_shm_zone_t                  *zone;
-    ngx_http_lua_shm_zone_ctx_t     *ctx;
-    volatile ngx_list_part_t        *part;
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx, nreqs);
+    }
 
-    part = &ngx_cycle->shared_memory.part;
-    zone = part->elts;
+    if (rc == NGX_DONE) {
+        ngx_http_lua_finalize_request(r, NGX_DONE);
+        return ngx_http_lua_run_posted_threads(c, vm, r, ctx, nreqs);
+    }
 
-    for (i = 0; /* void */ ; i++) {
+    if (ctx->entered_content_phase) {
+        ngx_http_lua_finalize_request(r, rc);
+        return NGX_DONE;
+    }
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
-            }
+    return rc;
+}
 
-            part = part->next;
-            zone = part->elts;
-            i = 0;
-        }
 
-        name = &zone[i].shm.name;
+static void
+ngx_http_lua_shdict_notify_waiter_cleanup(void *data)
+{
+    ngx_http_lua_co_ctx_t  *coctx = data;
 
-        dd("name: [%.*s] %d", (int) name->len, name->data, (int) name->len);
-        dd("name2: [%.*s] %d", (int) name_len, name_data, (int) name_len);
+    ngx_int_t                      rc;
+    ngx_uint_t                     len;
+    ngx_http_lua_shdict_waiter_t  *waiter;
 
-        if (name->len == name_len
-            && ngx_strncmp(name->data, name_data, name_len) == 0)
-        {
-            ctx = (ngx_http_lua_shm_zone_ctx_t *) zone[i].data;
-            return &ctx->zone;
-        }
+    waiter = coctx->data;
+
+    if (coctx->sleep.timer_set) {
+        ngx_del_timer(&coctx->sleep);
     }
 
-    return NULL;
-}
+    ngx_queue_remove(&waiter->queue);
 
+    if (waiter->value.data) {
 
-ngx_shm_zone_t *
-ngx_http_lua_ffi_shdict_udata_to_zone(void *zone_udata)
-{
-    if (zone_udata == NULL) {
-        return NULL;
-    }
+        /*
+         * popped for a thread aborted before it was resumed, e.g. by another
+         * ready one, so the value goes back to the head of the list
+         */
 
-    return *(ngx_shm_zone_t **) zone_udata;
-}
+        ngx_http_lua_shdict_lock(waiter->shard);
 
+        rc = ngx_http_lua_shdict_push_locked(waiter->shard, waiter->hash,
+                                             &waiter->key, waiter->value_type,
+                                             &waiter->value,
+                                             NGX_HTTP_LUA_SHDICT_LEFT, &len);
 
-int
-ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
-    size_t key_len, int value_type, u_char *str_value_buf,
-    size_t str_value_len, double num_value, long exptime, int user_flags,
-    char **errmsg, int *forcible)
-{
-    int                          i, n;
-    u_char                       c, *p;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_time_t                  *tp;
-    ngx_queue_t                 *queue, *q;
-    ngx_rbtree_node_t           *node;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
+        ngx_http_lua_shdict_unlock(waiter->shard);
 
-    dd("exptime: %ld", exptime);
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "lua shared dict \"%V\": failed to push back the "
+                          "value popped by blpop for key \"%V\": %s",
+                          &waiter->shard->name, &waiter->key,
+                          rc == NGX_DECLINED ? "value not a list"
+                                             : "no memory");
+        }
 
-    ctx = zone->data;
+        ngx_free(waiter->value.data);
+    }
 
-    *forcible = 0;
+    ngx_free(waiter);
 
-    hash = ngx_crc32_short(key, key_len);
+    coctx->data = NULL;
+    coctx->cleanup = NULL;
+}
 
-    switch (value_type) {
 
-    case SHDICT_TSTRING:
-        /* do nothing */
-        break;
+/*
+ * pushes the cursor of the next event and the keys of the events since
+ * the given cursor, or an empty string when some of them were overwritten;
+ * the events are copied out of the ring first, so that the Lua table is
+ * built, and may run out of memory, without the mutex of the ring
+ */
 
-    case SHDICT_TNUMBER:
-        dd("num value: %lf", num_value);
-        str_value_buf = (u_char *) &num_value;
-        str_value_len = sizeof(double);
-        break;
+static void
+ngx_http_lua_shdict_push_events(lua_State *L,
+    ngx_http_lua_shdict_notify_t *notify, uint64_t cursor)
+{
+    int                            n;
+    uint64_t                       next;
+    ngx_uint_t                     i, nevents, lost;
+    ngx_http_lua_shdict_ring_t    *ring;
+    ngx_http_lua_shdict_event_t   *ev;
 
-    case SHDICT_TBOOLEAN:
-        c = num_value ? 1 : 0;
-        str_value_buf = &c;
-        str_value_len = sizeof(u_char);
-        break;
+    ring = notify->ring;
 
-    case LUA_TNIL:
-        if (op & (NGX_HTTP_LUA_SHDICT_ADD|NGX_HTTP_LUA_SHDICT_REPLACE)) {
-            *errmsg = "attempt to add or replace nil values";
-            return NGX_ERROR;
-        }
+    ngx_shmtx_lock(&ring->mutex);
 
-        str_value_buf = NULL;
-        str_value_len = 0;
-        break;
+    next = ring->next;
 
-    default:
-        *errmsg = "unsupported value type";
-        return NGX_ERROR;
+    if (cursor == 0 || cursor > next) {
+        cursor = next;
     }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    lost = 0;
 
-#if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
-#endif
+    if (next - cursor > notify->size) {
+        lost = 1;
+        cursor = next - notify->size;
+    }
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+    for (nevents = 0; cursor + nevents < next; nevents++) {
+        ev = &ring->events[(cursor + nevents) & ring->mask];
 
-    dd("lookup returns %d", (int) rc);
+        notify->events[nevents].key_len = ev->key_len;
+        ngx_memcpy(notify->events[nevents].key, ev->key,
+                   ngx_min(ev->key_len, NGX_HTTP_LUA_SHDICT_EVENT_KEY));
+    }
 
-    if (op & NGX_HTTP_LUA_SHDICT_REPLACE) {
+    ngx_shmtx_unlock(&ring->mutex);
 
-        if (rc == NGX_DECLINED || rc == NGX_DONE) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            *errmsg = "not found";
-            return NGX_DECLINED;
-        }
+    lua_pushnumber(L, (lua_Number) next);
 
-        /* rc == NGX_OK */
+    lua_createtable(L, (int) (nevents + lost) /* narr */, 0 /* nrec */);
 
-        goto replace;
-    }
+    n = 0;
 
-    if (op & NGX_HTTP_LUA_SHDICT_ADD) {
+    if (lost) {
+        lua_pushliteral(L, "");
+        lua_rawseti(L, -2, ++n);
+    }
 
-        if (rc == NGX_OK) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            *errmsg = "exists";
-            return NGX_DECLINED;
-        }
+    for (i = 0; i < nevents; i++) {
+        ev = &notify->events[i];
 
-        if (rc == NGX_DONE) {
-            /* exists but expired */
+        lua_pushlstring(L, (char *) ev->key,
+                        ngx_min(ev->key_len, NGX_HTTP_LUA_SHDICT_EVENT_KEY));
+        lua_rawseti(L, -2, ++n);
+    }
+}
 
-            dd("go to replace");
-            goto replace;
-        }
 
-        /* rc == NGX_DECLINED */
+static void
+ngx_http_lua_shdict_insert_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_uint_t                   i, mask;
+    ngx_http_lua_shdict_slot_t  *slots;
 
-        dd("go to insert");
-        goto insert;
+    if (ctx->sh->slots == NULL) {
+        ngx_rbtree_insert(&ctx->sh->rbtree, node);
+        return;
     }
 
-    if (rc == NGX_OK || rc == NGX_DONE) {
+    slots = ctx->sh->slots;
+    mask = ctx->sh->mask;
 
-        if (value_type == LUA_TNIL) {
-            goto remove;
-        }
+    for (i = node->key & mask; slots[i].node; i = (i + 1) & mask) {
+        /* void */
+    }
 
-replace:
+    slots[i].hash = (uint32_t) node->key;
+    slots[i].node = ngx_http_lua_shdict_node_slot(ctx, node);
 
-        if (str_value_buf
-            && str_value_len == (size_t) sd->value_len
-            && sd->value_type != SHDICT_TLIST)
-        {
+    ctx->sh->nentries++;
+}
 
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                           "lua shared dict set: found old entry and value "
-                           "size matched, reusing it");
 
-            ngx_queue_remove(&sd->queue);
-            ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+static void
+ngx_http_lua_shdict_delete_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    uint32_t                     offset;
+    ngx_uint_t                   i, j, k, mask;
+    ngx_http_lua_shdict_slot_t  *slots;
 
-            sd->key_len = (u_short) key_len;
+    if (ctx->sh->slots == NULL) {
+        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        return;
+    }
 
-            if (exptime > 0) {
-                tp = ngx_timeofday();
-                sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
-                              + (uint64_t) exptime;
+    slots = ctx->sh->slots;
+    mask = ctx->sh->mask;
+    offset = ngx_http_lua_shdict_node_slot(ctx, node);
 
-            } else {
-                sd->expires = 0;
-            }
+    for (i = node->key & mask; slots[i].node != offset; i = (i + 1) & mask) {
+        /* void */
+    }
 
-            sd->user_flags = user_flags;
+    /*
+     * backward shift deletion: move the following entries of the probe
+     * sequence into the hole unless that would put them before their home
+     * slot, so that lookups never need tombstones
+     */
 
-            sd->value_len = (uint32_t) str_value_len;
+    for ( ;; ) {
+        slots[i].node = 0;
+        j = i;
 
-            dd("setting value type to %d", value_type);
+        for ( ;; ) {
+            j = (j + 1) & mask;
 
-            sd->value_type = (uint8_t) value_type;
+            if (slots[j].node == 0) {
+                ctx->sh->nentries--;
+                return;
+            }
 
-            p = ngx_copy(sd->data, key, key_len);
-            ngx_memcpy(p, str_value_buf, str_value_len);
+            k = slots[j].hash & mask;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+                continue;
+            }
 
-            return NGX_OK;
+            break;
         }
 
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                       "lua shared dict set: found old entry but value size "
-                       "NOT matched, removing it first");
+        slots[i] = slots[j];
+        i = j;
+    }
+}
 
-remove:
 
-        if (sd->value_type == SHDICT_TLIST) {
-            queue = ngx_http_lua_shdict_get_list_head(sd, key_len);
+static ngx_int_t
+ngx_http_lua_shdict_hash_find(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash, u_char *kdata, size_t klen,
+    ngx_http_lua_shdict_node_t **sdp, ngx_uint_t lock_free)
+{
+    ngx_uint_t                   i, n, mask;
+    ngx_rbtree_node_t           *node;
+    ngx_http_lua_shdict_slot_t  *slot, *slots;
+    ngx_http_lua_shdict_node_t  *sd;
 
-            for (q = ngx_queue_head(queue);
-                 q != ngx_queue_sentinel(queue);
-                 q = ngx_queue_next(q))
-            {
-                p = (u_char *) ngx_queue_data(q,
-                                              ngx_http_lua_shdict_list_node_t,
-                                              queue);
+    slots = ctx->sh->slots;
+    mask = ctx->sh->mask;
 
-                ngx_slab_free_locked(ctx->shpool, p);
-            }
-        }
+    /*
+     * the slots are 8 bytes long, so the probe sequence of a key usually
+     * stays within a cache line, and the inline hashes mean that only the
+     * node that really matches is ever touched
+     */
 
-        ngx_queue_remove(&sd->queue);
+    for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+        slot = &slots[i];
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+        if (slot->node == 0) {
+            *sdp = NULL;
+            return NGX_DECLINED;
+        }
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        if (slot->hash != (uint32_t) hash) {
+            continue;
+        }
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        node = ngx_http_lua_shdict_slot_node(ctx, slot);
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
+        if (lock_free
+            && (!ngx_http_lua_shdict_in_pool(ctx, node,
+                                             sizeof(ngx_rbtree_node_t))
+                || !ngx_http_lua_shdict_in_pool(ctx, sd->data,
+                                                sd->key_len)))
+        {
+            return NGX_ABORT;
+        }
+
+        if (ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len) == 0) {
+            *sdp = sd;
+            return NGX_OK;
+        }
     }
 
-insert:
+    /* only reachable by lock-free readers racing with writers */
 
-    /* rc == NGX_DECLINED or value size unmatch */
+    return NGX_ABORT;
+}
 
-    if (str_value_buf == NULL) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        return NGX_OK;
-    }
+
+static ngx_int_t
+ngx_http_lua_shdict_lookup(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
+{
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp;
+    uint64_t                     now;
+    int64_t                      ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (ctx->sh->sketch) {
+        ngx_http_lua_shdict_sketch_add(ctx->sh, (uint32_t) hash, 1);
+    }
+
+    if (ctx->sh->slots) {
+        if (ngx_http_lua_shdict_hash_find(ctx, hash, kdata, klen, &sd, 0)
+            != NGX_OK)
+        {
+            *sdp = NULL;
+            return NGX_DECLINED;
+        }
+
+        goto found;
+    }
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+
+        if (rc == 0) {
+            goto found;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+
+found:
+
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+    *sdp = sd;
+
+    dd("node expires: %lld", (long long) sd->expires);
+
+    if (sd->expires != 0) {
+        tp = ngx_timeofday();
+
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+        ms = sd->expires - now;
+
+        dd("time to live: %lld", (long long) ms);
+
+        if (ms < 0) {
+            dd("node already expired");
+            return NGX_DONE;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_lua_shdict_sketch_index(ngx_http_lua_shdict_shctx_t *sh,
+    uint32_t hash, ngx_uint_t row)
+{
+    static uint32_t  seeds[] = {
+        0x97cb3127, 0xab7d7d19, 0x8c4bf8f7, 0xc2b2ae35
+    };
+
+    hash *= seeds[row];
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+
+    return hash & sh->sketch_mask;
+}
+
+
+static void
+ngx_http_lua_shdict_sketch_add(ngx_http_lua_shdict_shctx_t *sh,
+    uint32_t hash, ngx_uint_t age)
+{
+    u_char      *c;
+    ngx_uint_t   i;
+
+    /*
+     * the lock-free readers get here without the lock, a lost update
+     * only makes an estimate slightly lower, so they are tolerated;
+     * the aging is left to the callers holding the lock though
+     */
+
+    for (i = 0; i < 4; i++) {
+        c = &sh->sketch[ngx_http_lua_shdict_sketch_index(sh, hash, i)];
+
+        if (*c < NGX_HTTP_LUA_SHDICT_SKETCH_MAX) {
+            (*c)++;
+        }
+    }
+
+    sh->sketch_adds++;
+
+    if (!age || sh->sketch_adds <= sh->sketch_mask) {
+        return;
+    }
+
+    /* halve all the counters so that the old popularity fades out */
+
+    for (i = 0; i <= sh->sketch_mask; i++) {
+        sh->sketch[i] >>= 1;
+    }
+
+    sh->sketch_adds = 0;
+}
+
+
+static ngx_uint_t
+ngx_http_lua_shdict_sketch_estimate(ngx_http_lua_shdict_shctx_t *sh,
+    uint32_t hash)
+{
+    ngx_uint_t  i, c, min;
+
+    min = NGX_HTTP_LUA_SHDICT_SKETCH_MAX;
+
+    for (i = 0; i < 4; i++) {
+        c = sh->sketch[ngx_http_lua_shdict_sketch_index(sh, hash, i)];
+
+        if (c < min) {
+            min = c;
+        }
+    }
+
+    return min;
+}
+
+
+/*
+ * decides whether a new key is worth evicting the LRU tail for: only when
+ * it has been seen more often than the tail, or when the tail has expired
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_admit(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash)
+{
+    uint64_t                     now;
+    ngx_time_t                  *tp;
+    ngx_queue_t                 *q;
+    ngx_rbtree_node_t           *node;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (ngx_queue_empty(&ctx->sh->lru_queue)) {
+        return 1;
+    }
+
+    q = ngx_queue_last(&ctx->sh->lru_queue);
+    sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+    if (sd->expires != 0) {
+        tp = ngx_timeofday();
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+        if (sd->expires <= now) {
+            return 1;
+        }
+    }
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    return ngx_http_lua_shdict_sketch_estimate(ctx->sh, hash)
+           > ngx_http_lua_shdict_sketch_estimate(ctx->sh,
+                                                 (uint32_t) node->key);
+}
+
+
+static int
+ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
+{
+    ngx_time_t                      *tp;
+    uint64_t                         now;
+    ngx_queue_t                     *q, *list_queue, *lq;
+    int64_t                          ms;
+    ngx_rbtree_node_t               *node;
+    ngx_http_lua_shdict_node_t      *sd;
+    int                              freed = 0;
+    ngx_http_lua_shdict_list_node_t *lnode;
+
+    tp = ngx_timeofday();
+
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    /*
+     * n == 1 deletes one or two expired entries
+     * n == 0 deletes oldest entry by force
+     *        and one or two zero rate entries
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&ctx->sh->lru_queue)) {
+            return freed;
+        }
+
+        q = ngx_queue_last(&ctx->sh->lru_queue);
+
+        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+        ms = sd->expires - now;
+
+        if (n++ != 0) {
+
+            if (sd->expires == 0) {
+                return freed;
+            }
+
+            if (ms > 0) {
+                return freed;
+            }
+        }
+
+        if (sd->expires == 0 || ms > 0) {
+            ctx->sh->stats.evictions++;
+
+        } else {
+            ctx->sh->stats.expired++;
+        }
+
+        if (sd->value_type == SHDICT_TLIST) {
+            list_queue = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
+
+            for (lq = ngx_queue_head(list_queue);
+                 lq != ngx_queue_sentinel(list_queue);
+                 lq = ngx_queue_next(lq))
+            {
+                lnode = ngx_queue_data(lq, ngx_http_lua_shdict_list_node_t,
+                                       queue);
+
+                ngx_slab_free_locked(ctx->shpool, lnode);
+            }
+        }
+
+        ngx_queue_remove(q);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_http_lua_shdict_delete_node(ctx, node);
+
+        ngx_http_lua_shdict_free_node(ctx, node);
+
+        freed++;
+    }
+
+    return freed;
+}
+
+
+void
+ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
+{
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_uint_t                   i;
+    ngx_shm_zone_t             **zone;
+    ngx_shm_zone_t             **zone_udata;
+
+    if (lmcf->shdict_zones != NULL) {
+        lua_createtable(L, 0, lmcf->shdict_zones->nelts /* nrec */);
+                /* ngx.shared */
+
+        lua_createtable(L, 0 /* narr */, 47 /* nrec */); /* shared mt */
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_lpush);
+        lua_setfield(L, -2, "lpush");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_rpush);
+        lua_setfield(L, -2, "rpush");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_lpop);
+        lua_setfield(L, -2, "lpop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_rpop);
+        lua_setfield(L, -2, "rpop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_llen);
+        lua_setfield(L, -2, "llen");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_blpop);
+        lua_setfield(L, -2, "blpop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_hset);
+        lua_setfield(L, -2, "hset");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_hget);
+        lua_setfield(L, -2, "hget");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_hincr);
+        lua_setfield(L, -2, "hincr");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_hdel);
+        lua_setfield(L, -2, "hdel");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_hgetall);
+        lua_setfield(L, -2, "hgetall");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_zadd);
+        lua_setfield(L, -2, "zadd");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_zrem);
+        lua_setfield(L, -2, "zrem");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_zremrangebyscore);
+        lua_setfield(L, -2, "zremrangebyscore");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_zcount);
+        lua_setfield(L, -2, "zcount");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_ztop);
+        lua_setfield(L, -2, "ztop");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_set_table);
+        lua_setfield(L, -2, "set_table");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_get_table);
+        lua_setfield(L, -2, "get_table");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_l1_get);
+        lua_setfield(L, -2, "l1_get");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_flush_expired);
+        lua_setfield(L, -2, "flush_expired");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_get_keys);
+        lua_setfield(L, -2, "get_keys");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_scan);
+        lua_setfield(L, -2, "scan");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_get_multi);
+        lua_setfield(L, -2, "get_multi");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_set_multi);
+        lua_setfield(L, -2, "set_multi");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_stats);
+        lua_setfield(L, -2, "stats");
+
+#if (nginx_version >= 1011007)
+        lua_pushcfunction(L, ngx_http_lua_shdict_fragmentation);
+        lua_setfield(L, -2, "fragmentation");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_compact);
+        lua_setfield(L, -2, "compact");
+#endif
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_incr_fast);
+        lua_setfield(L, -2, "incr_fast");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_get_sum);
+        lua_setfield(L, -2, "get_sum");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_watch);
+        lua_setfield(L, -2, "watch");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_events);
+        lua_setfield(L, -2, "events");
+
+        lua_pushcfunction(L, ngx_http_lua_shdict_wait_events);
+        lua_setfield(L, -2, "wait_events");
+
+        lua_pushvalue(L, -1); /* shared mt mt */
+        lua_setfield(L, -2, "__index"); /* shared mt */
+
+        zone = lmcf->shdict_zones->elts;
+
+        for (i = 0; i < lmcf->shdict_zones->nelts; i++) {
+            ctx = zone[i]->data;
+
+            lua_pushlstring(L, (char *) ctx->name.data, ctx->name.len);
+                /* shared mt key */
+
+            lua_createtable(L, 1 /* narr */, 0 /* nrec */);
+                /* table of zone[i] */
+            zone_udata = lua_newuserdata(L, sizeof(ngx_shm_zone_t *));
+                /* shared mt key ud */
+            *zone_udata = zone[i];
+            lua_rawseti(L, -2, SHDICT_USERDATA_INDEX); /* {zone[i]} */
+            lua_pushvalue(L, -3); /* shared mt key ud mt */
+            lua_setmetatable(L, -2); /* shared mt key ud */
+            lua_rawset(L, -4); /* shared mt */
+        }
+
+        lua_pop(L, 1); /* shared */
+
+    } else {
+        lua_newtable(L);    /* ngx.shared */
+    }
+
+    lua_setfield(L, -2, "shared");
+}
+
+
+static ngx_inline ngx_shm_zone_t *
+ngx_http_lua_shdict_get_zone(lua_State *L, int index)
+{
+    ngx_shm_zone_t      *zone;
+    ngx_shm_zone_t     **zone_udata;
+
+    lua_rawgeti(L, index, SHDICT_USERDATA_INDEX);
+    zone_udata = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (zone_udata == NULL) {
+        return NULL;
+    }
+
+    zone = *zone_udata;
+    return zone;
+}
+
+
+static int
+ngx_http_lua_shdict_flush_expired(lua_State *L)
+{
+    ngx_queue_t                     *q, *prev, *list_queue, *lq;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_http_lua_shdict_ctx_t       *ctx, *shard;
+    ngx_shm_zone_t                  *zone;
+    ngx_time_t                      *tp;
+    ngx_uint_t                       i;
+    int                              freed = 0;
+    int                              attempts = 0;
+    ngx_rbtree_node_t               *node;
+    uint64_t                         now;
+    int                              n;
+    ngx_http_lua_shdict_list_node_t *lnode;
+
+    n = lua_gettop(L);
+
+    if (n != 1 && n != 2) {
+        return luaL_error(L, "expecting 1 or 2 argument(s), but saw %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    if (n == 2) {
+        attempts = luaL_checkint(L, 2);
+    }
+
+    ctx = zone->data;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+
+        ngx_http_lua_shdict_lock(shard);
+
+        tp = ngx_timeofday();
+
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+        q = ngx_queue_last(&shard->sh->lru_queue);
+
+        while (q != ngx_queue_sentinel(&shard->sh->lru_queue)) {
+            prev = ngx_queue_prev(q);
+
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+            if (sd->expires != 0 && sd->expires <= now) {
+
+                if (sd->value_type == SHDICT_TLIST) {
+                    list_queue = ngx_http_lua_shdict_get_list_head(sd,
+                                                                sd->key_len);
+
+                    for (lq = ngx_queue_head(list_queue);
+                         lq != ngx_queue_sentinel(list_queue);
+                         lq = ngx_queue_next(lq))
+                    {
+                        lnode = ngx_queue_data(lq,
+                                               ngx_http_lua_shdict_list_node_t,
+                                               queue);
+
+                        ngx_slab_free_locked(shard->shpool, lnode);
+                    }
+                }
+
+                ngx_queue_remove(q);
+
+                node = (ngx_rbtree_node_t *)
+                    ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+                ngx_http_lua_shdict_delete_node(shard, node);
+                ngx_http_lua_shdict_free_node(shard, node);
+                shard->sh->stats.expired++;
+                freed++;
+
+                if (attempts && freed == attempts) {
+                    break;
+                }
+            }
+
+            q = prev;
+        }
+
+        ngx_http_lua_shdict_unlock(shard);
+
+        if (attempts && freed == attempts) {
+            break;
+        }
+    }
+
+    lua_pushnumber(L, freed);
+    return 1;
+}
+
+
+/*
+ * This trades CPU for memory. This is potentially slow. O(2n)
+ */
+
+static int
+ngx_http_lua_shdict_get_keys(lua_State *L)
+{
+    ngx_queue_t                 *q, *prev;
+    ngx_http_lua_shdict_node_t  *sd;
+    ngx_http_lua_shdict_ctx_t   *ctx, *shard;
+    ngx_shm_zone_t              *zone;
+    ngx_time_t                  *tp;
+    ngx_uint_t                   i;
+    int                          total = 0;
+    int                          attempts = 1024;
+    uint64_t                     now;
+    int                          n;
+
+    n = lua_gettop(L);
+
+    if (n != 1 && n != 2) {
+        return luaL_error(L, "expecting 1 or 2 argument(s), "
+                          "but saw %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    if (n == 2) {
+        attempts = luaL_checkint(L, 2);
+    }
+
+    ctx = zone->data;
+
+    lua_createtable(L, ctx->nshards == 1 ? 0 : attempts, 0);
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+
+        ngx_http_lua_shdict_lock(shard);
+
+        if (ngx_queue_empty(&shard->sh->lru_queue)) {
+            ngx_http_lua_shdict_unlock(shard);
+            continue;
+        }
+
+        tp = ngx_timeofday();
+
+        now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+        if (ctx->nshards == 1) {
+
+            /*
+             * first run through: get total number of elements we need to
+             * allocate
+             */
+
+            q = ngx_queue_last(&shard->sh->lru_queue);
+
+            while (q != ngx_queue_sentinel(&shard->sh->lru_queue)) {
+                prev = ngx_queue_prev(q);
+
+                sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+                if (sd->expires == 0 || sd->expires > now) {
+                    total++;
+                    if (attempts && total == attempts) {
+                        break;
+                    }
+                }
+
+                q = prev;
+            }
+
+            lua_pop(L, 1);
+            lua_createtable(L, total, 0);
+
+            total = 0;
+        }
+
+        /* second run through: add keys to table */
+
+        q = ngx_queue_last(&shard->sh->lru_queue);
+
+        while (q != ngx_queue_sentinel(&shard->sh->lru_queue)) {
+            prev = ngx_queue_prev(q);
+
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+            if (sd->expires == 0 || sd->expires > now) {
+                lua_pushlstring(L, (char *) sd->data, sd->key_len);
+                lua_rawseti(L, -2, ++total);
+                if (attempts && total == attempts) {
+                    break;
+                }
+            }
+
+            q = prev;
+        }
+
+        ngx_http_lua_shdict_unlock(shard);
+
+        if (attempts && total == attempts) {
+            break;
+        }
+    }
+
+    /* table is at top of stack */
+    return 1;
+}
+
+
+/*
+ * visits the keys of one shard in the order of their hash values, or of
+ * their home slots in the hash index, which never change while the keys
+ * stay in the dictionary; the cursor carries the shard number in its
+ * upper 32 bits and the first hash value or home slot to visit below
+ */
+
+static int
+ngx_http_lua_shdict_scan(lua_State *L)
+{
+    int                           n, count;
+    uint64_t                      pos;
+    ngx_uint_t                    shard_no;
+    lua_Number                    cursor;
+    ngx_time_t                   *tp;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shdict_ctx_t    *ctx, *shard;
+    ngx_http_lua_shdict_visit_t   v;
+
+    n = lua_gettop(L);
+
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments, "
+                          "but saw %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    cursor = luaL_checknumber(L, 2);
+
+    if (cursor < 0 || cursor >= 1099511627776.0 /* 2^40 */
+        || cursor != (lua_Number) (uint64_t) cursor)
+    {
+        return luaL_error(L, "bad \"cursor\" argument");
+    }
+
+    count = NGX_HTTP_LUA_SHDICT_SCAN_COUNT;
+
+    if (n == 3) {
+        count = luaL_checkint(L, 3);
+
+        if (count <= 0) {
+            return luaL_error(L, "bad \"count\" argument");
+        }
+    }
+
+    ctx = zone->data;
+
+    pos = (uint64_t) cursor;
+    shard_no = (ngx_uint_t) (pos >> 32);
+    pos &= 0xffffffff;
+
+    lua_createtable(L, count, 0);
+
+    if (shard_no >= ctx->nshards) {
+        lua_pushinteger(L, 0);
+        lua_insert(L, -2);
+        return 2;
+    }
+
+    shard = &ctx->shards[shard_no];
+
+    ngx_memzero(&v, sizeof(ngx_http_lua_shdict_visit_t));
+
+    v.L = L;
+
+    ngx_http_lua_shdict_lock(shard);
+
+    tp = ngx_timeofday();
+
+    v.now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    (void) ngx_http_lua_shdict_scan_shard(shard, &pos, (ngx_uint_t) count,
+                                          ngx_http_lua_shdict_scan_key, &v);
+
+    ngx_http_lua_shdict_unlock(shard);
+
+    if (pos == 0x100000000ULL) {
+        /* done with this shard */
+        shard_no++;
+        pos = 0;
+
+        if (shard_no == ctx->nshards) {
+            shard_no = 0;
+        }
+    }
+
+    lua_pushnumber(L, (lua_Number) (((uint64_t) shard_no << 32) | pos));
+    lua_insert(L, -2);
+
+    return 2;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_scan_key(ngx_http_lua_shdict_node_t *sd, void *data)
+{
+    ngx_http_lua_shdict_visit_t  *v = data;
+
+    if (sd->expires == 0 || sd->expires > v->now) {
+        lua_pushlstring(v->L, (char *) sd->data, sd->key_len);
+        lua_rawseti(v->L, -2, ++v->total);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * calls "visit" for about "count" nodes of a locked shard, from the hash
+ * value or home slot "pos" on, and sets "pos" to where to resume, or to
+ * 2^32 when done with the shard
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_scan_shard(ngx_http_lua_shdict_ctx_t *shard,
+    uint64_t *pos, ngx_uint_t count,
+    ngx_int_t (*visit)(ngx_http_lua_shdict_node_t *sd, void *data),
+    void *data)
+{
+    uint64_t                     start, end, last;
+    ngx_uint_t                   i, home, mask, visited;
+    ngx_rbtree_node_t           *node, *temp, *sentinel;
+    ngx_http_lua_shdict_node_t  *sd;
+    ngx_http_lua_shdict_slot_t  *slots;
+
+    start = *pos;
+    visited = 0;
+
+    if (shard->sh->slots) {
+        slots = shard->sh->slots;
+        mask = shard->sh->mask;
+        end = (uint64_t) mask + 1;
+
+        /*
+         * a key sits in the run of used slots starting at its home slot,
+         * less than a whole table away from it, so the keys homed below
+         * "end" are all found before the first free slot past it
+         */
+
+        for (i = (ngx_uint_t) start; i < end + mask; i++) {
+
+            if (slots[i & mask].node == 0) {
+                if (i >= end) {
+                    break;
+                }
+
+                continue;
+            }
+
+            home = slots[i & mask].hash & mask;
+
+            if (home < start || home >= end) {
+                continue;
+            }
+
+            /*
+             * a key of a run wrapping around the top of the table is only
+             * taken past the top, where "i" is at or after its home slot,
+             * and not again when the slot is seen a second time
+             */
+
+            if (home > i || i - home > mask) {
+                continue;
+            }
+
+            node = ngx_http_lua_shdict_slot_node(shard, &slots[i & mask]);
+            sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+            if (visit(sd, data) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (++visited >= count && end == (uint64_t) mask + 1
+                && i + 1 < end)
+            {
+                end = i + 1;
+            }
+        }
+
+        if (end == (uint64_t) mask + 1) {
+            end = 0x100000000ULL;
+        }
+
+    } else {
+        node = NULL;
+        temp = shard->sh->rbtree.root;
+        sentinel = shard->sh->rbtree.sentinel;
+
+        /* the leftmost node with a hash value not below the cursor */
+
+        while (temp != sentinel) {
+            if ((uint64_t) temp->key >= start) {
+                node = temp;
+                temp = temp->left;
+
+            } else {
+                temp = temp->right;
+            }
+        }
+
+        end = 0x100000000ULL;
+        last = 0;
+
+        while (node) {
+
+            /* keys sharing a hash value are never split across calls */
+
+            if (visited >= count && (uint64_t) node->key != last) {
+                end = node->key;
+                break;
+            }
+
+            last = node->key;
+
+            sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+            if (visit(sd, data) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            visited++;
+
+            node = ngx_http_lua_shdict_rbtree_next(&shard->sh->rbtree, node);
+        }
+    }
+
+    *pos = end;
+
+    return NGX_OK;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shdict_rbtree_next(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  *root, *sentinel, *parent;
+
+    sentinel = tree->sentinel;
+
+    if (node->right != sentinel) {
+        node = node->right;
+
+        while (node->left != sentinel) {
+            node = node->left;
+        }
+
+        return node;
+    }
+
+    root = tree->root;
+
+    for ( ;; ) {
+        parent = node->parent;
+
+        if (node == root) {
+            return NULL;
+        }
+
+        if (node == parent->left) {
+            return parent;
+        }
+
+        node = parent;
+    }
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shdict_rbtree_prev(ngx_rbtree_t *tree, ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  *root, *sentinel, *parent;
+
+    sentinel = tree->sentinel;
+
+    if (node->left != sentinel) {
+        node = node->left;
+
+        while (node->right != sentinel) {
+            node = node->right;
+        }
+
+        return node;
+    }
+
+    root = tree->root;
+
+    for ( ;; ) {
+        parent = node->parent;
+
+        if (node == root) {
+            return NULL;
+        }
+
+        if (node == parent->right) {
+            return parent;
+        }
+
+        node = parent;
+    }
+}
+
+
+ngx_int_t
+ngx_http_lua_shared_dict_get(ngx_shm_zone_t *zone, u_char *key_data,
+    size_t key_len, ngx_http_lua_value_t *value)
+{
+    u_char                      *data;
+    size_t                       len;
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key_data, key_len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key_data, key_len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        return rc;
+    }
+
+    /* rc == NGX_OK */
+
+    value->type = sd->value_type;
+
+    dd("type: %d", (int) value->type);
+
+    data = sd->data + sd->key_len;
+    len = (size_t) sd->value_len;
+
+    switch (value->type) {
+
+    case SHDICT_TSTRING:
+
+        if (value->value.s.data == NULL || value->value.s.len == 0) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "no string buffer "
+                          "initialized");
+            ngx_http_lua_shdict_unlock(ctx);
+            return NGX_ERROR;
+        }
+
+        if (len > value->value.s.len) {
+            len = value->value.s.len;
+
+        } else {
+            value->value.s.len = len;
+        }
+
+        ngx_memcpy(value->value.s.data, data, len);
+        break;
+
+    case SHDICT_TCOMPRESSED:
+
+        if (value->value.s.data == NULL || value->value.s.len == 0) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "no string buffer "
+                          "initialized");
+            ngx_http_lua_shdict_unlock(ctx);
+            return NGX_ERROR;
+        }
+
+        if (len < sizeof(uint32_t)
+            || ngx_http_lua_shdict_inflate(data + sizeof(uint32_t),
+                                           len - sizeof(uint32_t),
+                                           value->value.s.data,
+                                           &value->value.s.len)
+               != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "bad compressed "
+                          "value found for key %*s", key_len, key_data);
+
+            ngx_http_lua_shdict_unlock(ctx);
+            return NGX_ERROR;
+        }
+
+        value->type = SHDICT_TSTRING;
+        break;
+
+    case SHDICT_TNUMBER:
+
+        if (len != sizeof(double)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "bad lua number "
+                          "value size found for key %*s: %lu", key_len,
+                          key_data, (unsigned long) len);
+
+            ngx_http_lua_shdict_unlock(ctx);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(&value->value.b, data, len);
+        break;
+
+    case SHDICT_TBOOLEAN:
+
+        if (len != sizeof(u_char)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "bad lua boolean "
+                          "value size found for key %*s: %lu", key_len,
+                          key_data, (unsigned long) len);
+
+            ngx_http_lua_shdict_unlock(ctx);
+            return NGX_ERROR;
+        }
+
+        value->value.b = *data;
+        break;
+
+    default:
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "bad lua value type "
+                      "found for key %*s: %d", key_len, key_data,
+                      (int) value->type);
+
+        ngx_http_lua_shdict_unlock(ctx);
+        return NGX_ERROR;
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_shdict_lpush(lua_State *L)
+{
+    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
+}
+
+
+static int
+ngx_http_lua_shdict_rpush(lua_State *L)
+{
+    return ngx_http_lua_shdict_push_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
+}
+
+
+static int
+ngx_http_lua_shdict_push_helper(lua_State *L, int flags)
+{
+    int                              n;
+    ngx_str_t                        key;
+    uint32_t                         hash;
+    ngx_int_t                        rc;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_str_t                        value;
+    int                              value_type;
+    double                           num;
+    ngx_uint_t                       len;
+    ngx_shm_zone_t                  *zone;
+
+    n = lua_gettop(L);
+
+    if (n != 3) {
+        return luaL_error(L, "expecting 3 arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    value_type = lua_type(L, 3);
+
+    switch (value_type) {
+
+    case SHDICT_TSTRING:
+        value.data = (u_char *) lua_tolstring(L, 3, &value.len);
+        break;
+
+    case SHDICT_TNUMBER:
+        value.len = sizeof(double);
+        num = lua_tonumber(L, 3);
+        value.data = (u_char *) &num;
+        break;
+
+    default:
+        lua_pushnil(L);
+        lua_pushliteral(L, "bad value type");
+        return 2;
+    }
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_push_locked(ctx, hash, &key, value_type, &value,
+                                         flags, &len);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    if (rc == NGX_DECLINED) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "value not a list");
+        return 2;
+    }
+
+    if (rc == NGX_ERROR) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "no memory");
+        return 2;
+    }
+
+    lua_pushnumber(L, (lua_Number) len);
+    return 1;
+}
+
+
+/*
+ * pushes the value into the list of the key, created when missing, with the
+ * shard locked, returns NGX_DECLINED when the value of the key is no list
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_push_locked(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    ngx_str_t *key, int value_type, ngx_str_t *value, int flags,
+    ngx_uint_t *len)
+{
+    int                               n;
+    ngx_int_t                         rc;
+    ngx_queue_t                      *queue, *q;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_shdict_node_t       *sd;
+    ngx_http_lua_shdict_list_node_t  *lnode;
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key->data, key->len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    /* exists but expired */
+
+    if (rc == NGX_DONE) {
+
+        if (sd->value_type != SHDICT_TLIST) {
+            /* TODO: reuse when length matched */
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                           "lua shared dict push: found old entry and value "
+                           "type not matched, remove it first");
+
+            ngx_queue_remove(&sd->queue);
+
+            node = (ngx_rbtree_node_t *)
+                        ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+            ngx_http_lua_shdict_delete_node(ctx, node);
+
+            ngx_http_lua_shdict_free_node(ctx, node);
+
+            dd("go to init_list");
+            goto init_list;
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict push: found old entry and value "
+                       "type matched, reusing it");
+
+        sd->expires = 0;
+
+        ngx_http_lua_shdict_wheel_update(ctx, sd);
+
+        /* free list nodes */
+
+        queue = ngx_http_lua_shdict_get_list_head(sd, key->len);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            /* TODO: reuse matched size list node */
+            lnode = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
+            ngx_slab_free_locked(ctx->shpool, lnode);
+        }
+
+        ngx_queue_init(queue);
+
+        ngx_queue_remove(&sd->queue);
+        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+        dd("go to push_node");
+        goto push_node;
+    }
+
+    /* exists and not expired */
+
+    if (rc == NGX_OK) {
+
+        if (sd->value_type != SHDICT_TLIST) {
+            return NGX_DECLINED;
+        }
+
+        queue = ngx_http_lua_shdict_get_list_head(sd, key->len);
+
+        ngx_queue_remove(&sd->queue);
+        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+        dd("go to push_node");
+        goto push_node;
+    }
+
+    /* rc == NGX_DECLINED, not found */
+
+init_list:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict list: creating a new entry");
+
+    /* NOTICE: we assume the begin point aligned in slab, be careful */
+    n = offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_http_lua_shdict_node_t, data)
+        + key->len
+        + sizeof(ngx_queue_t);
+
+    dd("length before aligned: %d", n);
+
+    n = (int) (uintptr_t) ngx_align_ptr(n, NGX_ALIGNMENT);
+
+    dd("length after aligned: %d", n);
+
+    node = ngx_http_lua_shdict_alloc_node(ctx, n);
+
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    queue = ngx_http_lua_shdict_get_list_head(sd, key->len);
+
+    node->key = hash;
+    sd->key_len = (u_short) key->len;
+
+    sd->expires = 0;
+
+    sd->value_len = 0;
+
+    dd("setting value type to %d", (int) SHDICT_TLIST);
+
+    sd->value_type = (uint8_t) SHDICT_TLIST;
+
+    ngx_memcpy(sd->data, key->data, key->len);
+
+    ngx_queue_init(queue);
+
+    ngx_http_lua_shdict_insert_node(ctx, node);
+
+    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+push_node:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict list: creating a new list node");
+
+    n = offsetof(ngx_http_lua_shdict_list_node_t, data)
+        + value->len;
+
+    dd("list node length: %d", n);
+
+    lnode = ngx_slab_alloc_locked(ctx->shpool, n);
+
+    if (lnode == NULL) {
+        ctx->sh->stats.alloc_failures++;
+
+        if (sd->value_len == 0) {
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                           "lua shared dict list: no memory for create"
+                           " list node and list empty, remove it");
+
+            ngx_queue_remove(&sd->queue);
+
+            node = (ngx_rbtree_node_t *)
+                        ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+            ngx_http_lua_shdict_delete_node(ctx, node);
+
+            ngx_http_lua_shdict_free_node(ctx, node);
+        }
+
+        return NGX_ERROR;
+    }
+
+    dd("setting list length to %d", sd->value_len + 1);
+
+    sd->value_len = sd->value_len + 1;
+
+    dd("setting list node value length to %d", (int) value->len);
+
+    lnode->value_len = (uint32_t) value->len;
+
+    dd("setting list node value type to %d", value_type);
+
+    lnode->value_type = (uint8_t) value_type;
+
+    ngx_memcpy(lnode->data, value->data, value->len);
+
+    if (flags == NGX_HTTP_LUA_SHDICT_LEFT) {
+        ngx_queue_insert_head(queue, &lnode->queue);
+
+    } else {
+        ngx_queue_insert_tail(queue, &lnode->queue);
+    }
+
+    ngx_http_lua_shdict_notify(ctx, key->data, key->len);
+    ngx_http_lua_shdict_notify_push(ctx);
+
+    *len = sd->value_len;
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_shdict_lpop(lua_State *L)
+{
+    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_LEFT);
+}
+
+
+static int
+ngx_http_lua_shdict_rpop(lua_State *L)
+{
+    return ngx_http_lua_shdict_pop_helper(L, NGX_HTTP_LUA_SHDICT_RIGHT);
+}
+
+
+static int
+ngx_http_lua_shdict_pop_helper(lua_State *L, int flags)
+{
+    int                              n;
+    ngx_str_t                        name;
+    ngx_str_t                        key;
+    uint32_t                         hash;
+    ngx_int_t                        rc;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_str_t                        value;
+    int                              value_type;
+    double                           num;
+    ngx_rbtree_node_t               *node;
+    ngx_shm_zone_t                  *zone;
+    ngx_queue_t                     *queue;
+    ngx_http_lua_shdict_list_node_t *lnode;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+    name = ctx->name;
+
+    ngx_http_lua_shdict_lock(ctx);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        ngx_http_lua_shdict_unlock(ctx);
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != SHDICT_TLIST) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "value not a list");
+        return 2;
+    }
+
+    if (sd->value_len <= 0) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        return luaL_error(L, "bad lua list length found for key %s "
+                          "in shared_dict %s: %lu", key.data, name.data,
+                          (unsigned long) sd->value_len);
+    }
+
+    queue = ngx_http_lua_shdict_get_list_head(sd, key.len);
+
+    if (flags == NGX_HTTP_LUA_SHDICT_LEFT) {
+        queue = ngx_queue_head(queue);
+
+    } else {
+        queue = ngx_queue_last(queue);
+    }
+
+    lnode = ngx_queue_data(queue, ngx_http_lua_shdict_list_node_t, queue);
+
+    value_type = lnode->value_type;
+
+    dd("data: %p", lnode->data);
+    dd("value len: %d", (int) sd->value_len);
+
+    value.data = lnode->data;
+    value.len = (size_t) lnode->value_len;
+
+    switch (value_type) {
+
+    case SHDICT_TSTRING:
+
+        lua_pushlstring(L, (char *) value.data, value.len);
+        break;
+
+    case SHDICT_TNUMBER:
+
+        if (value.len != sizeof(double)) {
+
+            ngx_http_lua_shdict_unlock(ctx);
+
+            return luaL_error(L, "bad lua list node number value size found "
+                              "for key %s in shared_dict %s: %lu", key.data,
+                              name.data, (unsigned long) value.len);
+        }
+
+        ngx_memcpy(&num, value.data, sizeof(double));
+
+        lua_pushnumber(L, num);
+        break;
+
+    default:
+
+        ngx_http_lua_shdict_unlock(ctx);
+
+        return luaL_error(L, "bad list node value type found for key %s in "
+                          "shared_dict %s: %d", key.data, name.data,
+                          value_type);
+    }
+
+    ngx_queue_remove(queue);
+
+    ngx_slab_free_locked(ctx->shpool, lnode);
+
+    if (sd->value_len == 1) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict list: empty node after pop, "
+                       "remove it");
+
+        ngx_queue_remove(&sd->queue);
+
+        node = (ngx_rbtree_node_t *)
+                    ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_http_lua_shdict_delete_node(ctx, node);
+
+        ngx_http_lua_shdict_free_node(ctx, node);
+
+    } else {
+        sd->value_len = sd->value_len - 1;
+
+        ngx_queue_remove(&sd->queue);
+        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    }
+
+    ngx_http_lua_shdict_notify(ctx, key.data, key.len);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_llen(lua_State *L)
+{
+    int                          n;
+    ngx_str_t                    key;
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+    ngx_shm_zone_t              *zone;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_OK) {
+
+        if (sd->value_type != SHDICT_TLIST) {
+            ngx_http_lua_shdict_unlock(ctx);
+
+            lua_pushnil(L);
+            lua_pushliteral(L, "value not a list");
+            return 2;
+        }
+
+        ngx_queue_remove(&sd->queue);
+        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnumber(L, (lua_Number) sd->value_len);
+        return 1;
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    lua_pushnumber(L, 0);
+    return 1;
+}
+
+
+/*
+ * checks the zone, key and (when field is not NULL) field arguments of the
+ * hash and sorted set methods, returns the number of values pushed on
+ * errors, 0 otherwise
+ */
+
+static int
+ngx_http_lua_shdict_item_args(lua_State *L, int nargs, ngx_shm_zone_t **zone,
+    ngx_str_t *key, ngx_str_t *field)
+{
+    int  n;
+
+    n = lua_gettop(L);
+
+    if (n != nargs) {
+        return luaL_error(L, "expecting %d arguments, "
+                          "but only seen %d", nargs, n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    *zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (*zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key->data = (u_char *) luaL_checklstring(L, 2, &key->len);
+
+    if (key->len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key->len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    if (field == NULL) {
+        return 0;
+    }
+
+    if (lua_isnil(L, 3)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil field");
+        return 2;
+    }
+
+    field->data = (u_char *) luaL_checklstring(L, 3, &field->len);
+
+    if (field->len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "field too long");
+        return 2;
+    }
+
+    return 0;
+}
+
+
+/*
+ * looks up the hash or sorted set (by value_type) of a key with the shard
+ * locked, an expired item, or none, being replaced with an empty one when
+ * create is set
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_item_open(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    ngx_str_t *key, int value_type, ngx_uint_t create,
+    ngx_http_lua_shdict_node_t **sdp, char **err)
+{
+    int                               n;
+    ngx_int_t                         rc;
+    ngx_queue_t                      *queue, *q;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_shdict_zset_t       *zset;
+    ngx_http_lua_shdict_node_t       *sd;
+    ngx_http_lua_shdict_list_node_t  *lnode;
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key->data, key->len, &sd);
+
+    if (rc == NGX_OK) {
+
+        if (sd->value_type != value_type) {
+            *err = (value_type == SHDICT_THASH) ? "value not a hash"
+                                                : "value not a sorted set";
+            return NGX_ERROR;
+        }
+
+        ngx_queue_remove(&sd->queue);
+        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+        *sdp = sd;
+        return NGX_OK;
+    }
+
+    if (!create) {
+        return NGX_DECLINED;
+    }
+
+    if (rc == NGX_DONE) {
+
+        /* exists but expired */
+
+        if (sd->value_type == SHDICT_TLIST) {
+            queue = ngx_http_lua_shdict_get_list_head(sd, key->len);
+
+            for (q = ngx_queue_head(queue);
+                 q != ngx_queue_sentinel(queue);
+                 q = ngx_queue_next(q))
+            {
+                lnode = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t,
+                                       queue);
+
+                ngx_slab_free_locked(ctx->shpool, lnode);
+            }
+        }
+
+        ngx_queue_remove(&sd->queue);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_http_lua_shdict_delete_node(ctx, node);
+
+        ngx_http_lua_shdict_free_node(ctx, node);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict: creating a new entry of type %d",
+                   value_type);
+
+    n = offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_http_lua_shdict_node_t, data)
+        + key->len
+        + ((value_type == SHDICT_THASH) ? sizeof(ngx_queue_t)
+                                        : sizeof(ngx_http_lua_shdict_zset_t));
+
+    n = (int) (uintptr_t) ngx_align_ptr(n, NGX_ALIGNMENT);
+
+    node = ngx_http_lua_shdict_alloc_node(ctx, n);
+
+    if (node == NULL) {
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    node->key = hash;
+    sd->key_len = (u_short) key->len;
+    sd->expires = 0;
+    sd->user_flags = 0;
+    sd->value_len = 0;  /* the number of fields or members */
+    sd->value_type = (uint8_t) value_type;
+
+    ngx_memcpy(sd->data, key->data, key->len);
+
+    if (value_type == SHDICT_THASH) {
+        ngx_queue_init(ngx_http_lua_shdict_get_list_head(sd, key->len));
+
+    } else {
+        zset = ngx_http_lua_shdict_get_zset(sd);
+
+        ngx_rbtree_init(&zset->by_score, &zset->score_sentinel,
+                        ngx_http_lua_shdict_zscore_insert);
+        ngx_rbtree_init(&zset->by_member, &zset->member_sentinel,
+                        ngx_http_lua_shdict_zname_insert);
+    }
+
+    ngx_http_lua_shdict_insert_node(ctx, node);
+    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+    *sdp = sd;
+    return NGX_OK;
+}
+
+
+/* removes a hash whose last field is gone, with the shard locked */
+
+static void
+ngx_http_lua_shdict_item_drop(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    ngx_rbtree_node_t  *node;
+
+    ngx_queue_remove(&sd->queue);
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_http_lua_shdict_delete_node(ctx, node);
+
+    ngx_http_lua_shdict_free_node(ctx, node);
+}
+
+
+static ngx_http_lua_shdict_field_node_t *
+ngx_http_lua_shdict_field_find(ngx_http_lua_shdict_node_t *sd,
+    ngx_str_t *field)
+{
+    ngx_queue_t                       *queue, *q;
+    ngx_http_lua_shdict_field_node_t  *fnode;
+
+    queue = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
+
+    for (q = ngx_queue_head(queue);
+         q != ngx_queue_sentinel(queue);
+         q = ngx_queue_next(q))
+    {
+        fnode = ngx_queue_data(q, ngx_http_lua_shdict_field_node_t, queue);
+
+        if (fnode->field_len == field->len
+            && ngx_memcmp(fnode->data, field->data, field->len) == 0)
+        {
+            return fnode;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * sets a field of a hash with the shard locked, in place when the new value
+ * is as long as the old one
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_field_store(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd, ngx_str_t *field, int value_type,
+    ngx_str_t *value)
+{
+    size_t                             n;
+    ngx_http_lua_shdict_field_node_t  *fnode, *old;
+
+    old = ngx_http_lua_shdict_field_find(sd, field);
+
+    if (old && old->value_len == value->len) {
+        old->value_type = (uint8_t) value_type;
+        ngx_memcpy(old->data + old->field_len, value->data, value->len);
+        return NGX_OK;
+    }
+
+    n = offsetof(ngx_http_lua_shdict_field_node_t, data)
+        + field->len
+        + value->len;
+
+    fnode = ngx_slab_alloc_locked(ctx->shpool, n);
+
+    if (fnode == NULL) {
+        ctx->sh->stats.alloc_failures++;
+        return NGX_ERROR;
+    }
+
+    fnode->value_len = (uint32_t) value->len;
+    fnode->field_len = (uint16_t) field->len;
+    fnode->value_type = (uint8_t) value_type;
+
+    ngx_memcpy(ngx_copy(fnode->data, field->data, field->len), value->data,
+               value->len);
+
+    if (old) {
+        ngx_queue_insert_after(&old->queue, &fnode->queue);
+        ngx_queue_remove(&old->queue);
+        ngx_slab_free_locked(ctx->shpool, old);
+        return NGX_OK;
+    }
+
+    ngx_queue_insert_tail(ngx_http_lua_shdict_get_list_head(sd, sd->key_len),
+                          &fnode->queue);
+
+    sd->value_len++;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_shdict_push_field(lua_State *L,
+    ngx_http_lua_shdict_field_node_t *fnode)
+{
+    u_char  *p;
+    double   num;
+
+    p = fnode->data + fnode->field_len;
+
+    switch (fnode->value_type) {
+
+    case SHDICT_TSTRING:
+        lua_pushlstring(L, (char *) p, fnode->value_len);
+        break;
+
+    case SHDICT_TNUMBER:
+        ngx_memcpy(&num, p, sizeof(double));
+        lua_pushnumber(L, num);
+        break;
+
+    default:  /* SHDICT_TBOOLEAN */
+        lua_pushboolean(L, *p);
+        break;
+    }
+}
+
+
+static int
+ngx_http_lua_shdict_hset(lua_State *L)
+{
+    int                                 rc, value_type;
+    char                               *err;
+    u_char                              c;
+    double                              num;
+    uint32_t                            hash;
+    ngx_str_t                           key, field, value;
+    ngx_shm_zone_t                     *zone;
+    ngx_http_lua_shdict_ctx_t          *ctx;
+    ngx_http_lua_shdict_node_t         *sd;
+    ngx_http_lua_shdict_field_node_t   *fnode;
+
+    rc = ngx_http_lua_shdict_item_args(L, 4, &zone, &key, &field);
+    if (rc) {
+        return rc;
+    }
+
+    value_type = lua_type(L, 4);
+
+    switch (value_type) {
+
+    case SHDICT_TSTRING:
+        value.data = (u_char *) lua_tolstring(L, 4, &value.len);
+        break;
+
+    case SHDICT_TNUMBER:
+        num = lua_tonumber(L, 4);
+        value.data = (u_char *) &num;
+        value.len = sizeof(double);
+        break;
+
+    case SHDICT_TBOOLEAN:
+        c = lua_toboolean(L, 4) ? 1 : 0;
+        value.data = &c;
+        value.len = sizeof(u_char);
+        break;
+
+    case LUA_TNIL:
+        ngx_str_null(&value);
+        break;
+
+    default:
+        lua_pushnil(L);
+        lua_pushliteral(L, "bad value type");
+        return 2;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    ngx_http_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_THASH,
+                                       value_type != LUA_TNIL, &sd, &err);
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    if (value_type == LUA_TNIL) {
+        fnode = ngx_http_lua_shdict_field_find(sd, &field);
+
+        if (fnode) {
+            ngx_queue_remove(&fnode->queue);
+            ngx_slab_free_locked(ctx->shpool, fnode);
+
+            sd->value_len--;
+
+            ngx_http_lua_shdict_notify(ctx, key.data, key.len);
+        }
+
+    } else if (ngx_http_lua_shdict_field_store(ctx, sd, &field, value_type,
+                                               &value)
+               != NGX_OK)
+    {
+        if (sd->value_len == 0) {
+            ngx_http_lua_shdict_item_drop(ctx, sd);
+        }
+
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "no memory");
+        return 2;
+
+    } else {
+        ngx_http_lua_shdict_notify(ctx, key.data, key.len);
+    }
+
+    num = (double) sd->value_len;
+
+    if (sd->value_len == 0) {
+        ngx_http_lua_shdict_item_drop(ctx, sd);
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    lua_pushnumber(L, (lua_Number) num);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_hdel(lua_State *L)
+{
+    lua_settop(L, 3);
+    lua_pushnil(L);
+
+    return ngx_http_lua_shdict_hset(L);
+}
+
+
+static int
+ngx_http_lua_shdict_hget(lua_State *L)
+{
+    int                                 rc;
+    char                               *err;
+    uint32_t                            hash;
+    ngx_str_t                           key, field;
+    ngx_shm_zone_t                     *zone;
+    ngx_http_lua_shdict_ctx_t          *ctx;
+    ngx_http_lua_shdict_node_t         *sd;
+    ngx_http_lua_shdict_field_node_t   *fnode;
+
+    rc = ngx_http_lua_shdict_item_args(L, 3, &zone, &key, &field);
+    if (rc) {
+        return rc;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_THASH, 0,
+                                       &sd, &err);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    fnode = (rc == NGX_OK) ? ngx_http_lua_shdict_field_find(sd, &field) : NULL;
+
+    if (fnode == NULL) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ngx_http_lua_shdict_push_field(L, fnode);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_hincr(lua_State *L)
+{
+    int                                 rc;
+    char                               *err;
+    u_char                             *p;
+    double                              num, value;
+    uint32_t                            hash;
+    ngx_str_t                           key, field, v;
+    ngx_shm_zone_t                     *zone;
+    ngx_http_lua_shdict_ctx_t          *ctx;
+    ngx_http_lua_shdict_node_t         *sd;
+    ngx_http_lua_shdict_field_node_t   *fnode;
+
+    rc = ngx_http_lua_shdict_item_args(L, 4, &zone, &key, &field);
+    if (rc) {
+        return rc;
+    }
+
+    value = luaL_checknumber(L, 4);
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    ngx_http_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_THASH, 1,
+                                       &sd, &err);
+
+    if (rc != NGX_OK) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    fnode = ngx_http_lua_shdict_field_find(sd, &field);
+
+    if (fnode) {
+        if (fnode->value_type != SHDICT_TNUMBER) {
+            ngx_http_lua_shdict_unlock(ctx);
+
+            lua_pushnil(L);
+            lua_pushliteral(L, "not a number");
+            return 2;
+        }
+
+        /* updated in place */
+
+        p = fnode->data + fnode->field_len;
+
+        ngx_memcpy(&num, p, sizeof(double));
+        num += value;
+        ngx_memcpy(p, &num, sizeof(double));
+
+    } else {
+        num = value;
+
+        v.data = (u_char *) &num;
+        v.len = sizeof(double);
+
+        if (ngx_http_lua_shdict_field_store(ctx, sd, &field, SHDICT_TNUMBER,
+                                            &v)
+            != NGX_OK)
+        {
+            if (sd->value_len == 0) {
+                ngx_http_lua_shdict_item_drop(ctx, sd);
+            }
+
+            ngx_http_lua_shdict_unlock(ctx);
+
+            lua_pushnil(L);
+            lua_pushliteral(L, "no memory");
+            return 2;
+        }
+    }
+
+    ngx_http_lua_shdict_notify(ctx, key.data, key.len);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    lua_pushnumber(L, (lua_Number) num);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_hgetall(lua_State *L)
+{
+    int                                 rc;
+    char                               *err;
+    uint32_t                            hash;
+    ngx_str_t                           key;
+    ngx_queue_t                        *queue, *q;
+    ngx_shm_zone_t                     *zone;
+    ngx_http_lua_shdict_ctx_t          *ctx;
+    ngx_http_lua_shdict_node_t         *sd;
+    ngx_http_lua_shdict_field_node_t   *fnode;
+
+    rc = ngx_http_lua_shdict_item_args(L, 2, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_THASH, 0,
+                                       &sd, &err);
+
+    if (rc != NGX_OK) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+
+        if (rc == NGX_DECLINED) {
+            return 1;
+        }
+
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_createtable(L, 0 /* narr */, (int) sd->value_len /* nrec */);
+
+    queue = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
+
+    for (q = ngx_queue_head(queue);
+         q != ngx_queue_sentinel(queue);
+         q = ngx_queue_next(q))
+    {
+        fnode = ngx_queue_data(q, ngx_http_lua_shdict_field_node_t, queue);
+
+        lua_pushlstring(L, (char *) fnode->data, fnode->field_len);
+        ngx_http_lua_shdict_push_field(L, fnode);
+        lua_rawset(L, -3);
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_zcmp(double score, u_char *member, size_t len,
+    ngx_http_lua_shdict_zmember_t *zm)
+{
+    if (score < zm->score) {
+        return -1;
+    }
+
+    if (score > zm->score) {
+        return 1;
+    }
+
+    return (int) ngx_memn2cmp(member, zm->data, len, zm->member_len);
+}
+
+
+static void
+ngx_http_lua_shdict_zscore_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              **p;
+    ngx_http_lua_shdict_zmember_t   *zm;
+
+    zm = ngx_http_lua_shdict_zmember(node);
+
+    for ( ;; ) {
+
+        p = (ngx_http_lua_shdict_zcmp(zm->score, zm->data, zm->member_len,
+                                      ngx_http_lua_shdict_zmember(temp))
+             < 0)
+            ? &temp->left : &temp->right;
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_lua_shdict_zname_insert(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              **p;
+    ngx_http_lua_shdict_zmember_t   *zm, *zmt;
+
+    zm = (ngx_http_lua_shdict_zmember_t *)
+             ((u_char *) node - offsetof(ngx_http_lua_shdict_zmember_t,
+                                         by_member));
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            zmt = (ngx_http_lua_shdict_zmember_t *)
+                      ((u_char *) temp
+                       - offsetof(ngx_http_lua_shdict_zmember_t, by_member));
+
+            p = (ngx_memn2cmp(zm->data, zmt->data, zm->member_len,
+                              zmt->member_len)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_http_lua_shdict_zmember_t *
+ngx_http_lua_shdict_zmember_find(ngx_http_lua_shdict_zset_t *zset,
+    ngx_str_t *member, uint32_t hash)
+{
+    ngx_int_t                       rc;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_lua_shdict_zmember_t  *zm;
+
+    node = zset->by_member.root;
+    sentinel = zset->by_member.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        zm = (ngx_http_lua_shdict_zmember_t *)
+                 ((u_char *) node - offsetof(ngx_http_lua_shdict_zmember_t,
+                                             by_member));
+
+        rc = ngx_memn2cmp(member->data, zm->data, member->len,
+                          zm->member_len);
+
+        if (rc == 0) {
+            return zm;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* the first node of the by_score tree with a score not below min */
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shdict_zset_first(ngx_http_lua_shdict_zset_t *zset, double min)
+{
+    ngx_rbtree_node_t  *node, *sentinel, *first;
+
+    node = zset->by_score.root;
+    sentinel = zset->by_score.sentinel;
+    first = NULL;
+
+    while (node != sentinel) {
+
+        if (ngx_http_lua_shdict_zmember(node)->score >= min) {
+            first = node;
+            node = node->left;
+
+        } else {
+            node = node->right;
+        }
+    }
+
+    return first;
+}
+
+
+static void
+ngx_http_lua_shdict_zmember_delete(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd, ngx_http_lua_shdict_zmember_t *zm)
+{
+    ngx_http_lua_shdict_zset_t  *zset;
+
+    zset = ngx_http_lua_shdict_get_zset(sd);
+
+    ngx_rbtree_delete(&zset->by_score, &zm->by_score);
+    ngx_rbtree_delete(&zset->by_member, &zm->by_member);
+
+    ngx_slab_free_locked(ctx->shpool, zm);
+
+    sd->value_len--;
+}
+
+
+/* frees the members of a by_score (sub)tree without rebalancing it */
+
+static void
+ngx_http_lua_shdict_zset_free(ngx_slab_pool_t *shpool, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t  *right;
+
+    while (node != sentinel) {
+        ngx_http_lua_shdict_zset_free(shpool, node->left, sentinel);
+
+        right = node->right;
+        ngx_slab_free_locked(shpool, ngx_http_lua_shdict_zmember(node));
+        node = right;
+    }
+}
+
+
+/* checks the member argument at index of the sorted set methods */
+
+static int
+ngx_http_lua_shdict_zset_member(lua_State *L, int index, ngx_str_t *member)
+{
+    if (lua_isnil(L, index)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil member");
+        return 2;
+    }
+
+    member->data = (u_char *) luaL_checklstring(L, index, &member->len);
+
+    if (member->len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "member too long");
+        return 2;
+    }
+
+    return 0;
+}
+
+
+static int
+ngx_http_lua_shdict_zadd(lua_State *L)
+{
+    int                              rc;
+    char                            *err;
+    double                           score;
+    uint32_t                         hash, mhash;
+    ngx_str_t                        key, member;
+    ngx_shm_zone_t                  *zone;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_http_lua_shdict_zset_t      *zset;
+    ngx_http_lua_shdict_zmember_t   *zm;
+
+    rc = ngx_http_lua_shdict_item_args(L, 4, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    score = luaL_checknumber(L, 3);
+
+    if (score != score) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "bad score");
+        return 2;
+    }
+
+    rc = ngx_http_lua_shdict_zset_member(L, 4, &member);
+    if (rc) {
+        return rc;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+    mhash = ngx_crc32_short(member.data, member.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    ngx_http_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_TZSET, 1,
+                                       &sd, &err);
+
+    if (rc != NGX_OK) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    zset = ngx_http_lua_shdict_get_zset(sd);
+
+    zm = ngx_http_lua_shdict_zmember_find(zset, &member, mhash);
+
+    if (zm) {
+        if (zm->score != score) {
+            ngx_rbtree_delete(&zset->by_score, &zm->by_score);
+            zm->score = score;
+            ngx_rbtree_insert(&zset->by_score, &zm->by_score);
+        }
+
+    } else {
+        zm = ngx_slab_alloc_locked(ctx->shpool,
+                                   offsetof(ngx_http_lua_shdict_zmember_t,
+                                            data)
+                                   + member.len);
+
+        if (zm == NULL) {
+            ctx->sh->stats.alloc_failures++;
+
+            if (sd->value_len == 0) {
+                ngx_http_lua_shdict_item_drop(ctx, sd);
+            }
+
+            ngx_http_lua_shdict_unlock(ctx);
+
+            lua_pushnil(L);
+            lua_pushliteral(L, "no memory");
+            return 2;
+        }
+
+        zm->by_score.key = 0;
+        zm->by_member.key = mhash;
+        zm->score = score;
+        zm->member_len = (uint32_t) member.len;
+
+        ngx_memcpy(zm->data, member.data, member.len);
+
+        ngx_rbtree_insert(&zset->by_score, &zm->by_score);
+        ngx_rbtree_insert(&zset->by_member, &zm->by_member);
+
+        sd->value_len++;
+    }
+
+    ngx_http_lua_shdict_notify(ctx, key.data, key.len);
+
+    score = (double) sd->value_len;
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    lua_pushnumber(L, (lua_Number) score);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_zrem(lua_State *L)
+{
+    int                              rc;
+    char                            *err;
+    uint32_t                         hash, n;
+    ngx_str_t                        key, member;
+    ngx_shm_zone_t                  *zone;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_http_lua_shdict_zmember_t   *zm;
+
+    rc = ngx_http_lua_shdict_item_args(L, 3, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    rc = ngx_http_lua_shdict_zset_member(L, 3, &member);
+    if (rc) {
+        return rc;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_TZSET, 0,
+                                       &sd, &err);
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    zm = ngx_http_lua_shdict_zmember_find(ngx_http_lua_shdict_get_zset(sd),
+                                          &member,
+                                          ngx_crc32_short(member.data,
+                                                          member.len));
+
+    if (zm) {
+        ngx_http_lua_shdict_zmember_delete(ctx, sd, zm);
+        ngx_http_lua_shdict_notify(ctx, key.data, key.len);
+    }
+
+    n = sd->value_len;
+
+    if (n == 0) {
+        ngx_http_lua_shdict_item_drop(ctx, sd);
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    lua_pushnumber(L, (lua_Number) n);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_zremrangebyscore(lua_State *L)
+{
+    int                              rc;
+    char                            *err;
+    double                           min, max;
+    uint32_t                         hash;
+    ngx_str_t                        key;
+    ngx_uint_t                       n;
+    ngx_shm_zone_t                  *zone;
+    ngx_rbtree_node_t               *node, *next;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_http_lua_shdict_zset_t      *zset;
+    ngx_http_lua_shdict_zmember_t   *zm;
+
+    rc = ngx_http_lua_shdict_item_args(L, 4, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    min = luaL_checknumber(L, 3);
+    max = luaL_checknumber(L, 4);
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_TZSET, 0,
+                                       &sd, &err);
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    zset = ngx_http_lua_shdict_get_zset(sd);
+
+    n = 0;
+
+    for (node = ngx_http_lua_shdict_zset_first(zset, min);
+         node;
+         node = next)
+    {
+        zm = ngx_http_lua_shdict_zmember(node);
+
+        if (zm->score > max) {
+            break;
+        }
+
+        next = ngx_http_lua_shdict_rbtree_next(&zset->by_score, node);
+
+        ngx_http_lua_shdict_zmember_delete(ctx, sd, zm);
+        n++;
+    }
+
+    if (n) {
+        ngx_http_lua_shdict_notify(ctx, key.data, key.len);
+    }
+
+    if (sd->value_len == 0) {
+        ngx_http_lua_shdict_item_drop(ctx, sd);
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    lua_pushnumber(L, (lua_Number) n);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_zcount(lua_State *L)
+{
+    int                              rc;
+    char                            *err;
+    double                           min, max;
+    uint32_t                         hash;
+    ngx_str_t                        key;
+    ngx_uint_t                       n;
+    ngx_shm_zone_t                  *zone;
+    ngx_rbtree_node_t               *node;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_http_lua_shdict_zset_t      *zset;
+
+    rc = ngx_http_lua_shdict_item_args(L, 4, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    min = luaL_checknumber(L, 3);
+    max = luaL_checknumber(L, 4);
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_TZSET, 0,
+                                       &sd, &err);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    n = 0;
+
+    if (rc == NGX_OK) {
+        zset = ngx_http_lua_shdict_get_zset(sd);
+
+        for (node = ngx_http_lua_shdict_zset_first(zset, min);
+             node && ngx_http_lua_shdict_zmember(node)->score <= max;
+             node = ngx_http_lua_shdict_rbtree_next(&zset->by_score, node))
+        {
+            n++;
+        }
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    lua_pushnumber(L, (lua_Number) n);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_ztop(lua_State *L)
+{
+    int                              rc, i, count;
+    char                            *err;
+    uint32_t                         hash;
+    ngx_str_t                        key;
+    ngx_shm_zone_t                  *zone;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_http_lua_shdict_zset_t      *zset;
+    ngx_http_lua_shdict_zmember_t   *zm;
+
+    rc = ngx_http_lua_shdict_item_args(L, 3, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    count = (int) luaL_checkinteger(L, 3);
+
+    if (count <= 0) {
+        return luaL_error(L, "bad \"count\" argument");
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_item_open(ctx, hash, &key, SHDICT_TZSET, 0,
+                                       &sd, &err);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_createtable(L, 0 /* narr */, 0 /* nrec */);
+        lua_createtable(L, 0 /* narr */, 0 /* nrec */);
+        return 2;
+    }
+
+    if ((uint32_t) count > sd->value_len) {
+        count = (int) sd->value_len;
+    }
+
+    lua_createtable(L, count /* narr */, 0 /* nrec */);  /* members */
+    lua_createtable(L, count /* narr */, 0 /* nrec */);  /* scores */
+
+    zset = ngx_http_lua_shdict_get_zset(sd);
+    sentinel = zset->by_score.sentinel;
+
+    /* the highest scores first */
+
+    node = zset->by_score.root;
+
+    while (node->right != sentinel) {
+        node = node->right;
+    }
+
+    for (i = 1; i <= count; i++) {
+        zm = ngx_http_lua_shdict_zmember(node);
+
+        lua_pushlstring(L, (char *) zm->data, zm->member_len);
+        lua_rawseti(L, -3, i);
+
+        lua_pushnumber(L, (lua_Number) zm->score);
+        lua_rawseti(L, -2, i);
+
+        node = ngx_http_lua_shdict_rbtree_prev(&zset->by_score, node);
+    }
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    return 2;
+}
+
+
+/*
+ * serializes the value at index, a table, number, string or boolean, into
+ * p, or only counts the bytes it takes when p is NULL; returns that count,
+ * or -1 with err set
+ */
+
+static ssize_t
+ngx_http_lua_shdict_encode(lua_State *L, int index, u_char *p,
+    ngx_uint_t depth, char **err)
+{
+    u_char    *data;
+    size_t     len;
+    ssize_t    n, rc;
+    double     num;
+    uint32_t   i, narr, nrec;
+
+    switch (lua_type(L, index)) {
+
+    case LUA_TBOOLEAN:
+        if (p) {
+            p[0] = SHDICT_TBOOLEAN;
+            p[1] = lua_toboolean(L, index) ? 1 : 0;
+        }
+
+        return 2;
+
+    case LUA_TNUMBER:
+        if (p) {
+            num = lua_tonumber(L, index);
+
+            *p++ = SHDICT_TNUMBER;
+            ngx_memcpy(p, &num, sizeof(double));
+        }
+
+        return 1 + sizeof(double);
+
+    case LUA_TSTRING:
+        data = (u_char *) lua_tolstring(L, index, &len);
+
+        if (len > NGX_MAX_UINT32_VALUE) {
+            *err = "string too long";
+            return -1;
+        }
+
+        if (p) {
+            i = (uint32_t) len;
+
+            *p++ = SHDICT_TSTRING;
+            p = ngx_cpymem(p, &i, sizeof(uint32_t));
+            ngx_memcpy(p, data, len);
+        }
+
+        return 1 + sizeof(uint32_t) + len;
+
+    case LUA_TTABLE:
+        break;
+
+    default:
+        *err = "bad value type";
+        return -1;
+    }
+
+    /* the nested tables are limited, which also catches cycles */
+
+    if (depth == NGX_HTTP_LUA_SHDICT_TABLE_DEPTH || !lua_checkstack(L, 4)) {
+        *err = "table too deep";
+        return -1;
+    }
+
+    /* the array part, up to the first nil */
+
+    for (narr = 0; /* void */ ; narr++) {
+        lua_rawgeti(L, index, narr + 1);
+
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    n = 1 + 2 * sizeof(uint32_t);
+
+    for (i = 1; i <= narr; i++) {
+        lua_rawgeti(L, index, i);
+
+        rc = ngx_http_lua_shdict_encode(L, lua_gettop(L), p ? p + n : NULL,
+                                        depth + 1, err);
+        lua_pop(L, 1);
+
+        if (rc == -1) {
+            return -1;
+        }
+
+        n += rc;
+    }
+
+    /* the other keys */
+
+    nrec = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        /* stack: key value */
+
+        switch (lua_type(L, -2)) {
+
+        case LUA_TNUMBER:
+            num = lua_tonumber(L, -2);
+
+            if (num >= 1 && num <= narr && num == (double) (uint32_t) num) {
+                lua_pop(L, 1);
+                continue;
+            }
+
+            break;
+
+        case LUA_TSTRING:
+        case LUA_TBOOLEAN:
+            break;
+
+        default:
+            lua_pop(L, 2);
+            *err = "bad key type";
+            return -1;
+        }
+
+        rc = ngx_http_lua_shdict_encode(L, lua_gettop(L) - 1,
+                                        p ? p + n : NULL, depth + 1, err);
+        if (rc == -1) {
+            lua_pop(L, 2);
+            return -1;
+        }
+
+        n += rc;
+
+        rc = ngx_http_lua_shdict_encode(L, lua_gettop(L), p ? p + n : NULL,
+                                        depth + 1, err);
+        if (rc == -1) {
+            lua_pop(L, 2);
+            return -1;
+        }
+
+        n += rc;
+        nrec++;
+
+        lua_pop(L, 1);
+    }
+
+    if (p) {
+        *p++ = SHDICT_TTABLE;
+        p = ngx_cpymem(p, &narr, sizeof(uint32_t));
+        ngx_memcpy(p, &nrec, sizeof(uint32_t));
+    }
+
+    return n;
+}
+
+
+/*
+ * pushes the value serialized at p onto the stack, returns the end of the
+ * value or NULL on bad data
+ */
+
+static u_char *
+ngx_http_lua_shdict_decode(lua_State *L, u_char *p, u_char *last,
+    ngx_uint_t depth)
+{
+    double    num;
+    uint32_t  i, len, narr, nrec;
+
+    if (p == last) {
+        return NULL;
+    }
+
+    switch (*p++) {
+
+    case SHDICT_TBOOLEAN:
+        if (last - p < 1) {
+            return NULL;
+        }
+
+        lua_pushboolean(L, *p);
+        return p + 1;
+
+    case SHDICT_TNUMBER:
+        if (last - p < (ssize_t) sizeof(double)) {
+            return NULL;
+        }
+
+        ngx_memcpy(&num, p, sizeof(double));
+        lua_pushnumber(L, (lua_Number) num);
+        return p + sizeof(double);
+
+    case SHDICT_TSTRING:
+        if (last - p < (ssize_t) sizeof(uint32_t)) {
+            return NULL;
+        }
+
+        ngx_memcpy(&len, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+
+        if ((size_t) (last - p) < len) {
+            return NULL;
+        }
+
+        lua_pushlstring(L, (char *) p, len);
+        return p + len;
+
+    case SHDICT_TTABLE:
+        break;
+
+    default:
+        return NULL;
+    }
+
+    if (last - p < (ssize_t) (2 * sizeof(uint32_t))
+        || depth == NGX_HTTP_LUA_SHDICT_TABLE_DEPTH
+        || !lua_checkstack(L, 4))
+    {
+        return NULL;
+    }
+
+    ngx_memcpy(&narr, p, sizeof(uint32_t));
+    ngx_memcpy(&nrec, p + sizeof(uint32_t), sizeof(uint32_t));
+    p += 2 * sizeof(uint32_t);
+
+    /* every value takes 2 bytes at least */
+
+    if ((uint64_t) narr + 2 * (uint64_t) nrec > (uint64_t) (last - p) / 2) {
+        return NULL;
+    }
+
+    lua_createtable(L, (int) narr, (int) nrec);
+
+    for (i = 1; i <= narr; i++) {
+        p = ngx_http_lua_shdict_decode(L, p, last, depth + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        lua_rawseti(L, -2, i);
+    }
+
+    for (i = 0; i < nrec; i++) {
+        p = ngx_http_lua_shdict_decode(L, p, last, depth + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        /* tables and NaN are no valid keys */
+
+        if (lua_type(L, -1) == LUA_TTABLE
+            || (lua_type(L, -1) == LUA_TNUMBER
+                && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+        {
+            return NULL;
+        }
+
+        p = ngx_http_lua_shdict_decode(L, p, last, depth + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        lua_rawset(L, -3);
+    }
+
+    return p;
+}
+
+
+static int
+ngx_http_lua_shdict_set_table(lua_State *L)
+{
+    int                 n, rc, flags, forcible;
+    char               *err;
+    long                exptime;
+    u_char             *buf;
+    ssize_t             len;
+    ngx_str_t           key;
+    lua_Number          num;
+    ngx_shm_zone_t     *zone;
+
+    n = lua_gettop(L);
+
+    if (n < 3 || n > 5) {
+        return luaL_error(L, "expecting 3, 4 or 5 arguments, "
+                          "but seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    if (lua_isnil(L, 2)) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    exptime = 0;
+
+    if (n >= 4 && !lua_isnil(L, 4)) {
+        num = luaL_checknumber(L, 4);
+        if (num < 0) {
+            return luaL_error(L, "bad \"exptime\" argument");
+        }
+
+        exptime = (long) (num * 1000);
+    }
+
+    flags = (n == 5) ? (int) luaL_optinteger(L, 5, 0) : 0;
+
+    lua_settop(L, 3);
+
+    /* counts the bytes first, then writes them in one go */
+
+    len = ngx_http_lua_shdict_encode(L, 3, NULL, 0, &err);
+
+    if (len == -1) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    buf = lua_newuserdata(L, (size_t) len);
+
+    (void) ngx_http_lua_shdict_encode(L, 3, buf, 0, &err);
+
+    rc = ngx_http_lua_ffi_shdict_store(zone, 0, key.data, key.len,
+                                       SHDICT_TTABLE, buf, (size_t) len, 0,
+                                       exptime, flags, &err, &forcible);
+
+    if (rc != NGX_OK) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        lua_pushboolean(L, forcible);
+        return 3;
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+
+static int
+ngx_http_lua_shdict_get_table(lua_State *L)
+{
+    int                          rc, n;
+    u_char                      *buf, *p, *last;
+    u_char                       tmp[NGX_HTTP_LUA_SHDICT_TABLE_BUF];
+    size_t                       len, size;
+    uint32_t                     hash, flags;
+    ngx_str_t                    key;
+    ngx_shm_zone_t              *zone;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    rc = ngx_http_lua_shdict_item_args(L, 2, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    buf = tmp;
+    size = sizeof(tmp);
+
+again:
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
+
+    if (rc != NGX_OK) {
+        ctx->sh->stats.gets++;
+        ctx->sh->stats.misses++;
+
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (sd->value_type != SHDICT_TTABLE) {
+        ctx->sh->stats.gets++;
+        ctx->sh->stats.hits++;
+
+        ngx_http_lua_shdict_unlock(ctx);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "value not a table");
+        return 2;
+    }
+
+    /*
+     * the value is decoded from a copy, without the lock; a copy too large
+     * for the stack goes to a userdata allocated without the lock as well,
+     * so that it is never leaked when decoding it raises a Lua error
+     */
+
+    len = (size_t) sd->value_len;
+
+    if (len > size) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        buf = lua_newuserdata(L, len);
+        size = len;
+
+        goto again;
+    }
+
+    ctx->sh->stats.gets++;
+    ctx->sh->stats.hits++;
+
+    flags = sd->user_flags;
+
+    ngx_memcpy(buf, sd->data + sd->key_len, len);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    n = lua_gettop(L);
+    last = buf + len;
+
+    p = ngx_http_lua_shdict_decode(L, buf, last, 0);
+
+    if (p != last) {
+        lua_settop(L, n);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "bad table value");
+        return 2;
+    }
+
+    if (flags) {
+        lua_pushinteger(L, (lua_Integer) flags);
+        return 2;
+    }
+
+    return 1;
+}
+
+
+static char        ngx_http_lua_shdict_l1_key;
+static ngx_uint_t  ngx_http_lua_shdict_l1_nzones;
+
+
+/*
+ * creates the l1 cache of a zone in this process, on first use, the cached
+ * values being kept apart in each Lua VM, see l1_values
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_l1_init(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    size_t                     size;
+    ngx_uint_t                 i, nbuckets;
+    ngx_http_lua_shdict_l1_t  *l1;
+
+    for (nbuckets = 16; nbuckets < ctx->l1_size; nbuckets <<= 1) {
+        /* void */
+    }
+
+    size = sizeof(ngx_http_lua_shdict_l1_t)
+           + nbuckets * sizeof(ngx_http_lua_shdict_l1_entry_t *)
+           + ctx->l1_size * sizeof(ngx_http_lua_shdict_l1_entry_t);
+
+    l1 = ngx_calloc(size, ngx_cycle->log);
+    if (l1 == NULL) {
+        return NGX_ERROR;
+    }
+
+    l1->buckets = (ngx_http_lua_shdict_l1_entry_t **) &l1[1];
+    l1->mask = nbuckets - 1;
+    l1->entries = (ngx_http_lua_shdict_l1_entry_t *)
+                      &l1->buckets[nbuckets];
+
+    ngx_queue_init(&l1->lru);
+    ngx_queue_init(&l1->free);
+
+    for (i = 0; i < ctx->l1_size; i++) {
+        ngx_queue_insert_tail(&l1->free, &l1->entries[i].queue);
+    }
+
+    l1->size = ctx->l1_size;
+    l1->id = ++ngx_http_lua_shdict_l1_nzones;
+
+    ctx->l1 = l1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * pushes the table of the values cached by l1 in this Lua VM, created on
+ * first use: with lua_code_cache off, every request has a VM of its own,
+ * so a value is only used by l1_get when the stamp stored with it, at the
+ * index following the value's, is the one of the entry
+ */
+
+static void
+ngx_http_lua_shdict_l1_values(lua_State *L, ngx_http_lua_shdict_l1_t *l1)
+{
+    lua_pushlightuserdata(L, ngx_http_lua_lightudata_mask(shdict_l1_key));
+    lua_rawget(L, LUA_REGISTRYINDEX);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+
+        lua_createtable(L, 1 /* narr */, 0 /* nrec */);
+        lua_pushlightuserdata(L, ngx_http_lua_lightudata_mask(shdict_l1_key));
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_rawgeti(L, -1, (int) l1->id);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+
+        lua_createtable(L, (int) l1->size * 2 /* narr */, 0 /* nrec */);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, (int) l1->id);
+    }
+
+    lua_remove(L, -2);
+}
+
+
+static ngx_http_lua_shdict_l1_entry_t *
+ngx_http_lua_shdict_l1_find(ngx_http_lua_shdict_l1_t *l1, uint32_t hash,
+    ngx_str_t *key)
+{
+    ngx_http_lua_shdict_l1_entry_t  *e;
+
+    for (e = l1->buckets[hash & l1->mask]; e; e = e->next) {
+        if (e->hash == hash
+            && e->key.len == key->len
+            && ngx_memcmp(e->key.data, key->data, key->len) == 0)
+        {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * tells without the lock whether the value cached by the entry still is
+ * the one of the zone: the node it was read from must hold the same key
+ * with the same version, which the writers change on every update and
+ * clear when they free the node
+ */
+
+static ngx_uint_t
+ngx_http_lua_shdict_l1_valid(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_l1_entry_t *e)
+{
+    uint64_t                     now, expires;
+    ngx_uint_t                   i, valid;
+    ngx_time_t                  *tp;
+    ngx_atomic_uint_t            seq;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    tp = ngx_timeofday();
+
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    sd = e->sd;
+
+    for (i = 0; i < NGX_HTTP_LUA_SHDICT_READ_TRIES; i++) {
+
+        seq = ctx->sh->seq;
+
+        if (seq & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        expires = sd->expires;
+
+        valid = (sd->version == e->version
+                 && sd->key_len == e->key.len
+                 && ngx_memcmp(sd->data, e->key.data, e->key.len) == 0);
+
+        ngx_memory_barrier();
+
+        if (ctx->sh->seq != seq) {
+            continue;
+        }
+
+        if (!valid || (expires != 0 && (int64_t) (expires - now) < 0)) {
+            return 0;
+        }
+
+        ngx_http_lua_shdict_lock_free_done(ctx, e->hash, e->key.data,
+                                           e->key.len, 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_lua_shdict_l1_drop(lua_State *L, ngx_http_lua_shdict_l1_t *l1,
+    ngx_http_lua_shdict_l1_entry_t *e)
+{
+    ngx_http_lua_shdict_l1_entry_t  **ep;
+
+    for (ep = &l1->buckets[e->hash & l1->mask]; *ep != e; ep = &(*ep)->next) {
+        /* void */
+    }
+
+    *ep = e->next;
+
+    ngx_queue_remove(&e->queue);
+    ngx_queue_insert_tail(&l1->free, &e->queue);
+
+    ngx_free(e->key.data);
+    e->key.data = NULL;
+
+    ngx_http_lua_shdict_l1_values(L, l1);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, (int) (e - l1->entries) * 2 + 1);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, (int) (e - l1->entries) * 2 + 2);
+    lua_pop(L, 1);
+}
+
+
+/* caches the value on the top of the stack, evicting the LRU entry if need */
+
+static void
+ngx_http_lua_shdict_l1_store(lua_State *L, ngx_http_lua_shdict_l1_t *l1,
+    ngx_http_lua_shdict_l1_entry_t *e, ngx_http_lua_shdict_node_t *sd,
+    uint32_t hash, ngx_str_t *key, uint32_t version, uint32_t flags)
+{
+    ngx_queue_t  *q;
+
+    if (e == NULL) {
+        if (ngx_queue_empty(&l1->free)) {
+            q = ngx_queue_last(&l1->lru);
+
+            ngx_http_lua_shdict_l1_drop(L, l1,
+                                        ngx_queue_data(q,
+                                            ngx_http_lua_shdict_l1_entry_t,
+                                            queue));
+        }
+
+        q = ngx_queue_head(&l1->free);
+        e = ngx_queue_data(q, ngx_http_lua_shdict_l1_entry_t, queue);
+
+        e->key.data = ngx_alloc(key->len, ngx_cycle->log);
+        if (e->key.data == NULL) {
+            return;
+        }
+
+        ngx_memcpy(e->key.data, key->data, key->len);
+
+        e->key.len = key->len;
+        e->hash = hash;
+
+        e->next = l1->buckets[hash & l1->mask];
+        l1->buckets[hash & l1->mask] = e;
+    }
+
+    ngx_queue_remove(&e->queue);
+    ngx_queue_insert_head(&l1->lru, &e->queue);
+
+    e->sd = sd;
+    e->version = version;
+    e->user_flags = flags;
+    e->stamp = ++l1->stamp;
+
+    ngx_http_lua_shdict_l1_values(L, l1);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, (int) (e - l1->entries) * 2 + 1);
+    lua_pushnumber(L, (lua_Number) e->stamp);
+    lua_rawseti(L, -2, (int) (e - l1->entries) * 2 + 2);
+    lua_pop(L, 1);
+}
+
+
+static int
+ngx_http_lua_shdict_l1_get(lua_State *L)
+{
+    int                              rc, n, value_type;
+    char                            *err;
+    u_char                          *buf, *p, *last;
+    u_char                           tmp[NGX_HTTP_LUA_SHDICT_TABLE_BUF];
+    size_t                           len, size;
+    double                           num;
+    uint32_t                         hash, version, flags;
+    ngx_str_t                        key;
+    ngx_shm_zone_t                  *zone;
+    ngx_http_lua_shdict_l1_t        *l1;
+    ngx_http_lua_shdict_ctx_t       *ctx;
+    ngx_http_lua_shdict_node_t      *sd;
+    ngx_http_lua_shdict_l1_entry_t  *e;
+
+    rc = ngx_http_lua_shdict_item_args(L, 2, &zone, &key, NULL);
+    if (rc) {
+        return rc;
+    }
+
+    ctx = zone->data;
+
+    if (ctx->l1_size == 0) {
+        return luaL_error(L, "no l1 cache for the lua_shared_dict");
+    }
+
+    if (ctx->l1 == NULL && ngx_http_lua_shdict_l1_init(ctx) != NGX_OK) {
+        return luaL_error(L, "no memory");
+    }
+
+    l1 = ctx->l1;
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ctx = ngx_http_lua_shdict_get_shard(ctx, hash);
+
+    e = ngx_http_lua_shdict_l1_find(l1, hash, &key);
+
+    if (e) {
+        ngx_http_lua_shdict_l1_values(L, l1);
+        lua_rawgeti(L, -1, (int) (e - l1->entries) * 2 + 2);
+
+        /* the value may have been cached by another Lua VM */
+
+        if (lua_tonumber(L, -1) == (lua_Number) e->stamp
+            && ngx_http_lua_shdict_l1_valid(ctx, e))
+        {
+            ngx_queue_remove(&e->queue);
+            ngx_queue_insert_head(&l1->lru, &e->queue);
+
+            lua_pop(L, 1);
+            lua_rawgeti(L, -1, (int) (e - l1->entries) * 2 + 1);
+
+            flags = e->user_flags;
+            goto done;
+        }
+
+        lua_pop(L, 2);
+    }
+
+    buf = NULL;
+    size = sizeof(tmp);
+
+again:
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    ngx_http_lua_shdict_expire(ctx, 1);
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key.data, key.len, &sd);
+
+    if (rc != NGX_OK) {
+        ctx->sh->stats.gets++;
+        ctx->sh->stats.misses++;
+
+        ngx_http_lua_shdict_unlock(ctx);
+
+        if (e) {
+            ngx_http_lua_shdict_l1_drop(L, l1, e);
+        }
+
+        lua_pushnil(L);
+        return 1;
+    }
+
+    value_type = sd->value_type;
+    len = (size_t) sd->value_len;
+    p = sd->data + sd->key_len;
+    flags = sd->user_flags;
+    version = sd->version;
+
+    err = NULL;
+
+    switch (value_type) {
+
+    case SHDICT_TSTRING:
+        lua_pushlstring(L, (char *) p, len);
+        break;
+
+    case SHDICT_TNUMBER:
+        if (len != sizeof(double)) {
+            err = "bad value";
+            break;
+        }
+
+        ngx_memcpy(&num, p, sizeof(double));
+        lua_pushnumber(L, (lua_Number) num);
+        break;
+
+    case SHDICT_TBOOLEAN:
+        if (len != sizeof(u_char)) {
+            err = "bad value";
+            break;
+        }
+
+        lua_pushboolean(L, *p);
+        break;
+
+    case SHDICT_TCOMPRESSED:
+
+        /* inflated from a copy, without the lock */
+
+        buf = ngx_alloc(len, ngx_cycle->log);
+        if (buf == NULL) {
+            err = "no memory";
+            break;
+        }
+
+        ngx_memcpy(buf, p, len);
+        break;
+
+    case SHDICT_TTABLE:
+
+        /*
+         * decoded from a copy, without the lock, in memory owned by Lua so
+         * that it is never leaked when decoding it raises a Lua error
+         */
+
+        if (len > size) {
+            ngx_http_lua_shdict_unlock(ctx);
+
+            buf = lua_newuserdata(L, len);
+            size = len;
+
+            goto again;
+        }
+
+        if (buf == NULL) {
+            buf = tmp;
+        }
+
+        ngx_memcpy(buf, p, len);
+        break;
+
+    case SHDICT_TCOUNTER:
+
+        /* never cached, incr_fast changes counters without the lock */
+
+        lua_pushnumber(L, (lua_Number)
+                              ngx_http_lua_shdict_counter_sum(ctx, sd));
+        version = 0;
+        break;
+
+    case SHDICT_TLIST:
+        err = "value is a list";
+        break;
+
+    case SHDICT_THASH:
+        err = "value is a hash";
+        break;
+
+    case SHDICT_TZSET:
+        err = "value is a sorted set";
+        break;
+
+    default:
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "bad value type found for key %*s in "
+                      "shared_dict %V: %d", key.len, key.data, &ctx->name,
+                      value_type);
+
+        err = "bad value";
+        break;
+    }
+
+    ctx->sh->stats.gets++;
+    ctx->sh->stats.hits++;
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    if (err == NULL && value_type == SHDICT_TCOMPRESSED) {
+        if (ngx_http_lua_shdict_decompress(ctx, &value_type, &buf, &len,
+                                           &err)
+            == NGX_OK)
+        {
+            lua_pushlstring(L, (char *) buf, len);
+            ngx_free(buf);
+        }
+
+    } else if (err == NULL && value_type == SHDICT_TTABLE) {
+        n = lua_gettop(L);
+        last = buf + len;
+
+        if (ngx_http_lua_shdict_decode(L, buf, last, 0) != last) {
+            lua_settop(L, n);
+            err = "bad table value";
+        }
+    }
+
+    if (err) {
+        if (e) {
+            ngx_http_lua_shdict_l1_drop(L, l1, e);
+        }
+
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    if (version) {
+        ngx_http_lua_shdict_l1_store(L, l1, e, sd, hash, &key, version, flags);
+
+    } else if (e) {
+        ngx_http_lua_shdict_l1_drop(L, l1, e);
+    }
+
+done:
+
+    if (flags) {
+        lua_pushinteger(L, (lua_Integer) flags);
+        return 2;
+    }
+
+    return 1;
+}
+
+
+ngx_shm_zone_t *
+ngx_http_lua_find_zone(u_char *name_data, size_t name_len)
+{
+    ngx_str_t                       *name;
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                  *zone;
+    ngx_http_lua_shm_zone_ctx_t     *ctx;
+    volatile ngx_list_part_t        *part;
+
+    part = &ngx_cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        name = &zone[i].shm.name;
+
+        dd("name: [%.*s] %d", (int) name->len, name->data, (int) name->len);
+        dd("name2: [%.*s] %d", (int) name_len, name_data, (int) name_len);
+
+        if (name->len == name_len
+            && ngx_strncmp(name->data, name_data, name_len) == 0)
+        {
+            ctx = (ngx_http_lua_shm_zone_ctx_t *) zone[i].data;
+            return &ctx->zone;
+        }
+    }
+
+    return NULL;
+}
+
+
+ngx_shm_zone_t *
+ngx_http_lua_ffi_shdict_udata_to_zone(void *zone_udata)
+{
+    if (zone_udata == NULL) {
+        return NULL;
+    }
+
+    return *(ngx_shm_zone_t **) zone_udata;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_store_locked(ngx_http_lua_shdict_ctx_t *ctx, int op,
+    uint32_t hash, u_char *key, size_t key_len, int value_type,
+    u_char *str_value_buf, size_t str_value_len, double num_value,
+    long exptime, int user_flags, char **errmsg, int *forcible)
+{
+    int                          i, n;
+    u_char                       c, *p;
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp;
+    ngx_queue_t                 *queue, *q;
+    ngx_rbtree_node_t           *node;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    dd("exptime: %ld", exptime);
+
+    *forcible = 0;
+
+    switch (value_type) {
+
+    case SHDICT_TSTRING:
+    case SHDICT_TCOMPRESSED:
+    case SHDICT_TTABLE:
+        /* do nothing */
+        break;
+
+    case SHDICT_TNUMBER:
+        dd("num value: %lf", num_value);
+        str_value_buf = (u_char *) &num_value;
+        str_value_len = sizeof(double);
+        break;
+
+    case SHDICT_TBOOLEAN:
+        c = num_value ? 1 : 0;
+        str_value_buf = &c;
+        str_value_len = sizeof(u_char);
+        break;
+
+    case LUA_TNIL:
+        if (op & (NGX_HTTP_LUA_SHDICT_ADD|NGX_HTTP_LUA_SHDICT_REPLACE)) {
+            *errmsg = "attempt to add or replace nil values";
+            return NGX_ERROR;
+        }
+
+        str_value_buf = NULL;
+        str_value_len = 0;
+        break;
+
+    default:
+        *errmsg = "unsupported value type";
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+    dd("lookup returns %d", (int) rc);
+
+    if (op & NGX_HTTP_LUA_SHDICT_REPLACE) {
+
+        if (rc == NGX_DECLINED || rc == NGX_DONE) {
+            *errmsg = "not found";
+            return NGX_DECLINED;
+        }
+
+        /* rc == NGX_OK */
+
+        goto replace;
+    }
+
+    if (op & NGX_HTTP_LUA_SHDICT_ADD) {
+
+        if (rc == NGX_OK) {
+            *errmsg = "exists";
+            return NGX_DECLINED;
+        }
+
+        if (rc == NGX_DONE) {
+            /* exists but expired */
+
+            dd("go to replace");
+            goto replace;
+        }
+
+        /* rc == NGX_DECLINED */
+
+        dd("go to insert");
+        goto insert;
+    }
+
+    if (rc == NGX_OK || rc == NGX_DONE) {
+
+        if (value_type == LUA_TNIL) {
+            goto remove;
+        }
+
+replace:
+
+        if (str_value_buf
+            && str_value_len == (size_t) sd->value_len
+            && sd->value_type != SHDICT_TLIST
+            && sd->value_type != SHDICT_THASH
+            && sd->value_type != SHDICT_TZSET
+            && sd->value_type != SHDICT_TCOUNTER)
+        {
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                           "lua shared dict set: found old entry and value "
+                           "size matched, reusing it");
+
+            ngx_queue_remove(&sd->queue);
+            ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+            sd->key_len = (u_short) key_len;
+
+            if (exptime > 0) {
+                tp = ngx_timeofday();
+                sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
+                              + (uint64_t) exptime;
+
+            } else {
+                sd->expires = 0;
+            }
+
+            ngx_http_lua_shdict_wheel_update(ctx, sd);
+
+            sd->user_flags = user_flags;
+
+            sd->value_len = (uint32_t) str_value_len;
+
+            dd("setting value type to %d", value_type);
+
+            sd->value_type = (uint8_t) value_type;
+
+            p = ngx_copy(sd->data, key, key_len);
+            ngx_memcpy(p, str_value_buf, str_value_len);
+
+            ngx_http_lua_shdict_new_version(ctx, sd);
+
+            ctx->sh->stats.sets++;
+
+            ngx_http_lua_shdict_notify(ctx, key, key_len);
+
+            return NGX_OK;
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict set: found old entry but value size "
+                       "NOT matched, removing it first");
+
+remove:
+
+        if (sd->value_type == SHDICT_TLIST) {
+            queue = ngx_http_lua_shdict_get_list_head(sd, key_len);
+
+            for (q = ngx_queue_head(queue);
+                 q != ngx_queue_sentinel(queue);
+                 q = ngx_queue_next(q))
+            {
+                p = (u_char *) ngx_queue_data(q,
+                                              ngx_http_lua_shdict_list_node_t,
+                                              queue);
+
+                ngx_slab_free_locked(ctx->shpool, p);
+            }
+        }
+
+        ngx_queue_remove(&sd->queue);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_http_lua_shdict_delete_node(ctx, node);
+
+        ngx_http_lua_shdict_free_node(ctx, node);
+
+    }
+
+insert:
+
+    /* rc == NGX_DECLINED or value size unmatch */
+
+    if (str_value_buf == NULL) {
+
+        if (rc != NGX_DECLINED) {
+            ngx_http_lua_shdict_notify(ctx, key, key_len);
+        }
+
+        return NGX_OK;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict set: creating a new entry");
+
+    n = offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_http_lua_shdict_node_t, data)
+        + key_len
+        + str_value_len;
+
+    node = ngx_http_lua_shdict_alloc_node(ctx, n);
+
+    if (node == NULL) {
+
+        if (op & NGX_HTTP_LUA_SHDICT_SAFE_STORE) {
+            *errmsg = "no memory";
+            return NGX_ERROR;
+        }
+
+        if (ctx->sh->sketch && rc == NGX_DECLINED
+            && !ngx_http_lua_shdict_admit(ctx, hash))
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                           "lua shared dict set: entry \"%*s\" not admitted, "
+                           "its key is colder than the LRU tail", key_len,
+                           key);
+
+            *errmsg = "not admitted";
+            return NGX_DECLINED;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict set: overriding non-expired items "
+                       "due to memory shortage for entry \"%*s\"", key_len,
+                       key);
+
+        for (i = 0; i < 30; i++) {
+            if (ngx_http_lua_shdict_expire(ctx, 0) == 0) {
+                break;
+            }
+
+            *forcible = 1;
+
+            node = ngx_http_lua_shdict_alloc_node(ctx, n);
+            if (node != NULL) {
+                goto allocated;
+            }
+        }
+
+        *errmsg = "no memory";
+        return NGX_ERROR;
+    }
+
+allocated:
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    node->key = hash;
+    sd->key_len = (u_short) key_len;
+
+    if (exptime > 0) {
+        tp = ngx_timeofday();
+        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
+                      + (uint64_t) exptime;
+
+    } else {
+        sd->expires = 0;
+    }
+
+    ngx_http_lua_shdict_wheel_update(ctx, sd);
+
+    sd->user_flags = user_flags;
+    sd->value_len = (uint32_t) str_value_len;
+    dd("setting value type to %d", value_type);
+    sd->value_type = (uint8_t) value_type;
+
+    p = ngx_copy(sd->data, key, key_len);
+    ngx_memcpy(p, str_value_buf, str_value_len);
+
+    ngx_http_lua_shdict_new_version(ctx, sd);
+
+    ngx_http_lua_shdict_insert_node(ctx, node);
+    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+    ctx->sh->stats.sets++;
+
+    ngx_http_lua_shdict_notify(ctx, key, key_len);
+
+    return NGX_OK;
+}
+
+
+/*
+ * deflates a string into an ngx_alloc()ed buffer, prefixed with the length of
+ * the string, returns NGX_DECLINED when that does not save any memory
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_compress(u_char *data, size_t len, u_char **out,
+    size_t *out_len)
+{
+#if !(NGX_ZLIB)
+
+    /* compress=N is refused by the lua_shared_dict directive */
+
+    return NGX_DECLINED;
+
+#else
+
+    u_char    *buf;
+    uLongf     n;
+    uint32_t   raw;
+
+    if (len > NGX_MAX_UINT32_VALUE) {
+        return NGX_DECLINED;
+    }
+
+    n = compressBound((uLong) len);
+
+    buf = ngx_alloc(sizeof(uint32_t) + n, ngx_cycle->log);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (compress2(buf + sizeof(uint32_t), &n, data, (uLong) len,
+                  Z_BEST_SPEED)
+        != Z_OK
+        || sizeof(uint32_t) + n >= len)
+    {
+        ngx_free(buf);
+        return NGX_DECLINED;
+    }
+
+    raw = (uint32_t) len;
+    ngx_memcpy(buf, &raw, sizeof(uint32_t));
+
+    *out = buf;
+    *out_len = sizeof(uint32_t) + n;
+
+    return NGX_OK;
+
+#endif
+}
+
+
+/* inflates the zlib stream src into at most *len bytes of dst */
+
+static ngx_int_t
+ngx_http_lua_shdict_inflate(u_char *src, size_t src_len, u_char *dst,
+    size_t *len)
+{
+#if !(NGX_ZLIB)
+
+    /* only zones of another binary, e.g. from snapshots, hold such values */
+
+    return NGX_ERROR;
+
+#else
+
+    int       rc;
+    z_stream  zs;
+
+    ngx_memzero(&zs, sizeof(z_stream));
+
+    if (inflateInit(&zs) != Z_OK) {
+        return NGX_ERROR;
+    }
+
+    zs.next_in = src;
+    zs.avail_in = (uInt) src_len;
+    zs.next_out = dst;
+    zs.avail_out = (uInt) *len;
+
+    rc = inflate(&zs, Z_FINISH);
+
+    /* a full dst is fine for the callers asking for a prefix only */
+
+    if (rc != Z_STREAM_END && (rc != Z_BUF_ERROR || zs.avail_out != 0)) {
+        inflateEnd(&zs);
+        return NGX_ERROR;
+    }
+
+    *len -= zs.avail_out;
+
+    inflateEnd(&zs);
+
+    return NGX_OK;
+
+#endif
+}
+
+
+/*
+ * replaces a compressed value copied out of a shard, always to an ngx_alloc()ed
+ * buffer, with the original string, in an ngx_alloc()ed buffer as well
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_decompress(ngx_http_lua_shdict_ctx_t *ctx,
+    int *value_type, u_char **str_value_buf, size_t *str_value_len,
+    char **err)
+{
+    u_char    *src, *dst;
+    size_t     len;
+    uint32_t   raw;
+    uint64_t   usec;
+
+    usec = ngx_http_lua_shdict_usec();
+
+    src = *str_value_buf;
+    dst = NULL;
+
+    if (*str_value_len < sizeof(uint32_t)) {
+        goto bad;
+    }
+
+    ngx_memcpy(&raw, src, sizeof(uint32_t));
+
+    dst = ngx_alloc(raw, ngx_cycle->log);
+    if (dst == NULL) {
+        ngx_free(src);
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+    len = raw;
+
+    if (ngx_http_lua_shdict_inflate(src + sizeof(uint32_t),
+                                    *str_value_len - sizeof(uint32_t), dst,
+                                    &len)
+        != NGX_OK
+        || len != raw)
+    {
+        goto bad;
+    }
+
+    ngx_free(src);
+
+    (void) ngx_atomic_fetch_add(&ctx->sh->decompressed, 1);
+    (void) ngx_atomic_fetch_add(&ctx->sh->decompress_usec,
+                                (ngx_atomic_int_t)
+                                    (ngx_http_lua_shdict_usec() - usec));
+
+    *value_type = SHDICT_TSTRING;
+    *str_value_buf = dst;
+    *str_value_len = len;
+
+    return NGX_OK;
+
+bad:
+
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "bad compressed value found in shared_dict %V", &ctx->name);
+
+    ngx_free(src);
+
+    if (dst) {
+        ngx_free(dst);
+    }
+
+    *err = "bad compressed value";
+    return NGX_ERROR;
+}
+
+
+/*
+ * compresses a string of compress=N bytes or more before the lock is taken,
+ * returns the ngx_alloc()ed buffer of the compressed value, which the caller
+ * frees, or NULL when the value is stored as is
+ */
+
+static u_char *
+ngx_http_lua_shdict_compress_value(ngx_http_lua_shdict_ctx_t *ctx,
+    int *value_type, u_char **str_value_buf, size_t *str_value_len,
+    uint64_t *usec)
+{
+    u_char  *buf;
+
+    *usec = 0;
+
+    if (*value_type != SHDICT_TSTRING
+        || ctx->compress == 0
+        || *str_value_len < ctx->compress)
+    {
+        return NULL;
+    }
+
+    *usec = ngx_http_lua_shdict_usec();
+
+    buf = NULL;
+
+    if (ngx_http_lua_shdict_compress(*str_value_buf, *str_value_len, &buf,
+                                     str_value_len)
+        == NGX_OK)
+    {
+        *value_type = SHDICT_TCOMPRESSED;
+        *str_value_buf = buf;
+    }
+
+    *usec = ngx_http_lua_shdict_usec() - *usec;
+
+    return buf;
+}
+
+
+/* accounts for the compression of a value stored, with the shard locked */
+
+static void
+ngx_http_lua_shdict_compress_stats(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_int_t rc, u_char *buf, size_t raw_len, size_t len, uint64_t usec)
+{
+    ctx->sh->stats.compress_usec += usec;
+
+    if (buf && rc == NGX_OK) {
+        ctx->sh->stats.compressed++;
+        ctx->sh->stats.compress_bytes_in += raw_len;
+        ctx->sh->stats.compress_bytes_out += len;
+    }
+}
+
+
+int
+ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
+    size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, long exptime, int user_flags,
+    char **errmsg, int *forcible)
+{
+    u_char                      *buf;
+    size_t                       raw_len;
+    uint32_t                     hash;
+    uint64_t                     usec;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+
+    raw_len = str_value_len;
+
+    buf = ngx_http_lua_shdict_compress_value(zone->data, &value_type,
+                                             &str_value_buf, &str_value_len,
+                                             &usec);
+
+    hash = ngx_crc32_short(key, key_len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_store_locked(ctx, op, hash, key, key_len,
+                                          value_type, str_value_buf,
+                                          str_value_len, num_value, exptime,
+                                          user_flags, errmsg, forcible);
+
+    ngx_http_lua_shdict_compress_stats(ctx, rc, buf, raw_len, str_value_len,
+                                       usec);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    if (buf) {
+        ngx_free(buf);
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_get_locked(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    u_char *key, size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int get_stale, int *is_stale, char **err)
+{
+    ngx_str_t                    name;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_node_t  *sd;
+    ngx_str_t                    value;
+
+    name = ctx->name;
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+    dd("shdict lookup returns %d", (int) rc);
+
+    ctx->sh->stats.gets++;
+
+    if (rc == NGX_OK) {
+        ctx->sh->stats.hits++;
+
+    } else {
+        ctx->sh->stats.misses++;
+    }
+
+    if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
+        *value_type = LUA_TNIL;
+        return NGX_OK;
+    }
+
+    /* rc == NGX_OK || (rc == NGX_DONE && get_stale) */
+
+    *value_type = sd->value_type;
+
+    dd("data: %p", sd->data);
+    dd("key len: %d", (int) sd->key_len);
+
+    value.data = sd->data + sd->key_len;
+    value.len = (size_t) sd->value_len;
+
+    if (*value_type == SHDICT_TCOMPRESSED) {
+
+        /* always copied to a buffer of its own, see decompress() */
+
+        *str_value_buf = ngx_alloc(value.len, ngx_cycle->log);
+        if (*str_value_buf == NULL) {
+            return NGX_ERROR;
+        }
+
+    } else if (*str_value_len < (size_t) value.len) {
+        if (*value_type == SHDICT_TBOOLEAN) {
+            return NGX_ERROR;
+        }
+
+        if (*value_type == SHDICT_TSTRING) {
+            *str_value_buf = ngx_alloc(value.len, ngx_cycle->log);
+            if (*str_value_buf == NULL) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    switch (*value_type) {
+
+    case SHDICT_TSTRING:
+    case SHDICT_TCOMPRESSED:
+        *str_value_len = value.len;
+        ngx_memcpy(*str_value_buf, value.data, value.len);
+        break;
+
+    case SHDICT_TNUMBER:
+
+        if (value.len != sizeof(double)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "bad lua number value size found for key %*s "
+                          "in shared_dict %V: %z", key_len, key,
+                          &name, value.len);
+            return NGX_ERROR;
+        }
+
+        *str_value_len = value.len;
+        ngx_memcpy(num_value, value.data, sizeof(double));
+        break;
+
+    case SHDICT_TBOOLEAN:
+
+        if (value.len != sizeof(u_char)) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                          "bad lua boolean value size found for key %*s "
+                          "in shared_dict %V: %z", key_len, key, &name,
+                          value.len);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(*str_value_buf, value.data, value.len);
+        break;
+
+    case SHDICT_TLIST:
+
+        *err = "value is a list";
+        return NGX_ERROR;
+
+    case SHDICT_THASH:
+
+        *err = "value is a hash";
+        return NGX_ERROR;
+
+    case SHDICT_TZSET:
+
+        *err = "value is a sorted set";
+        return NGX_ERROR;
+
+    case SHDICT_TTABLE:
+
+        *err = "value is a table";
+        return NGX_ERROR;
+
+    case SHDICT_TCOUNTER:
+
+        *value_type = SHDICT_TNUMBER;
+        *str_value_len = sizeof(double);
+        *num_value = ngx_http_lua_shdict_counter_sum(ctx, sd);
+        break;
+
+    default:
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                      "bad value type found for key %*s in "
+                      "shared_dict %V: %d", key_len, key, &name,
+                      *value_type);
+        return NGX_ERROR;
+    }
+
+    *user_flags = sd->user_flags;
+    dd("user flags: %d", *user_flags);
+
+    if (get_stale) {
+
+        /* always return value, flags, stale */
+
+        *is_stale = (rc == NGX_DONE);
+        return NGX_OK;
+    }
+
+    return NGX_OK;
+}
+
+
+int
+ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, int *user_flags,
+    int get_stale, int *is_stale, char **err)
+{
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+
+    *err = NULL;
+
+    hash = ngx_crc32_short(key, key_len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+#if (NGX_DEBUG)
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "fetching key \"%*s\" in shared dict \"%V\"", key_len,
+                   key, &ctx->name);
+#endif /* NGX_DEBUG */
+
+    if (ctx->read_mostly) {
+        rc = ngx_http_lua_shdict_get_lock_free(ctx, hash, key, key_len,
+                                               value_type, str_value_buf,
+                                               str_value_len, num_value,
+                                               user_flags, get_stale,
+                                               is_stale);
+        if (rc != NGX_AGAIN) {
+            goto done;
+        }
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict get: too many concurrent writes, "
+                       "falling back to the lock");
+    }
+
+    ngx_http_lua_shdict_lock(ctx);
+
+#if 1
+    if (!get_stale) {
+        ngx_http_lua_shdict_expire(ctx, 1);
+    }
+#endif
+
+    rc = ngx_http_lua_shdict_get_locked(ctx, hash, key, key_len, value_type,
+                                        str_value_buf, str_value_len,
+                                        num_value, user_flags, get_stale,
+                                        is_stale, err);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+done:
+
+    if (rc == NGX_OK && *value_type == SHDICT_TCOMPRESSED) {
+        rc = ngx_http_lua_shdict_decompress(ctx, value_type, str_value_buf,
+                                            str_value_len, err);
+    }
+
+    return rc;
+}
+
+
+int
+ngx_http_lua_ffi_shdict_get_multi(ngx_shm_zone_t *zone,
+    ngx_http_lua_ffi_shdict_item_t *items, int nitems)
+{
+    int                              i, is_stale;
+    uint32_t                         hash;
+    ngx_int_t                        rc;
+    ngx_http_lua_shdict_ctx_t       *ctx, *locked;
+    ngx_http_lua_ffi_shdict_item_t  *item;
+
+    /*
+     * the items are looked up in order and a shard lock is only released
+     * when the next key lives in another shard, so an unsharded zone is
+     * locked exactly once for the whole batch
+     */
+
+    locked = NULL;
+
+    for (i = 0; i < nitems; i++) {
+        item = &items[i];
+        item->err = NULL;
+
+        hash = ngx_crc32_short(item->key.data, item->key.len);
+
+        ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+        if (ctx != locked) {
+
+            if (ctx->read_mostly) {
+                rc = ngx_http_lua_shdict_get_lock_free(ctx, hash,
+                                                       item->key.data,
+                                                       item->key.len,
+                                                       &item->value_type,
+                                                       &item->str_value_buf,
+                                                       &item->str_value_len,
+                                                       &item->num_value,
+                                                       &item->user_flags,
+                                                       0, &is_stale);
+                if (rc != NGX_AGAIN) {
+                    item->rc = (int) rc;
+                    continue;
+                }
+            }
+
+            if (locked) {
+                ngx_http_lua_shdict_unlock(locked);
+            }
+
+            ngx_http_lua_shdict_lock(ctx);
+            locked = ctx;
+
+#if 1
+            ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+        }
+
+        item->rc = (int) ngx_http_lua_shdict_get_locked(ctx, hash,
+                                                        item->key.data,
+                                                        item->key.len,
+                                                        &item->value_type,
+                                                        &item->str_value_buf,
+                                                        &item->str_value_len,
+                                                        &item->num_value,
+                                                        &item->user_flags,
+                                                        0, &is_stale,
+                                                        &item->err);
+    }
+
+    if (locked) {
+        ngx_http_lua_shdict_unlock(locked);
+    }
+
+    for (i = 0; i < nitems; i++) {
+        item = &items[i];
+
+        if (item->rc != NGX_OK || item->value_type != SHDICT_TCOMPRESSED) {
+            continue;
+        }
+
+        hash = ngx_crc32_short(item->key.data, item->key.len);
+
+        ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+        item->rc = (int) ngx_http_lua_shdict_decompress(ctx,
+                                                        &item->value_type,
+                                                        &item->str_value_buf,
+                                                        &item->str_value_len,
+                                                        &item->err);
+    }
+
+    return NGX_OK;
+}
+
+
+int
+ngx_http_lua_ffi_shdict_set_multi(ngx_shm_zone_t *zone, int op,
+    ngx_http_lua_ffi_shdict_item_t *items, int nitems, long exptime)
+{
+    int                              i;
+    u_char                          *buf, *raw;
+    size_t                           raw_len;
+    uint32_t                         hash;
+    uint64_t                         usec;
+    ngx_http_lua_shdict_ctx_t       *zctx, *ctx, *locked;
+    ngx_http_lua_ffi_shdict_item_t  *item;
+
+    zctx = zone->data;
+    locked = NULL;
+
+    for (i = 0; i < nitems; i++) {
+        item = &items[i];
+        item->err = NULL;
+
+        hash = ngx_crc32_short(item->key.data, item->key.len);
+
+        ctx = ngx_http_lua_shdict_get_shard(zctx, hash);
+
+        raw = item->str_value_buf;
+        raw_len = item->str_value_len;
+
+        /* the large strings are compressed without any lock held */
+
+        buf = NULL;
+        usec = 0;
+
+        if (item->value_type == SHDICT_TSTRING
+            && zctx->compress
+            && item->str_value_len >= zctx->compress)
+        {
+            if (locked) {
+                ngx_http_lua_shdict_unlock(locked);
+                locked = NULL;
+            }
+
+            buf = ngx_http_lua_shdict_compress_value(zctx, &item->value_type,
+                                                     &item->str_value_buf,
+                                                     &item->str_value_len,
+                                                     &usec);
+        }
+
+        if (ctx != locked) {
+            if (locked) {
+                ngx_http_lua_shdict_unlock(locked);
+            }
+
+            ngx_http_lua_shdict_lock(ctx);
+            locked = ctx;
+
+#if 1
+            ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+        }
+
+        item->rc = (int) ngx_http_lua_shdict_store_locked(ctx, op, hash,
+                                                          item->key.data,
+                                                          item->key.len,
+                                                          item->value_type,
+                                                          item->str_value_buf,
+                                                          item->str_value_len,
+                                                          item->num_value,
+                                                          exptime,
+                                                          item->user_flags,
+                                                          &item->err,
+                                                          &item->forcible);
+
+        ngx_http_lua_shdict_compress_stats(ctx, item->rc, buf, raw_len,
+                                           item->str_value_len, usec);
+
+        if (buf) {
+            ngx_free(buf);
+
+            /* the item is handed back to the caller as it was */
+
+            item->value_type = SHDICT_TSTRING;
+            item->str_value_buf = raw;
+            item->str_value_len = raw_len;
+        }
+    }
+
+    if (locked) {
+        ngx_http_lua_shdict_unlock(locked);
+    }
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_shdict_get_multi(lua_State *L)
+{
+    int                              i, n, anchor;
+    u_char                          *buf;
+    size_t                           len;
+    ngx_shm_zone_t                  *zone;
+    ngx_http_lua_ffi_shdict_item_t  *items, *item;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting 2 arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    n = lua_objlen(L, 2);
+
+    /* each item comes with a small inline buffer for short strings */
+
+    items = lua_newuserdata(L, n * (sizeof(ngx_http_lua_ffi_shdict_item_t)
+                                    + NGX_HTTP_LUA_SHDICT_MULTI_BUF));
+    buf = (u_char *) &items[n];
+
+    anchor = 0;
+
+    for (i = 0; i < n; i++) {
+        item = &items[i];
+
+        lua_rawgeti(L, 2, i + 1);
+
+        switch (lua_type(L, -1)) {
+
+        case LUA_TSTRING:
+
+            /* the key string stays referenced by the keys table */
+
+            item->key.data = (u_char *) lua_tolstring(L, -1, &len);
+            lua_pop(L, 1);
+            break;
+
+        case LUA_TNUMBER:
+
+            /* converted as by the other methods, into a table of our own */
+
+            if (anchor == 0) {
+                lua_createtable(L, n, 0);
+                lua_insert(L, -2);
+                anchor = lua_gettop(L) - 1;
+            }
+
+            item->key.data = (u_char *) lua_tolstring(L, -1, &len);
+            lua_rawseti(L, anchor, i + 1);
+            break;
+
+        default:
+            lua_pushnil(L);
+            lua_pushliteral(L, "bad key type");
+            return 2;
+        }
+
+        if (len == 0) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "empty key");
+            return 2;
+        }
+
+        if (len > 65535) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "key too long");
+            return 2;
+        }
+
+        item->key.len = (int) len;
+        item->value_type = LUA_TNIL;
+        item->str_value_buf = buf + i * NGX_HTTP_LUA_SHDICT_MULTI_BUF;
+        item->str_value_len = NGX_HTTP_LUA_SHDICT_MULTI_BUF;
+    }
+
+    (void) ngx_http_lua_ffi_shdict_get_multi(zone, items, n);
+
+    lua_createtable(L, 0, n);
+
+    for (i = 0; i < n; i++) {
+        item = &items[i];
+
+        if (item->rc != NGX_OK) {
+            continue;
+        }
+
+        switch (item->value_type) {
+
+        case SHDICT_TSTRING:
+            lua_rawgeti(L, 2, i + 1);
+            lua_pushlstring(L, (char *) item->str_value_buf,
+                            item->str_value_len);
+            lua_rawset(L, -3);
+            break;
+
+        case SHDICT_TNUMBER:
+            lua_rawgeti(L, 2, i + 1);
+            lua_pushnumber(L, item->num_value);
+            lua_rawset(L, -3);
+            break;
+
+        case SHDICT_TBOOLEAN:
+            lua_rawgeti(L, 2, i + 1);
+            lua_pushboolean(L, *item->str_value_buf);
+            lua_rawset(L, -3);
+            break;
+
+        default:
+            /* LUA_TNIL */
+            break;
+        }
+    }
+
+    /* the values that did not fit into the inline buffers were allocated */
+
+    for (i = 0; i < n; i++) {
+        item = &items[i];
+
+        if (item->value_type == SHDICT_TSTRING
+            && item->str_value_buf != NULL
+            && item->str_value_buf != buf + i * NGX_HTTP_LUA_SHDICT_MULTI_BUF)
+        {
+            ngx_free(item->str_value_buf);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        item = &items[i];
+
+        if (item->rc != NGX_OK) {
+            lua_pushnil(L);
+
+            if (item->err) {
+                lua_pushstring(L, item->err);
+
+            } else {
+                lua_pushliteral(L, "failed to get the key");
+            }
+
+            return 2;
+        }
+    }
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_set_multi(lua_State *L)
+{
+    int                              i, n, forcible, anchor;
+    long                             exptime;
+    size_t                           len;
+    lua_Number                       num;
+    ngx_shm_zone_t                  *zone;
+    ngx_http_lua_ffi_shdict_item_t  *items, *item;
+
+    n = lua_gettop(L);
+
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments, "
+                          "but seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    exptime = 0;
+
+    if (n == 3) {
+        num = luaL_checknumber(L, 3);
+        if (num < 0) {
+            return luaL_error(L, "bad \"exptime\" argument");
+        }
+
+        exptime = (long) (num * 1000);
+    }
+
+    n = 0;
+    anchor = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        n++;
+
+        if (lua_type(L, -2) == LUA_TNUMBER) {
+            anchor = 1;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    items = lua_newuserdata(L, n * sizeof(ngx_http_lua_ffi_shdict_item_t));
+
+    if (anchor) {
+        /* the strings of the number keys, converted as by the other methods */
+        lua_createtable(L, n, 0);
+        anchor = lua_gettop(L);
+    }
+
+    i = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, 2) != 0) {
+        /* stack: key value */
+
+        item = &items[i++];
+
+        switch (lua_type(L, -2)) {
+
+        case LUA_TSTRING:
+            item->key.data = (u_char *) lua_tolstring(L, -2, &len);
+            break;
+
+        case LUA_TNUMBER:
+
+            /* converting the key itself would break lua_next() */
+
+            lua_pushvalue(L, -2);
+            item->key.data = (u_char *) lua_tolstring(L, -1, &len);
+            lua_rawseti(L, anchor, i);
+            break;
+
+        default:
+            lua_pushnil(L);
+            lua_pushliteral(L, "bad key type");
+            return 2;
+        }
+
+        if (len == 0) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "empty key");
+            return 2;
+        }
+
+        if (len > 65535) {
+            lua_pushnil(L);
+            lua_pushliteral(L, "key too long");
+            return 2;
+        }
+
+        item->key.len = (int) len;
+        item->value_type = lua_type(L, -1);
+        item->user_flags = 0;
+        item->forcible = 0;
+
+        switch (item->value_type) {
+
+        case SHDICT_TSTRING:
+            item->str_value_buf = (u_char *) lua_tolstring(L, -1, &len);
+            item->str_value_len = len;
+            break;
+
+        case SHDICT_TNUMBER:
+            item->num_value = lua_tonumber(L, -1);
+            break;
+
+        case SHDICT_TBOOLEAN:
+            item->num_value = lua_toboolean(L, -1);
+            break;
+
+        default:
+            lua_pushnil(L);
+            lua_pushliteral(L, "bad value type");
+            return 2;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    (void) ngx_http_lua_ffi_shdict_set_multi(zone, 0, items, n, exptime);
+
+    forcible = 0;
+
+    for (i = 0; i < n; i++) {
+        item = &items[i];
+
+        forcible |= item->forcible;
+
+        if (item->rc != NGX_OK) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, item->err);
+            lua_pushboolean(L, forcible);
+            return 3;
+        }
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+
+static int
+ngx_http_lua_shdict_stats(lua_State *L)
+{
+    int                               n;
+    ngx_shm_zone_t                   *zone;
+    ngx_http_lua_ffi_shdict_stats_t   stats;
+
+    n = lua_gettop(L);
+
+    if (n != 1) {
+        return luaL_error(L, "expecting exactly one argument, "
+                          "but seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    (void) ngx_http_lua_ffi_shdict_stats(zone, &stats);
+
+    lua_createtable(L, 0 /* narr */, 15 /* nrec */);
+
+    lua_pushnumber(L, (lua_Number) stats.gets);
+    lua_setfield(L, -2, "gets");
+
+    lua_pushnumber(L, (lua_Number) stats.hits);
+    lua_setfield(L, -2, "hits");
+
+    lua_pushnumber(L, (lua_Number) stats.misses);
+    lua_setfield(L, -2, "misses");
+
+    lua_pushnumber(L, (lua_Number) stats.sets);
+    lua_setfield(L, -2, "sets");
+
+    lua_pushnumber(L, (lua_Number) stats.evictions);
+    lua_setfield(L, -2, "evictions");
+
+    lua_pushnumber(L, (lua_Number) stats.expired);
+    lua_setfield(L, -2, "expired");
+
+    lua_pushnumber(L, (lua_Number) stats.alloc_failures);
+    lua_setfield(L, -2, "alloc_failures");
+
+    lua_pushnumber(L, (lua_Number) stats.lock_waits);
+    lua_setfield(L, -2, "lock_waits");
+
+    lua_pushnumber(L, (lua_Number) stats.bytes_used);
+    lua_setfield(L, -2, "bytes_used");
+
+    lua_pushnumber(L, (lua_Number) stats.compressed);
+    lua_setfield(L, -2, "compressed");
+
+    lua_pushnumber(L, (lua_Number) stats.compress_bytes_in);
+    lua_setfield(L, -2, "compress_bytes_in");
+
+    lua_pushnumber(L, (lua_Number) stats.compress_bytes_out);
+    lua_setfield(L, -2, "compress_bytes_out");
+
+    lua_pushnumber(L, (lua_Number) stats.compress_usec);
+    lua_setfield(L, -2, "compress_usec");
+
+    lua_pushnumber(L, (lua_Number) stats.decompressed);
+    lua_setfield(L, -2, "decompressed");
+
+    lua_pushnumber(L, (lua_Number) stats.decompress_usec);
+    lua_setfield(L, -2, "decompress_usec");
+
+    return 1;
+}
+
+#if (nginx_version >= 1011007)
+
+static ngx_inline ngx_uint_t
+ngx_http_lua_shdict_popcount(uintptr_t map)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; map; n++) {
+        map &= map - 1;
+    }
+
+    return n;
+}
+
+
+/*
+ * the chunk size of the slab page holding p, with the numbers of the used
+ * and of all the chunks of the page, or 0 for the allocations of whole pages
+ */
+
+static size_t
+ngx_http_lua_shdict_chunk_usage(ngx_slab_pool_t *pool, u_char *p,
+    ngx_uint_t *used, ngx_uint_t *total)
+{
+    size_t            size;
+    uintptr_t        *bitmap;
+    ngx_uint_t        i, n, busy, nmaps;
+    ngx_slab_page_t  *page;
+
+    n = (p - pool->start) >> ngx_pagesize_shift;
+    page = &pool->pages[n];
+
+    switch (page->prev & NGX_HTTP_LUA_SHDICT_SLAB_PAGE_MASK) {
+
+    case NGX_HTTP_LUA_SHDICT_SLAB_SMALL:
+
+        size = (size_t) 1 << (page->slab & NGX_HTTP_LUA_SHDICT_SLAB_SHIFT_MASK);
+
+        /* the bitmap is at the start of the page, in chunks marked busy */
+
+        bitmap = (uintptr_t *) (pool->start + (n << ngx_pagesize_shift));
+        nmaps = (ngx_pagesize / size) / (8 * sizeof(uintptr_t));
+
+        busy = (ngx_pagesize / size) / (size * 8);
+        if (busy == 0) {
+            busy = 1;
+        }
+
+        *used = 0;
+
+        for (i = 0; i < nmaps; i++) {
+            *used += ngx_http_lua_shdict_popcount(bitmap[i]);
+        }
+
+        *used -= busy;
+        *total = ngx_pagesize / size - busy;
+
+        return size;
+
+    case NGX_HTTP_LUA_SHDICT_SLAB_EXACT:
+
+        *used = ngx_http_lua_shdict_popcount(page->slab);
+        *total = 8 * sizeof(uintptr_t);
+
+        return ngx_pagesize / (8 * sizeof(uintptr_t));
+
+    case NGX_HTTP_LUA_SHDICT_SLAB_BIG:
+
+        size = (size_t) 1 << (page->slab & NGX_HTTP_LUA_SHDICT_SLAB_SHIFT_MASK);
+
+        *used = ngx_http_lua_shdict_popcount(page->slab
+                                         >> NGX_HTTP_LUA_SHDICT_SLAB_MAP_SHIFT);
+        *total = ngx_pagesize / size;
+
+        return size;
+
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * moves the node, along with its link in the wheel, to a chunk of a page
+ * of the same size class that is at least as full as its current page, so
+ * that the sparse pages drain and go back to the free pages of the pool
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_relocate(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    size_t                       size;
+    u_char                      *block, *nblock;
+    uint32_t                     offset;
+    ngx_uint_t                   i, mask, used, total, nused, ntotal;
+    ngx_queue_t                 *q, *nq;
+    ngx_rbtree_t                *tree;
+    ngx_rbtree_node_t           *nnode;
+    ngx_http_lua_shdict_node_t  *sd, *nsd;
+    ngx_http_lua_shdict_slot_t  *slots;
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    if (sd->value_type == SHDICT_TZSET) {
+        /* the leaves of the members point to the sentinels in the node */
+        return NGX_DECLINED;
+    }
+
+    block = ctx->sh->wheel ? (u_char *) ngx_http_lua_shdict_node_timer(node)
+                           : (u_char *) node;
+
+    size = ngx_http_lua_shdict_chunk_usage(ctx->shpool, block, &used, &total);
+
+    if (size == 0 || used == total) {
+        return NGX_DECLINED;
+    }
+
+    nblock = ngx_slab_alloc_locked(ctx->shpool, size);
+    if (nblock == NULL) {
+        return NGX_DECLINED;
+    }
+
+    (void) ngx_http_lua_shdict_chunk_usage(ctx->shpool, nblock, &nused,
+                                           &ntotal);
+
+    if (((nblock - ctx->shpool->start) >> ngx_pagesize_shift)
+        == ((block - ctx->shpool->start) >> ngx_pagesize_shift)
+        || nused - 1 < used)
+    {
+        ngx_slab_free_locked(ctx->shpool, nblock);
+        return NGX_DECLINED;
+    }
+
+    ngx_memcpy(nblock, block, size);
+
+    if (ctx->sh->wheel) {
+        q = (ngx_queue_t *) block;
+        nq = (ngx_queue_t *) nblock;
+
+        if (q->next) {
+            nq->prev->next = nq;
+            nq->next->prev = nq;
+        }
+
+        nnode = ngx_http_lua_shdict_timer_node(nq);
+
+    } else {
+        nnode = (ngx_rbtree_node_t *) nblock;
+    }
+
+    nsd = (ngx_http_lua_shdict_node_t *) &nnode->color;
+
+    nsd->queue.prev->next = &nsd->queue;
+    nsd->queue.next->prev = &nsd->queue;
+
+    if (sd->value_type == SHDICT_TLIST || sd->value_type == SHDICT_THASH) {
+        q = ngx_http_lua_shdict_get_list_head(sd, sd->key_len);
+        nq = ngx_http_lua_shdict_get_list_head(nsd, nsd->key_len);
+
+        if (ngx_queue_empty(q)) {
+            ngx_queue_init(nq);
+
+        } else {
+            nq->prev->next = nq;
+            nq->next->prev = nq;
+        }
+    }
+
+    if (ctx->sh->slots) {
+        slots = ctx->sh->slots;
+        mask = ctx->sh->mask;
+        offset = ngx_http_lua_shdict_node_slot(ctx, node);
+
+        for (i = node->key & mask; slots[i].node != offset;
+             i = (i + 1) & mask)
+        {
+            /* void */
+        }
+
+        slots[i].node = ngx_http_lua_shdict_node_slot(ctx, nnode);
+
+    } else {
+        tree = &ctx->sh->rbtree;
+
+        if (node == tree->root) {
+            tree->root = nnode;
+
+        } else if (node == node->parent->left) {
+            node->parent->left = nnode;
+
+        } else {
+            node->parent->right = nnode;
+        }
+
+        if (nnode->left != tree->sentinel) {
+            nnode->left->parent = nnode;
+        }
+
+        if (nnode->right != tree->sentinel) {
+            nnode->right->parent = nnode;
+        }
+    }
+
+    /* the l1 caches still pointing to the old node miss from now on */
+
+    sd->version = 0;
+
+    ngx_slab_free_locked(ctx->shpool, block);
+
+    return NGX_OK;
+}
+
+
+/*
+ * relocates the nodes of up to count keys of the shard, in the order of
+ * the index, starting where the previous call stopped
+ */
+
+static ngx_uint_t
+ngx_http_lua_shdict_compact_shard(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_uint_t count)
+{
+    ngx_uint_t                   i, n, mask, moved, cursor;
+    ngx_rbtree_node_t           *node, *next, *temp, *sentinel;
+    ngx_http_lua_shdict_slot_t  *slots;
+
+    moved = 0;
+    cursor = ctx->sh->compact_cursor;
+
+    if (ctx->sh->slots) {
+        slots = ctx->sh->slots;
+        mask = ctx->sh->mask;
+
+        for (n = 0; n < count && n <= mask; n++) {
+            i = cursor++ & mask;
+
+            if (slots[i].node == 0) {
+                continue;
+            }
+
+            node = ngx_http_lua_shdict_slot_node(ctx, &slots[i]);
+
+            if (ngx_http_lua_shdict_relocate(ctx, node) == NGX_OK) {
+                moved++;
+            }
+        }
+
+        ctx->sh->compact_cursor = cursor & mask;
+
+        return moved;
+    }
+
+    node = NULL;
+    temp = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    /* the leftmost node with a hash value not below the cursor */
+
+    while (temp != sentinel) {
+        if (temp->key >= cursor) {
+            node = temp;
+            temp = temp->left;
+
+        } else {
+            temp = temp->right;
+        }
+    }
+
+    for (n = 0; node && n < count; n++) {
+
+        /* the relocation keeps the shape of the tree */
+
+        next = ngx_http_lua_shdict_rbtree_next(&ctx->sh->rbtree, node);
+
+        if (ngx_http_lua_shdict_relocate(ctx, node) == NGX_OK) {
+            moved++;
+        }
+
+        node = next;
+    }
+
+    ctx->sh->compact_cursor = node ? node->key : 0;
+
+    return moved;
+}
+
+
+static int
+ngx_http_lua_shdict_fragmentation(lua_State *L)
+{
+    int                          n, nclasses;
+    ngx_uint_t                   i, k, shift, busy, pages, per_page;
+    ngx_uint_t                   used[8 * sizeof(uintptr_t)];
+    ngx_uint_t                   total[8 * sizeof(uintptr_t)];
+    ngx_uint_t                   npages, nfree, nslots;
+    ngx_shm_zone_t              *zone;
+    ngx_slab_pool_t             *shpool;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+
+    n = lua_gettop(L);
+
+    if (n != 1) {
+        return luaL_error(L, "expecting exactly one argument, "
+                          "but seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    ctx = zone->data;
+
+    /* all the shards have the same pages and size classes */
+
+    nslots = ngx_pagesize_shift - ctx->shards[0].shpool->min_shift;
+
+    ngx_memzero(used, sizeof(used));
+    ngx_memzero(total, sizeof(total));
+
+    npages = 0;
+    nfree = 0;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shpool = ctx->shards[i].shpool;
+
+        ngx_http_lua_shdict_lock(&ctx->shards[i]);
+
+        npages += (shpool->end - shpool->start) >> ngx_pagesize_shift;
+        nfree += shpool->pfree;
+
+        for (k = 0; k < nslots; k++) {
+            used[k] += shpool->stats[k].used;
+            total[k] += shpool->stats[k].total;
+        }
+
+        ngx_http_lua_shdict_unlock(&ctx->shards[i]);
+    }
+
+    lua_createtable(L, 0 /* narr */, 3 /* nrec */);
+
+    lua_pushinteger(L, (lua_Integer) npages);
+    lua_setfield(L, -2, "pages");
+
+    lua_pushinteger(L, (lua_Integer) nfree);
+    lua_setfield(L, -2, "free_pages");
+
+    lua_createtable(L, (int) nslots, 0);
+
+    nclasses = 0;
+
+    for (k = 0; k < nslots; k++) {
+        if (total[k] == 0) {
+            continue;
+        }
+
+        shift = k + ctx->shards[0].shpool->min_shift;
+
+        per_page = ngx_pagesize >> shift;
+
+        if (per_page > 8 * sizeof(uintptr_t)) {
+            /* the bitmap of the page takes some of its chunks */
+
+            busy = per_page / (((ngx_uint_t) 1 << shift) * 8);
+            per_page -= busy ? busy : 1;
+        }
+
+        pages = total[k] / per_page;
+
+        lua_createtable(L, 0 /* narr */, 4 /* nrec */);
+
+        lua_pushinteger(L, (lua_Integer) 1 << shift);
+        lua_setfield(L, -2, "size");
+
+        lua_pushinteger(L, (lua_Integer) pages);
+        lua_setfield(L, -2, "pages");
+
+        lua_pushinteger(L, (lua_Integer) used[k]);
+        lua_setfield(L, -2, "used");
+
+        lua_pushinteger(L, (lua_Integer) (total[k] - used[k]));
+        lua_setfield(L, -2, "free");
+
+        lua_rawseti(L, -2, ++nclasses);
+    }
+
+    lua_setfield(L, -2, "classes");
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_compact(lua_State *L)
+{
+    int                          n, count;
+    ngx_int_t                    freed;
+    ngx_uint_t                   i, moved, pfree;
+    ngx_shm_zone_t              *zone;
+    ngx_http_lua_shdict_ctx_t   *ctx, *shard;
+
+    n = lua_gettop(L);
+
+    if (n != 1 && n != 2) {
+        return luaL_error(L, "expecting 1 or 2 arguments, "
+                          "but saw %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    count = NGX_HTTP_LUA_SHDICT_COMPACT_COUNT;
+
+    if (n == 2) {
+        count = luaL_checkint(L, 2);
+
+        if (count <= 0) {
+            return luaL_error(L, "bad \"count\" argument");
+        }
+    }
+
+    ctx = zone->data;
+
+    moved = 0;
+    freed = 0;
+
+    /* a shard at a time, so that the lock is held for count keys at most */
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+
+        ngx_http_lua_shdict_lock(shard);
+
+        pfree = shard->shpool->pfree;
+
+        moved += ngx_http_lua_shdict_compact_shard(shard, (ngx_uint_t) count);
+
+        freed += (ngx_int_t) shard->shpool->pfree - (ngx_int_t) pfree;
+
+        ngx_http_lua_shdict_unlock(shard);
+    }
+
+    lua_pushinteger(L, (lua_Integer) moved);
+    lua_pushinteger(L, (lua_Integer) freed);
+
+    return 2;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_lua_shdict_peek_lock_free(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash, u_char *kdata, size_t klen,
+    ngx_http_lua_shdict_node_t **sdp)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   depth;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    /*
+     * the tree may be modified under our feet, so every pointer is checked
+     * to stay inside the shard's pool before it is dereferenced and the
+     * walk is bounded; the caller validates the result with the sequence
+     */
+
+    if (ctx->sh->slots) {
+        return ngx_http_lua_shdict_hash_find(ctx, hash, kdata, klen, sdp, 1);
+    }
+
+    node = ctx->sh->rbtree.root;
+    sentinel = &ctx->sh->sentinel;
+
+    for (depth = 0; node != sentinel; depth++) {
+
+        if (depth == 128
+            || !ngx_http_lua_shdict_in_pool(ctx, node,
+                                            sizeof(ngx_rbtree_node_t)))
+        {
+            return NGX_ABORT;
+        }
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+        if (!ngx_http_lua_shdict_in_pool(ctx, sd->data, sd->key_len)) {
+            return NGX_ABORT;
+        }
+
+        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+
+        if (rc == 0) {
+            *sdp = sd;
+            return NGX_OK;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_get_lock_free(ngx_http_lua_shdict_ctx_t *ctx,
+    uint32_t hash, u_char *key, size_t key_len, int *value_type,
+    u_char **str_value_buf, size_t *str_value_len, double *num_value,
+    int *user_flags, int get_stale, int *is_stale)
+{
+    int                          type;
+    u_char                      *data, *buf, c;
+    size_t                       len;
+    double                       num;
+    uint32_t                     flags;
+    uint64_t                     now, expires;
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, expired;
+    ngx_time_t                  *tp;
+    ngx_atomic_uint_t            seq;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    num = 0;
+    c = 0;
+
+    tp = ngx_timeofday();
+
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
+
+    for (i = 0; i < NGX_HTTP_LUA_SHDICT_READ_TRIES; i++) {
+
+        seq = ctx->sh->seq;
+
+        if (seq & 1) {
+            /* a writer is in the middle of its update */
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        rc = ngx_http_lua_shdict_peek_lock_free(ctx, hash, key, key_len,
+                                                &sd);
+
+        if (rc == NGX_ABORT) {
+            continue;
+        }
+
+        if (rc == NGX_DECLINED) {
+            ngx_memory_barrier();
+
+            if (ctx->sh->seq != seq) {
+                continue;
+            }
+
+            ngx_http_lua_shdict_lock_free_done(ctx, hash, key, key_len, 0);
+
+            *value_type = LUA_TNIL;
+            return NGX_OK;
+        }
+
+        /* rc == NGX_OK, take a snapshot of the node */
+
+        type = sd->value_type;
+        len = (size_t) sd->value_len;
+        expires = sd->expires;
+        flags = sd->user_flags;
+        data = sd->data + key_len;
+
+        buf = NULL;
+
+        if (!ngx_http_lua_shdict_in_pool(ctx, data, len)) {
+            continue;
+        }
+
+        switch (type) {
+
+        case SHDICT_TSTRING:
+        case SHDICT_TCOMPRESSED:
+
+            if (len > *str_value_len || type == SHDICT_TCOMPRESSED) {
+                buf = ngx_alloc(len, ngx_cycle->log);
+                if (buf == NULL) {
+                    return NGX_ERROR;
+                }
+
+                ngx_memcpy(buf, data, len);
+
+            } else {
+                ngx_memcpy(*str_value_buf, data, len);
+            }
+
+            break;
+
+        case SHDICT_TNUMBER:
+
+            if (len != sizeof(double)) {
+                /* let the locked path report it if it is for real */
+                return NGX_AGAIN;
+            }
+
+            ngx_memcpy(&num, data, sizeof(double));
+            break;
+
+        case SHDICT_TBOOLEAN:
+
+            if (len != sizeof(u_char) || *str_value_len < sizeof(u_char)) {
+                return NGX_AGAIN;
+            }
+
+            c = *data;
+            break;
+
+        default:
+            /* lists and corrupted values are left to the locked path */
+            return NGX_AGAIN;
+        }
+
+        ngx_memory_barrier();
+
+        if (ctx->sh->seq != seq) {
+            if (buf) {
+                ngx_free(buf);
+            }
+
+            continue;
+        }
+
+        /* the snapshot is consistent */
+
+        expired = (expires != 0 && (int64_t) (expires - now) < 0);
+
+        ngx_http_lua_shdict_lock_free_done(ctx, hash, key, key_len, !expired);
+
+        if (expired && !get_stale) {
+            if (buf) {
+                ngx_free(buf);
+            }
+
+            *value_type = LUA_TNIL;
+            return NGX_OK;
+        }
+
+        *value_type = type;
+
+        switch (type) {
+
+        case SHDICT_TSTRING:
+        case SHDICT_TCOMPRESSED:
+            if (buf) {
+                *str_value_buf = buf;
+            }
+
+            *str_value_len = len;
+            break;
+
+        case SHDICT_TNUMBER:
+            *str_value_len = len;
+            *num_value = num;
+            break;
+
+        default: /* SHDICT_TBOOLEAN */
+            **str_value_buf = c;
+            break;
+        }
+
+        *user_flags = flags;
+
+        if (get_stale) {
+            *is_stale = expired;
+        }
+
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_lua_shdict_lock_free_done(ngx_http_lua_shdict_ctx_t *ctx,
+    uint32_t hash, u_char *key, size_t key_len, ngx_uint_t hit)
+{
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (hit) {
+        ctx->hits++;
+
+    } else {
+        ctx->misses++;
+    }
+
+    if ((++ctx->reads % NGX_HTTP_LUA_SHDICT_LRU_SAMPLE) != 0
+        || !ngx_shmtx_trylock(&ctx->shpool->mutex))
+    {
+        if (ctx->sh->sketch) {
+            ngx_http_lua_shdict_sketch_add(ctx->sh, hash, 0);
+        }
+
+        return;
+    }
+
+    /*
+     * only the LRU queue, the statistics and the sketch are touched here,
+     * none of which the lock-free readers rely on, so the sequence is left
+     * alone
+     */
+
+    if (hit) {
+        (void) ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+    } else if (ctx->sh->sketch) {
+        ngx_http_lua_shdict_sketch_add(ctx->sh, hash, 1);
+    }
+
+    ctx->sh->stats.gets += ctx->hits + ctx->misses;
+    ctx->sh->stats.hits += ctx->hits;
+    ctx->sh->stats.misses += ctx->misses;
+
+    ctx->hits = 0;
+    ctx->misses = 0;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+int
+ngx_http_lua_ffi_shdict_incr(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, double *value, char **err, int has_init, double init,
+    long init_ttl, int *forcible)
+{
+    int                          i, n;
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp = NULL;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+    double                       num;
+    ngx_rbtree_node_t           *node;
+    u_char                      *p;
+    ngx_queue_t                 *queue, *q;
+
+    if (init_ttl > 0) {
+        tp = ngx_timeofday();
+    }
+
+    *forcible = 0;
+
+    hash = ngx_crc32_short(key, key_len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    dd("looking up key %.*s in shared dict %.*s", (int) key_len, key,
+       (int) ctx->name.len, ctx->name.data);
+
+    ngx_http_lua_shdict_lock(ctx);
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+    dd("shdict lookup returned %d", (int) rc);
+
+    if (rc == NGX_DECLINED || rc == NGX_DONE) {
+        if (!has_init) {
+            ngx_http_lua_shdict_unlock(ctx);
+            *err = "not found";
+            return NGX_ERROR;
+        }
+
+        /* add value */
+        num = *value + init;
+
+        if (rc == NGX_DONE) {
+
+            /* found an expired item */
+
+            if ((size_t) sd->value_len == sizeof(double)
+                && sd->value_type != SHDICT_TLIST
+                && sd->value_type != SHDICT_THASH
+                && sd->value_type != SHDICT_TZSET
+                && sd->value_type != SHDICT_TCOUNTER)
+            {
+                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                               "lua shared dict incr: found old entry and "
+                               "value size matched, reusing it");
+
+                ngx_queue_remove(&sd->queue);
+                ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+                dd("go to setvalue");
+                goto setvalue;
+            }
+
+            dd("go to remove");
+            goto remove;
+        }
+
+        dd("go to insert");
+        goto insert;
+    }
+
+    /* rc == NGX_OK */
+
+    if (sd->value_type != SHDICT_TNUMBER || sd->value_len != sizeof(double)) {
+        ngx_http_lua_shdict_unlock(ctx);
+        *err = "not a number";
+        return NGX_ERROR;
+    }
+
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+    dd("setting value type to %d", (int) sd->value_type);
+
+    p = sd->data + key_len;
+
+    ngx_memcpy(&num, p, sizeof(double));
+    num += *value;
+
+    ngx_memcpy(p, (double *) &num, sizeof(double));
+
+    ngx_http_lua_shdict_new_version(ctx, sd);
+
+    ngx_http_lua_shdict_notify(ctx, key, key_len);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    *value = num;
+    return NGX_OK;
+
+remove:
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "lua shared dict set: creating a new entry");
+                   "lua shared dict incr: found old entry but value size "
+                   "NOT matched, removing it first");
+
+    if (sd->value_type == SHDICT_TLIST) {
+        queue = ngx_http_lua_shdict_get_list_head(sd, key_len);
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            p = (u_char *) ngx_queue_data(q, ngx_http_lua_shdict_list_node_t,
+                                          queue);
+
+            ngx_slab_free_locked(ctx->shpool, p);
+        }
+    }
+
+    ngx_queue_remove(&sd->queue);
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    ngx_http_lua_shdict_delete_node(ctx, node);
+
+    ngx_http_lua_shdict_free_node(ctx, node);
+
+insert:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "lua shared dict incr: creating a new entry");
+
+    n = offsetof(ngx_rbtree_node_t, color)
+        + offsetof(ngx_http_lua_shdict_node_t, data)
+        + key_len
+        + sizeof(double);
+
+    node = ngx_http_lua_shdict_alloc_node(ctx, n);
+
+    if (node == NULL) {
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict incr: overriding non-expired items "
+                       "due to memory shortage for entry \"%*s\"", key_len,
+                       key);
+
+        for (i = 0; i < 30; i++) {
+            if (ngx_http_lua_shdict_expire(ctx, 0) == 0) {
+                break;
+            }
+
+            *forcible = 1;
+
+            node = ngx_http_lua_shdict_alloc_node(ctx, n);
+            if (node != NULL) {
+                goto allocated;
+            }
+        }
+
+        ngx_http_lua_shdict_unlock(ctx);
+
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+allocated:
+
+    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+    node->key = hash;
+
+    sd->key_len = (u_short) key_len;
+
+    sd->value_len = (uint32_t) sizeof(double);
+
+    ngx_http_lua_shdict_insert_node(ctx, node);
+
+    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+
+setvalue:
+
+    sd->user_flags = 0;
+
+    if (init_ttl > 0) {
+        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
+                      + (uint64_t) init_ttl;
+
+    } else {
+        sd->expires = 0;
+    }
+
+    ngx_http_lua_shdict_wheel_update(ctx, sd);
+
+    dd("setting value type to %d", LUA_TNUMBER);
+
+    sd->value_type = (uint8_t) LUA_TNUMBER;
+
+    p = ngx_copy(sd->data, key, key_len);
+    ngx_memcpy(p, (double *) &num, sizeof(double));
+
+    ngx_http_lua_shdict_new_version(ctx, sd);
+
+    ngx_http_lua_shdict_notify(ctx, key, key_len);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    *value = num;
+    return NGX_OK;
+}
+
+
+int
+ngx_http_lua_ffi_shdict_incr_fast(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, int64_t value, char **err, int *forcible)
+{
+    int                                  evicted;
+    uint32_t                             hash;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, own;
+    ngx_http_lua_shdict_ctx_t           *ctx;
+    ngx_http_lua_shdict_node_t          *sd;
+    ngx_http_lua_shdict_counter_t       *cell;
+    ngx_http_lua_shdict_counter_ref_t    ref;
+    ngx_http_lua_shdict_counter_slot_t  *slot;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_atomic_uint_t                    seq;
+#endif
+
+    *forcible = 0;
+
+    hash = ngx_crc32_short(key, key_len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    /*
+     * an existing counter is found the way the lock-free reads do and the
+     * worker adds to its own slot without the lock; should the counter go
+     * away meanwhile, the increment lands in a stale slot of a cell that
+     * is still a cell
+     */
+
+    for (i = 0; i < NGX_HTTP_LUA_SHDICT_READ_TRIES; i++) {
+
+        seq = ctx->sh->seq;
+
+        if (seq & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        rc = ngx_http_lua_shdict_peek_lock_free(ctx, hash, key, key_len,
+                                                &sd);
+
+        if (rc == NGX_ABORT) {
+            continue;
+        }
+
+        if (rc == NGX_DECLINED
+            || sd->value_type != SHDICT_TCOUNTER
+            || sd->value_len != sizeof(ngx_http_lua_shdict_counter_ref_t)
+            || sd->expires != 0)
+        {
+            /* left to the locked path, whatever it is */
+            break;
+        }
+
+        if (!ngx_http_lua_shdict_in_pool(ctx, sd->data + key_len,
+                                         sizeof(ref)))
+        {
+            continue;
+        }
+
+        ngx_memcpy(&ref, sd->data + key_len, sizeof(ref));
+
+        ngx_memory_barrier();
+
+        if (ctx->sh->seq != seq) {
+            continue;
+        }
+
+        cell = ngx_http_lua_shdict_counter_cell(ctx, &ref);
+        own = ngx_http_lua_shdict_counter_own_slot(cell);
+        slot = ngx_http_lua_shdict_counter_slot(cell, own);
+
+        if (own == cell->nslots - 1 || slot->gen != ref.gen) {
+            /* the shared slot, or a slot to reset first */
+            break;
+        }
+
+        (void) ngx_atomic_fetch_add(&slot->value, (ngx_atomic_int_t) value);
+
+        /* keeps busy counters away from the LRU tail */
+
+        if ((++ctx->reads % NGX_HTTP_LUA_SHDICT_LRU_SAMPLE) == 0
+            && ngx_shmtx_trylock(&ctx->shpool->mutex))
+        {
+            (void) ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        }
+
+        return NGX_OK;
+    }
+
+#endif
+
+    ngx_http_lua_shdict_lock(ctx);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+    if (rc == NGX_OK && sd->value_type != SHDICT_TCOUNTER) {
+        ngx_http_lua_shdict_unlock(ctx);
+        *err = "not a counter";
+        return NGX_ERROR;
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                       "lua shared dict incr_fast: creating a new counter");
+
+        cell = ngx_http_lua_shdict_counter_alloc(ctx);
+
+        for (i = 0; cell == NULL && i < 30; i++) {
+            if (ngx_http_lua_shdict_expire(ctx, 0) == 0) {
+                break;
+            }
+
+            *forcible = 1;
+
+            cell = ngx_http_lua_shdict_counter_alloc(ctx);
+        }
+
+        if (cell == NULL) {
+            ngx_http_lua_shdict_unlock(ctx);
+            *err = "no memory";
+            return NGX_ERROR;
+        }
+
+        ref.cell = (uint32_t) (((u_char *) cell - (u_char *) ctx->shpool)
+                               >> 3);
+        ref.gen = cell->gen;
+
+        /* the node is stored as a string, expired items and all */
+
+        rc = ngx_http_lua_shdict_store_locked(ctx, 0, hash, key, key_len,
+                                              SHDICT_TSTRING, (u_char *) &ref,
+                                              sizeof(ref), 0, 0, 0, err,
+                                              &evicted);
+        if (rc != NGX_OK) {
+            cell->next = ctx->sh->counters;
+            ctx->sh->counters = cell;
+
+            ngx_http_lua_shdict_unlock(ctx);
+            return NGX_ERROR;
+        }
+
+        *forcible |= evicted;
+
+        (void) ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+        sd->value_type = SHDICT_TCOUNTER;
+    }
+
+    ngx_memcpy(&ref, sd->data + key_len, sizeof(ref));
+
+    cell = ngx_http_lua_shdict_counter_cell(ctx, &ref);
+    own = ngx_http_lua_shdict_counter_own_slot(cell);
+    slot = ngx_http_lua_shdict_counter_slot(cell, own);
+
+    if (slot->gen != ref.gen) {
+        /* left over by a former counter of the cell */
+        slot->value = 0;
+        ngx_memory_barrier();
+        slot->gen = ref.gen;
+    }
+
+    (void) ngx_atomic_fetch_add(&slot->value, (ngx_atomic_int_t) value);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    return NGX_OK;
+}
+
+
+int
+ngx_http_lua_ffi_shdict_get_sum(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, double *sum, char **err)
+{
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    hash = ngx_crc32_short(key, key_len);
+
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+#if 1
+    ngx_http_lua_shdict_expire(ctx, 1);
+#endif
+
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key, key_len, &sd);
+
+    if (rc != NGX_OK) {
+        ngx_http_lua_shdict_unlock(ctx);
+        return NGX_DECLINED;
+    }
+
+    if (sd->value_type != SHDICT_TCOUNTER) {
+        ngx_http_lua_shdict_unlock(ctx);
+        *err = "not a counter";
+        return NGX_ERROR;
+    }
+
+    *sum = ngx_http_lua_shdict_counter_sum(ctx, sd);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_shdict_incr_fast(lua_State *L)
+{
+    int                  n, forcible;
+    char                *err;
+    ngx_str_t            key;
+    lua_Number           value;
+    ngx_shm_zone_t      *zone;
+
+    n = lua_gettop(L);
+
+    if (n != 3) {
+        return luaL_error(L, "expecting 3 arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    value = luaL_checknumber(L, 3);
+
+    /* only integers, within the exact range of the doubles */
+
+    if (value < -9007199254740992.0 || value > 9007199254740992.0
+        || value != (lua_Number) (int64_t) value)
+    {
+        return luaL_error(L, "bad \"n\" argument");
+    }
+
+    if (ngx_http_lua_ffi_shdict_incr_fast(zone, key.data, key.len,
+                                          (int64_t) value, &err, &forcible)
+        != NGX_OK)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        lua_pushboolean(L, forcible);
+        return 3;
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnil(L);
+    lua_pushboolean(L, forcible);
+    return 3;
+}
+
+
+static int
+ngx_http_lua_shdict_get_sum(lua_State *L)
+{
+    int                  n;
+    char                *err;
+    double               sum;
+    ngx_int_t            rc;
+    ngx_str_t            key;
+    ngx_shm_zone_t      *zone;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting exactly two arguments, "
+                          "but only seen %d", n);
+    }
+
+    if (lua_type(L, 1) != LUA_TTABLE) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad \"zone\" argument");
+    }
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    rc = ngx_http_lua_ffi_shdict_get_sum(zone, key.data, key.len, &sum, &err);
+
+    if (rc == NGX_DECLINED) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (rc != NGX_OK) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_pushnumber(L, (lua_Number) sum);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_watch(lua_State *L)
+{
+    int                            n;
+    ngx_str_t                      prefix;
+    ngx_uint_t                     i;
+    ngx_shm_zone_t                *zone;
+    ngx_http_lua_shdict_ctx_t     *ctx;
+    ngx_http_lua_shdict_ring_t    *ring;
+    ngx_http_lua_shdict_watch_t   *w;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting exactly two arguments, "
+                          "but only seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    prefix.data = (u_char *) luaL_checklstring(L, 2, &prefix.len);
+
+    ctx = zone->data;
+
+    if (ctx->notify == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no events");
+        return 2;
+    }
+
+    if (prefix.len > NGX_HTTP_LUA_SHDICT_WATCH_LEN) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "prefix too long");
+        return 2;
+    }
+
+    ring = ctx->notify->ring;
+
+    ngx_shmtx_lock(&ring->mutex);
+
+    for (i = 0; i < ring->nwatches; i++) {
+        w = &ring->watches[i];
+
+        if (w->len == prefix.len
+            && ngx_memcmp(w->data, prefix.data, prefix.len) == 0)
+        {
+            ngx_shmtx_unlock(&ring->mutex);
+
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+    }
+
+    if (i == NGX_HTTP_LUA_SHDICT_WATCHES) {
+        ngx_shmtx_unlock(&ring->mutex);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "too many watches");
+        return 2;
+    }
+
+    w = &ring->watches[i];
+
+    w->len = (u_char) prefix.len;
+    ngx_memcpy(w->data, prefix.data, prefix.len);
+
+    /* the writers read nwatches without the mutex */
+
+    ngx_memory_barrier();
+
+    ring->nwatches = i + 1;
+
+    ngx_shmtx_unlock(&ring->mutex);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shdict_events(lua_State *L)
+{
+    int                         n;
+    lua_Number                  cursor;
+    ngx_shm_zone_t             *zone;
+    ngx_http_lua_shdict_ctx_t  *ctx;
+
+    n = lua_gettop(L);
+
+    if (n != 2) {
+        return luaL_error(L, "expecting exactly two arguments, "
+                          "but only seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    cursor = luaL_checknumber(L, 2);
+
+    if (cursor < 0 || cursor >= 9007199254740992.0 /* 2^53 */
+        || cursor != (lua_Number) (uint64_t) cursor)
+    {
+        return luaL_error(L, "bad \"cursor\" argument");
+    }
+
+    ctx = zone->data;
+
+    if (ctx->notify == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no events");
+        return 2;
+    }
+
+    ngx_http_lua_shdict_push_events(L, ctx->notify, (uint64_t) cursor);
+    return 2;
+}
+
+
+static int
+ngx_http_lua_shdict_wait_events(lua_State *L)
+{
+    int                            n;
+    uint64_t                       cur, next;
+    ngx_int_t                      delay;  /* in msec */
+    lua_Number                     cursor;
+    ngx_shm_zone_t                *zone;
+    ngx_http_request_t            *r;
+    ngx_http_lua_ctx_t            *ctx;
+    ngx_http_lua_co_ctx_t         *coctx;
+    ngx_http_lua_shdict_ring_t    *ring;
+    ngx_http_lua_shdict_notify_t  *notify;
+    ngx_http_lua_shdict_waiter_t  *waiter;
+
+    n = lua_gettop(L);
+
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments, "
+                          "but saw %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    cursor = luaL_checknumber(L, 2);
+
+    if (cursor < 0 || cursor >= 9007199254740992.0 /* 2^53 */
+        || cursor != (lua_Number) (uint64_t) cursor)
+    {
+        return luaL_error(L, "bad \"cursor\" argument");
+    }
+
+    delay = 0;
+
+    if (n == 3) {
+        delay = (ngx_int_t) (luaL_checknumber(L, 3) * 1000);
+
+        if (delay < 0) {
+            return luaL_error(L, "bad \"timeout\" argument");
+        }
+    }
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return luaL_error(L, "no request ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_YIELDABLE);
+
+    coctx = ctx->cur_co_ctx;
+    if (coctx == NULL) {
+        return luaL_error(L, "no co ctx found");
+    }
+
+    notify = ((ngx_http_lua_shdict_ctx_t *) zone->data)->notify;
+
+    if (notify == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no events");
+        return 2;
+    }
+
+    if (notify->conn == NULL) {
+        return luaL_error(L, "no events in this process");
+    }
+
+    ring = notify->ring;
+
+    /*
+     * armed before looking at the ring so that a writer appending right
+     * after the check still wakes this worker up
+     */
+
+    ring->armed[ngx_worker] = 1;
+
+    ngx_memory_barrier();
+
+    ngx_shmtx_lock(&ring->mutex);
+    next = ring->next;
+    ngx_shmtx_unlock(&ring->mutex);
+
+    cur = (uint64_t) cursor;
+
+    if (cur == 0 || cur > next) {
+        cur = next;
+    }
+
+    if (cur < next) {
+        ngx_http_lua_shdict_push_events(L, notify, cur);
+        return 2;
+    }
+
+    if (delay == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+
+    waiter = ngx_alloc(sizeof(ngx_http_lua_shdict_waiter_t), ngx_cycle->log);
+    if (waiter == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no memory");
+        return 2;
+    }
+
+    waiter->coctx = coctx;
+    waiter->notify = notify;
+    waiter->cursor = cur;
+    waiter->value.data = NULL;
+    waiter->timedout = 0;
+    waiter->pop = 0;
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_lua_shdict_notify_waiter_cleanup;
+    coctx->data = waiter;
+
+    coctx->sleep.handler = ngx_http_lua_shdict_notify_timeout;
+    coctx->sleep.data = coctx;
+    coctx->sleep.log = r->connection->log;
+
+    ngx_add_timer(&coctx->sleep, (ngx_msec_t) delay);
+
+    ngx_queue_insert_tail(&notify->waiters, &waiter->queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua shared dict waiting for events after %uL", cur);
+
+    return lua_yield(L, 0);
+}
+
+
+/*
+ * pops the head of the list of a key into an ngx_alloc()ed copy, returns
+ * NGX_DECLINED when the list is empty
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_lpop_copy(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash,
+    ngx_str_t *key, int *value_type, ngx_str_t *value, char **err)
+{
+    ngx_int_t                         rc;
+    ngx_queue_t                      *queue, *q;
+    ngx_rbtree_node_t                *node;
+    ngx_http_lua_shdict_node_t       *sd;
+    ngx_http_lua_shdict_list_node_t  *lnode;
 
-    n = offsetof(ngx_rbtree_node_t, color)
-        + offsetof(ngx_http_lua_shdict_node_t, data)
-        + key_len
-        + str_value_len;
+    ngx_http_lua_shdict_lock(ctx);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, n);
+    ngx_http_lua_shdict_expire(ctx, 1);
 
-    if (node == NULL) {
+    rc = ngx_http_lua_shdict_lookup(ctx, hash, key->data, key->len, &sd);
 
-        if (op & NGX_HTTP_LUA_SHDICT_SAFE_STORE) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+    if (rc != NGX_OK) {
+        ngx_http_lua_shdict_unlock(ctx);
+        return NGX_DECLINED;
+    }
 
-            *errmsg = "no memory";
-            return NGX_ERROR;
+    if (sd->value_type != SHDICT_TLIST) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        *err = "value not a list";
+        return NGX_ERROR;
+    }
+
+    queue = ngx_http_lua_shdict_get_list_head(sd, key->len);
+
+    if (ngx_queue_empty(queue)) {
+        ngx_http_lua_shdict_unlock(ctx);
+        return NGX_DECLINED;
+    }
+
+    q = ngx_queue_head(queue);
+    lnode = ngx_queue_data(q, ngx_http_lua_shdict_list_node_t, queue);
+
+    value->data = ngx_alloc(ngx_max(lnode->value_len, 1), ngx_cycle->log);
+    if (value->data == NULL) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        *err = "no memory";
+        return NGX_ERROR;
+    }
+
+    value->len = lnode->value_len;
+    ngx_memcpy(value->data, lnode->data, value->len);
+
+    *value_type = lnode->value_type;
+
+    ngx_queue_remove(q);
+
+    ngx_slab_free_locked(ctx->shpool, lnode);
+
+    if (sd->value_len == 1) {
+        ngx_queue_remove(&sd->queue);
+
+        node = (ngx_rbtree_node_t *)
+                    ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_http_lua_shdict_delete_node(ctx, node);
+
+        ngx_http_lua_shdict_free_node(ctx, node);
+
+    } else {
+        sd->value_len = sd->value_len - 1;
+
+        ngx_queue_remove(&sd->queue);
+        ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    }
+
+    ngx_http_lua_shdict_notify(ctx, key->data, key->len);
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_shdict_push_popped(lua_State *L, int value_type,
+    ngx_str_t *value)
+{
+    double  num;
+
+    if (value_type == SHDICT_TNUMBER && value->len == sizeof(double)) {
+        ngx_memcpy(&num, value->data, sizeof(double));
+        lua_pushnumber(L, (lua_Number) num);
+        return;
+    }
+
+    lua_pushlstring(L, (char *) value->data, value->len);
+}
+
+
+static int
+ngx_http_lua_shdict_blpop(lua_State *L)
+{
+    int                            n, value_type;
+    char                          *err;
+    uint32_t                       hash;
+    uint64_t                       pushes;
+    ngx_int_t                      rc;
+    ngx_int_t                      delay;  /* in msec */
+    ngx_str_t                      key, value;
+    ngx_shm_zone_t                *zone;
+    ngx_http_request_t            *r;
+    ngx_http_lua_ctx_t            *ctx;
+    ngx_http_lua_co_ctx_t         *coctx;
+    ngx_http_lua_shdict_ctx_t     *shard;
+    ngx_http_lua_shdict_ring_t    *ring;
+    ngx_http_lua_shdict_notify_t  *notify;
+    ngx_http_lua_shdict_waiter_t  *waiter;
+
+    n = lua_gettop(L);
+
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments, "
+                          "but saw %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    zone = ngx_http_lua_shdict_get_zone(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    delay = 0;
+
+    if (n == 3) {
+        delay = (ngx_int_t) (luaL_checknumber(L, 3) * 1000);
+
+        if (delay < 0) {
+            return luaL_error(L, "bad \"timeout\" argument");
         }
+    }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                       "lua shared dict set: overriding non-expired items "
-                       "due to memory shortage for entry \"%*s\"", key_len,
-                       key);
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "nil key");
+        return 2;
+    }
+
+    key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
+
+    if (key.len == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "empty key");
+        return 2;
+    }
+
+    if (key.len > 65535) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "key too long");
+        return 2;
+    }
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return luaL_error(L, "no request ctx found");
+    }
+
+    ngx_http_lua_check_context(L, ctx, NGX_HTTP_LUA_CONTEXT_YIELDABLE);
+
+    coctx = ctx->cur_co_ctx;
+    if (coctx == NULL) {
+        return luaL_error(L, "no co ctx found");
+    }
+
+    notify = ((ngx_http_lua_shdict_ctx_t *) zone->data)->notify;
+
+    if (notify == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no events");
+        return 2;
+    }
+
+    if (notify->conn == NULL) {
+        return luaL_error(L, "no events in this process");
+    }
+
+    ring = notify->ring;
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    shard = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    /*
+     * armed and the pushes counted before looking at the list so that a
+     * push right after the check still wakes this worker up
+     */
+
+    ring->armed[ngx_worker] = 1;
+
+    ngx_memory_barrier();
+
+    pushes = ring->pushes;
+
+    err = NULL;
+
+    rc = ngx_http_lua_shdict_lpop_copy(shard, hash, &key, &value_type, &value,
+                                       &err);
+
+    if (rc == NGX_OK) {
+        ngx_http_lua_shdict_push_popped(L, value_type, &value);
+        ngx_free(value.data);
+        return 1;
+    }
+
+    if (rc == NGX_ERROR) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    if (delay == 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+
+    waiter = ngx_alloc(sizeof(ngx_http_lua_shdict_waiter_t) + key.len,
+                       ngx_cycle->log);
+    if (waiter == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no memory");
+        return 2;
+    }
+
+    waiter->coctx = coctx;
+    waiter->notify = notify;
+    waiter->cursor = pushes;
+    waiter->shard = shard;
+    waiter->hash = hash;
+    waiter->key.data = (u_char *) &waiter[1];
+    waiter->key.len = key.len;
+    waiter->value.data = NULL;
+    waiter->err = NULL;
+    waiter->timedout = 0;
+    waiter->pop = 1;
+
+    ngx_memcpy(waiter->key.data, key.data, key.len);
+
+    ngx_http_lua_cleanup_pending_operation(coctx);
+    coctx->cleanup = ngx_http_lua_shdict_notify_waiter_cleanup;
+    coctx->data = waiter;
+
+    coctx->sleep.handler = ngx_http_lua_shdict_notify_timeout;
+    coctx->sleep.data = coctx;
+    coctx->sleep.log = r->connection->log;
+
+    ngx_add_timer(&coctx->sleep, (ngx_msec_t) delay);
+
+    ngx_queue_insert_tail(&notify->waiters, &waiter->queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua shared dict waiting for a push to \"%V\"", &key);
+
+    return lua_yield(L, 0);
+}
+
+
+int
+ngx_http_lua_ffi_shdict_flush_all(ngx_shm_zone_t *zone)
+{
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q;
+    ngx_http_lua_shdict_node_t  *sd;
+    ngx_http_lua_shdict_ctx_t   *ctx, *shard;
+
+    ctx = zone->data;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+
+        ngx_http_lua_shdict_lock(shard);
+
+        for (q = ngx_queue_head(&shard->sh->lru_queue);
+             q != ngx_queue_sentinel(&shard->sh->lru_queue);
+             q = ngx_queue_next(q))
+        {
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+            sd->expires = 1;
+
+            ngx_http_lua_shdict_wheel_update(shard, sd);
+        }
+
+        ngx_http_lua_shdict_expire(shard, 0);
+
+        if (i == ctx->nshards - 1) {
+            ngx_http_lua_shdict_notify(shard, NULL, 0);
+        }
+
+        ngx_http_lua_shdict_unlock(shard);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_peek(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t hash,
+    u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    if (ctx->sh->slots) {
+        if (ngx_http_lua_shdict_hash_find(ctx, hash, kdata, klen, sdp, 0)
+            != NGX_OK)
+        {
+            *sdp = NULL;
+            return NGX_DECLINED;
+        }
+
+        return NGX_OK;
+    }
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+
+        if (rc == 0) {
+            *sdp = sd;
+
+            return NGX_OK;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+}
+
+
+long
+ngx_http_lua_ffi_shdict_get_ttl(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len)
+{
+    uint32_t                     hash;
+    uint64_t                     now;
+    uint64_t                     expires;
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    hash = ngx_crc32_short(key, key_len);
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
+
+    ngx_http_lua_shdict_lock(ctx);
+
+    rc = ngx_http_lua_shdict_peek(ctx, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        return NGX_DECLINED;
+    }
+
+    /* rc == NGX_OK */
+
+    expires = sd->expires;
+
+    ngx_http_lua_shdict_unlock(ctx);
+
+    if (expires == 0) {
+        return 0;
+    }
 
-        for (i = 0; i < 30; i++) {
-            if (ngx_http_lua_shdict_expire(ctx, 0) == 0) {
-                break;
-            }
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
 
-            *forcible = 1;
+    return expires - now;
+}
 
-            node = ngx_slab_alloc_locked(ctx->shpool, n);
-            if (node != NULL) {
-                goto allocated;
-            }
-        }
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+int
+ngx_http_lua_ffi_shdict_set_expire(ngx_shm_zone_t *zone, u_char *key,
+    size_t key_len, long exptime)
+{
+    uint32_t                     hash;
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp = NULL;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
 
-        *errmsg = "no memory";
-        return NGX_ERROR;
+    if (exptime > 0) {
+        tp = ngx_timeofday();
     }
 
-allocated:
+    hash = ngx_crc32_short(key, key_len);
+    ctx = ngx_http_lua_shdict_get_shard(zone->data, hash);
 
-    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+    ngx_http_lua_shdict_lock(ctx);
 
-    node->key = hash;
-    sd->key_len = (u_short) key_len;
+    rc = ngx_http_lua_shdict_peek(ctx, hash, key, key_len, &sd);
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_lua_shdict_unlock(ctx);
+
+        return NGX_DECLINED;
+    }
+
+    /* rc == NGX_OK */
 
     if (exptime > 0) {
-        tp = ngx_timeofday();
         sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
                       + (uint64_t) exptime;
 
@@ -1553,548 +9504,755 @@ allocated:
         sd->expires = 0;
     }
 
-    sd->user_flags = user_flags;
-    sd->value_len = (uint32_t) str_value_len;
-    dd("setting value type to %d", value_type);
-    sd->value_type = (uint8_t) value_type;
-
-    p = ngx_copy(sd->data, key, key_len);
-    ngx_memcpy(p, str_value_buf, str_value_len);
+    ngx_http_lua_shdict_wheel_update(ctx, sd);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_http_lua_shdict_unlock(ctx);
 
     return NGX_OK;
 }
 
 
-int
-ngx_http_lua_ffi_shdict_get(ngx_shm_zone_t *zone, u_char *key,
-    size_t key_len, int *value_type, u_char **str_value_buf,
-    size_t *str_value_len, double *num_value, int *user_flags,
-    int get_stale, int *is_stale, char **err)
+size_t
+ngx_http_lua_ffi_shdict_capacity(ngx_shm_zone_t *zone)
 {
-    ngx_str_t                    name;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-    ngx_str_t                    value;
+    return zone->shm.size;
+}
 
-    *err = NULL;
+
+#if (nginx_version >= 1011007)
+size_t
+ngx_http_lua_ffi_shdict_free_space(ngx_shm_zone_t *zone)
+{
+    size_t                       bytes;
+    ngx_uint_t                   i;
+    ngx_http_lua_shdict_ctx_t   *ctx;
 
     ctx = zone->data;
-    name = ctx->name;
+    bytes = 0;
 
-    hash = ngx_crc32_short(key, key_len);
+    for (i = 0; i < ctx->nshards; i++) {
+        ngx_http_lua_shdict_lock(&ctx->shards[i]);
+        bytes += ctx->shards[i].shpool->pfree * ngx_pagesize;
+        ngx_http_lua_shdict_unlock(&ctx->shards[i]);
+    }
 
-#if (NGX_DEBUG)
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "fetching key \"%*s\" in shared dict \"%V\"", key_len,
-                   key, &name);
-#endif /* NGX_DEBUG */
+    return bytes;
+}
+#endif
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
 
-#if 1
-    if (!get_stale) {
-        ngx_http_lua_shdict_expire(ctx, 1);
-    }
+int
+ngx_http_lua_ffi_shdict_stats(ngx_shm_zone_t *zone,
+    ngx_http_lua_ffi_shdict_stats_t *stats)
+{
+    ngx_uint_t                    i;
+    ngx_http_lua_shdict_ctx_t    *ctx, *shard;
+    ngx_http_lua_shdict_stats_t  *st;
+#if (nginx_version >= 1011007)
+    ngx_slab_pool_t              *shpool;
 #endif
 
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+    ctx = zone->data;
 
-    dd("shdict lookup returns %d", (int) rc);
+    ngx_memzero(stats, sizeof(ngx_http_lua_ffi_shdict_stats_t));
 
-    if (rc == NGX_DECLINED || (rc == NGX_DONE && !get_stale)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        *value_type = LUA_TNIL;
-        return NGX_OK;
-    }
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+        st = &shard->sh->stats;
 
-    /* rc == NGX_OK || (rc == NGX_DONE && get_stale) */
+        ngx_http_lua_shdict_lock(shard);
 
-    *value_type = sd->value_type;
+        /* the lock-free reads of this process not flushed yet */
 
-    dd("data: %p", sd->data);
-    dd("key len: %d", (int) sd->key_len);
+        st->gets += shard->hits + shard->misses;
+        st->hits += shard->hits;
+        st->misses += shard->misses;
 
-    value.data = sd->data + sd->key_len;
-    value.len = (size_t) sd->value_len;
+        shard->hits = 0;
+        shard->misses = 0;
 
-    if (*str_value_len < (size_t) value.len) {
-        if (*value_type == SHDICT_TBOOLEAN) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            return NGX_ERROR;
-        }
+        stats->gets += st->gets;
+        stats->hits += st->hits;
+        stats->misses += st->misses;
+        stats->sets += st->sets;
+        stats->evictions += st->evictions;
+        stats->expired += st->expired;
+        stats->alloc_failures += st->alloc_failures;
+        stats->lock_waits += st->lock_waits;
+        stats->compressed += st->compressed;
+        stats->compress_bytes_in += st->compress_bytes_in;
+        stats->compress_bytes_out += st->compress_bytes_out;
+        stats->compress_usec += st->compress_usec;
+        stats->decompressed += shard->sh->decompressed;
+        stats->decompress_usec += shard->sh->decompress_usec;
 
-        if (*value_type == SHDICT_TSTRING) {
-            *str_value_buf = malloc(value.len);
-            if (*str_value_buf == NULL) {
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
-                return NGX_ERROR;
-            }
-        }
+#if (nginx_version >= 1011007)
+        shpool = shard->shpool;
+        stats->bytes_used += (((shpool->end - shpool->start)
+                               >> ngx_pagesize_shift)
+                              - shpool->pfree) << ngx_pagesize_shift;
+#endif
+
+        ngx_http_lua_shdict_unlock(shard);
     }
 
-    switch (*value_type) {
+    return NGX_OK;
+}
 
-    case SHDICT_TSTRING:
-        *str_value_len = value.len;
-        ngx_memcpy(*str_value_buf, value.data, value.len);
-        break;
 
-    case SHDICT_TNUMBER:
+static ngx_int_t
+ngx_http_lua_shdict_snapshot_flush(ngx_http_lua_shdict_snapshot_buf_t *b,
+    ngx_log_t *log)
+{
+    u_char   *p;
+    ssize_t   n;
 
-        if (value.len != sizeof(double)) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                          "bad lua number value size found for key %*s "
-                          "in shared_dict %V: %z", key_len, key,
-                          &name, value.len);
+    for (p = b->start; p < b->last; p += n) {
+        n = ngx_write_fd(b->fd, p, b->last - p);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_write_fd_n " to \"%s\" failed", b->name);
             return NGX_ERROR;
         }
+    }
 
-        *str_value_len = value.len;
-        ngx_memcpy(num_value, value.data, sizeof(double));
-        break;
+    b->last = b->start;
 
-    case SHDICT_TBOOLEAN:
+    return NGX_OK;
+}
 
-        if (value.len != sizeof(u_char)) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                          "bad lua boolean value size found for key %*s "
-                          "in shared_dict %V: %z", key_len, key, &name,
-                          value.len);
+
+static ngx_int_t
+ngx_http_lua_shdict_snapshot_write(ngx_http_lua_shdict_snapshot_buf_t *b,
+    void *data, size_t len, ngx_log_t *log)
+{
+    size_t   n;
+    u_char  *p;
+
+    p = data;
+
+    while (len) {
+        if (b->last == b->end
+            && ngx_http_lua_shdict_snapshot_flush(b, log) != NGX_OK)
+        {
             return NGX_ERROR;
         }
 
-        ngx_memcpy(*str_value_buf, value.data, value.len);
-        break;
-
-    case SHDICT_TLIST:
+        n = ngx_min(len, (size_t) (b->end - b->last));
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        b->last = ngx_cpymem(b->last, p, n);
+        p += n;
+        len -= n;
+    }
 
-        *err = "value is a list";
-        return NGX_ERROR;
+    return NGX_OK;
+}
 
-    default:
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                      "bad value type found for key %*s in "
-                      "shared_dict %V: %d", key_len, key, &name,
-                      *value_type);
-        return NGX_ERROR;
-    }
+/* appends to the buffer without writing it out, growing it when needed */
 
-    *user_flags = sd->user_flags;
-    dd("user flags: %d", *user_flags);
+static ngx_int_t
+ngx_http_lua_shdict_snapshot_append(ngx_http_lua_shdict_snapshot_buf_t *b,
+    void *data, size_t len, ngx_log_t *log)
+{
+    u_char  *p;
+    size_t   size;
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    if ((size_t) (b->end - b->last) < len) {
+        size = ngx_max((size_t) (b->end - b->start) * 2,
+                       (size_t) (b->last - b->start) + len);
 
-    if (get_stale) {
+        p = ngx_alloc(size, log);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
 
-        /* always return value, flags, stale */
+        b->last = ngx_cpymem(p, b->start, b->last - b->start);
+        ngx_free(b->start);
 
-        *is_stale = (rc == NGX_DONE);
-        return NGX_OK;
+        b->start = p;
+        b->pos = p;
+        b->end = p + size;
     }
 
+    b->last = ngx_cpymem(b->last, data, len);
+
     return NGX_OK;
 }
 
 
-int
-ngx_http_lua_ffi_shdict_incr(ngx_shm_zone_t *zone, u_char *key,
-    size_t key_len, double *value, char **err, int has_init, double init,
-    long init_ttl, int *forcible)
+/* returns "len" contiguous bytes from the file, valid until the next call */
+
+static u_char *
+ngx_http_lua_shdict_snapshot_read(ngx_http_lua_shdict_snapshot_buf_t *b,
+    size_t len, ngx_log_t *log)
 {
-    int                          i, n;
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_time_t                  *tp = NULL;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-    double                       num;
-    ngx_rbtree_node_t           *node;
-    u_char                      *p;
-    ngx_queue_t                 *queue, *q;
+    u_char   *p;
+    size_t    size;
+    ssize_t   n;
 
-    if (init_ttl > 0) {
-        tp = ngx_timeofday();
-    }
+    if ((size_t) (b->last - b->pos) < len) {
 
-    ctx = zone->data;
+        size = b->last - b->pos;
 
-    *forcible = 0;
+        if ((size_t) (b->end - b->start) < len) {
 
-    hash = ngx_crc32_short(key, key_len);
+            /* a value larger than the buffer */
 
-    dd("looking up key %.*s in shared dict %.*s", (int) key_len, key,
-       (int) ctx->name.len, ctx->name.data);
+            p = ngx_alloc(len, log);
+            if (p == NULL) {
+                return NULL;
+            }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
-#if 1
-    ngx_http_lua_shdict_expire(ctx, 1);
-#endif
-    rc = ngx_http_lua_shdict_lookup(zone, hash, key, key_len, &sd);
+            ngx_memcpy(p, b->pos, size);
+            ngx_free(b->start);
 
-    dd("shdict lookup returned %d", (int) rc);
+            b->start = p;
+            b->end = p + len;
 
-    if (rc == NGX_DECLINED || rc == NGX_DONE) {
-        if (!has_init) {
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
-            *err = "not found";
-            return NGX_ERROR;
+        } else {
+            ngx_memmove(b->start, b->pos, size);
         }
 
-        /* add value */
-        num = *value + init;
-
-        if (rc == NGX_DONE) {
-
-            /* found an expired item */
+        b->pos = b->start;
+        b->last = b->start + size;
 
-            if ((size_t) sd->value_len == sizeof(double)
-                && sd->value_type != SHDICT_TLIST)
-            {
-                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                               "lua shared dict incr: found old entry and "
-                               "value size matched, reusing it");
+        while ((size_t) (b->last - b->pos) < len) {
+            n = ngx_read_fd(b->fd, b->last, b->end - b->last);
 
-                ngx_queue_remove(&sd->queue);
-                ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+            if (n == -1) {
+                ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                              ngx_read_fd_n " \"%s\" failed", b->name);
+                return NULL;
+            }
 
-                dd("go to setvalue");
-                goto setvalue;
+            if (n == 0) {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                              "lua shared dict snapshot \"%s\" is truncated",
+                              b->name);
+                return NULL;
             }
 
-            dd("go to remove");
-            goto remove;
+            b->last += n;
         }
-
-        dd("go to insert");
-        goto insert;
     }
 
-    /* rc == NGX_OK */
+    p = b->pos;
+    b->pos += len;
 
-    if (sd->value_type != SHDICT_TNUMBER || sd->value_len != sizeof(double)) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        *err = "not a number";
-        return NGX_ERROR;
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_load(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    int                                     forcible;
+    char                                   *err;
+    u_char                                 *p;
+    size_t                                  size;
+    double                                  num;
+    uint32_t                                hash;
+    uint64_t                                now;
+    ngx_int_t                               rc;
+    ngx_uint_t                              n;
+    long                                    exptime;
+    ngx_time_t                             *tp;
+    ngx_http_lua_shdict_ctx_t              *shard;
+    ngx_http_lua_shdict_snapshot_buf_t      b;
+    ngx_http_lua_shdict_snapshot_header_t   header;
+    ngx_http_lua_shdict_snapshot_record_t   rec;
+
+    if (ctx->persist.len == 0) {
+        return NGX_OK;
     }
 
-    ngx_queue_remove(&sd->queue);
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+    /* a missing or bad snapshot only means the zone starts empty */
 
-    dd("setting value type to %d", (int) sd->value_type);
+    b.name = ctx->persist.data;
 
-    p = sd->data + key_len;
+    b.fd = ngx_open_file(b.name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (b.fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_ERR, ctx->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", b.name);
+        }
+
+        return NGX_OK;
+    }
+
+    b.start = ngx_alloc(NGX_HTTP_LUA_SHDICT_SNAPSHOT_BUF, ctx->log);
+    if (b.start == NULL) {
+        goto done;
+    }
 
-    ngx_memcpy(&num, p, sizeof(double));
-    num += *value;
+    b.pos = b.start;
+    b.last = b.start;
+    b.end = b.start + NGX_HTTP_LUA_SHDICT_SNAPSHOT_BUF;
 
-    ngx_memcpy(p, (double *) &num, sizeof(double));
+    p = ngx_http_lua_shdict_snapshot_read(&b, sizeof(header), ctx->log);
+    if (p == NULL) {
+        goto done;
+    }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_memcpy(&header, p, sizeof(header));
 
-    *value = num;
-    return NGX_OK;
+    if (ngx_memcmp(header.signature, NGX_HTTP_LUA_SHDICT_SNAPSHOT_SIGNATURE,
+                   sizeof(header.signature))
+        != 0
+        || header.version != NGX_HTTP_LUA_SHDICT_SNAPSHOT_VERSION
+        || header.record_size != sizeof(rec))
+    {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                      "lua shared dict snapshot \"%s\" has a bad header, "
+                      "ignored", b.name);
+        goto done;
+    }
 
-remove:
+    tp = ngx_timeofday();
+    now = (uint64_t) tp->sec * 1000 + tp->msec;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "lua shared dict incr: found old entry but value size "
-                   "NOT matched, removing it first");
+    /* no record can be larger than the zone, whatever the snapshot says */
 
-    if (sd->value_type == SHDICT_TLIST) {
-        queue = ngx_http_lua_shdict_get_list_head(sd, key_len);
+    size = ctx->shpool->end - (u_char *) ctx->shpool;
 
-        for (q = ngx_queue_head(queue);
-             q != ngx_queue_sentinel(queue);
-             q = ngx_queue_next(q))
-        {
-            p = (u_char *) ngx_queue_data(q, ngx_http_lua_shdict_list_node_t,
-                                          queue);
+    n = 0;
 
-            ngx_slab_free_locked(ctx->shpool, p);
+    for ( ;; ) {
+        p = ngx_http_lua_shdict_snapshot_read(&b, sizeof(rec), ctx->log);
+        if (p == NULL) {
+            break;
         }
-    }
 
-    ngx_queue_remove(&sd->queue);
+        ngx_memcpy(&rec, p, sizeof(rec));
 
-    node = (ngx_rbtree_node_t *)
-               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+        if (rec.key_len == 0) {
+            /* the end of the snapshot */
+            break;
+        }
 
-    ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        if ((size_t) rec.key_len + rec.value_len > size) {
+            goto bad;
+        }
 
-    ngx_slab_free_locked(ctx->shpool, node);
+        p = ngx_http_lua_shdict_snapshot_read(&b, rec.key_len + rec.value_len,
+                                              ctx->log);
+        if (p == NULL) {
+            break;
+        }
 
-insert:
+        if (rec.expires == 0) {
+            exptime = 0;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "lua shared dict incr: creating a new entry");
+        } else if (rec.expires > now) {
+            exptime = (long) (rec.expires - now);
 
-    n = offsetof(ngx_rbtree_node_t, color)
-        + offsetof(ngx_http_lua_shdict_node_t, data)
-        + key_len
-        + sizeof(double);
+        } else {
+            continue;
+        }
 
-    node = ngx_slab_alloc_locked(ctx->shpool, n);
+        switch (rec.value_type) {
 
-    if (node == NULL) {
+        case SHDICT_TCOMPRESSED:
+            if (rec.value_len < sizeof(uint32_t)) {
+                goto bad;
+            }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                       "lua shared dict incr: overriding non-expired items "
-                       "due to memory shortage for entry \"%*s\"", key_len,
-                       key);
+            /* fall through */
 
-        for (i = 0; i < 30; i++) {
-            if (ngx_http_lua_shdict_expire(ctx, 0) == 0) {
-                break;
+        case SHDICT_TSTRING:
+        case SHDICT_TTABLE:
+            num = 0;
+            break;
+
+        case SHDICT_TNUMBER:
+            if (rec.value_len != sizeof(double)) {
+                goto bad;
             }
 
-            *forcible = 1;
+            ngx_memcpy(&num, p + rec.key_len, sizeof(double));
+            break;
 
-            node = ngx_slab_alloc_locked(ctx->shpool, n);
-            if (node != NULL) {
-                goto allocated;
+        case SHDICT_TBOOLEAN:
+            if (rec.value_len != sizeof(u_char)) {
+                goto bad;
             }
-        }
-
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
 
-        *err = "no memory";
-        return NGX_ERROR;
-    }
+            num = p[rec.key_len];
+            break;
 
-allocated:
+        default:
+            goto bad;
+        }
 
-    sd = (ngx_http_lua_shdict_node_t *) &node->color;
+        hash = ngx_crc32_short(p, rec.key_len);
 
-    node->key = hash;
+        shard = ngx_http_lua_shdict_get_shard(ctx, hash);
 
-    sd->key_len = (u_short) key_len;
+        ngx_http_lua_shdict_lock(shard);
 
-    sd->value_len = (uint32_t) sizeof(double);
+        rc = ngx_http_lua_shdict_store_locked(shard, 0, hash, p, rec.key_len,
+                                              rec.value_type, p + rec.key_len,
+                                              rec.value_len, num, exptime,
+                                              rec.user_flags, &err,
+                                              &forcible);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+        ngx_http_lua_shdict_unlock(shard);
 
-    ngx_queue_insert_head(&ctx->sh->lru_queue, &sd->queue);
+        if (rc != NGX_OK) {
+            ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                          "lua shared dict \"%V\": failed to load key "
+                          "\"%*s\" from \"%s\": %s", &ctx->name,
+                          (size_t) rec.key_len, p, b.name, err);
+            continue;
+        }
 
-setvalue:
+        n++;
+    }
 
-    sd->user_flags = 0;
+    ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0,
+                  "lua shared dict \"%V\": loaded %ui keys from \"%s\"",
+                  &ctx->name, n, b.name);
 
-    if (init_ttl > 0) {
-        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
-                      + (uint64_t) init_ttl;
+    goto done;
 
-    } else {
-        sd->expires = 0;
-    }
+bad:
 
-    dd("setting value type to %d", LUA_TNUMBER);
+    ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                  "lua shared dict snapshot \"%s\" has a bad record, "
+                  "stopped loading after %ui keys", b.name, n);
 
-    sd->value_type = (uint8_t) LUA_TNUMBER;
+done:
 
-    p = ngx_copy(sd->data, key, key_len);
-    ngx_memcpy(p, (double *) &num, sizeof(double));
+    if (b.start) {
+        ngx_free(b.start);
+    }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    if (ngx_close_file(b.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ctx->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", b.name);
+    }
 
-    *value = num;
     return NGX_OK;
 }
 
 
-int
-ngx_http_lua_ffi_shdict_flush_all(ngx_shm_zone_t *zone)
+static ngx_int_t
+ngx_http_lua_shdict_save_key(ngx_http_lua_shdict_node_t *sd, void *data)
 {
-    ngx_queue_t                 *q;
-    ngx_http_lua_shdict_node_t  *sd;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-
-    ctx = zone->data;
+    ngx_http_lua_shdict_visit_t  *v = data;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_http_lua_shdict_snapshot_record_t  rec;
 
-    for (q = ngx_queue_head(&ctx->sh->lru_queue);
-         q != ngx_queue_sentinel(&ctx->sh->lru_queue);
-         q = ngx_queue_next(q))
+    if (sd->value_type == SHDICT_TLIST
+        || sd->value_type == SHDICT_THASH
+        || sd->value_type == SHDICT_TZSET
+        || sd->value_type == SHDICT_TCOUNTER
+        || (sd->expires != 0 && sd->expires <= v->now))
     {
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
-        sd->expires = 1;
+        return NGX_OK;
     }
 
-    ngx_http_lua_shdict_expire(ctx, 0);
+    ngx_memzero(&rec, sizeof(rec));
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    rec.expires = sd->expires;
+    rec.value_len = sd->value_len;
+    rec.user_flags = sd->user_flags;
+    rec.key_len = sd->key_len;
+    rec.value_type = sd->value_type;
+
+    if (ngx_http_lua_shdict_snapshot_append(v->b, &rec, sizeof(rec), v->log)
+        != NGX_OK
+        || ngx_http_lua_shdict_snapshot_append(v->b, sd->data,
+                                               sd->key_len + sd->value_len,
+                                               v->log)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    v->saved++;
 
     return NGX_OK;
 }
 
 
+/*
+ * saves a shard in batches of keys copied to the buffer under the lock and
+ * written out without it; the batches follow the hash values of the keys,
+ * like scan, since the LRU order changes between them
+ */
+
 static ngx_int_t
-ngx_http_lua_shdict_peek(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
-    u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
+ngx_http_lua_shdict_save_shard(ngx_http_lua_shdict_ctx_t *shard,
+    ngx_http_lua_shdict_snapshot_buf_t *b, uint64_t now, ngx_uint_t *n,
+    ngx_log_t *log)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
-
-    ctx = shm_zone->data;
-
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
-
-    while (node != sentinel) {
+    uint64_t                      pos;
+    ngx_int_t                     rc;
+    ngx_http_lua_shdict_visit_t   v;
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+    ngx_memzero(&v, sizeof(ngx_http_lua_shdict_visit_t));
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
+    v.now = now;
+    v.b = b;
+    v.log = log;
 
-        /* hash == node->key */
+    pos = 0;
 
-        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+    do {
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+        rc = ngx_http_lua_shdict_scan_shard(shard, &pos,
+                                            NGX_HTTP_LUA_SHDICT_SNAPSHOT_BATCH,
+                                            ngx_http_lua_shdict_save_key, &v);
 
-        if (rc == 0) {
-            *sdp = sd;
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
-            return NGX_OK;
+        if (rc != NGX_OK
+            || ngx_http_lua_shdict_snapshot_flush(b, log) != NGX_OK)
+        {
+            return NGX_ERROR;
         }
 
-        node = (rc < 0) ? node->left : node->right;
-    }
+    } while (pos != 0x100000000ULL);
 
-    *sdp = NULL;
+    *n += v.saved;
 
-    return NGX_DECLINED;
+    return NGX_OK;
 }
 
 
-long
-ngx_http_lua_ffi_shdict_get_ttl(ngx_shm_zone_t *zone, u_char *key,
-    size_t key_len)
+/*
+ * saves the zone, from the master process on exit, when the workers are
+ * gone, or periodically from the first worker with persist_interval=T
+ */
+
+static ngx_int_t
+ngx_http_lua_shdict_save(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t exiting,
+    ngx_log_t *log)
 {
-    uint32_t                     hash;
-    uint64_t                     now;
-    uint64_t                     expires;
-    ngx_int_t                    rc;
-    ngx_time_t                  *tp;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
+    u_char                                 *tmp;
+    uint64_t                                now;
+    ngx_int_t                               rc;
+    ngx_uint_t                              i, n;
+    ngx_time_t                             *tp;
+    ngx_queue_t                            *q;
+    ngx_http_lua_shdict_ctx_t              *shard;
+    ngx_http_lua_shdict_node_t             *sd;
+    ngx_http_lua_shdict_snapshot_buf_t      b;
+    ngx_http_lua_shdict_snapshot_header_t   header;
+    ngx_http_lua_shdict_snapshot_record_t   rec;
 
-    ctx = zone->data;
-    hash = ngx_crc32_short(key, key_len);
+    /*
+     * the snapshot is written aside and renamed when complete, the name
+     * being unique to the process since the first workers of an old and a
+     * new binary may both be saving the zone during a binary upgrade
+     */
+
+    tmp = ngx_alloc(ctx->persist.len + sizeof(".tmp") + NGX_INT64_LEN + 1,
+                    log);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    ngx_sprintf(tmp, "%V.%P.tmp%Z", &ctx->persist, ngx_pid);
 
-    rc = ngx_http_lua_shdict_peek(zone, hash, key, key_len, &sd);
+    b.name = tmp;
 
-    if (rc == NGX_DECLINED) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    b.fd = ngx_open_file(tmp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                         NGX_FILE_DEFAULT_ACCESS);
 
-        return NGX_DECLINED;
+    if (b.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", tmp);
+        ngx_free(tmp);
+        return NGX_ERROR;
     }
 
-    /* rc == NGX_OK */
+    rc = NGX_ERROR;
 
-    expires = sd->expires;
+    b.start = ngx_alloc(NGX_HTTP_LUA_SHDICT_SNAPSHOT_BUF, log);
+    if (b.start == NULL) {
+        goto done;
+    }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    b.pos = b.start;
+    b.last = b.start;
+    b.end = b.start + NGX_HTTP_LUA_SHDICT_SNAPSHOT_BUF;
 
-    if (expires == 0) {
-        return 0;
+    ngx_memzero(&header, sizeof(header));
+    ngx_memcpy(header.signature, NGX_HTTP_LUA_SHDICT_SNAPSHOT_SIGNATURE,
+               sizeof(header.signature));
+    header.version = NGX_HTTP_LUA_SHDICT_SNAPSHOT_VERSION;
+    header.record_size = sizeof(rec);
+
+    if (ngx_http_lua_shdict_snapshot_write(&b, &header, sizeof(header), log)
+        != NGX_OK)
+    {
+        goto done;
     }
 
     tp = ngx_timeofday();
     now = (uint64_t) tp->sec * 1000 + tp->msec;
 
-    return expires - now;
-}
+    ngx_memzero(&rec, sizeof(rec));
 
+    n = 0;
 
-int
-ngx_http_lua_ffi_shdict_set_expire(ngx_shm_zone_t *zone, u_char *key,
-    size_t key_len, long exptime)
-{
-    uint32_t                     hash;
-    ngx_int_t                    rc;
-    ngx_time_t                  *tp = NULL;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
 
-    if (exptime > 0) {
-        tp = ngx_timeofday();
-    }
+        if (!exiting) {
+            if (ngx_http_lua_shdict_save_shard(shard, &b, now, &n, log)
+                != NGX_OK)
+            {
+                goto done;
+            }
 
-    ctx = zone->data;
-    hash = ngx_crc32_short(key, key_len);
+            continue;
+        }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+        /*
+         * on exit, the workers are gone by now, but one of them may have
+         * died while holding the lock; the whole shard is then saved at
+         * once, in the LRU order
+         */
 
-    rc = ngx_http_lua_shdict_peek(zone, hash, key, key_len, &sd);
+        if (!ngx_shmtx_trylock(&shard->shpool->mutex)) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "lua shared dict \"%V\" is locked, some keys are "
+                          "not saved", &ctx->name);
+            continue;
+        }
 
-    if (rc == NGX_DECLINED) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        /* oldest first, so that loading restores the LRU order */
 
-        return NGX_DECLINED;
+        for (q = ngx_queue_last(&shard->sh->lru_queue);
+             q != ngx_queue_sentinel(&shard->sh->lru_queue);
+             q = ngx_queue_prev(q))
+        {
+            sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+            if (sd->value_type == SHDICT_TLIST
+                || sd->value_type == SHDICT_THASH
+                || sd->value_type == SHDICT_TZSET
+                || sd->value_type == SHDICT_TCOUNTER
+                || (sd->expires != 0 && sd->expires <= now))
+            {
+                continue;
+            }
+
+            rec.expires = sd->expires;
+            rec.value_len = sd->value_len;
+            rec.user_flags = sd->user_flags;
+            rec.key_len = sd->key_len;
+            rec.value_type = sd->value_type;
+
+            if (ngx_http_lua_shdict_snapshot_write(&b, &rec, sizeof(rec), log)
+                != NGX_OK
+                || ngx_http_lua_shdict_snapshot_write(&b, sd->data,
+                                                      sd->key_len
+                                                      + sd->value_len,
+                                                      log)
+                   != NGX_OK)
+            {
+                ngx_shmtx_unlock(&shard->shpool->mutex);
+                goto done;
+            }
+
+            n++;
+        }
+
+        ngx_shmtx_unlock(&shard->shpool->mutex);
     }
 
-    /* rc == NGX_OK */
+    /* a record with an empty key marks the end of the snapshot */
 
-    if (exptime > 0) {
-        sd->expires = (uint64_t) tp->sec * 1000 + tp->msec
-                      + (uint64_t) exptime;
+    ngx_memzero(&rec, sizeof(rec));
 
-    } else {
-        sd->expires = 0;
+    if (ngx_http_lua_shdict_snapshot_write(&b, &rec, sizeof(rec), log)
+        != NGX_OK
+        || ngx_http_lua_shdict_snapshot_flush(&b, log) != NGX_OK)
+    {
+        goto done;
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    rc = NGX_OK;
 
-    return NGX_OK;
-}
+done:
 
+    if (b.start) {
+        ngx_free(b.start);
+    }
 
-size_t
-ngx_http_lua_ffi_shdict_capacity(ngx_shm_zone_t *zone)
-{
-    return zone->shm.size;
+    if (ngx_close_file(b.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", tmp);
+        rc = NGX_ERROR;
+    }
+
+    if (rc == NGX_OK) {
+        if (ngx_rename_file(tmp, ctx->persist.data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                          tmp, ctx->persist.data);
+            rc = NGX_ERROR;
+
+        } else {
+            ngx_log_error(exiting ? NGX_LOG_NOTICE : NGX_LOG_INFO, log, 0,
+                          "lua shared dict \"%V\": saved %ui keys to \"%s\"",
+                          &ctx->name, n, ctx->persist.data);
+        }
+
+    } else if (ngx_delete_file(tmp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", tmp);
+    }
+
+    ngx_free(tmp);
+
+    return rc;
 }
 
 
-#if (nginx_version >= 1011007)
-size_t
-ngx_http_lua_ffi_shdict_free_space(ngx_shm_zone_t *zone)
+void
+ngx_http_lua_shdict_exit_master(ngx_cycle_t *cycle)
 {
-    size_t                       bytes;
+    ngx_uint_t                   i;
+    ngx_shm_zone_t             **zone;
+    ngx_http_lua_main_conf_t    *lmcf;
     ngx_http_lua_shdict_ctx_t   *ctx;
 
-    ctx = zone->data;
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
+    if (lmcf == NULL || lmcf->shdict_zones == NULL) {
+        return;
+    }
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
-    bytes = ctx->shpool->pfree * ngx_pagesize;
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    /*
+     * after a binary upgrade, the zones of the new binary, loaded from the
+     * periodic snapshots, are the live ones, and are saved by the new
+     * master process on its own exit
+     */
 
-    return bytes;
+    if (ngx_new_binary) {
+        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                      "lua shared dicts not saved, left to the new binary");
+        return;
+    }
+
+    zone = lmcf->shdict_zones->elts;
+
+    for (i = 0; i < lmcf->shdict_zones->nelts; i++) {
+        ctx = zone[i]->data;
+
+        if (ctx->persist.len) {
+            (void) ngx_http_lua_shdict_save(ctx, 1, cycle->log);
+        }
+    }
 }
-#endif
 
 
 /* vi:set ft=c ts=4 sw=4 et fdm=marker: */
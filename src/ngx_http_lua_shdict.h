@@ -9,6 +9,7 @@
 
 
 #include "ngx_http_lua_common.h"
+#include "ngx_http_lua_api.h"
 
 
 typedef struct {
@@ -19,6 +20,7 @@ typedef struct {
     uint64_t                     expires;
     ngx_queue_t                  queue;
     uint32_t                     user_flags;
+    uint32_t                     version;  /* of the value, 0 when freed */
     u_char                       data[1];
 } ngx_http_lua_shdict_node_t;
 
@@ -31,20 +33,302 @@ typedef struct {
 } ngx_http_lua_shdict_list_node_t;
 
 
+/* a field of a hash, in the queue of the hash item */
+typedef struct {
+    ngx_queue_t                  queue;
+    uint32_t                     value_len;
+    uint16_t                     field_len;
+    uint8_t                      value_type;
+    u_char                       data[1];  /* the field, then the value */
+} ngx_http_lua_shdict_field_node_t;
+
+
+/*
+ * a member of a sorted set, in both trees of the set: by_score ordered by
+ * the score and then the member, by_member keyed by the crc32 of the member
+ */
+
+typedef struct {
+    ngx_rbtree_node_t            by_score;
+    ngx_rbtree_node_t            by_member;
+    double                       score;
+    uint32_t                     member_len;
+    u_char                       data[1];
+} ngx_http_lua_shdict_zmember_t;
+
+
+/* the trees of a sorted set item, in place of the queue of a list */
+typedef struct {
+    ngx_rbtree_t                 by_score;
+    ngx_rbtree_node_t            score_sentinel;
+    ngx_rbtree_t                 by_member;
+    ngx_rbtree_node_t            member_sentinel;
+} ngx_http_lua_shdict_zset_t;
+
+
+#define NGX_HTTP_LUA_SHDICT_INDEX_RBTREE  0
+#define NGX_HTTP_LUA_SHDICT_INDEX_HASH    1
+
+
+#define NGX_HTTP_LUA_SHDICT_POLICY_LRU      0
+#define NGX_HTTP_LUA_SHDICT_POLICY_TINYLFU  1
+
+
+#define NGX_HTTP_LUA_SHDICT_EXPIRY_LRU    0
+#define NGX_HTTP_LUA_SHDICT_EXPIRY_WHEEL  1
+
+
+/* a slot of the open-addressing index used by index=hash zones */
+typedef struct {
+    uint32_t                      hash;
+    uint32_t                      node;  /* offset of the node in the pool,
+                                            in 8-byte units, 0 when free */
+} ngx_http_lua_shdict_slot_t;
+
+
+/*
+ * the value of a counter of incr_fast lives in a cell of its own: a
+ * header followed by one cache line per worker process, each worker adding
+ * to its own line without the lock, and a last line shared by all the
+ * other processes under the lock
+ */
+
+typedef struct ngx_http_lua_shdict_counter_s  ngx_http_lua_shdict_counter_t;
+
+struct ngx_http_lua_shdict_counter_s {
+    ngx_http_lua_shdict_counter_t  *next;  /* in the free list */
+    uint32_t                        gen;  /* bumped when the cell is freed */
+    uint32_t                        nslots;
+};
+
+
+typedef struct {
+    ngx_atomic_t                  value;
+    uint32_t                      gen;  /* of the counter the value is for */
+} ngx_http_lua_shdict_counter_slot_t;
+
+
+#define NGX_HTTP_LUA_SHDICT_EVENT_KEY    254
+#define NGX_HTTP_LUA_SHDICT_WATCHES      32
+#define NGX_HTTP_LUA_SHDICT_WATCH_LEN    63
+
+
+/* a change event of a zone with events=N */
+typedef struct {
+    uint16_t                      key_len;  /* of the whole key */
+    u_char                        key[NGX_HTTP_LUA_SHDICT_EVENT_KEY];
+} ngx_http_lua_shdict_event_t;
+
+
+typedef struct {
+    u_char                        len;
+    u_char                        data[NGX_HTTP_LUA_SHDICT_WATCH_LEN];
+} ngx_http_lua_shdict_watch_t;
+
+
+/* the ring of the change events, in the pool of the first shard */
+typedef struct {
+    ngx_shmtx_sh_t                lock;
+    ngx_shmtx_t                   mutex;
+
+    uint64_t                      next;  /* number of the next event */
+    ngx_atomic_t                  pushes;  /* to all the lists, for blpop */
+    ngx_uint_t                    mask;
+    ngx_http_lua_shdict_event_t  *events;
+
+    /* watches are only ever added, nwatches last */
+    ngx_atomic_t                  nwatches;
+    ngx_http_lua_shdict_watch_t   watches[NGX_HTTP_LUA_SHDICT_WATCHES];
+
+    /* set by the workers with waiting light threads, by ngx_worker */
+    ngx_atomic_t                  armed[NGX_MAX_PROCESSES];
+} ngx_http_lua_shdict_ring_t;
+
+
+/* updated with the shard locked */
+typedef struct {
+    uint64_t                      gets;
+    uint64_t                      hits;
+    uint64_t                      misses;
+    uint64_t                      sets;
+    uint64_t                      evictions;  /* of valid items, by force */
+    uint64_t                      expired;
+    uint64_t                      alloc_failures;
+    uint64_t                      lock_waits;
+    uint64_t                      compressed;
+    uint64_t                      compress_bytes_in;
+    uint64_t                      compress_bytes_out;
+    uint64_t                      compress_usec;
+} ngx_http_lua_shdict_stats_t;
+
+
 typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   lru_queue;
+    ngx_atomic_t                  seq;  /* odd while the shard is locked */
+    uint32_t                      version;  /* the last one given out */
+
+    ngx_http_lua_shdict_slot_t   *slots;
+    ngx_uint_t                    mask;
+    ngx_uint_t                    nentries;
+
+    /* count-min sketch of the key frequencies for policy=tinylfu */
+    u_char                       *sketch;
+    ngx_uint_t                    sketch_mask;
+    ngx_uint_t                    sketch_adds;
+
+    /* the timing wheel of the expiry=wheel zones, by level and bucket */
+    ngx_queue_t                  *wheel;
+    uint64_t                      wheel_tick;  /* the next tick to run */
+
+    /*
+     * the freed counter cells, which are never given back to the pool, so
+     * that a late lock-free increment can only ever hit another counter
+     */
+    ngx_http_lua_shdict_counter_t *counters;
+
+    ngx_http_lua_shdict_ring_t   *ring;  /* only set in the first shard */
+
+    /* the hash value, or the index slot, the next compact call starts at */
+    ngx_uint_t                    compact_cursor;
+
+    ngx_http_lua_shdict_stats_t   stats;
+
+    /* values are inflated after they are copied out, without the lock */
+    ngx_atomic_t                  decompressed;
+    ngx_atomic_t                  decompress_usec;
 } ngx_http_lua_shdict_shctx_t;
 
 
+/* the per-process side of the change events of a zone */
+typedef struct {
+    ngx_http_lua_shdict_ring_t   *ring;
+    ngx_uint_t                    size;  /* from events=N */
+
+    /* the events copied out of the ring, before the Lua table is built */
+    ngx_http_lua_shdict_event_t  *events;
+
+    ngx_fd_t                     *fds;  /* an eventfd per worker process */
+    ngx_uint_t                    nfds;
+
+    ngx_connection_t             *conn;  /* of this worker's eventfd */
+    ngx_queue_t                   waiters;  /* light threads of this worker */
+} ngx_http_lua_shdict_notify_t;
+
+
+/*
+ * an entry of the l1 cache of a zone with l1=N, the cached value itself
+ * being kept in a Lua table of each Lua VM, at the index of the entry,
+ * along with the stamp of the store it was cached by
+ */
+
+typedef struct ngx_http_lua_shdict_l1_entry_s  ngx_http_lua_shdict_l1_entry_t;
+
+struct ngx_http_lua_shdict_l1_entry_s {
+    ngx_queue_t                      queue;  /* in the LRU or the free queue */
+    ngx_http_lua_shdict_l1_entry_t  *next;  /* in the bucket */
+    ngx_http_lua_shdict_node_t      *sd;  /* the node read */
+    uint32_t                         hash;
+    uint32_t                         version;  /* of the value in sd */
+    uint32_t                         user_flags;
+    ngx_uint_t                       stamp;  /* of the last store */
+    ngx_str_t                        key;  /* ngx_alloc()ed */
+};
+
+
+/* the per-process cache of the values of a zone read by l1_get */
 typedef struct {
+    ngx_http_lua_shdict_l1_entry_t  **buckets;
+    ngx_uint_t                        mask;
+    ngx_http_lua_shdict_l1_entry_t   *entries;
+    ngx_queue_t                       lru;
+    ngx_queue_t                       free;
+    ngx_uint_t                        size;
+    ngx_uint_t                        id;  /* in the tables of the Lua VMs */
+    ngx_uint_t                        stamp;
+} ngx_http_lua_shdict_l1_t;
+
+
+typedef struct ngx_http_lua_shdict_ctx_s  ngx_http_lua_shdict_ctx_t;
+
+
+struct ngx_http_lua_shdict_ctx_s {
     ngx_http_lua_shdict_shctx_t  *sh;
     ngx_slab_pool_t              *shpool;
     ngx_str_t                     name;
     ngx_http_lua_main_conf_t     *main_conf;
     ngx_log_t                    *log;
-} ngx_http_lua_shdict_ctx_t;
+
+    ngx_uint_t                    nshards;
+    ngx_http_lua_shdict_ctx_t    *shards;  /* points to the ctx itself
+                                              when nshards == 1 */
+
+    ngx_uint_t                    reads;  /* lock-free reads in this
+                                             process, for LRU sampling */
+
+    /* lock-free hits and misses of this process not yet in sh->stats */
+    ngx_uint_t                    hits;
+    ngx_uint_t                    misses;
+
+    ngx_uint_t                    index;  /* NGX_HTTP_LUA_SHDICT_INDEX_* */
+    ngx_uint_t                    policy;  /* NGX_HTTP_LUA_SHDICT_POLICY_* */
+    ngx_uint_t                    expiry;  /* NGX_HTTP_LUA_SHDICT_EXPIRY_* */
+
+    ngx_str_t                     persist;  /* snapshot file, null-terminated,
+                                               only set in the zone's ctx */
+    ngx_msec_t                    persist_interval;  /* of the saves by the
+                                                        first worker, 0 when
+                                                        only saved on exit */
+
+    size_t                        compress;  /* the compress=N threshold, 0
+                                                when off, only set in the
+                                                zone's ctx */
+
+    ngx_http_lua_shdict_notify_t *notify;  /* shared by the shards, NULL
+                                              without events=N */
+
+    ngx_uint_t                    l1_size;  /* from l1=N, only set in the
+                                               zone's ctx, as l1 is */
+    ngx_http_lua_shdict_l1_t     *l1;  /* created on first use */
+
+    unsigned                      read_mostly:1;
+    unsigned                      hugepages:1;  /* only set in the zone's
+                                                   ctx */
+};
+
+
+/* an entry of the batches passed to get_multi and set_multi */
+typedef struct {
+    ngx_http_lua_ffi_str_t       key;
+    int                          value_type;
+    int                          user_flags;
+    u_char                      *str_value_buf;
+    size_t                       str_value_len;
+    double                       num_value;
+    char                        *err;
+    int                          rc;
+    int                          forcible;
+} ngx_http_lua_ffi_shdict_item_t;
+
+
+typedef struct {
+    uint64_t                     gets;
+    uint64_t                     hits;
+    uint64_t                     misses;
+    uint64_t                     sets;
+    uint64_t                     evictions;
+    uint64_t                     expired;
+    uint64_t                     alloc_failures;
+    uint64_t                     lock_waits;
+    uint64_t                     bytes_used;
+    uint64_t                     compressed;
+    uint64_t                     compress_bytes_in;
+    uint64_t                     compress_bytes_out;
+    uint64_t                     compress_usec;
+    uint64_t                     decompressed;
+    uint64_t                     decompress_usec;
+} ngx_http_lua_ffi_shdict_stats_t;
 
 
 typedef struct {
@@ -55,11 +339,76 @@ typedef struct {
 } ngx_http_lua_shm_zone_ctx_t;
 
 
+static ngx_inline ngx_http_lua_shdict_ctx_t *
+ngx_http_lua_shdict_get_shard(ngx_http_lua_shdict_ctx_t *ctx, uint32_t hash)
+{
+    if (ctx->nshards == 1) {
+        return ctx->shards;
+    }
+
+    return &ctx->shards[hash % ctx->nshards];
+}
+
+
+static ngx_inline void
+ngx_http_lua_shdict_lock(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    if (!ngx_shmtx_trylock(&ctx->shpool->mutex)) {
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ctx->sh->stats.lock_waits++;
+    }
+
+    /*
+     * the sequence is always maintained, even for zones without
+     * read_mostly, since the workers of an old configuration may still be
+     * writing to the zone after a reload turned read_mostly on
+     */
+
+    ctx->sh->seq++;
+    ngx_memory_barrier();
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_lua_shdict_trylock(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    if (!ngx_shmtx_trylock(&ctx->shpool->mutex)) {
+        return 0;
+    }
+
+    ctx->sh->seq++;
+    ngx_memory_barrier();
+
+    return 1;
+}
+
+
+static ngx_inline void
+ngx_http_lua_shdict_unlock(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    ngx_memory_barrier();
+    ctx->sh->seq++;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
 ngx_int_t ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data);
 void ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 void ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf,
     lua_State *L);
+ngx_int_t ngx_http_lua_shdict_init_worker(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf);
+void ngx_http_lua_shdict_exit_worker(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf);
+void ngx_http_lua_shdict_exit_master(ngx_cycle_t *cycle);
+int ngx_http_lua_ffi_shdict_stats(ngx_shm_zone_t *zone,
+    ngx_http_lua_ffi_shdict_stats_t *stats);
+int ngx_http_lua_ffi_shdict_store(ngx_shm_zone_t *zone, int op, u_char *key,
+    size_t key_len, int value_type, u_char *str_value_buf,
+    size_t str_value_len, double num_value, long exptime, int user_flags,
+    char **errmsg, int *forcible);
 
 
 #endif /* _NGX_HTTP_LUA_SHDICT_H_INCLUDED_ */
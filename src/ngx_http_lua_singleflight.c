@@ -0,0 +1,178 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_singleflight.h"
+
+
+void
+ngx_http_lua_inject_singleflight_api(ngx_http_lua_main_conf_t *lmcf,
+    ngx_log_t *log, lua_State *L)
+{
+    int         rc;
+
+    /* the waiters in this worker sleep on an ngx.semaphore object of the
+     * flight, those of the other workers watch the lock key of the
+     * flight in the lua_singleflight_dict zone */
+
+    const char buf[] =
+        "local dict_name = ...\n"
+        "local type = type\n"
+        "local error = error\n"
+        "local pcall = pcall\n"
+        "local select = select\n"
+        "local unpack = unpack\n"
+        "local tostring = tostring\n"
+        "local prefix = \"singleflight:\"\n"
+        "local flights = {}\n"
+        "local semaphore, dict\n"
+        "local seq = 0\n"
+        "local errprefix = dict_name and\n"
+            "'lua_singleflight_dict \"' .. dict_name .. '\": '\n"
+        "local function pack(...)\n"
+            "return { n = select(\"#\", ...), ... }\n"
+        "end\n"
+        "local function get_dict()\n"
+            "if dict or not dict_name then\n"
+                "return dict\n"
+            "end\n"
+            "local zone = ngx.shared[dict_name]\n"
+            "if not zone then\n"
+                "error(errprefix .. \"no such lua_shared_dict\", 3)\n"
+            "end\n"
+            "local ok, err = zone:watch(prefix)\n"
+            "if not ok then\n"
+                "error(errprefix .. err, 3)\n"
+            "end\n"
+            "dict = zone\n"
+            "return dict\n"
+        "end\n"
+        "local function compute(key, timeout, fn)\n"
+            "if not dict then\n"
+                "return pack(pcall(fn))\n"
+            "end\n"
+            "local lock_key = prefix .. key .. \":lock\"\n"
+            "local res_key = prefix .. key\n"
+            "local deadline = ngx.now() + timeout\n"
+            "seq = seq + 1\n"
+            "local id = ngx.worker.pid() .. \":\" .. seq\n"
+            "while true do\n"
+                "local cursor = dict:events(0)\n"
+                "local ok, err = dict:add(lock_key, id, timeout)\n"
+                "if ok then\n"
+                    "local res = pack(pcall(fn))\n"
+                    "res.id = id\n"
+                    "if not res[1] then\n"
+                        "res[2] = tostring(res[2])\n"
+                    "end\n"
+                    "dict:set_table(res_key, res, timeout)\n"
+                    "dict:delete(lock_key)\n"
+                    "return res\n"
+                "end\n"
+                "if err ~= \"exists\" then\n"
+                    "return pack(pcall(fn))\n"
+                "end\n"
+                "local holder = dict:get(lock_key)\n"
+                "while holder do\n"
+                    "local remaining = deadline - ngx.now()\n"
+                    "if remaining <= 0 then\n"
+                        "return pack(false, \"timeout\")\n"
+                    "end\n"
+                    "local next_cursor = dict:wait_events(cursor, remaining)\n"
+                    "if next_cursor then\n"
+                        "cursor = next_cursor\n"
+                    "end\n"
+                    "if dict:get(lock_key) ~= holder then\n"
+                        "local res = dict:get_table(res_key)\n"
+                        "if res and res.id == holder then\n"
+                            "return res\n"
+                        "end\n"
+                        "break\n"
+                    "end\n"
+                "end\n"
+                "if deadline - ngx.now() <= 0 then\n"
+                    "return pack(false, \"timeout\")\n"
+                "end\n"
+            "end\n"
+        "end\n"
+        "return function (key, timeout, fn)\n"
+            "if type(key) ~= \"string\" or key == \"\" then\n"
+                "error(\"bad \\\"key\\\" argument\", 2)\n"
+            "end\n"
+            "if type(timeout) ~= \"number\" or timeout <= 0 then\n"
+                "error(\"bad \\\"timeout\\\" argument\", 2)\n"
+            "end\n"
+            "if type(fn) ~= \"function\" then\n"
+                "error(\"bad \\\"fn\\\" argument\", 2)\n"
+            "end\n"
+            "get_dict()\n"
+            "local now = ngx.now()\n"
+            "local flight = flights[key]\n"
+            "local res\n"
+            "if flight and flight.expires > now then\n"
+                "local ok, err = flight.sema:wait(timeout)\n"
+                "if not ok then\n"
+                    "return nil, err\n"
+                "end\n"
+                "res = flight.res\n"
+            "else\n"
+                "if not semaphore then\n"
+                    "semaphore = require \"ngx.semaphore\"\n"
+                "end\n"
+                "flight = { sema = semaphore.new(), expires = now + timeout }\n"
+                "flights[key] = flight\n"
+                "res = compute(key, timeout, fn)\n"
+                "if flights[key] == flight then\n"
+                    "flights[key] = nil\n"
+                "end\n"
+                "flight.res = res\n"
+                "local waiters = -flight.sema:count()\n"
+                "if waiters > 0 then\n"
+                    "flight.sema:post(waiters)\n"
+                "end\n"
+            "end\n"
+            "if res[1] then\n"
+                "return unpack(res, 2, res.n)\n"
+            "end\n"
+            "return nil, res[2]\n"
+        "end";
+
+    rc = luaL_loadbuffer(L, buf, sizeof(buf) - 1, "=ngx.singleflight");
+    if (rc != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "failed to load Lua code for ngx.singleflight: %i: %s",
+                      rc, lua_tostring(L, -1));
+
+        lua_pop(L, 1);
+        return;
+    }
+
+    if (lmcf->singleflight_dict.len) {
+        lua_pushlstring(L, (char *) lmcf->singleflight_dict.data,
+                        lmcf->singleflight_dict.len);
+
+    } else {
+        lua_pushnil(L);
+    }
+
+    rc = lua_pcall(L, 1, 1, 0);
+    if (rc != 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "failed to run the Lua code for ngx.singleflight: "
+                      "%i: %s", rc, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_setfield(L, -2, "singleflight");
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
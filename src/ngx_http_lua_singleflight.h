@@ -0,0 +1,20 @@
+
+/*
+ * Copyright (C) Yichun Zhang (agentzh)
+ */
+
+
+#ifndef _NGX_HTTP_LUA_SINGLEFLIGHT_H_INCLUDED_
+#define _NGX_HTTP_LUA_SINGLEFLIGHT_H_INCLUDED_
+
+
+#include "ngx_http_lua_common.h"
+
+
+void ngx_http_lua_inject_singleflight_api(ngx_http_lua_main_conf_t *lmcf,
+    ngx_log_t *log, lua_State *L);
+
+
+#endif /* _NGX_HTTP_LUA_SINGLEFLIGHT_H_INCLUDED_ */
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
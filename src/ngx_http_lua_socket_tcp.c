@@ -17,6 +17,23 @@
 #include "ngx_http_lua_output.h"
 #include "ngx_http_lua_contentby.h"
 #include "ngx_http_lua_probe.h"
+#include "ngx_http_lua_dns_cache.h"
+
+
+/* the strings of at least this length are sent in place by send() */
+#define NGX_HTTP_LUA_SOCKET_INPLACE_LEN  1024
+
+
+typedef struct {
+    size_t                           copy_len;
+    size_t                           ref_len;
+    int                              nrefs;
+    int                              anchor;
+    u_char                          *dst;  /* the end of the copies so far */
+    ngx_chain_t                     *copy;  /* the copy buffer until used */
+    ngx_buf_t                       *run;  /* the current run of copies */
+    ngx_chain_t                    **last;
+} ngx_http_lua_socket_inplace_t;
 
 
 static int ngx_http_lua_socket_tcp(lua_State *L);
@@ -26,7 +43,11 @@ static int ngx_http_lua_socket_tcp_sslhandshake(lua_State *L);
 #endif
 static int ngx_http_lua_socket_tcp_receive(lua_State *L);
 static int ngx_http_lua_socket_tcp_receiveany(lua_State *L);
+static int ngx_http_lua_socket_tcp_receive_into(lua_State *L);
 static int ngx_http_lua_socket_tcp_send(lua_State *L);
+static int ngx_http_lua_socket_tcp_sendfile(lua_State *L);
+static int ngx_http_lua_socket_tcp_send_helper(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
 static int ngx_http_lua_socket_tcp_close(lua_State *L);
 static int ngx_http_lua_socket_tcp_settimeout(lua_State *L);
 static int ngx_http_lua_socket_tcp_settimeouts(lua_State *L);
@@ -50,6 +71,18 @@ static void ngx_http_lua_socket_tcp_finalize_write_part(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u);
 static ngx_int_t ngx_http_lua_socket_send(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_inplace_bufs(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L, int type);
+static void ngx_http_lua_socket_inplace_count(lua_State *L, int index,
+    ngx_http_lua_socket_inplace_t *ip);
+static ngx_int_t ngx_http_lua_socket_inplace_table(ngx_http_request_t *r,
+    lua_State *L, int index, ngx_http_lua_socket_inplace_t *ip);
+static ngx_int_t ngx_http_lua_socket_inplace_add(ngx_http_request_t *r,
+    ngx_http_lua_socket_inplace_t *ip, u_char *p, size_t len);
+static void ngx_http_lua_socket_inplace_free(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u);
+static void ngx_http_lua_socket_sendfile_done(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u);
 static ngx_int_t ngx_http_lua_socket_test_connect(ngx_http_request_t *r,
     ngx_connection_t *c);
 static void ngx_http_lua_socket_handle_conn_error(ngx_http_request_t *r,
@@ -78,6 +111,9 @@ static int ngx_http_lua_socket_tcp_receive_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
 static ngx_int_t ngx_http_lua_socket_read_line(void *data, ssize_t bytes);
 static void ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_socket_resolved_addr(ngx_http_request_t *r,
+    ngx_http_upstream_resolved_t *ur, struct sockaddr *sockaddr,
+    socklen_t socklen);
 static int ngx_http_lua_socket_resolve_retval_handler(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L);
 static int ngx_http_lua_socket_conn_error_retval_handler(ngx_http_request_t *r,
@@ -90,6 +126,7 @@ static ngx_int_t ngx_http_lua_socket_read_all(void *data, ssize_t bytes);
 static ngx_int_t ngx_http_lua_socket_read_until(void *data, ssize_t bytes);
 static ngx_int_t ngx_http_lua_socket_read_chunk(void *data, ssize_t bytes);
 static ngx_int_t ngx_http_lua_socket_read_any(void *data, ssize_t bytes);
+static ngx_int_t ngx_http_lua_socket_read_into(void *data, ssize_t bytes);
 static int ngx_http_lua_socket_tcp_receiveuntil(lua_State *L);
 static int ngx_http_lua_socket_receiveuntil_iterator(lua_State *L);
 static ngx_int_t ngx_http_lua_socket_compile_pattern(u_char *data, size_t len,
@@ -237,13 +274,16 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
 {
     ngx_int_t         rc;
 
-    lua_createtable(L, 0, 4 /* nrec */);    /* ngx.socket */
+    lua_createtable(L, 0, 5 /* nrec */);    /* ngx.socket */
 
     lua_pushcfunction(L, ngx_http_lua_socket_tcp);
     lua_pushvalue(L, -1);
     lua_setfield(L, -3, "tcp");
     lua_setfield(L, -2, "stream");
 
+    lua_pushcfunction(L, ngx_http_lua_dns_cache_stats);
+    lua_setfield(L, -2, "dns_cache_stats");
+
     {
         const char  buf[] = "local sock = ngx.socket.tcp()"
                             " local ok, err = sock:connect(...)"
@@ -292,7 +332,7 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
     /* {{{raw req socket object metatable */
     lua_pushlightuserdata(L, ngx_http_lua_lightudata_mask(
                           raw_req_socket_metatable_key));
-    lua_createtable(L, 0 /* narr */, 7 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 8 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_receive);
     lua_setfield(L, -2, "receive");
@@ -306,6 +346,9 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_send);
     lua_setfield(L, -2, "send");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_sendfile);
+    lua_setfield(L, -2, "sendfile");
+
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_settimeout);
     lua_setfield(L, -2, "settimeout"); /* ngx socket mt */
 
@@ -321,7 +364,7 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
     /* {{{tcp object metatable */
     lua_pushlightuserdata(L, ngx_http_lua_lightudata_mask(
                           tcp_socket_metatable_key));
-    lua_createtable(L, 0 /* narr */, 14 /* nrec */);
+    lua_createtable(L, 0 /* narr */, 16 /* nrec */);
 
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_connect);
     lua_setfield(L, -2, "connect");
@@ -342,9 +385,80 @@ ngx_http_lua_inject_socket_tcp_api(ngx_log_t *log, lua_State *L)
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_receiveuntil);
     lua_setfield(L, -2, "receiveuntil");
 
+    {
+        /* turns the cdata buffer into its address for the C function */
+        const char  buf[] =
+            "local receive_into = ...\n"
+            "local ffi = require \"ffi\"\n"
+            "local type = type\n"
+            "local error = error\n"
+            "local tonumber = tonumber\n"
+            "local tostring = tostring\n"
+            "local find = string.find\n"
+            "local cast = ffi.cast\n"
+            "local sizeof = ffi.sizeof\n"
+            "local typeof = ffi.typeof\n"
+            "local uintptr_t = ffi.typeof(\"uintptr_t\")\n"
+            "local ptr = ffi.new(\"const void *[1]\")\n"
+            "return function (sock, buf, len)\n"
+                "if type(buf) ~= \"cdata\" then\n"
+                    "error(\"bad argument #1 to 'receive_into' \"\n"
+                          ".. \"(cdata expected, got \" .. type(buf)\n"
+                          ".. \")\", 2)\n"
+                "end\n"
+                /* only pointers and arrays convert implicitly */
+                "ptr[0] = buf\n"
+                "local addr = tonumber(cast(uintptr_t, ptr[0]))\n"
+                "if addr == 0 then\n"
+                    "error(\"bad argument #1 to 'receive_into' \"\n"
+                          ".. \"(NULL buffer)\", 2)\n"
+                "end\n"
+                "if type(len) ~= \"number\" or len < 0 then\n"
+                    "error(\"bad argument #2 to 'receive_into' \"\n"
+                          ".. \"(bad len argument)\", 2)\n"
+                "end\n"
+                /* the size of pointers is not the one of their memory */
+                "local size = sizeof(buf)\n"
+                "if size and len > size\n"
+                    "and not find(tostring(typeof(buf)), \"[*&]\")\n"
+                "then\n"
+                    "error(\"bad argument #2 to 'receive_into' \"\n"
+                          ".. \"(len exceeds the size of the buffer)\", 2)\n"
+                "end\n"
+                /* not a tail call, keeping buf alive while the C one yields */
+                "local n, err, partial = receive_into(sock, addr, len)\n"
+                "return n, err, partial\n"
+            "end\n";
+
+        rc = luaL_loadbuffer(L, buf, sizeof(buf) - 1,
+                             "=tcpsock:receive_into");
+    }
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_CRIT, log, 0,
+                      "failed to load Lua code for tcpsock:receive_into(): "
+                      "%i", rc);
+
+    } else {
+        lua_pushcfunction(L, ngx_http_lua_socket_tcp_receive_into);
+
+        if (lua_pcall(L, 1, 1, 0) != 0) {
+            ngx_log_error(NGX_LOG_CRIT, log, 0,
+                          "failed to create tcpsock:receive_into(): %s",
+                          lua_tostring(L, -1));
+            lua_pop(L, 1);
+
+        } else {
+            lua_setfield(L, -2, "receive_into");
+        }
+    }
+
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_send);
     lua_setfield(L, -2, "send");
 
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_sendfile);
+    lua_setfield(L, -2, "sendfile");
+
     lua_pushcfunction(L, ngx_http_lua_socket_tcp_close);
     lua_setfield(L, -2, "close");
 
@@ -554,13 +668,16 @@ ngx_http_lua_socket_tcp_connect_helper(lua_State *L,
     int                                    host_size;
     int                                    saved_top;
     ngx_int_t                              rc;
+    ngx_int_t                              state;
     ngx_str_t                              host;
     ngx_str_t                             *conn_op_host;
     ngx_url_t                              url;
+    ngx_addr_t                             addr;
     ngx_queue_t                           *q;
     ngx_resolver_ctx_t                    *rctx, temp;
     ngx_http_lua_co_ctx_t                 *coctx;
     ngx_http_core_loc_conf_t              *clcf;
+    ngx_http_lua_loc_conf_t               *llcf;
     ngx_http_lua_socket_pool_t            *spool;
     ngx_http_lua_socket_tcp_conn_op_ctx_t *conn_op_ctx;
 
@@ -730,6 +847,38 @@ ngx_http_lua_socket_tcp_connect_helper(lua_State *L,
     } else {
         u->resolved->host = host;
         u->resolved->port = url.default_port;
+
+        llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+        if (llcf->dns_cache) {
+            rc = ngx_http_lua_dns_cache_lookup(r, llcf->dns_cache, &host,
+                                               &addr, &state);
+
+            if (rc == NGX_DONE) {
+                u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
+                lua_pushnil(L);
+                lua_pushfstring(L, "%s could not be resolved (%d: %s)",
+                                host.data, (int) state,
+                                ngx_resolver_strerror(state));
+                goto failed;
+            }
+
+            if (rc == NGX_OK) {
+                rc = ngx_http_lua_socket_resolved_addr(r, u->resolved,
+                                                       addr.sockaddr,
+                                                       addr.socklen);
+            }
+
+            if (rc == NGX_ERROR) {
+                if (resuming) {
+                    lua_pushnil(L);
+                    lua_pushliteral(L, "no memory");
+                    goto failed;
+                }
+
+                goto no_memory_and_not_resuming;
+            }
+        }
     }
 
     if (u->resolved->sockaddr) {
@@ -1085,6 +1234,7 @@ ngx_http_lua_socket_tcp_connect(lua_State *L)
     ngx_memzero(u, sizeof(ngx_http_lua_socket_tcp_upstream_t));
 
     u->request = r; /* set the controlling request */
+    u->request_ref = LUA_NOREF;
 
     u->conf = llcf;
 
@@ -1165,10 +1315,9 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
     ngx_connection_t                    *c;
     ngx_http_upstream_resolved_t        *ur;
     ngx_http_lua_ctx_t                  *lctx;
+    ngx_http_lua_loc_conf_t             *llcf;
     lua_State                           *L;
     ngx_http_lua_socket_tcp_upstream_t  *u;
-    u_char                              *p;
-    size_t                               len;
     socklen_t                            socklen;
     struct sockaddr                     *sockaddr;
     ngx_uint_t                           i;
@@ -1187,6 +1336,12 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
         return;
     }
 
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    if (llcf->dns_cache) {
+        ngx_http_lua_dns_cache_update(llcf->dns_cache, ctx);
+    }
+
     lctx->cur_co_ctx = u->write_co_ctx;
 
     u->write_co_ctx->cleanup = NULL;
@@ -1262,29 +1417,12 @@ ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
 
     ngx_memcpy(sockaddr, ur->addrs[i].sockaddr, socklen);
 
-    switch (sockaddr->sa_family) {
-#if (NGX_HAVE_INET6)
-    case AF_INET6:
-        ((struct sockaddr_in6 *) sockaddr)->sin6_port = htons(ur->port);
-        break;
-#endif
-    default: /* AF_INET */
-        ((struct sockaddr_in *) sockaddr)->sin_port = htons(ur->port);
-    }
-
-    p = ngx_pnalloc(r->pool, NGX_SOCKADDR_STRLEN);
-    if (p == NULL) {
+    if (ngx_http_lua_socket_resolved_addr(r, ur, sockaddr, socklen)
+        != NGX_OK)
+    {
         goto nomem;
     }
 
-    len = ngx_sock_ntop(sockaddr, socklen, p, NGX_SOCKADDR_STRLEN, 1);
-    ur->sockaddr = sockaddr;
-    ur->socklen = socklen;
-
-    ur->host.data = p;
-    ur->host.len = len;
-    ur->naddrs = 1;
-
     ngx_resolve_name_done(ctx);
     ur->ctx = NULL;
 
@@ -1324,6 +1462,41 @@ nomem:
 }
 
 
+static ngx_int_t
+ngx_http_lua_socket_resolved_addr(ngx_http_request_t *r,
+    ngx_http_upstream_resolved_t *ur, struct sockaddr *sockaddr,
+    socklen_t socklen)
+{
+    u_char      *p;
+    size_t       len;
+
+    switch (sockaddr->sa_family) {
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        ((struct sockaddr_in6 *) sockaddr)->sin6_port = htons(ur->port);
+        break;
+#endif
+    default: /* AF_INET */
+        ((struct sockaddr_in *) sockaddr)->sin_port = htons(ur->port);
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_SOCKADDR_STRLEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = ngx_sock_ntop(sockaddr, socklen, p, NGX_SOCKADDR_STRLEN, 1);
+    ur->sockaddr = sockaddr;
+    ur->socklen = socklen;
+
+    ur->host.data = p;
+    ur->host.len = len;
+    ur->naddrs = 1;
+
+    return NGX_OK;
+}
+
+
 static void
 ngx_http_lua_socket_init_peer_connection_addr_text(ngx_peer_connection_t *pc)
 {
@@ -2355,6 +2528,70 @@ ngx_http_lua_socket_tcp_receive(lua_State *L)
 }
 
 
+static int
+ngx_http_lua_socket_tcp_receive_into(lua_State *L)
+{
+    lua_Integer                          bytes;
+    ngx_http_request_t                  *r;
+    ngx_http_lua_loc_conf_t             *llcf;
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+
+    /* called by the Lua wrapper with the address of the buffer */
+
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+
+    if (u == NULL || u->peer.connection == NULL || u->read_closed) {
+
+        llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+        if (llcf->log_socket_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to receive data on a closed socket: u:%p, "
+                          "c:%p, ft:%d eof:%d",
+                          u, u ? u->peer.connection : NULL,
+                          u ? (int) u->ft_type : 0, u ? (int) u->eof : 0);
+        }
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_socket_check_busy_connecting(r, u, L);
+    ngx_http_lua_socket_check_busy_reading(r, u, L);
+
+    bytes = lua_tointeger(L, 3);
+    if (bytes == 0) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    u->recv_into = (u_char *) (uintptr_t) lua_tonumber(L, 2);
+
+    u->input_filter = ngx_http_lua_socket_read_into;
+    u->length = (size_t) bytes;
+    u->rest = u->length;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket calling receive_into() method to read "
+                   "%uz bytes into %p", u->rest, u->recv_into);
+
+    return ngx_http_lua_socket_tcp_receive_helper(r, u, L);
+}
+
+
 static ngx_int_t
 ngx_http_lua_socket_read_chunk(void *data, ssize_t bytes)
 {
@@ -2429,6 +2666,20 @@ ngx_http_lua_socket_read_any(void *data, ssize_t bytes)
 }
 
 
+static ngx_int_t
+ngx_http_lua_socket_read_into(void *data, ssize_t bytes)
+{
+    ngx_http_lua_socket_tcp_upstream_t      *u = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, u->request->connection->log, 0,
+                   "lua tcp socket read into");
+
+    /* the same as read_chunk(), only the data is not pushed as a string */
+
+    return ngx_http_lua_socket_read_chunk(data, bytes);
+}
+
+
 static ngx_int_t
 ngx_http_lua_socket_tcp_read(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u)
@@ -2721,13 +2972,9 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
     ngx_http_lua_ctx_t                  *ctx;
     ngx_http_lua_socket_tcp_upstream_t  *u;
     int                                  type;
-    int                                  tcp_nodelay;
     const char                          *msg;
     ngx_buf_t                           *b;
-    ngx_connection_t                    *c;
     ngx_http_lua_loc_conf_t             *llcf;
-    ngx_http_core_loc_conf_t            *clcf;
-    ngx_http_lua_co_ctx_t               *coctx;
 
     /* TODO: add support for the optional "i" and "j" arguments */
 
@@ -2823,6 +3070,24 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
+    if (len >= NGX_HTTP_LUA_SOCKET_INPLACE_LEN
+        && (type == LUA_TSTRING || type == LUA_TTABLE))
+    {
+        rc = ngx_http_lua_socket_inplace_bufs(r, u, L, type);
+
+        if (rc == NGX_ERROR) {
+            return luaL_error(L, "no memory");
+        }
+
+        if (rc == NGX_OK) {
+            b = u->request_bufs->buf;
+            len = u->request_len;
+            goto prepared;
+        }
+
+        /* rc == NGX_DECLINED: no long strings to send in place */
+    }
+
     cl = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
                                          &ctx->free_bufs, len);
 
@@ -2881,6 +3146,28 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
 
     u->request_len = len;
 
+prepared:
+
+    ngx_http_lua_probe_socket_tcp_send_start(r, u, b->pos, len);
+
+    return ngx_http_lua_socket_tcp_send_helper(r, u, L);
+}
+
+
+static int
+ngx_http_lua_socket_tcp_send_helper(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    ngx_int_t                            rc;
+    int                                  tcp_nodelay;
+    ngx_connection_t                    *c;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_lua_loc_conf_t             *llcf;
+    ngx_http_core_loc_conf_t            *clcf;
+    ngx_http_lua_co_ctx_t               *coctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
     /* mimic ngx_http_upstream_init_request here */
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
@@ -2916,8 +3203,6 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
     u->write_co_ctx = NULL;
 #endif
 
-    ngx_http_lua_probe_socket_tcp_send_start(r, u, b->pos, len);
-
     rc = ngx_http_lua_socket_send(r, u);
 
     dd("socket send returned %d", (int) rc);
@@ -2927,7 +3212,7 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
     }
 
     if (rc == NGX_OK) {
-        lua_pushinteger(L, len);
+        lua_pushinteger(L, u->request_len);
         return 1;
     }
 
@@ -2961,46 +3246,272 @@ ngx_http_lua_socket_tcp_send(lua_State *L)
 
 
 static int
-ngx_http_lua_socket_tcp_send_retval_handler(ngx_http_request_t *r,
-    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+ngx_http_lua_socket_tcp_sendfile(lua_State *L)
 {
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua tcp socket send return value handler");
+    int                                  n;
+    off_t                                offset, size;
+    lua_Number                           len;
+    ngx_fd_t                             fd;
+    ngx_err_t                            err;
+    ngx_str_t                            name;
+    ngx_file_info_t                      fi;
+    ngx_connection_t                    *c;
+    ngx_http_request_t                  *r;
+    ngx_http_lua_loc_conf_t             *llcf;
+    ngx_http_core_loc_conf_t            *clcf;
+    ngx_http_lua_socket_sendfile_t      *sf;
+    ngx_http_lua_socket_tcp_upstream_t  *u;
+    u_char                              *p;
+    u_char                               errstr[NGX_MAX_ERROR_STR];
 
-    if (u->ft_type) {
-        return ngx_http_lua_socket_write_error_retval_handler(r, u, L);
+    n = lua_gettop(L);
+    if (n < 2 || n > 4) {
+        return luaL_error(L, "expecting 2, 3, or 4 arguments "
+                          "(including the object), but got %d", n);
     }
 
-    lua_pushinteger(L, u->request_len);
-    return 1;
-}
-
-
-static int
-ngx_http_lua_socket_tcp_receive_retval_handler(ngx_http_request_t *r,
-    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
-{
-    int                          n;
-    ngx_int_t                    rc;
-    ngx_http_lua_ctx_t          *ctx;
-    ngx_event_t                 *ev;
-
-    ngx_http_lua_loc_conf_t             *llcf;
+    r = ngx_http_lua_get_req(L);
+    if (r == NULL) {
+        return luaL_error(L, "no request found");
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "lua tcp socket receive return value handler");
+    luaL_checktype(L, 1, LUA_TTABLE);
 
-    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    lua_rawgeti(L, 1, SOCKET_CTX_INDEX);
+    u = lua_touserdata(L, -1);
+    lua_pop(L, 1);
 
-#if 1
-    if (u->raw_downstream || u->body_downstream) {
+    if (u == NULL || u->peer.connection == NULL || u->write_closed) {
         llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
 
-        if (llcf->check_client_abort) {
-
-            r->read_event_handler = ngx_http_lua_rd_check_broken_connection;
+        if (llcf->log_socket_errors) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "attempt to send data on a closed socket: u:%p, "
+                          "c:%p, ft:%d eof:%d",
+                          u, u ? u->peer.connection : NULL,
+                          u ? (int) u->ft_type : 0, u ? (int) u->eof : 0);
+        }
 
-            ev = r->connection->read;
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    ngx_http_lua_socket_check_busy_connecting(r, u, L);
+    ngx_http_lua_socket_check_busy_writing(r, u, L);
+
+    if (u->body_downstream) {
+        return luaL_error(L, "attempt to write to request sockets");
+    }
+
+    offset = 0;
+    len = -1;
+
+    if (n > 2 && !lua_isnil(L, 3)) {
+        if (!lua_isnumber(L, 3) || lua_tonumber(L, 3) < 0) {
+            return luaL_argerror(L, 3, "bad offset argument");
+        }
+
+        offset = (off_t) lua_tonumber(L, 3);
+    }
+
+    if (n > 3 && !lua_isnil(L, 4)) {
+        if (!lua_isnumber(L, 4) || lua_tonumber(L, 4) < 0) {
+            return luaL_argerror(L, 4, "bad len argument");
+        }
+
+        len = lua_tonumber(L, 4);
+    }
+
+    switch (lua_type(L, 2)) {
+
+    case LUA_TSTRING:
+        name.data = (u_char *) lua_tolstring(L, 2, &name.len);
+
+        fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+        if (fd == NGX_INVALID_FILE) {
+            err = ngx_errno;
+            goto failed;
+        }
+
+        break;
+
+    case LUA_TNUMBER:
+        if (lua_tonumber(L, 2) < 0) {
+            return luaL_argerror(L, 2, "bad fd argument");
+        }
+
+        fd = (ngx_fd_t) lua_tointeger(L, 2);
+        ngx_str_set(&name, "fd");
+        break;
+
+    default:
+        return luaL_argerror(L, 2, "string or number expected");
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        err = ngx_errno;
+
+        if (lua_type(L, 2) == LUA_TSTRING) {
+            (void) ngx_close_file(fd);
+        }
+
+        goto failed;
+    }
+
+    /* send at most the rest of the file */
+
+    size = ngx_file_size(&fi);
+    size = offset < size ? size - offset : 0;
+
+    if (len >= 0 && len < size) {
+        size = (off_t) len;
+    }
+
+    if (size == 0) {
+        if (lua_type(L, 2) == LUA_TSTRING) {
+            (void) ngx_close_file(fd);
+        }
+
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    c = u->peer.connection;
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    sf = u->sendfile;
+
+    if (sf == NULL) {
+        sf = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_socket_sendfile_t));
+        if (sf == NULL) {
+            if (lua_type(L, 2) == LUA_TSTRING) {
+                (void) ngx_close_file(fd);
+            }
+
+            return luaL_error(L, "no memory");
+        }
+
+        /* mimic ngx_http_upstream_init_request here, the read buffers
+         * are kept in sf->output.free for the next calls */
+
+        sf->output.alignment = clcf->directio_alignment;
+        sf->output.pool = r->pool;
+        sf->output.bufs.num = 2;
+        sf->output.bufs.size = u->conf->buffer_size;
+        sf->output.tag = (ngx_buf_tag_t) &ngx_http_lua_module;
+        sf->output.output_filter = ngx_chain_writer;
+        sf->output.filter_ctx = &sf->writer;
+
+        sf->writer.pool = r->pool;
+
+        u->sendfile = sf;
+    }
+
+    /* TLS connections read the file into the output bufs instead */
+
+    sf->output.sendfile = (ngx_io.flags & NGX_IO_SENDFILE) ? 1 : 0;
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl) {
+        sf->output.sendfile = 0;
+    }
+#endif
+
+    sf->writer.out = NULL;
+    sf->writer.last = &sf->writer.out;
+    sf->writer.connection = c;
+    sf->writer.limit = clcf->sendfile_max_chunk;
+
+    ngx_memzero(&sf->file, sizeof(ngx_file_t));
+
+    sf->file.fd = fd;
+    sf->file.name = name;
+    sf->file.log = r->connection->log;
+
+    /* the tag of the file buf must not be ours, or it would be freed
+     * into sf->output.free as a read buf */
+
+    ngx_memzero(&sf->buf, sizeof(ngx_buf_t));
+
+    sf->buf.in_file = 1;
+    sf->buf.file = &sf->file;
+    sf->buf.file_pos = offset;
+    sf->buf.file_last = offset + size;
+
+    sf->chain.buf = &sf->buf;
+    sf->chain.next = NULL;
+
+    sf->in = &sf->chain;
+    sf->active = 1;
+    sf->close = (lua_type(L, 2) == LUA_TSTRING);
+
+    u->request_len = (size_t) size;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket sendfile %O bytes at %O of \"%V\", "
+                   "sendfile:%d", size, offset, &name,
+                   (int) sf->output.sendfile);
+
+    return ngx_http_lua_socket_tcp_send_helper(r, u, L);
+
+failed:
+
+    p = ngx_strerror(err, errstr, sizeof(errstr));
+    /* for compatibility with LuaSocket */
+    ngx_strlow(errstr, errstr, p - errstr);
+
+    lua_pushnil(L);
+    lua_pushlstring(L, (char *) errstr, p - errstr);
+    return 2;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_send_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket send return value handler");
+
+    if (u->ft_type) {
+        return ngx_http_lua_socket_write_error_retval_handler(r, u, L);
+    }
+
+    lua_pushinteger(L, u->request_len);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_receive_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L)
+{
+    int                          n;
+    ngx_int_t                    rc;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_event_t                 *ev;
+
+    ngx_http_lua_loc_conf_t             *llcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket receive return value handler");
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+#if 1
+    if (u->raw_downstream || u->body_downstream) {
+        llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+        if (llcf->check_client_abort) {
+
+            r->read_event_handler = ngx_http_lua_rd_check_broken_connection;
+
+            ev = r->connection->read;
 
             dd("rev active: %d", ev->active);
 
@@ -3327,7 +3838,7 @@ ngx_http_lua_socket_send_handler(ngx_http_request_t *r,
         return;
     }
 
-    if (u->request_bufs) {
+    if (u->request_bufs || (u->sendfile && u->sendfile->active)) {
         (void) ngx_http_lua_socket_send(r, u);
     }
 }
@@ -3337,10 +3848,12 @@ static ngx_int_t
 ngx_http_lua_socket_send(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u)
 {
-    ngx_int_t                    n;
-    ngx_connection_t            *c;
-    ngx_http_lua_ctx_t          *ctx;
-    ngx_buf_t                   *b;
+    ngx_int_t                        n;
+    ngx_connection_t                *c;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_buf_t                       *b;
+    ngx_chain_t                     *cl;
+    ngx_http_lua_socket_sendfile_t  *sf;
 
     c = u->peer.connection;
 
@@ -3354,46 +3867,102 @@ ngx_http_lua_socket_send(ngx_http_request_t *r,
         return NGX_ERROR;
     }
 
-    b = u->request_bufs->buf;
+    sf = u->sendfile;
 
     for (;;) {
-        n = c->send(c, b->pos, b->last - b->pos);
 
-        if (n >= 0) {
-            b->pos += n;
+        if (sf && sf->active) {
+            /* sendfile(2), or the file read into bufs for TLS */
+
+            n = ngx_output_chain(&sf->output, sf->in);
+            sf->in = NULL;
 
-            if (b->pos == b->last) {
-                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                               "lua tcp socket sent all the data");
+            if (n == NGX_AGAIN) {
 
-                if (c->write->timer_set) {
-                    ngx_del_timer(c->write);
+                /*
+                 * stopped by sendfile_max_chunk with the socket still
+                 * writable, for which no event is to come
+                 */
+
+                if (c->write->ready) {
+#if (nginx_version >= 1017005)
+                    ngx_post_event(c->write, &ngx_posted_next_events);
+#else
+                    ngx_post_event(c->write, &ngx_posted_events);
+#endif
                 }
 
+                break;
+            }
 
-                ngx_chain_update_chains(r->pool,
-                                        &ctx->free_bufs, &ctx->busy_bufs,
-                                        &u->request_bufs,
-                                        (ngx_buf_tag_t) &ngx_http_lua_module);
+            if (n != NGX_OK) {
+                n = NGX_ERROR;
+                break;
+            }
 
-                u->write_event_handler = ngx_http_lua_socket_dummy_handler;
+        } else if (u->request_bufs->next) {
+            /* the bufs of ngx_http_lua_socket_inplace_bufs() */
 
-                if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-                    ngx_http_lua_socket_handle_write_error(r, u,
-                                                NGX_HTTP_LUA_SOCKET_FT_ERROR);
-                    return NGX_ERROR;
-                }
+            for (cl = u->request_bufs; ngx_buf_size(cl->buf) == 0;
+                 cl = cl->next)
+            {
+                /* void */
+            }
 
-                ngx_http_lua_socket_handle_write_success(r, u);
-                return NGX_OK;
+            cl = c->send_chain(c, cl, 0);
+
+            if (cl == NGX_CHAIN_ERROR) {
+                n = NGX_ERROR;
+                break;
             }
 
-            /* keep sending more data */
-            continue;
+            if (cl) {
+                n = NGX_AGAIN;
+                break;
+            }
+
+        } else {
+            b = u->request_bufs->buf;
+            n = c->send(c, b->pos, b->last - b->pos);
+
+            if (n < 0) {
+                /* NGX_ERROR || NGX_AGAIN */
+                break;
+            }
+
+            b->pos += n;
+
+            if (b->pos != b->last) {
+                /* keep sending more data */
+                continue;
+            }
         }
 
-        /* NGX_ERROR || NGX_AGAIN */
-        break;
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua tcp socket sent all the data");
+
+        if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+
+        ngx_http_lua_socket_inplace_free(r, u);
+        ngx_http_lua_socket_sendfile_done(r, u);
+
+        ngx_chain_update_chains(r->pool,
+                                &ctx->free_bufs, &ctx->busy_bufs,
+                                &u->request_bufs,
+                                (ngx_buf_tag_t) &ngx_http_lua_module);
+
+        u->write_event_handler = ngx_http_lua_socket_dummy_handler;
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            ngx_http_lua_socket_handle_write_error(r, u,
+                                                NGX_HTTP_LUA_SOCKET_FT_ERROR);
+            return NGX_ERROR;
+        }
+
+        ngx_http_lua_socket_handle_write_success(r, u);
+        return NGX_OK;
     }
 
     if (n == NGX_ERROR) {
@@ -3424,6 +3993,287 @@ ngx_http_lua_socket_send(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_lua_socket_inplace_bufs(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u, lua_State *L, int type)
+{
+    size_t                           len;
+    u_char                          *p;
+    ngx_chain_t                     *cl;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_lua_socket_inplace_t    ip;
+
+    /*
+     * the long strings of the data are handed to the kernel in place as
+     * iovecs, with the values in between copied to a single buffer, and
+     * the strings are anchored in the registry until they are sent
+     */
+
+    ngx_memzero(&ip, sizeof(ngx_http_lua_socket_inplace_t));
+
+    u->request_bufs = NULL;
+    ip.last = &u->request_bufs;
+
+    if (type == LUA_TSTRING) {
+        p = (u_char *) lua_tolstring(L, 2, &len);
+
+        if (ngx_http_lua_socket_inplace_add(r, &ip, p, len) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ip.nrefs = 1;
+        lua_pushvalue(L, 2);
+
+    } else {
+        ngx_http_lua_socket_inplace_count(L, 2, &ip);
+
+        if (ip.nrefs == 0) {
+            return NGX_DECLINED;
+        }
+
+        if (ip.copy_len) {
+            ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+            ip.copy = ngx_http_lua_chain_get_free_buf(r->connection->log,
+                                                      r->pool,
+                                                      &ctx->free_bufs,
+                                                      ip.copy_len);
+            if (ip.copy == NULL) {
+                return NGX_ERROR;
+            }
+
+            ip.dst = ip.copy->buf->start;
+        }
+
+        lua_createtable(L, ip.nrefs, 0);
+        ip.anchor = lua_gettop(L);
+        ip.nrefs = 0;
+
+        if (ngx_http_lua_socket_inplace_table(r, L, 2, &ip) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_lua_socket_inplace_free(r, u);
+
+    u->request_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    len = 0;
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        len += cl->buf->last - cl->buf->pos;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket send %uz bytes, %uz bytes copied, "
+                   "%d strings in place", len, len - ip.ref_len, ip.nrefs);
+
+    u->request_len = len;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_socket_inplace_count(lua_State *L, int index,
+    ngx_http_lua_socket_inplace_t *ip)
+{
+    int                  i, n;
+    size_t               len;
+
+    /* the table has been checked by ngx_http_lua_calc_strlen_in_table() */
+
+    n = (int) lua_objlen(L, index);
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, index, i);
+
+        switch (lua_type(L, -1)) {
+
+        case LUA_TTABLE:
+            ngx_http_lua_socket_inplace_count(L, lua_gettop(L), ip);
+            break;
+
+        case LUA_TSTRING:
+            lua_tolstring(L, -1, &len);
+
+            if (len >= NGX_HTTP_LUA_SOCKET_INPLACE_LEN) {
+                ip->nrefs++;
+
+            } else {
+                ip->copy_len += len;
+            }
+
+            break;
+
+        default: /* LUA_TNUMBER */
+            ip->copy_len += ngx_http_lua_get_num_len(L, -1);
+            break;
+        }
+
+        lua_pop(L, 1);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_inplace_table(ngx_http_request_t *r, lua_State *L,
+    int index, ngx_http_lua_socket_inplace_t *ip)
+{
+    int                  i, n;
+    size_t               len;
+    u_char              *p;
+
+    n = (int) lua_objlen(L, index);
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, index, i);
+
+        switch (lua_type(L, -1)) {
+
+        case LUA_TTABLE:
+            if (ngx_http_lua_socket_inplace_table(r, L, lua_gettop(L), ip)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case LUA_TSTRING:
+            p = (u_char *) lua_tolstring(L, -1, &len);
+
+            if (len >= NGX_HTTP_LUA_SOCKET_INPLACE_LEN) {
+                if (ngx_http_lua_socket_inplace_add(r, ip, p, len) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, ip->anchor, ++ip->nrefs);
+                break;
+            }
+
+            if (ip->run == NULL
+                && ngx_http_lua_socket_inplace_add(r, ip, NULL, 0) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ip->run->last = ngx_copy(ip->run->last, p, len);
+            break;
+
+        default: /* LUA_TNUMBER */
+            if (ip->run == NULL
+                && ngx_http_lua_socket_inplace_add(r, ip, NULL, 0) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ip->run->last = ngx_http_lua_write_num(L, -1, ip->run->last);
+            break;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_inplace_add(ngx_http_request_t *r,
+    ngx_http_lua_socket_inplace_t *ip, u_char *p, size_t len)
+{
+    ngx_buf_t                   *b;
+    ngx_chain_t                 *cl;
+    ngx_http_lua_ctx_t          *ctx;
+
+    /* adds the buf of a string sent in place, or that of a run of copies
+     * when p is NULL */
+
+    if (ip->run) {
+        ip->dst = ip->run->last;
+        ip->run = NULL;
+    }
+
+    if (p == NULL && ip->copy) {
+        cl = ip->copy;
+        ip->copy = NULL;
+
+    } else {
+        ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+
+        cl = ngx_http_lua_chain_get_free_buf(r->connection->log, r->pool,
+                                             &ctx->free_bufs, 0);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    b = cl->buf;
+    b->memory = 1;
+
+    if (p) {
+        b->pos = p;
+        b->last = p + len;
+        ip->ref_len += len;
+
+    } else {
+        b->pos = ip->dst;
+        b->last = ip->dst;
+        ip->run = b;
+    }
+
+    *ip->last = cl;
+    ip->last = &cl->next;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_socket_inplace_free(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u)
+{
+    lua_State                   *L;
+
+    if (u->request_ref == LUA_NOREF) {
+        return;
+    }
+
+    L = ngx_http_lua_get_lua_vm(r, NULL);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, u->request_ref);
+    u->request_ref = LUA_NOREF;
+}
+
+
+static void
+ngx_http_lua_socket_sendfile_done(ngx_http_request_t *r,
+    ngx_http_lua_socket_tcp_upstream_t *u)
+{
+    ngx_http_lua_socket_sendfile_t  *sf;
+
+    sf = u->sendfile;
+
+    if (sf == NULL || !sf->active) {
+        return;
+    }
+
+    sf->active = 0;
+    sf->in = NULL;
+    sf->output.in = NULL;
+    sf->output.busy = NULL;
+    sf->writer.out = NULL;
+    sf->writer.last = &sf->writer.out;
+
+    if (sf->close && ngx_close_file(sf->file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &sf->file.name);
+    }
+}
+
+
 static void
 ngx_http_lua_socket_handle_conn_success(ngx_http_request_t *r,
     ngx_http_lua_socket_tcp_upstream_t *u)
@@ -3820,6 +4670,9 @@ ngx_http_lua_socket_tcp_finalize_write_part(ngx_http_request_t *r,
     ngx_connection_t                    *c;
     ngx_http_lua_ctx_t                  *ctx;
 
+    ngx_http_lua_socket_inplace_free(r, u);
+    ngx_http_lua_socket_sendfile_done(r, u);
+
     if (u->write_closed) {
         return;
     }
@@ -4649,8 +5502,10 @@ ngx_http_lua_socket_read_until(void *data, ssize_t bytes)
     ngx_http_request_t                      *r;
     ngx_buf_t                               *b;
     u_char                                   c;
+    u_char                                  *p;
     u_char                                  *pat;
     size_t                                   pat_len;
+    size_t                                   n;
     int                                      i;
     int                                      state;
     int                                      old_state = 0; /* just to make old
@@ -4678,6 +5533,46 @@ ngx_http_lua_socket_read_until(void *data, ssize_t bytes)
 
     i = 0;
     while (i < bytes) {
+
+        if (state == 0) {
+
+            /*
+             * skips to the next occurrence of the first byte of the
+             * pattern with memchr(), which is vectorized in most libcs,
+             * instead of running the state machine over every byte
+             */
+
+            n = bytes - i;
+
+            if (u->length && n > u->rest) {
+                n = u->rest;
+            }
+
+            p = memchr(b->pos + i, pat[0], n);
+            if (p) {
+                n = p - (b->pos + i);
+            }
+
+            if (n) {
+                u->buf_in->buf->last += n;
+                i += n;
+
+                if (u->length) {
+                    u->rest -= n;
+
+                    if (u->rest == 0) {
+                        cp->state = state;
+                        b->pos += i;
+                        return NGX_OK;
+                    }
+                }
+
+                if (i == bytes) {
+                    break;
+                }
+            }
+        }
+
         c = b->pos[i];
 
         dd("%d: read char %d, state: %d", i, c, state);
@@ -5051,6 +5946,7 @@ ngx_http_lua_req_socket(lua_State *L)
     coctx = ctx->cur_co_ctx;
 
     u->request = r;
+    u->request_ref = LUA_NOREF;
 
     llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
 
@@ -5712,6 +6608,7 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
     size_t                   chunk_size;
     ngx_buf_t               *b;
     size_t                   nbufs;
+    u_char                  *p;
     luaL_Buffer              luabuf;
 
     dd("bufs_in: %p, buf_in: %p", u->bufs_in, u->buf_in);
@@ -5719,7 +6616,14 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
     nbufs = 0;
     ll = NULL;
 
-    luaL_buffinit(L, &luabuf);
+    /* receive_into() copies the data into the buffer of the caller */
+
+    p = u->input_filter == ngx_http_lua_socket_read_into ? u->recv_into
+                                                         : NULL;
+
+    if (p == NULL) {
+        luaL_buffinit(L, &luabuf);
+    }
 
     for (cl = u->bufs_in; cl; cl = cl->next) {
         b = cl->buf;
@@ -5728,7 +6632,12 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
         dd("copying input data chunk from %p: \"%.*s\"", cl,
            (int) chunk_size, b->pos);
 
-        luaL_addlstring(&luabuf, (char *) b->pos, chunk_size);
+        if (p) {
+            p = ngx_cpymem(p, b->pos, chunk_size);
+
+        } else {
+            luaL_addlstring(&luabuf, (char *) b->pos, chunk_size);
+        }
 
         if (cl->next) {
             ll = &cl->next;
@@ -5741,7 +6650,12 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
         nbufs++;
     }
 
-    luaL_pushresult(&luabuf);
+    if (p) {
+        lua_pushinteger(L, p - u->recv_into);
+
+    } else {
+        luaL_pushresult(&luabuf);
+    }
 
 #if (DDEBUG)
     dd("size: %d, nbufs: %d", (int) size, (int) nbufs);
@@ -5749,7 +6663,8 @@ ngx_http_lua_socket_push_input_data(ngx_http_request_t *r,
 
 #if (NGX_DTRACE)
     ngx_http_lua_probe_socket_tcp_receive_done(r, u,
-                                               (u_char *) lua_tostring(L, -1),
+                                               p ? u->recv_into
+                                               : (u_char *) lua_tostring(L, -1),
                                                size);
 #endif
 
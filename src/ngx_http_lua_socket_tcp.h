@@ -49,6 +49,18 @@ typedef struct {
 } ngx_http_lua_socket_tcp_conn_op_ctx_t;
 
 
+typedef struct {
+    ngx_output_chain_ctx_t           output;
+    ngx_chain_writer_ctx_t           writer;
+    ngx_file_t                       file;
+    ngx_buf_t                        buf;
+    ngx_chain_t                      chain;
+    ngx_chain_t                     *in;  /* not given to the output yet */
+    unsigned                         active:1;
+    unsigned                         close:1;  /* the file is opened by us */
+} ngx_http_lua_socket_sendfile_t;
+
+
 #define ngx_http_lua_socket_tcp_free_conn_op_ctx(conn_op_ctx)                \
     ngx_free(conn_op_ctx->host.data);                                        \
     ngx_free(conn_op_ctx)
@@ -109,9 +121,14 @@ struct ngx_http_lua_socket_tcp_upstream_s {
 
     ngx_int_t                      (*input_filter)(void *data, ssize_t bytes);
     void                            *input_filter_ctx;
+    u_char                          *recv_into; /* the buffer of
+                                                   receive_into() */
 
     size_t                           request_len;
     ngx_chain_t                     *request_bufs;
+    int                              request_ref; /* anchors the Lua strings
+                                                     sent in place */
+    ngx_http_lua_socket_sendfile_t  *sendfile;
 
     ngx_http_lua_co_ctx_t           *read_co_ctx;
     ngx_http_lua_co_ctx_t           *write_co_ctx;
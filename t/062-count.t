@@ -34,7 +34,7 @@ __DATA__
 --- request
 GET /test
 --- response_body
-ngx: 113
+ngx: 114
 --- no_error_log
 [error]
 
@@ -55,7 +55,7 @@ ngx: 113
 --- request
 GET /test
 --- response_body
-113
+114
 --- no_error_log
 [error]
 
@@ -83,7 +83,7 @@ GET /test
 --- request
 GET /test
 --- response_body
-n = 113
+n = 114
 --- no_error_log
 [error]
 
@@ -212,7 +212,7 @@ n = 2
 --- request
 GET /test
 --- response_body
-n = 4
+n = 5
 --- no_error_log
 [error]
 
@@ -283,7 +283,7 @@ n = 6
 --- request
 GET /test
 --- response_body
-n = 22
+n = 47
 --- no_error_log
 [error]
 
@@ -459,7 +459,7 @@ worker: 4
 --- request
 GET /test
 --- response_body
-n = 14
+n = 16
 --- no_error_log
 [error]
 
@@ -512,7 +512,7 @@ n = 6
 --- request
 GET /test
 --- response_body
-n = 7
+n = 8
 --- no_error_log
 [error]
 
@@ -0,0 +1,188 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 2);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: set, get, incr and delete in a sharded zone
+--- http_config
+    lua_shared_dict dogs 1m shards=4;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 100 do
+                local ok, err = dogs:set("key" .. i, i)
+                if not ok then
+                    ngx.say("failed to set key", i, ": ", err)
+                    return
+                end
+            end
+
+            local sum = 0
+            for i = 1, 100 do
+                sum = sum + dogs:get("key" .. i)
+            end
+
+            ngx.say("sum: ", sum)
+
+            ngx.say("incr: ", dogs:incr("key7", 3))
+            ngx.say("incr init: ", dogs:incr("counter", 1, 10))
+
+            dogs:delete("key7")
+            ngx.say("deleted: ", dogs:get("key7"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 5050
+incr: 10
+incr init: 11
+deleted: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: get_keys visits every shard
+--- http_config
+    lua_shared_dict dogs 1m shards=8;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 50 do
+                dogs:set("key" .. i, true)
+            end
+
+            ngx.say("all keys: ", #dogs:get_keys(0))
+            ngx.say("limited keys: ", #dogs:get_keys(20))
+
+            dogs:set("short", 1, 0.001)
+            ngx.sleep(0.01)
+
+            ngx.say("flushed: ", dogs:flush_expired())
+
+            dogs:flush_all()
+            ngx.say("after flush_all: ", dogs:get("key1"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+all keys: 50
+limited keys: 20
+flushed: 1
+after flush_all: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: lists in a sharded zone
+--- http_config
+    lua_shared_dict dogs 1m shards=2;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 10 do
+                dogs:rpush("list" .. i % 3, i)
+            end
+
+            for i = 0, 2 do
+                ngx.say("list", i, ": ", dogs:llen("list" .. i), " ",
+                        dogs:lpop("list" .. i))
+            end
+        }
+    }
+--- request
+GET /test
+--- response_body
+list0: 3 3
+list1: 4 1
+list2: 3 2
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: free space is the sum of all the shards
+--- http_config
+    lua_shared_dict dogs 1m shards=4;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local free = dogs:free_space()
+            ngx.say("capacity: ", dogs:capacity())
+            ngx.say("free space positive: ", free > 0)
+            ngx.say("free space within capacity: ", free < dogs:capacity())
+        }
+    }
+--- request
+GET /test
+--- response_body
+capacity: 1048576
+free space positive: true
+free space within capacity: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: bad shards number
+--- http_config
+    lua_shared_dict dogs 1m shards=0;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict shards "shards=0"
+
+
+
+=== TEST 6: zone too small for the shards
+--- http_config
+    lua_shared_dict dogs 64k shards=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+lua shared dict size "64k" is too small for "shards=16"
+
@@ -0,0 +1,124 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# Rerun with different worker counts to see how the throughput of a zone
+# scales with and without shards, e.g.
+#
+#   TEST_NGINX_SHDICT_WORKERS=32 prove t/167-shdict-shards-contention.t
+#
+# and compare the "shdict contention" lines in t/servroot/logs/error.log.
+
+$ENV{TEST_NGINX_SHDICT_WORKERS} ||= 4;
+$ENV{TEST_NGINX_SHDICT_OPS} ||= 20000;
+
+#worker_connections(1014);
+master_on();
+workers($ENV{TEST_NGINX_SHDICT_WORKERS});
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+
+our $HttpConfig = <<_EOC_;
+    init_worker_by_lua_block {
+        local ops = $ENV{TEST_NGINX_SHDICT_OPS}
+
+        local function hammer(premature)
+            if premature then
+                return
+            end
+
+            local dogs = ngx.shared.dogs
+            local begin = ngx.now()
+
+            for i = 1, ops do
+                dogs:incr("count" .. i % 64, 1, 0)
+                dogs:set("key" .. i % 1000, i)
+                dogs:get("key" .. (i + 500) % 1000)
+            end
+
+            ngx.update_time()
+
+            ngx.log(ngx.WARN, "shdict contention: ", ops * 3, " ops in ",
+                    ngx.now() - begin, " sec with ",
+                    ngx.worker.count(), " workers")
+
+            dogs:incr("done", 1, 0)
+        end
+
+        assert(ngx.timer.at(0, hammer))
+    }
+_EOC_
+
+our $Config = <<_EOC_;
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local workers = ngx.worker.count()
+
+            for i = 1, 300 do
+                if (dogs:get("done") or 0) == workers then
+                    break
+                end
+
+                ngx.sleep(0.1)
+            end
+
+            local total = 0
+            for i = 0, 63 do
+                total = total + dogs:get("count" .. i)
+            end
+
+            ngx.say("total: ", total == workers * $ENV{TEST_NGINX_SHDICT_OPS})
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: single lock for the whole zone
+--- http_config eval
+"lua_shared_dict dogs 10m;" . $::HttpConfig
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+total: true
+--- error_log
+shdict contention:
+--- timeout: 35
+
+
+
+=== TEST 2: one lock per shard
+--- http_config eval
+"lua_shared_dict dogs 10m shards=16;" . $::HttpConfig
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+total: true
+--- error_log
+shdict contention:
+--- timeout: 35
+
+
+
+=== TEST 3: one lock per shard and lock-free reads
+--- http_config eval
+"lua_shared_dict dogs 10m shards=16 read_mostly;" . $::HttpConfig
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+total: true
+--- error_log
+shdict contention:
+--- timeout: 35
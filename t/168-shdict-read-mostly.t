@@ -0,0 +1,179 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 1);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: values of all the scalar types
+--- http_config
+    lua_shared_dict dogs 1m read_mostly;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("str", "hello", 0, 7)
+            dogs:set("num", 3.14)
+            dogs:set("bool", false)
+
+            ngx.say("str: ", dogs:get("str"))
+            ngx.say("num: ", dogs:get("num"))
+            ngx.say("bool: ", dogs:get("bool"))
+            ngx.say("missing: ", dogs:get("missing"))
+
+            dogs:set("str", "world!")
+            ngx.say("str: ", dogs:get("str"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+str: hello7
+num: 3.14
+bool: false
+missing: nil
+str: world!
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: expired and stale values
+--- http_config
+    lua_shared_dict dogs 1m read_mostly;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", 32, 0.01)
+            dogs:set("blah", 33, 0.3)
+            ngx.sleep(0.02)
+
+            ngx.say("get: ", dogs:get("foo"))
+
+            local val, flags, stale = dogs:get_stale("foo")
+            ngx.say(val, ", ", flags, ", ", stale)
+            local val, flags, stale = dogs:get_stale("blah")
+            ngx.say(val, ", ", flags, ", ", stale)
+        }
+    }
+--- request
+GET /test
+--- response_body
+get: nil
+32, nil, true
+33, nil, false
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: values larger than the caller's buffer
+--- http_config
+    lua_shared_dict dogs 1m read_mostly;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local big = string.rep("a", 10000) .. "z"
+            dogs:set("big", big)
+
+            local val = dogs:get("big")
+            ngx.say("len: ", #val, ", same: ", val == big)
+        }
+    }
+--- request
+GET /test
+--- response_body
+len: 10001, same: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: lists go through the locked path
+--- http_config
+    lua_shared_dict dogs 1m read_mostly;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:lpush("foo", "bar")
+
+            local val, err = dogs:get("foo")
+            ngx.say(val, " ", err)
+        }
+    }
+--- request
+GET /test
+--- response_body
+nil value is a list
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: read_mostly with shards
+--- http_config
+    lua_shared_dict dogs 1m shards=4 read_mostly;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for round = 1, 3 do
+                for i = 1, 200 do
+                    dogs:set("key" .. i, i * round)
+                end
+            end
+
+            local sum = 0
+            for i = 1, 200 do
+                sum = sum + dogs:get("key" .. i)
+            end
+
+            ngx.say("sum: ", sum)
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 60300
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: bad parameter
+--- http_config
+    lua_shared_dict dogs 1m read_only;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict parameter "read_only"
@@ -0,0 +1,270 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: set_multi and get_multi
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local ok, err, forcible = dogs:set_multi({
+                str = "hello",
+                num = 3.14,
+                yes = true,
+                no = false,
+            })
+            ngx.say("set_multi: ", ok, " ", err, " ", forcible)
+
+            local vals, err = dogs:get_multi({ "str", "num", "yes", "no",
+                                               "missing" })
+            if not vals then
+                ngx.say("failed to get_multi: ", err)
+                return
+            end
+
+            ngx.say("str: ", vals.str)
+            ngx.say("num: ", vals.num)
+            ngx.say("yes: ", vals.yes)
+            ngx.say("no: ", vals.no)
+            ngx.say("missing: ", vals.missing)
+        }
+    }
+--- request
+GET /test
+--- response_body
+set_multi: true nil false
+str: hello
+num: 3.14
+yes: true
+no: false
+missing: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: exptime and long values
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local big = string.rep("a", 1000) .. "z"
+
+            dogs:set_multi({ foo = big, bar = "short" }, 0.01)
+            dogs:set("baz", 1)
+
+            local vals = dogs:get_multi({ "foo", "bar", "baz" })
+            ngx.say("foo: ", #vals.foo, " ", vals.foo == big)
+            ngx.say("bar: ", vals.bar)
+
+            ngx.sleep(0.02)
+
+            vals = dogs:get_multi({ "foo", "bar", "baz" })
+            ngx.say("expired: ", vals.foo, " ", vals.bar, " ", vals.baz)
+        }
+    }
+--- request
+GET /test
+--- response_body
+foo: 1001 true
+bar: short
+expired: nil nil 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: batches spanning several shards
+--- http_config
+    lua_shared_dict dogs 1m shards=4 read_mostly;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local vals, keys = {}, {}
+            for i = 1, 100 do
+                vals["key" .. i] = i
+                keys[i] = "key" .. i
+            end
+
+            assert(dogs:set_multi(vals))
+
+            local sum = 0
+            for k, v in pairs(dogs:get_multi(keys)) do
+                sum = sum + v
+            end
+
+            ngx.say("sum: ", sum)
+            ngx.say("single get: ", dogs:get("key42"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 5050
+single get: 42
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: errors
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:lpush("list", "a")
+
+            ngx.say(dogs:get_multi({ "list" }))
+            ngx.say(dogs:get_multi({ "" }))
+            ngx.say(dogs:get_multi({ true }))
+            ngx.say(dogs:set_multi({ foo = {} }))
+            ngx.say(dogs:set_multi({ [true] = "a" }))
+
+            local ok, err = pcall(dogs.set_multi, dogs, { foo = 1 }, -1)
+            ngx.say(err)
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilvalue is a list
+nilempty key
+nilbad key type
+nilbad value type
+nilbad key type
+bad "exptime" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: the FFI interface
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            ffi.cdef[[
+                typedef struct {
+                    int              len;
+                    unsigned char   *data;
+                } ngx_http_lua_ffi_str_t;
+
+                typedef struct {
+                    ngx_http_lua_ffi_str_t   key;
+                    int                      value_type;
+                    int                      user_flags;
+                    unsigned char           *str_value_buf;
+                    size_t                   str_value_len;
+                    double                   num_value;
+                    char                    *err;
+                    int                      rc;
+                    int                      forcible;
+                } ngx_http_lua_ffi_shdict_item_t;
+
+                void *ngx_http_lua_ffi_shdict_udata_to_zone(void *zone_udata);
+                int ngx_http_lua_ffi_shdict_get_multi(void *zone,
+                    ngx_http_lua_ffi_shdict_item_t *items, int nitems);
+                int ngx_http_lua_ffi_shdict_set_multi(void *zone, int op,
+                    ngx_http_lua_ffi_shdict_item_t *items, int nitems,
+                    long exptime);
+            ]]
+
+            local C = ffi.C
+            local dogs = ngx.shared.dogs
+            local zone = C.ngx_http_lua_ffi_shdict_udata_to_zone(dogs[1])
+
+            local items = ffi.new("ngx_http_lua_ffi_shdict_item_t[2]")
+
+            items[0].key.data = "a"
+            items[0].key.len = 1
+            items[0].value_type = 4  -- string
+            items[0].str_value_buf = "hello"
+            items[0].str_value_len = 5
+            items[0].user_flags = 7
+
+            items[1].key.data = "b"
+            items[1].key.len = 1
+            items[1].value_type = 3  -- number
+            items[1].num_value = 42
+
+            C.ngx_http_lua_ffi_shdict_set_multi(zone, 0, items, 2, 0)
+            ngx.say("set rc: ", items[0].rc, " ", items[1].rc)
+
+            local buf = ffi.new("unsigned char[16]")
+            for i = 0, 1 do
+                items[i].str_value_buf = buf + i * 8
+                items[i].str_value_len = 8
+            end
+
+            C.ngx_http_lua_ffi_shdict_get_multi(zone, items, 2)
+
+            ngx.say("a: ", ffi.string(items[0].str_value_buf,
+                                      items[0].str_value_len),
+                    " flags: ", items[0].user_flags)
+            ngx.say("b: ", items[1].num_value)
+        }
+    }
+--- request
+GET /test
+--- response_body
+set rc: 0 0
+a: hello flags: 7
+b: 42
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: number keys
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:set_multi({ [1] = "a", [2.5] = "b", c = "c" }))
+            ngx.say(dogs:get("1"), " ", dogs:get(2.5), " ", dogs:get("c"))
+
+            local vals = dogs:get_multi({ 1, "2.5", "c", 3 })
+            ngx.say(vals[1], " ", vals["2.5"], " ", vals.c, " ", vals[3])
+        }
+    }
+--- request
+GET /test
+--- response_body
+truenilfalse
+a b c
+a b c nil
+--- no_error_log
+[error]
@@ -0,0 +1,256 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 1);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: basic operations
+--- http_config
+    lua_shared_dict dogs 1m index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", 32, 0, 3)
+            dogs:set("bah", "hello")
+            dogs:add("baz", true)
+
+            ngx.say("foo: ", dogs:get("foo"))
+            ngx.say("bah: ", dogs:get("bah"))
+            ngx.say("baz: ", dogs:get("baz"))
+
+            local ok, err = dogs:add("foo", 1)
+            ngx.say("add: ", ok, " ", err)
+
+            ok, err = dogs:replace("foo", 33)
+            ngx.say("replace: ", ok, " ", err)
+
+            ngx.say("incr: ", (dogs:incr("foo", 1)))
+            ngx.say("incr init: ", (dogs:incr("counter", 1, 0)))
+
+            dogs:set("ttl", 1, 10)
+            ngx.say("ttl: ", dogs:ttl("ttl") > 0)
+
+            dogs:delete("bah")
+            ngx.say("deleted: ", dogs:get("bah"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+foo: 323
+bah: hello
+baz: true
+add: false exists
+replace: true nil
+incr: 34
+incr init: 1
+ttl: true
+deleted: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: deleting keys keeps the other keys reachable
+--- http_config
+    lua_shared_dict dogs 1m index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 3000 do
+                assert(dogs:safe_set("key" .. i, i))
+            end
+
+            for i = 1, 3000, 2 do
+                dogs:delete("key" .. i)
+            end
+
+            local found, missing = 0, 0
+            for i = 1, 3000 do
+                local v = dogs:get("key" .. i)
+                if i % 2 == 0 and v == i then
+                    found = found + 1
+
+                elseif i % 2 == 1 and v == nil then
+                    missing = missing + 1
+                end
+            end
+
+            ngx.say("found: ", found, ", missing: ", missing)
+
+            for i = 1, 3000, 2 do
+                dogs:set("key" .. i, -i)
+            end
+
+            local sum = 0
+            for i = 1, 3000 do
+                sum = sum + dogs:get("key" .. i)
+            end
+
+            ngx.say("sum: ", sum)
+            ngx.say("keys: ", #dogs:get_keys(0))
+        }
+    }
+--- request
+GET /test
+--- response_body
+found: 1500, missing: 1500
+sum: 1500
+keys: 3000
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: evicting items when the zone is full
+--- http_config
+    lua_shared_dict dogs 64k index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local evicted = false
+            for i = 1, 2000 do
+                local ok, err, forcible = dogs:set("key" .. i, i)
+                if not ok then
+                    ngx.say("failed to set key", i, ": ", err)
+                    return
+                end
+
+                evicted = evicted or forcible
+            end
+
+            ngx.say("evicted: ", evicted)
+            ngx.say("last: ", dogs:get("key2000"))
+            ngx.say("first: ", dogs:get("key1"))
+
+            local ok, err = dogs:safe_add("key1", 1)
+            ngx.say("safe_add: ", ok, " ", err)
+        }
+    }
+--- request
+GET /test
+--- response_body
+evicted: true
+last: 2000
+first: nil
+safe_add: false no memory
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: expiry, lists and flushing
+--- http_config
+    lua_shared_dict dogs 1m index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("short", 1, 0.001)
+            dogs:set("long", 2)
+            dogs:rpush("list", "a")
+            dogs:rpush("list", "b")
+
+            ngx.sleep(0.01)
+
+            ngx.say("stale: ", dogs:get_stale("short"))
+            ngx.say("flushed: ", dogs:flush_expired())
+            ngx.say("short: ", dogs:get("short"))
+            ngx.say("list: ", dogs:llen("list"), " ", dogs:lpop("list"))
+
+            dogs:flush_all()
+            ngx.say("after flush_all: ", dogs:get("long"),
+                    " ", dogs:llen("list"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+stale: 1niltrue
+flushed: 1
+short: nil
+list: 2 a
+after flush_all: nil 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: with shards and lock-free reads
+--- http_config
+    lua_shared_dict dogs 1m shards=4 read_mostly index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local vals, keys = {}, {}
+            for i = 1, 500 do
+                vals["key" .. i] = i
+                keys[i] = "key" .. i
+            end
+
+            assert(dogs:set_multi(vals))
+
+            local sum = 0
+            for i = 1, 500 do
+                sum = sum + dogs:get("key" .. i)
+            end
+
+            ngx.say("sum: ", sum)
+
+            sum = 0
+            for _, v in pairs(dogs:get_multi(keys)) do
+                sum = sum + v
+            end
+
+            ngx.say("get_multi sum: ", sum)
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 125250
+get_multi sum: 125250
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: bad index
+--- http_config
+    lua_shared_dict dogs 1m index=btree;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict index "index=btree"
@@ -0,0 +1,105 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# Compares the lookup latency of the rbtree and hash indexes of
+# lua_shared_dict. Rerun with more keys to see the difference on large
+# dictionaries, e.g.
+#
+#   TEST_NGINX_SHDICT_KEYS=1000000 TEST_NGINX_SHDICT_SIZE=256m \
+#       prove t/171-shdict-index-bench.t
+#
+#   TEST_NGINX_SHDICT_KEYS=10000000 TEST_NGINX_SHDICT_SIZE=2g \
+#       prove t/171-shdict-index-bench.t
+#
+# and compare the "shdict lookup" lines in t/servroot/logs/error.log.
+
+$ENV{TEST_NGINX_SHDICT_KEYS} ||= 100000;
+$ENV{TEST_NGINX_SHDICT_SIZE} ||= '32m';
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+
+our $Config = <<_EOC_;
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local nkeys = $ENV{TEST_NGINX_SHDICT_KEYS}
+
+            for i = 1, nkeys do
+                local ok, err = dogs:safe_set("key" .. i, i)
+                if not ok then
+                    ngx.say("failed to set key", i, ": ", err)
+                    return
+                end
+            end
+
+            -- look up keys in a random order so that the index does not
+            -- stay in the CPU caches
+
+            local nsample = math.min(nkeys, 100000)
+            local keys = {}
+            for i = 1, nsample do
+                keys[i] = "key" .. math.random(nkeys)
+            end
+
+            ngx.update_time()
+            local begin = ngx.now()
+
+            local hits = 0
+            for round = 1, 10 do
+                for i = 1, nsample do
+                    if dogs:get(keys[i]) then
+                        hits = hits + 1
+                    end
+                end
+            end
+
+            ngx.update_time()
+
+            ngx.log(ngx.WARN, "shdict lookup: ", nkeys, " keys, ",
+                    (ngx.now() - begin) * 1e9 / (10 * nsample),
+                    " ns per get")
+
+            ngx.say("all hits: ", hits == 10 * nsample)
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: rbtree index
+--- http_config eval
+"lua_shared_dict dogs $ENV{TEST_NGINX_SHDICT_SIZE};"
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+all hits: true
+--- error_log
+shdict lookup:
+--- timeout: 120
+
+
+
+=== TEST 2: hash index
+--- http_config eval
+"lua_shared_dict dogs $ENV{TEST_NGINX_SHDICT_SIZE} index=hash;"
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+all hits: true
+--- error_log
+shdict lookup:
+--- timeout: 120
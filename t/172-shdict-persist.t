@@ -0,0 +1,301 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 4);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+# the blocks of this file depend on each other: every nginx instance
+# saves its zones on exit and the next one loads them
+
+$ENV{TEST_NGINX_SNAPSHOT} = "/tmp/lua-shdict-persist-$$";
+
+END {
+    unlink "$ENV{TEST_NGINX_SNAPSHOT}-dogs", "$ENV{TEST_NGINX_SNAPSHOT}-cats",
+           "$ENV{TEST_NGINX_SNAPSHOT}-birds", "$ENV{TEST_NGINX_SNAPSHOT}-fish";
+}
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: no snapshot yet
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_SNAPSHOT-dogs;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say("keys: ", #dogs:get_keys(0))
+
+            dogs:set("str", "hello", 0, 7)
+            dogs:set("num", 3.14)
+            dogs:set("bool", false)
+            dogs:set("ttl", 1, 100)
+            dogs:set("short", 1, 0.001)
+            dogs:lpush("list", "a")
+        }
+    }
+--- request
+GET /test
+--- response_body
+keys: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: the keys survive the restart
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_SNAPSHOT-dogs;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say("str: ", dogs:get("str"))
+            ngx.say("num: ", dogs:get("num"))
+            ngx.say("bool: ", dogs:get("bool"))
+
+            local ttl = dogs:ttl("ttl")
+            ngx.say("ttl: ", ttl > 90 and ttl <= 100)
+
+            ngx.say("short: ", dogs:get_stale("short"))
+            ngx.say("list: ", dogs:llen("list"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+str: hello7
+num: 3.14
+bool: false
+ttl: true
+short: nil
+list: 0
+--- error_log eval
+qr/lua shared dict "dogs": loaded 4 keys from ".*?-dogs"/
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: save a sharded zone
+--- http_config
+    lua_shared_dict cats 1m shards=4 index=hash persist=$TEST_NGINX_SNAPSHOT-cats;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local cats = ngx.shared.cats
+
+            for i = 1, 1000 do
+                cats:set("key" .. i, string.rep("v", i % 200) .. i)
+            end
+
+            ngx.say("done")
+        }
+    }
+--- request
+GET /test
+--- response_body
+done
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: load into a zone with a different layout
+--- http_config
+    lua_shared_dict cats 2m persist=$TEST_NGINX_SNAPSHOT-cats;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local cats = ngx.shared.cats
+
+            local good = 0
+            for i = 1, 1000 do
+                if cats:get("key" .. i) == string.rep("v", i % 200) .. i then
+                    good = good + 1
+                end
+            end
+
+            ngx.say("good: ", good)
+        }
+    }
+--- request
+GET /test
+--- response_body
+good: 1000
+--- error_log eval
+qr/lua shared dict "cats": loaded 1000 keys/
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: bad snapshot file
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_HTML_DIR/bad.snap;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("keys: ", #ngx.shared.dogs:get_keys(0))
+        }
+    }
+--- user_files
+>>> bad.snap
+hello world, this is not a snapshot
+--- request
+GET /test
+--- response_body
+keys: 0
+--- error_log eval
+qr/lua shared dict snapshot ".*?bad.snap" has a bad header, ignored/
+--- no_error_log
+[alert]
+
+
+
+=== TEST 6: records larger than the zone
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_HTML_DIR/big.snap;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("keys: ", #ngx.shared.dogs:get_keys(0))
+        }
+    }
+--- user_files eval
+">>> big.snap\n"
+. pack("a8LL", "LUASHDCT", 1, 24)
+. pack("QLLSCx5", 0, 0xfffffff0, 0, 3, 4) . "big"
+--- request
+GET /test
+--- response_body
+keys: 0
+--- error_log eval
+qr/lua shared dict snapshot ".*?big.snap" has a bad record, stopped loading after 0 keys/
+--- no_error_log
+[alert]
+
+
+
+=== TEST 7: keys failing to load are not counted
+--- http_config
+    lua_shared_dict dogs 1m persist=$TEST_NGINX_HTML_DIR/nomem.snap;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say("a: ", dogs:get("a"))
+            ngx.say("big: ", dogs:get("big"))
+        }
+    }
+--- user_files eval
+">>> nomem.snap\n"
+. pack("a8LL", "LUASHDCT", 1, 24)
+. pack("QLLSCx5", 0, 1, 0, 1, 4) . "ab"
+. pack("QLLSCx5", 0, 1000000, 0, 3, 4) . "big" . ("x" x 1000000)
+. pack("QLLSCx5", 0, 0, 0, 0, 0)
+--- request
+GET /test
+--- response_body
+a: b
+big: nil
+--- error_log eval
+[
+qr/lua shared dict "dogs": failed to load key "big" from ".*?nomem.snap": no memory/,
+qr/lua shared dict "dogs": loaded 1 keys/,
+]
+--- no_error_log
+[alert]
+
+
+
+=== TEST 8: periodic saves
+--- http_config
+    lua_shared_dict birds 1m persist=$TEST_NGINX_SNAPSHOT-birds persist_interval=100ms;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.shared.birds:set("foo", "bar")
+
+            ngx.sleep(0.3)
+
+            local f = io.open("$TEST_NGINX_SNAPSHOT-birds")
+            ngx.say("saved: ", f ~= nil)
+
+            if f then
+                f:close()
+            end
+        }
+    }
+--- request
+GET /test
+--- response_body
+saved: true
+--- error_log eval
+qr/lua shared dict "birds": saved 1 keys to/
+--- no_error_log
+[error]
+
+
+
+=== TEST 9: persist_interval without persist
+--- http_config
+    lua_shared_dict birds 1m persist_interval=1s;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+lua shared dict persist_interval requires persist
+
+
+
+=== TEST 10: periodic saves of several batches of keys
+--- http_config
+    lua_shared_dict fish 1m shards=2 persist=$TEST_NGINX_SNAPSHOT-fish persist_interval=100ms;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local fish = ngx.shared.fish
+
+            for i = 1, 1000 do
+                fish:set("key" .. i, i)
+            end
+
+            fish:set("expired", 1, 0.001)
+            fish:lpush("list", "a")
+
+            ngx.sleep(0.3)
+            ngx.say("ok")
+        }
+    }
+--- request
+GET /test
+--- response_body
+ok
+--- error_log eval
+qr/lua shared dict "fish": saved 1000 keys to/
+--- no_error_log
+[error]
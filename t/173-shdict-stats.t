@@ -0,0 +1,226 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: gets, hits, misses and sets
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", 1)
+            dogs:set("bar", "hello")
+            dogs:add("bar", "world")
+            dogs:delete("none")
+
+            dogs:get("foo")
+            dogs:get("bar")
+            dogs:get("baz")
+            dogs:get_multi({ "foo", "baz" })
+
+            local st = dogs:stats()
+            ngx.say("gets: ", st.gets)
+            ngx.say("hits: ", st.hits)
+            ngx.say("misses: ", st.misses)
+            ngx.say("sets: ", st.sets)
+            ngx.say("evictions: ", st.evictions)
+            ngx.say("expired: ", st.expired)
+            ngx.say("alloc_failures: ", st.alloc_failures)
+            ngx.say("lock_waits: ", st.lock_waits)
+            ngx.say("bytes_used: ", st.bytes_used > 0)
+        }
+    }
+--- request
+GET /test
+--- response_body
+gets: 5
+hits: 3
+misses: 2
+sets: 2
+evictions: 0
+expired: 0
+alloc_failures: 0
+lock_waits: 0
+bytes_used: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: expired items
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 3 do
+                dogs:set("key" .. i, i, 0.001)
+            end
+
+            ngx.sleep(0.01)
+
+            dogs:get_stale("key1")
+            dogs:flush_expired()
+
+            local st = dogs:stats()
+            ngx.say("gets: ", st.gets, ", misses: ", st.misses)
+            ngx.say("expired: ", st.expired)
+            ngx.say("evictions: ", st.evictions)
+        }
+    }
+--- request
+GET /test
+--- response_body
+gets: 1, misses: 1
+expired: 3
+evictions: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: evictions and allocation failures
+--- http_config
+    lua_shared_dict dogs 100k;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local val = string.rep("a", 1000)
+            local forced = 0
+
+            for i = 1, 500 do
+                local ok, err, forcible = dogs:set("key" .. i, val)
+                if forcible then
+                    forced = forced + 1
+                end
+            end
+
+            local st = dogs:stats()
+            ngx.say("sets: ", st.sets)
+            ngx.say("evictions: ", st.evictions > 0)
+            ngx.say("alloc_failures: ", st.alloc_failures >= forced)
+            ngx.say("bytes_used: ", st.bytes_used <= dogs:capacity())
+        }
+    }
+--- request
+GET /test
+--- response_body
+sets: 500
+evictions: true
+alloc_failures: true
+bytes_used: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: sums over the shards, lock-free reads included
+--- http_config
+    lua_shared_dict dogs 1m shards=4 read_mostly;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 100 do
+                dogs:set("key" .. i, i)
+            end
+
+            for i = 1, 200 do
+                dogs:get("key" .. i)
+            end
+
+            local st = dogs:stats()
+            ngx.say("gets: ", st.gets)
+            ngx.say("hits: ", st.hits)
+            ngx.say("misses: ", st.misses)
+            ngx.say("sets: ", st.sets)
+        }
+    }
+--- request
+GET /test
+--- response_body
+gets: 200
+hits: 100
+misses: 100
+sets: 100
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: the FFI interface
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            ffi.cdef[[
+                typedef struct {
+                    uint64_t    gets;
+                    uint64_t    hits;
+                    uint64_t    misses;
+                    uint64_t    sets;
+                    uint64_t    evictions;
+                    uint64_t    expired;
+                    uint64_t    alloc_failures;
+                    uint64_t    lock_waits;
+                    uint64_t    bytes_used;
+                    uint64_t    compressed;
+                    uint64_t    compress_bytes_in;
+                    uint64_t    compress_bytes_out;
+                    uint64_t    compress_usec;
+                    uint64_t    decompressed;
+                    uint64_t    decompress_usec;
+                } ngx_http_lua_ffi_shdict_stats_t;
+
+                void *ngx_http_lua_ffi_shdict_udata_to_zone(void *zone_udata);
+                int ngx_http_lua_ffi_shdict_stats(void *zone,
+                    ngx_http_lua_ffi_shdict_stats_t *stats);
+            ]]
+
+            local C = ffi.C
+            local dogs = ngx.shared.dogs
+            local zone = C.ngx_http_lua_ffi_shdict_udata_to_zone(dogs[1])
+
+            dogs:set("foo", "bar")
+            dogs:get("foo")
+
+            local st = ffi.new("ngx_http_lua_ffi_shdict_stats_t")
+            local rc = C.ngx_http_lua_ffi_shdict_stats(zone, st)
+
+            ngx.say("rc: ", rc)
+            ngx.say("gets: ", tonumber(st.gets), ", hits: ", tonumber(st.hits),
+                    ", sets: ", tonumber(st.sets))
+        }
+    }
+--- request
+GET /test
+--- response_body
+rc: 0
+gets: 1, hits: 1, sets: 1
+--- no_error_log
+[error]
@@ -0,0 +1,192 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# The first two tests replay the same synthetic trace, a small set of hot
+# keys mixed with a scan of keys used only once, against both policies and
+# log the hit ratios on the hot keys, e.g.
+#
+#   TEST_NGINX_SHDICT_STEPS=100000 prove t/174-shdict-tinylfu.t
+#
+# and compare the "shdict trace replay" lines in t/servroot/logs/error.log.
+
+$ENV{TEST_NGINX_SHDICT_STEPS} ||= 4000;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 1);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+our $Config = <<_EOC_;
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local val = string.rep("v", 1000)
+            local steps = $ENV{TEST_NGINX_SHDICT_STEPS}
+            local scan = 0
+            local hot_gets, hot_hits = 0, 0
+
+            local function access(key)
+                if dogs:get(key) then
+                    return true
+                end
+
+                dogs:set(key, val)
+                return false
+            end
+
+            for i = 1, steps do
+                local hit = access("hot" .. i % 20)
+
+                if i > steps / 2 then
+                    hot_gets = hot_gets + 1
+                    if hit then
+                        hot_hits = hot_hits + 1
+                    end
+                end
+
+                for j = 1, 3 do
+                    scan = scan + 1
+                    access("scan" .. scan)
+                end
+            end
+
+            local ratio = hot_hits / hot_gets
+
+            ngx.log(ngx.WARN, "shdict trace replay: hot key hit ratio ",
+                    ratio, " after ", steps, " steps")
+
+            ngx.say("most hot keys hit: ", ratio > 0.8)
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: trace replay, lru
+--- http_config
+    lua_shared_dict dogs 100k;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+most hot keys hit: false
+--- error_log
+shdict trace replay:
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: trace replay, tinylfu
+--- http_config
+    lua_shared_dict dogs 100k policy=tinylfu;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+most hot keys hit: true
+--- error_log
+shdict trace replay:
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: cold keys are not admitted into a full zone
+--- http_config
+    lua_shared_dict dogs 100k policy=tinylfu;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local val = string.rep("v", 1000)
+
+            local i = 0
+            repeat
+                i = i + 1
+                local ok, err, forcible = dogs:set("key" .. i, val)
+            until forcible or not ok
+
+            for j = 1, 10 do
+                for k = 1, i - 1 do
+                    dogs:get("key" .. k)
+                end
+            end
+
+            local ok, err, forcible = dogs:set("cold", val)
+            ngx.say("set: ", ok, " ", err, " ", forcible)
+            ngx.say("cold: ", dogs:get("cold"))
+            ngx.say("key2 kept: ", dogs:get("key2") == val)
+
+            ok, err = dogs:set("key2", "short")
+            ngx.say("update: ", ok, " ", err)
+        }
+    }
+--- request
+GET /test
+--- response_body
+set: false not admitted false
+cold: nil
+key2 kept: true
+update: true nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: tinylfu with shards and lock-free reads
+--- http_config
+    lua_shared_dict dogs 1m shards=4 read_mostly index=hash policy=tinylfu;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 200 do
+                dogs:set("key" .. i, i)
+            end
+
+            local sum = 0
+            for i = 1, 200 do
+                sum = sum + dogs:get("key" .. i)
+            end
+
+            ngx.say("sum: ", sum)
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 20100
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: bad policy
+--- http_config
+    lua_shared_dict dogs 1m policy=lfu;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict policy "policy=lfu"
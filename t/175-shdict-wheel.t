@@ -0,0 +1,178 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 1);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: expired items are reclaimed without being touched
+--- http_config
+    lua_shared_dict dogs 1m expiry=wheel;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 100 do
+                dogs:set("short" .. i, i, 0.05)
+            end
+
+            dogs:set("long", 1, 60)
+            dogs:set("forever", 2)
+
+            ngx.sleep(0.4)
+
+            ngx.say("expired: ", dogs:stats().expired)
+            ngx.say("stale: ", dogs:get_stale("short1"))
+            ngx.say("long: ", dogs:get("long"))
+            ngx.say("forever: ", dogs:get("forever"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+expired: 100
+stale: nil
+long: 1
+forever: 2
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: changed expiration times
+--- http_config
+    lua_shared_dict dogs 1m expiry=wheel;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", "a", 0.05)
+            dogs:set("foo", "b")
+
+            dogs:set("bar", "c", 0.05)
+            dogs:set("bar", "longer value", 60)
+
+            dogs:set("baz", "d", 60)
+            dogs:expire("baz", 0.05)
+
+            dogs:set("blah", "e", 0.05)
+            dogs:expire("blah", 0)
+
+            dogs:incr("count", 1, 0, 0.05)
+
+            ngx.sleep(0.4)
+
+            ngx.say("foo: ", dogs:get_stale("foo"))
+            ngx.say("bar: ", dogs:get_stale("bar"))
+            ngx.say("baz: ", dogs:get_stale("baz"))
+            ngx.say("blah: ", dogs:get_stale("blah"))
+            ngx.say("count: ", dogs:get_stale("count"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+foo: b
+bar: longer value
+baz: nil
+blah: e
+count: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: lists
+--- http_config
+    lua_shared_dict dogs 1m expiry=wheel;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 10 do
+                dogs:rpush("list", i)
+            end
+
+            dogs:expire("list", 0.05)
+
+            ngx.sleep(0.4)
+
+            ngx.say("expired: ", dogs:stats().expired)
+            ngx.say("llen: ", dogs:llen("list"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+expired: 1
+llen: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: flush_all with shards and the hash index
+--- http_config
+    lua_shared_dict dogs 1m shards=4 index=hash read_mostly expiry=wheel;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local free = dogs:free_space()
+
+            for i = 1, 200 do
+                dogs:set("key" .. i, string.rep("a", 100))
+            end
+
+            dogs:flush_all()
+
+            ngx.sleep(0.4)
+
+            ngx.say("expired: ", dogs:stats().expired)
+            ngx.say("free space back: ", dogs:free_space() == free)
+            ngx.say("keys: ", #dogs:get_keys(0))
+        }
+    }
+--- request
+GET /test
+--- response_body
+expired: 200
+free space back: true
+keys: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: bad expiry
+--- http_config
+    lua_shared_dict dogs 1m expiry=timer;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict expiry "expiry=timer"
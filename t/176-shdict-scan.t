@@ -0,0 +1,202 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+our $Config = <<'_EOC_';
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 1000 do
+                dogs:set("key" .. i, i)
+            end
+
+            local seen, dups, calls = {}, 0, 0
+            local cursor = 0
+
+            repeat
+                local keys
+                cursor, keys = dogs:scan(cursor, 50)
+                calls = calls + 1
+
+                for _, key in ipairs(keys) do
+                    if seen[key] then
+                        dups = dups + 1
+                    end
+
+                    seen[key] = true
+                end
+
+                -- keys added and removed in between batches
+                dogs:delete("key" .. calls)
+                dogs:set("new" .. calls, calls)
+            until cursor == 0
+
+            local missing = 0
+            for i = calls + 1, 1000 do
+                if not seen["key" .. i] then
+                    missing = missing + 1
+                end
+            end
+
+            ngx.say("several calls: ", calls > 10)
+            ngx.say("missing: ", missing)
+            ngx.say("duplicates: ", dups)
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: scan the red-black tree
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+several calls: true
+missing: 0
+duplicates: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: scan the hash index of several shards
+--- http_config
+    lua_shared_dict dogs 1m shards=4 index=hash;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+several calls: true
+missing: 0
+duplicates: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: expired keys and the default count
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", 1)
+            dogs:set("bar", 2, 0.001)
+            dogs:lpush("list", "a")
+
+            ngx.sleep(0.01)
+
+            local cursor, keys = dogs:scan(0)
+            table.sort(keys)
+
+            ngx.say(cursor, ": ", table.concat(keys, " "))
+        }
+    }
+--- request
+GET /test
+--- response_body
+0: foo list
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad arguments
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(pcall(dogs.scan, dogs, -1))
+            ngx.say(pcall(dogs.scan, dogs, 1.5))
+            ngx.say(pcall(dogs.scan, dogs, 0, 0))
+
+            local cursor, keys = dogs:scan(2 ^ 32 * 3)
+            ngx.say(cursor, " ", #keys)
+        }
+    }
+--- request
+GET /test
+--- response_body
+falsebad "cursor" argument
+falsebad "cursor" argument
+falsebad "count" argument
+0 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: probe runs wrapping around the top of a nearly full hash index
+--- http_config
+    lua_shared_dict dogs 1m index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local n = 0
+
+            while true do
+                local ok = dogs:safe_set("k" .. n + 1, true)
+                if not ok then
+                    break
+                end
+
+                n = n + 1
+            end
+
+            for _, count in ipairs({1, 3, 50}) do
+                local seen, found, dups = {}, 0, 0
+                local cursor = 0
+
+                repeat
+                    local keys
+                    cursor, keys = dogs:scan(cursor, count)
+
+                    for _, key in ipairs(keys) do
+                        if seen[key] then
+                            dups = dups + 1
+
+                        else
+                            seen[key] = true
+                            found = found + 1
+                        end
+                    end
+                until cursor == 0
+
+                ngx.say(count, ": missing: ", n - found,
+                        ", duplicates: ", dups)
+            end
+        }
+    }
+--- request
+GET /test
+--- response_body
+1: missing: 0, duplicates: 0
+3: missing: 0, duplicates: 0
+50: missing: 0, duplicates: 0
+--- no_error_log
+[error]
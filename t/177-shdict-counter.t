@@ -0,0 +1,150 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+master_on();
+workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: incr_fast and get_sum
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:incr_fast("hits", 1))
+            ngx.say(dogs:incr_fast("hits", 41))
+            dogs:incr_fast("hits", -2)
+
+            ngx.say("sum: ", dogs:get_sum("hits"))
+            ngx.say("get: ", dogs:get("hits"))
+            ngx.say("missing: ", dogs:get_sum("none"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+truenilfalse
+truenilfalse
+sum: 40
+get: 40
+missing: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: every worker adds to the sum
+--- http_config
+    lua_shared_dict dogs 1m shards=2;
+
+    init_by_lua_block {
+        ngx.shared.dogs:incr_fast("hits", 5)
+    }
+
+    init_worker_by_lua_block {
+        local dogs = ngx.shared.dogs
+
+        for i = 1, 1000 do
+            dogs:incr_fast("hits", 1)
+        end
+    }
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.sleep(0.1)
+            ngx.say("hits: ", ngx.shared.dogs:get_sum("hits"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+hits: 2005
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: counters removed and created again
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:incr_fast("a", 3)
+            dogs:delete("a")
+            dogs:incr_fast("b", 1)
+            ngx.say("a: ", dogs:get_sum("a"), ", b: ", dogs:get_sum("b"))
+
+            dogs:set("b", "hello")
+            dogs:incr_fast("c", 7)
+            ngx.say("b: ", dogs:get("b"), ", c: ", dogs:get_sum("c"))
+
+            dogs:flush_all()
+            ngx.say("flushed: ", dogs:get_sum("c"))
+
+            dogs:incr_fast("c", 2)
+            ngx.say("c: ", dogs:get_sum("c"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+a: nil, b: 1
+b: hello, c: 7
+flushed: nil
+c: 2
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: errors
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", 1)
+
+            ngx.say(dogs:incr_fast("foo", 1))
+            ngx.say(dogs:get_sum("foo"))
+            ngx.say(dogs:incr_fast(nil, 1))
+            ngx.say(dogs:incr_fast("", 1))
+            ngx.say(pcall(dogs.incr_fast, dogs, "bar", 1.5))
+            ngx.say((dogs:incr("foo", 1)))
+
+            dogs:incr_fast("bar", 1)
+            ngx.say(dogs:incr("bar", 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilnot a counterfalse
+nilnot a counter
+nilnil key
+nilempty key
+falsebad "n" argument
+2
+nilnot a number
+--- no_error_log
+[error]
@@ -0,0 +1,197 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 1);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: watched prefixes and the events since a cursor
+--- http_config
+    lua_shared_dict dogs 1m events=64;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:watch("user:"))
+            ngx.say(dogs:watch("user:"))
+
+            local cursor, keys = dogs:events(0)
+            ngx.say(#keys)
+
+            dogs:set("user:1", "foo")
+            dogs:set("other", "bar")
+            dogs:incr("user:2", 1, 0)
+            dogs:lpush("user:3", "a")
+            dogs:delete("user:1")
+            dogs:delete("user:none")
+
+            cursor, keys = dogs:events(cursor)
+            ngx.say(table.concat(keys, " "))
+
+            local next_cursor
+            next_cursor, keys = dogs:events(cursor)
+            ngx.say(next_cursor == cursor, " ", #keys)
+        }
+    }
+--- request
+GET /test
+--- response_body
+true
+true
+0
+user:1 user:2 user:3 user:1
+true 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: woken up by a change made in a timer
+--- http_config
+    lua_shared_dict dogs 1m shards=4 events=64;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:watch("")
+
+            local cursor = dogs:events(0)
+
+            ngx.timer.at(0.05, function ()
+                dogs:set("foo", 1)
+                dogs:set("bar", 2)
+            end)
+
+            local begin = ngx.now()
+            local next_cursor, keys = dogs:wait_events(cursor, 5)
+
+            ngx.say(next_cursor > cursor, " ", keys[1])
+            ngx.say("woken early: ", ngx.now() - begin < 1)
+        }
+    }
+--- request
+GET /test
+--- response_body
+true foo
+woken early: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: timeout
+--- http_config
+    lua_shared_dict dogs 1m events=64;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:watch("foo")
+            dogs:set("bar", 1)
+
+            ngx.say(dogs:wait_events(0, 0))
+            ngx.say(dogs:wait_events(0, 0.05))
+        }
+    }
+--- request
+GET /test
+--- response_body
+niltimeout
+niltimeout
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: flush_all and lost events
+--- http_config
+    lua_shared_dict dogs 1m events=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:watch("key")
+
+            local cursor = dogs:events(0)
+            dogs:set("key1", 1)
+            dogs:flush_all()
+
+            local keys
+            cursor, keys = dogs:events(cursor)
+            ngx.say(#keys, " [", keys[2], "]")
+
+            for i = 1, 20 do
+                dogs:set("key" .. i, i)
+            end
+
+            cursor, keys = dogs:events(cursor)
+            ngx.say(#keys, " [", keys[1], "] ", keys[2])
+        }
+    }
+--- request
+GET /test
+--- response_body
+2 []
+17 [] key5
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: zones without events
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:watch("foo"))
+            ngx.say(dogs:events(0))
+            ngx.say(dogs:wait_events(0, 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilno events
+nilno events
+nilno events
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: bad events
+--- http_config
+    lua_shared_dict dogs 1m events=8;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict events "events=8"
@@ -0,0 +1,196 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: hset, hget and hgetall
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:hset("client", "name", "foo"))
+            ngx.say(dogs:hset("client", "hits", 3))
+            ngx.say(dogs:hset("client", "banned", false))
+            ngx.say(dogs:hset("client", "name", "a longer name"))
+
+            ngx.say(dogs:hget("client", "name"))
+            ngx.say(dogs:hget("client", "hits"))
+            ngx.say(dogs:hget("client", "banned"))
+            ngx.say(dogs:hget("client", "none"))
+            ngx.say(dogs:hget("none", "name"))
+
+            local all = dogs:hgetall("client")
+            local fields = {}
+            for k, v in pairs(all) do
+                fields[#fields + 1] = k .. "=" .. tostring(v)
+            end
+
+            table.sort(fields)
+            ngx.say(table.concat(fields, " "))
+            ngx.say(dogs:hgetall("none"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+1
+2
+3
+3
+a longer name
+3
+false
+nil
+nil
+banned=false hits=3 name=a longer name
+nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: hincr and hdel
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:hincr("client", "hits", 1))
+            ngx.say(dogs:hincr("client", "hits", 2.5))
+            ngx.say(dogs:hset("client", "name", "foo"))
+            ngx.say(dogs:hincr("client", "name", 1))
+
+            ngx.say(dogs:hdel("client", "none"))
+            ngx.say(dogs:hdel("client", "name"))
+            ngx.say(dogs:hdel("client", "hits"))
+
+            ngx.say(dogs:get("client"))
+            ngx.say(dogs:hdel("client", "hits"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+1
+3.5
+2
+nilnot a number
+2
+1
+0
+nil
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: other value types
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("str", "bar")
+            dogs:lpush("list", "a")
+            dogs:hset("hash", "a", 1)
+
+            ngx.say(dogs:hset("str", "a", 1))
+            ngx.say(dogs:hget("list", "a"))
+            ngx.say(dogs:hincr("str", "a", 1))
+            ngx.say(dogs:hgetall("list"))
+
+            ngx.say(dogs:get("hash"))
+            ngx.say(dogs:lpush("hash", 1))
+            ngx.say(dogs:incr("hash", 1))
+
+            ngx.say(dogs:set("hash", "replaced"))
+            ngx.say(dogs:get("hash"))
+
+            ngx.say(pcall(dogs.hset, dogs, "hash", "a", {}))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilvalue not a hash
+nilvalue not a hash
+nilvalue not a hash
+nilvalue not a hash
+nilvalue is a hash
+nilvalue not a list
+nilnot a number
+truenilfalse
+replaced
+truenilbad value type
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: fields are freed with their hash
+--- http_config
+    lua_shared_dict dogs 1m expiry=wheel;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local free = dogs:free_space()
+            local val = string.rep("v", 1000)
+
+            for i = 1, 100 do
+                for j = 1, 10 do
+                    dogs:hset("hash" .. i, "field" .. j, val)
+                end
+            end
+
+            for i = 1, 50 do
+                dogs:delete("hash" .. i)
+            end
+
+            for i = 51, 100 do
+                dogs:expire("hash" .. i, 0.05)
+            end
+
+            ngx.sleep(0.4)
+
+            ngx.say("free space back: ", dogs:free_space() == free)
+
+            dogs:hset("foo", "bar", 1)
+            dogs:expire("foo", 0.001)
+            ngx.sleep(0.01)
+
+            ngx.say(dogs:hget("foo", "bar"))
+            ngx.say(dogs:hincr("foo", "bar", 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+free space back: true
+nil
+1
+--- no_error_log
+[error]
@@ -0,0 +1,203 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: zadd, zcount and ztop
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:zadd("board", 10, "foo"))
+            ngx.say(dogs:zadd("board", 30, "bar"))
+            ngx.say(dogs:zadd("board", 20, "baz"))
+            ngx.say(dogs:zadd("board", 20, "blah"))
+            ngx.say(dogs:zadd("board", 40, "foo"))
+
+            ngx.say(dogs:zcount("board", 20, 30))
+            ngx.say(dogs:zcount("board", -math.huge, math.huge))
+            ngx.say(dogs:zcount("board", 50, 60))
+            ngx.say(dogs:zcount("none", 0, 100))
+
+            local members, scores = dogs:ztop("board", 3)
+            for i = 1, #members do
+                ngx.say(members[i], ": ", scores[i])
+            end
+
+            members, scores = dogs:ztop("board", 10)
+            ngx.say(#members, " ", #scores)
+
+            members, scores = dogs:ztop("none", 10)
+            ngx.say(#members, " ", #scores)
+        }
+    }
+--- request
+GET /test
+--- response_body
+1
+2
+3
+4
+4
+3
+4
+0
+0
+foo: 40
+bar: 30
+blah: 20
+4 4
+0 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: a sliding window with zremrangebyscore and zrem
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 100 do
+                dogs:zadd("window", i, "req" .. i)
+            end
+
+            ngx.say(dogs:zremrangebyscore("window", 0, 60))
+            ngx.say(dogs:zcount("window", 0, 100))
+            ngx.say(dogs:zremrangebyscore("window", 0, 60))
+
+            ngx.say(dogs:zrem("window", "req100"))
+            ngx.say(dogs:zrem("window", "none"))
+            ngx.say(dogs:zrem("none", "req1"))
+
+            ngx.say(dogs:zremrangebyscore("window", 61, 99))
+            ngx.say(dogs:get("window"))
+            ngx.say(dogs:zcount("window", 0, 100))
+        }
+    }
+--- request
+GET /test
+--- response_body
+60
+40
+0
+39
+39
+0
+39
+nil
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: other value types and bad arguments
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("str", "bar")
+            dogs:hset("hash", "a", 1)
+            dogs:zadd("zset", 1, "a")
+
+            ngx.say(dogs:zadd("str", 1, "a"))
+            ngx.say(dogs:zcount("hash", 0, 1))
+            ngx.say(dogs:hget("zset", "a"))
+
+            ngx.say(dogs:get("zset"))
+            ngx.say(dogs:lpush("zset", 1))
+
+            ngx.say(dogs:zadd("zset", 0 / 0, "b"))
+            ngx.say(dogs:zadd("zset", 1, nil))
+            ngx.say(pcall(dogs.ztop, dogs, "zset", 0))
+
+            ngx.say(dogs:set("zset", "replaced"))
+            ngx.say(dogs:get("zset"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilvalue not a sorted set
+nilvalue not a sorted set
+nilvalue not a hash
+nilvalue is a sorted set
+nilvalue not a list
+nilbad score
+nilnil member
+falsebad "count" argument
+truenilfalse
+replaced
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: members are freed with their set
+--- http_config
+    lua_shared_dict dogs 1m expiry=wheel;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local free = dogs:free_space()
+
+            for i = 1, 100 do
+                for j = 1, 20 do
+                    dogs:zadd("zset" .. i, j, "member" .. j)
+                end
+            end
+
+            for i = 1, 50 do
+                dogs:delete("zset" .. i)
+            end
+
+            for i = 51, 100 do
+                dogs:expire("zset" .. i, 0.05)
+            end
+
+            ngx.sleep(0.4)
+
+            ngx.say("free space back: ", dogs:free_space() == free)
+
+            dogs:zadd("foo", 1, "bar")
+            dogs:expire("foo", 0.001)
+            ngx.sleep(0.01)
+
+            ngx.say(dogs:zcount("foo", 0, 10))
+            ngx.say(dogs:zadd("foo", 2, "baz"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+free space back: true
+0
+1
+--- no_error_log
+[error]
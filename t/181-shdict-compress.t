@@ -0,0 +1,192 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 - 1);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: large values are stored compressed
+--- http_config
+    lua_shared_dict dogs 1m compress=1k;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local big = string.rep("<li>hello, world</li>", 1000)
+
+            dogs:set("small", "hello")
+            dogs:set("big", big)
+
+            ngx.say("small: ", dogs:get("small"))
+            ngx.say("big: ", dogs:get("big") == big)
+            ngx.say("stale: ", dogs:get_stale("big") == big)
+
+            local st = dogs:stats()
+            ngx.say("compressed: ", st.compressed)
+            ngx.say("bytes in: ", st.compress_bytes_in)
+            ngx.say("ratio above 10: ",
+                    st.compress_bytes_in / st.compress_bytes_out > 10)
+            ngx.say("decompressed: ", st.decompressed)
+        }
+    }
+--- request
+GET /test
+--- response_body
+small: hello
+big: true
+stale: true
+compressed: 1
+bytes in: 21000
+ratio above 10: true
+decompressed: 2
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: incompressible values are stored as they are
+--- http_config
+    lua_shared_dict dogs 1m compress=1k;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local t = {}
+
+            math.randomseed(1)
+            for i = 1, 4096 do
+                t[i] = string.char(math.random(0, 255))
+            end
+
+            local noise = table.concat(t)
+
+            dogs:set("noise", noise)
+            ngx.say("noise: ", dogs:get("noise") == noise)
+            ngx.say("compressed: ", dogs:stats().compressed)
+        }
+    }
+--- request
+GET /test
+--- response_body
+noise: true
+compressed: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: get_multi, lock-free reads and other methods
+--- http_config
+    lua_shared_dict dogs 1m shards=4 read_mostly compress=100;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local big = string.rep("a", 10000)
+
+            for i = 1, 10 do
+                dogs:set("key" .. i, big .. i)
+            end
+
+            local ok = true
+            for i = 1, 10 do
+                if dogs:get("key" .. i) ~= big .. i then
+                    ok = false
+                end
+            end
+
+            ngx.say("get: ", ok)
+
+            local vals = dogs:get_multi({ "key1", "key2", "none" })
+            ngx.say("get_multi: ", vals.key1 == big .. 1, " ",
+                    vals.key2 == big .. 2, " ", vals.none)
+
+            ngx.say(dogs:incr("key1", 1))
+            ngx.say(dogs:lpush("key1", 1))
+            ngx.say("stats: ", dogs:stats().compressed)
+        }
+    }
+--- request
+GET /test
+--- response_body
+get: true
+get_multi: true true nil
+nilnot a number
+nilvalue not a list
+stats: 10
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: set_multi
+--- http_config
+    lua_shared_dict dogs 1m shards=4 compress=100;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local big = string.rep("a", 10000)
+
+            local vals = { small = "hello", num = 3 }
+            for i = 1, 10 do
+                vals["key" .. i] = big .. i
+            end
+
+            ngx.say(dogs:set_multi(vals))
+
+            local ok = true
+            for i = 1, 10 do
+                if dogs:get("key" .. i) ~= big .. i then
+                    ok = false
+                end
+            end
+
+            ngx.say("get: ", ok, " ", dogs:get("small"), " ", dogs:get("num"))
+
+            local st = dogs:stats()
+            ngx.say("compressed: ", st.compressed)
+            ngx.say("bytes in: ", st.compress_bytes_in)
+        }
+    }
+--- request
+GET /test
+--- response_body
+truenilfalse
+get: true hello 3
+compressed: 10
+bytes in: 100011
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: bad compress
+--- http_config
+    lua_shared_dict dogs 1m compress=0;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict compress "compress=0"
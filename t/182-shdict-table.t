@@ -0,0 +1,158 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: nested tables
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local ok, err, forcible = dogs:set_table("foo", {
+                "a", 3.14, true,
+                name = "dog",
+                [10] = false,
+                [0.5] = "half",
+                tags = { "x", "y", { deep = { 1, 2 } } },
+                empty = {},
+            })
+
+            ngx.say("set: ", ok, " ", err, " ", forcible)
+
+            local t = dogs:get_table("foo")
+            ngx.say(#t, ": ", t[1], " ", t[2], " ", t[3])
+            ngx.say(t.name, " ", t[10], " ", t[0.5])
+            ngx.say(t.tags[1], t.tags[2], " ", t.tags[3].deep[2])
+            ngx.say("empty: ", type(t.empty), " ", next(t.empty))
+        }
+    }
+--- request
+GET /test
+--- response_body
+set: true nil false
+3: a 3.14 true
+dog false half
+xy 2
+empty: table nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: flags, exptime and other value types
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set_table("foo", { 1, 2, 3 }, 0, 7)
+            dogs:set_table("bar", { 1 }, 0.001)
+            dogs:set("baz", "hello")
+
+            ngx.sleep(0.01)
+
+            local t, flags = dogs:get_table("foo")
+            ngx.say(table.concat(t, ","), " flags: ", flags)
+            ngx.say("bar: ", dogs:get_table("bar"))
+            ngx.say("baz: ", dogs:get_table("baz"))
+            ngx.say("get: ", dogs:get("foo"))
+            ngx.say("none: ", dogs:get_table("none"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+1,2,3 flags: 7
+bar: nil
+baz: nilvalue not a table
+get: nilvalue is a table
+none: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: bad values and keys
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:set_table("foo", { print }))
+            ngx.say(dogs:set_table("foo", { [{}] = 1 }))
+
+            local t = {}
+            t.self = t
+            ngx.say(dogs:set_table("foo", t))
+
+            ngx.say(pcall(dogs.set_table, dogs, "foo", "bar"))
+            ngx.say(pcall(dogs.set_table, dogs, "foo", {}, -1))
+            ngx.say("foo: ", dogs:get_table("foo"))
+        }
+    }
+--- request
+GET /test
+--- response_body_like
+^falsebad value type
+falsebad key type
+falsetable too deep
+false.*?table expected, got string
+falsebad "exptime" argument
+foo: nil
+$
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: shards and lock-free reads
+--- http_config
+    lua_shared_dict dogs 1m shards=4 read_mostly index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 50 do
+                dogs:set_table("key" .. i, { i, sq = i * i })
+            end
+
+            local sum = 0
+            for i = 1, 50 do
+                local t = dogs:get_table("key" .. i)
+                sum = sum + t[1] + t.sq
+            end
+
+            ngx.say("sum: ", sum)
+            ngx.say("get: ", dogs:get("key1"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 44200
+get: nilvalue is a table
+--- no_error_log
+[error]
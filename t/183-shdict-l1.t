@@ -0,0 +1,207 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 5);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: cached values follow the writes
+--- http_config
+    lua_shared_dict dogs 1m l1=100;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", "bar", 0, 3)
+            ngx.say("foo: ", dogs:l1_get("foo"))
+            ngx.say("foo: ", dogs:l1_get("foo"))
+
+            dogs:set("foo", "baz")
+            ngx.say("foo: ", dogs:l1_get("foo"))
+
+            dogs:incr("n", 1, 0)
+            ngx.say("n: ", dogs:l1_get("n"))
+            dogs:incr("n", 1)
+            ngx.say("n: ", dogs:l1_get("n"))
+
+            dogs:set("t", true, 0.001)
+            ngx.say("t: ", dogs:l1_get("t"))
+            ngx.sleep(0.01)
+            ngx.say("t: ", dogs:l1_get("t"))
+
+            dogs:delete("foo")
+            ngx.say("foo: ", dogs:l1_get("foo"))
+
+            dogs:lpush("foo", 1)
+            ngx.say("foo: ", dogs:l1_get("foo"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+foo: bar3
+foo: bar3
+foo: baz
+n: 1
+n: 2
+t: true
+t: nil
+foo: nil
+foo: nilvalue is a list
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: tables and compressed strings are decoded once
+--- http_config
+    lua_shared_dict dogs 1m l1=100 compress=100;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set_table("tbl", { 1, 2, a = "b" })
+            dogs:set("str", string.rep("a", 1000))
+
+            local t = dogs:l1_get("tbl")
+            ngx.say("same table: ", dogs:l1_get("tbl") == t, " ", t.a)
+
+            dogs:set_table("tbl", { 1, 2, a = "c" })
+            t = dogs:l1_get("tbl")
+            ngx.say("after set_table: ", t.a)
+
+            ngx.say("str: ", #dogs:l1_get("str"), " ", #dogs:l1_get("str"))
+            ngx.say("decompressed: ", dogs:stats().decompressed)
+        }
+    }
+--- request
+GET /test
+--- response_body
+same table: true b
+after set_table: c
+str: 1000 1000
+decompressed: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: evictions, shards and stats
+--- http_config
+    lua_shared_dict dogs 1m l1=4 shards=4 index=hash;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 20 do
+                dogs:set("key" .. i, i)
+            end
+
+            local sum = 0
+            for j = 1, 5 do
+                for i = 1, 20 do
+                    sum = sum + dogs:l1_get("key" .. i)
+                end
+            end
+
+            for i = 1, 10 do
+                dogs:l1_get("key1")
+            end
+
+            local st = dogs:stats()
+            ngx.say("sum: ", sum)
+            ngx.say("gets: ", st.gets, ", hits: ", st.hits)
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 1050
+gets: 110, hits: 110
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: no l1 cache
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(pcall(dogs.l1_get, dogs, "foo"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+falseno l1 cache for the lua_shared_dict
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: a Lua VM per request
+--- http_config
+    lua_shared_dict dogs 1m l1=10;
+--- config
+    location = /test {
+        lua_code_cache off;
+
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            if ngx.var.arg_set then
+                dogs:set("foo", { n = tonumber(ngx.var.arg_set) })
+            end
+
+            local v = dogs:l1_get("foo")
+            ngx.say(v.n)
+
+            v = dogs:l1_get("foo")
+            ngx.say(v.n)
+        }
+    }
+--- pipelined_requests eval
+["GET /test?set=1", "GET /test", "GET /test?set=2", "GET /test"]
+--- response_body eval
+["1\n1\n", "1\n1\n", "2\n2\n", "2\n2\n"]
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: bad l1
+--- http_config
+    lua_shared_dict dogs 1m l1=0;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say("error")
+        }
+    }
+--- request
+GET /test
+--- request_body_unlike
+error
+--- must_die
+--- error_log
+invalid lua shared dict l1 "l1=0"
@@ -0,0 +1,237 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: values already in the list
+--- http_config
+    lua_shared_dict dogs 1m events=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:rpush("queue", "foo")
+            dogs:rpush("queue", 3.5)
+
+            ngx.say(dogs:blpop("queue", 1))
+            ngx.say(dogs:blpop("queue"))
+            ngx.say(dogs:blpop("queue"))
+            ngx.say(dogs:llen("queue"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+foo
+3.5
+niltimeout
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: woken up by a push
+--- http_config
+    lua_shared_dict dogs 1m events=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.timer.at(0.05, function ()
+                dogs:rpush("other", "bar")
+                dogs:rpush("queue", "job1")
+                dogs:rpush("queue", "job2")
+            end)
+
+            local begin = ngx.now()
+
+            ngx.say(dogs:blpop("queue", 1))
+            ngx.say(dogs:blpop("queue", 1))
+            ngx.say("waited: ", ngx.now() - begin < 0.5)
+            ngx.say(dogs:llen("other"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+job1
+job2
+waited: true
+1
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: several threads waiting, first come first served
+--- http_config
+    lua_shared_dict dogs 1m events=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local function worker(name)
+                local val, err = dogs:blpop("queue", 0.2)
+                ngx.say(name, ": ", val, " ", err)
+            end
+
+            local t1 = ngx.thread.spawn(worker, "t1")
+            local t2 = ngx.thread.spawn(worker, "t2")
+            local t3 = ngx.thread.spawn(worker, "t3")
+
+            dogs:rpush("queue", "a")
+            dogs:rpush("queue", "b")
+
+            ngx.thread.wait(t1)
+            ngx.thread.wait(t2)
+            ngx.thread.wait(t3)
+        }
+    }
+--- request
+GET /test
+--- response_body
+t1: a nil
+t2: b nil
+t3: nil timeout
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: timeout
+--- http_config
+    lua_shared_dict dogs 1m events=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", 1)
+
+            ngx.say(dogs:blpop("queue", 0.05))
+            ngx.say(pcall(dogs.blpop, dogs, "queue", -1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+niltimeout
+falsebad "timeout" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: not a list
+--- http_config
+    lua_shared_dict dogs 1m events=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:set("foo", 1)
+
+            ngx.say(dogs:blpop("foo", 1))
+            ngx.say(dogs:blpop("", 1))
+            ngx.say(dogs:blpop(nil, 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilvalue not a list
+nilempty key
+nilnil key
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: zones without events
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            dogs:rpush("queue", "foo")
+
+            ngx.say(dogs:blpop("queue", 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+nilno events
+--- no_error_log
+[error]
+
+
+
+=== TEST 7: the value of a ready thread aborted before its turn
+--- http_config
+    lua_shared_dict dogs 1m events=16;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local res = ngx.location.capture("/sub")
+            ngx.print(res.body)
+
+            ngx.say(dogs:lpop("queue"))
+            ngx.say(dogs:llen("queue"))
+        }
+    }
+
+    location = /sub {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local function worker(name)
+                local val, err = dogs:blpop("queue", 1)
+                ngx.say(name, ": ", val, " ", err)
+
+                -- aborts t2, woken up along with t1
+                ngx.exit(ngx.OK)
+            end
+
+            local t1 = ngx.thread.spawn(worker, "t1")
+            local t2 = ngx.thread.spawn(worker, "t2")
+
+            dogs:rpush("queue", "a")
+            dogs:rpush("queue", "b")
+
+            ngx.thread.wait(t1)
+            ngx.thread.wait(t2)
+        }
+    }
+--- request
+GET /test
+--- response_body
+t1: a nil
+b
+0
+--- no_error_log
+[error]
@@ -0,0 +1,184 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+our $Config = <<'_EOC_';
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local val = string.rep("v", 100)
+
+            for i = 1, 2000 do
+                dogs:set("key" .. i, val .. i)
+            end
+
+            for i = 1, 50 do
+                dogs:rpush("list" .. i, "a" .. i)
+                dogs:rpush("list" .. i, "b" .. i)
+                dogs:hset("hash" .. i, "f", i)
+                dogs:zadd("zset" .. i, i, "m" .. i)
+            end
+
+            -- leaves every page of the values three quarters empty
+            for i = 1, 2000 do
+                if i % 4 ~= 0 then
+                    dogs:delete("key" .. i)
+                end
+            end
+
+            local before = dogs:fragmentation().free_pages
+            local moved, freed = 0, 0
+
+            -- whole passes over the keys
+            for _ = 1, 10 do
+                local n, pages = dogs:compact(100000)
+                moved = moved + n
+                freed = freed + pages
+            end
+
+            local after = dogs:fragmentation().free_pages
+
+            local bad = 0
+            for i = 4, 2000, 4 do
+                if dogs:get("key" .. i) ~= val .. i then
+                    bad = bad + 1
+                end
+            end
+
+            for i = 1, 50 do
+                if dogs:lpop("list" .. i) ~= "a" .. i
+                   or dogs:rpop("list" .. i) ~= "b" .. i
+                   or dogs:llen("list" .. i) ~= 0
+                   or dogs:hget("hash" .. i, "f") ~= i
+                   or dogs:zcount("zset" .. i, 0, 100) ~= 1
+                then
+                    bad = bad + 1
+                end
+            end
+
+            dogs:set("new", "value")
+
+            ngx.say("moved: ", moved > 0)
+            ngx.say("freed: ", freed > 0 and after - before == freed)
+            ngx.say("bad: ", bad)
+            ngx.say("new: ", dogs:get("new"))
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the size classes
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            local function used()
+                local n, free = 0, 0
+                for _, class in ipairs(dogs:fragmentation().classes) do
+                    n = n + class.used
+                    free = free + class.free
+                end
+
+                return n, free
+            end
+
+            local used0, free0 = used()
+
+            for i = 1, 100 do
+                dogs:set("key" .. i, string.rep("v", 100))
+            end
+
+            local used1 = used()
+
+            for i = 1, 100 do
+                dogs:delete("key" .. i)
+            end
+
+            local used2, free2 = used()
+            local st = dogs:fragmentation()
+
+            ngx.say("used: ", used1 - used0)
+            ngx.say("freed: ", used2 == used0, " ", free2 >= free0)
+            ngx.say("pages: ", st.pages > st.free_pages, " ", #st.classes > 0)
+        }
+    }
+--- request
+GET /test
+--- response_body
+used: 100
+freed: true true
+pages: true true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: compact the red-black tree
+--- http_config
+    lua_shared_dict dogs 2m;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+moved: true
+freed: true
+bad: 0
+new: value
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: compact the hash index of several shards, with the wheel
+--- http_config
+    lua_shared_dict dogs 4m shards=2 index=hash read_mostly expiry=wheel;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+moved: true
+freed: true
+bad: 0
+new: value
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: bad count
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(pcall(dogs.compact, dogs, 0))
+            ngx.say(dogs:compact())
+        }
+    }
+--- request
+GET /test
+--- response_body
+falsebad "count" argument
+00
+--- no_error_log
+[error]
@@ -0,0 +1,132 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# The first two tests time random lookups over the same keys in a zone
+# with and without huge pages and log the average time of a lookup, e.g.
+#
+#   TEST_NGINX_SHDICT_KEYS=1000000 TEST_NGINX_SHDICT_STEPS=1000000 \
+#       prove t/186-shdict-hugepages.t
+#
+# with a bigger zone in TEST_NGINX_SHDICT_SIZE, and compare the "shdict
+# random access" lines in t/servroot/logs/error.log. Huge pages are only
+# used when /sys/kernel/mm/transparent_hugepage/shmem_enabled allows them.
+
+$ENV{TEST_NGINX_SHDICT_SIZE} ||= '64m';
+$ENV{TEST_NGINX_SHDICT_KEYS} ||= 20000;
+$ENV{TEST_NGINX_SHDICT_STEPS} ||= 20000;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 2);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+our $Config = <<_EOC_;
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+            local val = string.rep("v", 500)
+            local nkeys = $ENV{TEST_NGINX_SHDICT_KEYS}
+            local steps = $ENV{TEST_NGINX_SHDICT_STEPS}
+
+            for i = 1, nkeys do
+                dogs:set("key" .. i, val)
+            end
+
+            math.randomseed(1)
+
+            local keys = {}
+            for i = 1, steps do
+                keys[i] = "key" .. math.random(nkeys)
+            end
+
+            local hits = 0
+
+            ngx.update_time()
+            local begin = ngx.now()
+
+            for i = 1, steps do
+                if dogs:get(keys[i]) then
+                    hits = hits + 1
+                end
+            end
+
+            ngx.update_time()
+
+            ngx.log(ngx.WARN, "shdict random access: ",
+                    (ngx.now() - begin) * 1e6 / steps, " usec per get over ",
+                    nkeys, " keys")
+
+            ngx.say("hits: ", hits == steps)
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: random access, normal pages
+--- http_config
+    lua_shared_dict dogs $TEST_NGINX_SHDICT_SIZE;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+hits: true
+--- error_log
+shdict random access:
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: random access, huge pages
+--- http_config
+    lua_shared_dict dogs $TEST_NGINX_SHDICT_SIZE hugepages;
+--- config eval: $::Config
+--- request
+GET /test
+--- response_body
+hits: true
+--- error_log
+shdict random access:
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: huge pages with shards
+--- http_config
+    lua_shared_dict dogs 4m shards=4 read_mostly hugepages;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            for i = 1, 100 do
+                dogs:set("key" .. i, i)
+            end
+
+            local sum = 0
+            for i = 1, 100 do
+                sum = sum + dogs:get("key" .. i)
+            end
+
+            ngx.say("sum: ", sum)
+        }
+    }
+--- request
+GET /test
+--- response_body
+sum: 5050
+--- no_error_log
+[error]
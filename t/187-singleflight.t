@@ -0,0 +1,231 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use Test::Nginx::Socket::Lua;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: one call for concurrent light threads
+--- config
+    location = /test {
+        content_by_lua_block {
+            local calls = 0
+
+            local function fetch()
+                calls = calls + 1
+                ngx.sleep(0.05)
+                return "value", calls
+            end
+
+            local function worker(name)
+                local val, n = ngx.singleflight("key", 1, fetch)
+                ngx.say(name, ": ", val, " ", n)
+            end
+
+            local threads = {}
+            for i = 1, 3 do
+                threads[i] = ngx.thread.spawn(worker, "t" .. i)
+            end
+
+            for i = 1, 3 do
+                ngx.thread.wait(threads[i])
+            end
+
+            ngx.say("calls: ", calls)
+            ngx.say(ngx.singleflight("key", 1, fetch))
+        }
+    }
+--- request
+GET /test
+--- response_body
+t1: value 1
+t2: value 1
+t3: value 1
+calls: 1
+value2
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: errors and nil values are shared
+--- config
+    location = /test {
+        content_by_lua_block {
+            local function worker(key, fn)
+                ngx.say(key, ": ", select("#", ngx.singleflight(key, 1, fn)),
+                        " ", ngx.singleflight(key, 1, fn))
+            end
+
+            local function fail()
+                ngx.sleep(0.01)
+                error("boom", 0)
+            end
+
+            local function none()
+                ngx.sleep(0.03)
+                return nil, nil, 3
+            end
+
+            local t1 = ngx.thread.spawn(worker, "fail", fail)
+            local t2 = ngx.thread.spawn(worker, "none", none)
+
+            ngx.thread.wait(t1)
+            ngx.thread.wait(t2)
+
+            ngx.say(pcall(ngx.singleflight, "", 1, none))
+            ngx.say(pcall(ngx.singleflight, "key", 0, none))
+            ngx.say(pcall(ngx.singleflight, "key", 1))
+        }
+    }
+--- request
+GET /test
+--- response_body
+fail: 2 nilboom
+none: 3 nilnil3
+falsebad "key" argument
+falsebad "timeout" argument
+falsebad "fn" argument
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: waiters time out
+--- config
+    location = /test {
+        content_by_lua_block {
+            local function slow()
+                ngx.sleep(0.2)
+                return "late"
+            end
+
+            local t = ngx.thread.spawn(function ()
+                ngx.say("leader: ", ngx.singleflight("key", 1, slow))
+            end)
+
+            ngx.say("waiter: ", ngx.singleflight("key", 0.05, slow))
+
+            ngx.thread.wait(t)
+        }
+    }
+--- request
+GET /test
+--- response_body
+waiter: niltimeout
+leader: late
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: the lock in the shared dict
+--- http_config
+    lua_shared_dict flights 1m events=64;
+    lua_singleflight_dict flights;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local flights = ngx.shared.flights
+            local calls = 0
+
+            local function fetch()
+                calls = calls + 1
+                ngx.sleep(0.1)
+                return { answer = 42 }
+            end
+
+            local t = ngx.thread.spawn(function ()
+                local res = ngx.singleflight("key", 1, fetch)
+                ngx.say("leader: ", res.answer)
+            end)
+
+            -- another worker holding the lock of the flight
+            flights:set("singleflight:other:lock", "1234:1", 1)
+
+            ngx.timer.at(0.05, function ()
+                flights:set_table("singleflight:other",
+                                  { true, "shared", n = 2, id = "1234:1" }, 1)
+                flights:delete("singleflight:other:lock")
+            end)
+
+            local begin = ngx.now()
+
+            ngx.say("waiter: ", ngx.singleflight("other", 1, fetch))
+            ngx.say("waited: ", ngx.now() - begin < 0.5)
+
+            ngx.thread.wait(t)
+
+            ngx.say("calls: ", calls)
+            ngx.say("lock: ", flights:get("singleflight:key:lock"))
+        }
+    }
+--- request
+GET /test
+--- response_body
+waiter: shared
+waited: true
+leader: 42
+calls: 1
+lock: nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: the lock of another worker times out
+--- http_config
+    lua_shared_dict flights 1m events=64;
+    lua_singleflight_dict flights;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local flights = ngx.shared.flights
+
+            flights:set("singleflight:key:lock", "1234:1", 1)
+
+            ngx.say(ngx.singleflight("key", 0.05, function ()
+                return "mine"
+            end))
+        }
+    }
+--- request
+GET /test
+--- response_body
+niltimeout
+--- no_error_log
+[error]
+
+
+
+=== TEST 6: the zone has no events
+--- http_config
+    lua_shared_dict flights 1m;
+    lua_singleflight_dict flights;
+--- config
+    location = /test {
+        content_by_lua_block {
+            ngx.say(pcall(ngx.singleflight, "key", 1, function ()
+                return "value"
+            end))
+        }
+    }
+--- request
+GET /test
+--- response_body
+falselua_singleflight_dict "flights": no events
+--- no_error_log
+[error]
@@ -0,0 +1,262 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# The last test times the sends of the same data as fragments that are
+# copied (1023 bytes) and as fragments sent in place (1024 bytes), e.g.
+#
+#   TEST_NGINX_SEND_SIZE=8388608 TEST_NGINX_SEND_LOOPS=100 \
+#       prove t/188-tcp-socket-inplace.t
+#
+# and compare the "tcp socket send" lines in t/servroot/logs/error.log.
+
+$ENV{TEST_NGINX_SEND_SIZE} ||= 1048576;
+$ENV{TEST_NGINX_SEND_LOOPS} ||= 10;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 5);
+
+log_level 'debug';
+
+no_long_string();
+#no_diff();
+
+add_block_preprocessor(sub {
+    my $block = shift;
+
+    if (!defined $block->http_config) {
+        $block->set_value("http_config", <<'_EOC_');
+    client_body_buffer_size 16m;
+    client_max_body_size 16m;
+
+    init_by_lua_block {
+        function post(data, len)
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                return nil, err
+            end
+
+            local bytes, err = sock:send({
+                "POST /echo HTTP/1.0\r\nContent-Length: ", len, "\r\n\r\n",
+                data
+            })
+            if not bytes then
+                return nil, err
+            end
+
+            local res, err = sock:receive("*a")
+            sock:close()
+
+            if not res then
+                return nil, err
+            end
+
+            return bytes, res:match("\r\n\r\n(.*)")
+        end
+    }
+_EOC_
+    }
+
+    my $config = $block->config;
+    $block->set_value("config", $config . <<'_EOC_');
+    location = /echo {
+        content_by_lua_block {
+            ngx.req.read_body()
+            local body = ngx.req.get_body_data() or ""
+            ngx.print(#body, " ", ngx.md5(body))
+        }
+    }
+_EOC_
+});
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: long strings in place, along with short strings and numbers
+--- config
+    location = /t {
+        content_by_lua_block {
+            local long1 = string.rep("a", 1024)
+            local long2 = string.rep("b", 5000)
+            local data = { "x", long1, 3.5, { "yz", { long2, 42 } }, "end" }
+            local all = table.concat({ "x", long1, "3.5yz", long2, "42end" })
+
+            local bytes, res = post(data, #all)
+
+            ngx.say("sent: ", bytes - #all > 0)
+            ngx.say("echo: ", res == #all .. " " .. ngx.md5(all))
+        }
+    }
+--- request
+GET /t
+--- response_body
+sent: true
+echo: true
+--- error_log
+lua tcp socket send 6080 bytes, 56 bytes copied, 2 strings in place
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: a single long string
+--- config
+    location = /t {
+        content_by_lua_block {
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            local body = string.rep("0123456789", 300000)
+            local req = "POST /echo HTTP/1.0\r\nContent-Length: " .. #body
+                        .. "\r\n\r\n"
+
+            ngx.say(sock:send(req) == #req)
+            ngx.say(sock:send(body))
+
+            local res = sock:receive("*a")
+            ngx.say(res:match("\r\n\r\n(.*)") == #body .. " " .. ngx.md5(body))
+        }
+    }
+--- request
+GET /t
+--- response_body
+true
+3000000
+true
+--- error_log
+lua tcp socket send 3000000 bytes, 0 bytes copied, 1 strings in place
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the strings stay alive while they are sent
+--- config
+    location = /t {
+        content_by_lua_block {
+            local data = {}
+            local parts = {}
+
+            for i = 1, 64 do
+                data[i] = string.rep(string.char(64 + i % 26), 65536) .. i
+                parts[i] = data[i]
+            end
+
+            local all = table.concat(parts)
+            local md5 = ngx.md5(all)
+            parts = nil
+            all = nil
+
+            local t = ngx.thread.spawn(function ()
+                -- lets the send start
+                ngx.sleep(0.001)
+
+                for i = 1, #data do
+                    data[i] = nil
+                end
+
+                for _ = 1, 10 do
+                    collectgarbage()
+                    ngx.sleep(0.001)
+                end
+            end)
+
+            local len = 64 * 65536 + 9 + 55 * 2
+            local bytes, res = post(data, len)
+
+            ngx.thread.wait(t)
+
+            ngx.say("echo: ", res == len .. " " .. md5)
+        }
+    }
+--- request
+GET /t
+--- response_body
+echo: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: short strings only
+--- config
+    location = /t {
+        content_by_lua_block {
+            local data = {}
+            for i = 1, 100 do
+                data[i] = string.rep("s", 1023)
+            end
+
+            local all = table.concat(data)
+            local bytes, res = post(data, #all)
+
+            ngx.say("echo: ", res == #all .. " " .. ngx.md5(all))
+        }
+    }
+--- request
+GET /t
+--- response_body
+echo: true
+--- no_error_log
+strings in place
+[error]
+
+
+
+=== TEST 5: copies vs strings in place
+--- config
+    location = /t {
+        content_by_lua_block {
+            local size = $TEST_NGINX_SEND_SIZE
+            local loops = $TEST_NGINX_SEND_LOOPS
+
+            local function bench(frag)
+                local data = {}
+                for i = 1, math.floor(size / frag) do
+                    data[i] = string.rep(string.char(97 + i % 26), frag)
+                end
+
+                local len = #data * frag
+
+                ngx.update_time()
+                local begin = ngx.now()
+
+                for _ = 1, loops do
+                    local bytes, res = post(data, len)
+                    if not bytes then
+                        ngx.log(ngx.ERR, "failed to post: ", res)
+                        return
+                    end
+                end
+
+                ngx.update_time()
+
+                ngx.log(ngx.WARN, "tcp socket send ", frag, "-byte fragments: ",
+                        (ngx.now() - begin) * 1000 / loops, " msec per ",
+                        len, " bytes, ", frag < 1024 and len or 0,
+                        " bytes copied")
+            end
+
+            bench(1023)
+            bench(1024)
+
+            ngx.say("done")
+        }
+    }
+--- request
+GET /t
+--- response_body
+done
+--- error_log
+tcp socket send 1023-byte fragments:
+tcp socket send 1024-byte fragments:
+--- no_error_log
+[error]
+--- timeout: 60
@@ -0,0 +1,223 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# The last test times receiveuntil() over a multipart-like body full of
+# partial matches of the boundary, e.g.
+#
+#   TEST_NGINX_RECV_PARTS=65536 TEST_NGINX_RECV_LOOPS=100 \
+#       prove t/189-socket-receiveuntil-scan.t
+#
+# and compare the "receiveuntil scan" lines in t/servroot/logs/error.log.
+
+$ENV{TEST_NGINX_RECV_PARTS} ||= 4096;
+$ENV{TEST_NGINX_RECV_LOOPS} ||= 10;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 1);
+
+no_long_string();
+#no_diff();
+
+our $HttpConfig = <<_EOC_;
+    init_by_lua_block {
+        local parts = {}
+
+        for i = 1, $ENV{TEST_NGINX_RECV_PARTS} do
+            parts[i] = string.rep("x", 1000) .. "\\r\\n--bound\\r" .. i .. "\\r\\n"
+        end
+
+        body = table.concat(parts)
+
+        function fetch(handler)
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                return nil, err
+            end
+
+            sock:send("GET /body HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            local header = sock:receiveuntil("\\r\\n\\r\\n")
+            header()
+
+            local res, err = handler(sock)
+            sock:close()
+
+            return res, err
+        end
+    }
+_EOC_
+
+our $Config = <<'_EOC_';
+    location = /body {
+        content_by_lua_block {
+            ngx.print(body, "\r\n--boundary--\r\n", "tail")
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a large body with partial matches of the pattern
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            local data, rest = fetch(function (sock)
+                local reader = sock:receiveuntil("\r\n--boundary--\r\n")
+                local data, err = reader()
+                if not data then
+                    return nil, err
+                end
+
+                return data, sock:receive("*a")
+            end)
+
+            ngx.say("data: ", data == body)
+            ngx.say("rest: ", rest)
+
+            data, rest = fetch(function (sock)
+                local reader = sock:receiveuntil("\r\n--boundary--\r\n",
+                                                 { inclusive = true })
+                return reader()
+            end)
+
+            ngx.say("inclusive: ", data == body .. "\r\n--boundary--\r\n")
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+data: true
+rest: tail
+inclusive: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: reading by size
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            for _, size in ipairs({ 7, 1001, 65536 }) do
+                local data = fetch(function (sock)
+                    local reader = sock:receiveuntil("\r\n--boundary--\r\n")
+                    local chunks = {}
+
+                    while true do
+                        local data, err = reader(size)
+                        if not data then
+                            if err then
+                                return nil, err
+                            end
+
+                            break
+                        end
+
+                        if #data > size then
+                            return nil, "chunk too large: " .. #data
+                        end
+
+                        chunks[#chunks + 1] = data
+                    end
+
+                    return table.concat(chunks)
+                end)
+
+                ngx.say(size, ": ", data == body)
+            end
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+7: true
+1001: true
+65536: true
+--- no_error_log
+[error]
+--- timeout: 30
+
+
+
+=== TEST 3: the first byte of the pattern right at the end of the buffer
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        lua_socket_buffer_size 1k;
+
+        content_by_lua_block {
+            local data = fetch(function (sock)
+                local reader = sock:receiveuntil("\r\n--boundary--\r\n")
+                return reader()
+            end)
+
+            ngx.say("data: ", data == body)
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+data: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: scanning speed
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            local loops = $TEST_NGINX_RECV_LOOPS
+            local bytes = 0
+
+            ngx.update_time()
+            local begin = ngx.now()
+
+            for _ = 1, loops do
+                local data, err = fetch(function (sock)
+                    local reader = sock:receiveuntil("\r\n--boundary--\r\n")
+                    return reader()
+                end)
+
+                if not data then
+                    ngx.log(ngx.ERR, "failed to read: ", err)
+                    return
+                end
+
+                bytes = #data
+            end
+
+            ngx.update_time()
+
+            ngx.log(ngx.WARN, "receiveuntil scan: ",
+                    (ngx.now() - begin) * 1000 / loops, " msec per ", bytes,
+                    " bytes")
+
+            ngx.say("done")
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+done
+--- error_log
+receiveuntil scan:
+--- no_error_log
+[error]
+--- timeout: 60
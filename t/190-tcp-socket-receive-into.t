@@ -0,0 +1,351 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# The last test reads the same records with receive() and receive_into()
+# and logs the time and the garbage of both, e.g.
+#
+#   TEST_NGINX_RECV_RECORDS=100000 TEST_NGINX_RECV_LOOPS=100 \
+#       prove t/190-tcp-socket-receive-into.t
+#
+# and compare the "tcp socket receive" lines in t/servroot/logs/error.log.
+
+$ENV{TEST_NGINX_RECV_RECORDS} ||= 10000;
+$ENV{TEST_NGINX_RECV_LOOPS} ||= 10;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 3);
+
+no_long_string();
+#no_diff();
+
+our $HttpConfig = <<_EOC_;
+    init_by_lua_block {
+        local records = {}
+
+        -- records of a 4-byte big-endian length and a payload
+        for i = 1, $ENV{TEST_NGINX_RECV_RECORDS} do
+            local payload = string.rep(string.char(i % 256), i % 200)
+            local len = #payload
+            records[i] = string.char(0, 0, math.floor(len / 256), len % 256)
+                         .. payload
+        end
+
+        data = table.concat(records)
+        nrecords = #records
+
+        function fetch(handler)
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                return nil, err
+            end
+
+            sock:send("GET /data HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            local header = sock:receiveuntil("\\r\\n\\r\\n")
+            header()
+
+            local res, err, partial = handler(sock)
+            sock:close()
+
+            return res, err, partial
+        end
+    }
+_EOC_
+
+our $Config = <<'_EOC_';
+    location = /data {
+        content_by_lua_block {
+            ngx.print(data)
+        }
+    }
+_EOC_
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: parse records into a reusable buffer
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            local buf = ffi.new("uint8_t[?]", 256)
+
+            local res, err = fetch(function (sock)
+                local records = {}
+
+                for i = 1, nrecords do
+                    local n, err = sock:receive_into(buf, 4)
+                    if not n then
+                        return nil, err
+                    end
+
+                    local len = buf[2] * 256 + buf[3]
+
+                    -- the payload right after the header in the buffer
+                    n, err = sock:receive_into(buf + 4, len)
+                    if not n then
+                        return nil, err
+                    end
+
+                    records[i] = ffi.string(buf, 4 + n)
+                end
+
+                return table.concat(records)
+            end)
+
+            ngx.say("data: ", res == data, " ", err)
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+data: true nil
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: the socket closed before the buffer is filled
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            local size = #data + 100
+            local buf = ffi.new("uint8_t[?]", size)
+
+            local n, err, partial = fetch(function (sock)
+                return sock:receive_into(buf, size)
+            end)
+
+            ngx.say(n, " ", err, " ", partial == #data)
+            ngx.say("data: ", ffi.string(buf, partial) == data)
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+nil closed true
+data: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: pointers and bad arguments
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            ffi.cdef[[
+                void *malloc(size_t size);
+                void free(void *p);
+            ]]
+
+            local p = ffi.C.malloc(16)
+
+            ngx.say(fetch(function (sock)
+                local n, err = sock:receive_into(ffi.cast("char *", p), 16)
+                if not n then
+                    return nil, err
+                end
+
+                return n, ffi.string(p, n) == data:sub(1, 16)
+            end))
+
+            ffi.C.free(p)
+
+            local buf = ffi.new("char[4]")
+
+            ngx.say(fetch(function (sock)
+                return sock:receive_into(buf, 0)
+            end))
+
+            local sock = ngx.socket.tcp()
+
+            ngx.say(pcall(sock.receive_into, sock, "buf", 4))
+            ngx.say(pcall(sock.receive_into, sock, nil, 4))
+            ngx.say(pcall(sock.receive_into, sock, ffi.cast("void *", 0), 4))
+            ngx.say(pcall(sock.receive_into, sock, buf, -1))
+            ngx.say(pcall(sock.receive_into, sock, buf, 5))
+            ngx.say(pcall(sock.receive_into, sock, ffi.new("int", 4), 4))
+            ngx.say(sock:receive_into(buf, 4))
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body_like
+^16truenil
+0nilnil
+falsebad argument #1 to 'receive_into' \(cdata expected, got string\)
+falsebad argument #1 to 'receive_into' \(cdata expected, got nil\)
+falsebad argument #1 to 'receive_into' \(NULL buffer\)
+falsebad argument #2 to 'receive_into' \(bad len argument\)
+falsebad argument #2 to 'receive_into' \(len exceeds the size of the buffer\)
+false.*?cannot convert 'int' to 'const void \*'
+nilclosed
+$
+--- error_log
+attempt to receive data on a closed socket
+--- no_error_log
+[crit]
+
+
+
+=== TEST 4: the buffer is not collected while reading into it
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            local done
+
+            ngx.thread.spawn(function ()
+                while not done do
+                    collectgarbage()
+                    ngx.sleep(0.001)
+                end
+            end)
+
+            ngx.say(fetch(function (sock)
+                return sock:receive_into(ffi.new("uint8_t[?]", #data), #data)
+            end) == #data)
+
+            done = true
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: receive() vs receive_into()
+--- http_config eval: $::HttpConfig
+--- config eval
+$::Config . <<'_EOC_';
+    location = /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            local loops = $TEST_NGINX_RECV_LOOPS
+            local buf = ffi.new("uint8_t[?]", 256)
+
+            local function parse_strings(sock)
+                local sum = 0
+
+                for _ = 1, nrecords do
+                    local header, err = sock:receive(4)
+                    if not header then
+                        return nil, err
+                    end
+
+                    local b3, b4 = header:byte(3, 4)
+                    local len = b3 * 256 + b4
+
+                    if len > 0 then
+                        local payload, err = sock:receive(len)
+                        if not payload then
+                            return nil, err
+                        end
+
+                        sum = sum + payload:byte(len)
+                    end
+                end
+
+                return sum
+            end
+
+            local function parse_into(sock)
+                local sum = 0
+
+                for _ = 1, nrecords do
+                    local n, err = sock:receive_into(buf, 4)
+                    if not n then
+                        return nil, err
+                    end
+
+                    local len = buf[2] * 256 + buf[3]
+
+                    if len > 0 then
+                        n, err = sock:receive_into(buf, len)
+                        if not n then
+                            return nil, err
+                        end
+
+                        sum = sum + buf[len - 1]
+                    end
+                end
+
+                return sum
+            end
+
+            local sums = {}
+
+            for _, parse in ipairs({ parse_strings, parse_into }) do
+                local name = parse == parse_into and "receive_into()"
+                             or "receive()"
+
+                collectgarbage()
+                collectgarbage("stop")
+
+                local mem = collectgarbage("count")
+
+                ngx.update_time()
+                local begin = ngx.now()
+
+                for _ = 1, loops do
+                    local sum, err = fetch(parse)
+                    if not sum then
+                        ngx.log(ngx.ERR, "failed to parse: ", err)
+                        return
+                    end
+
+                    sums[name] = sum
+                end
+
+                ngx.update_time()
+
+                ngx.log(ngx.WARN, "tcp socket receive with ", name, ": ",
+                        (ngx.now() - begin) * 1000 / loops, " msec and ",
+                        (collectgarbage("count") - mem) / loops,
+                        " KB of garbage per ", nrecords, " records")
+
+                collectgarbage("restart")
+            end
+
+            ngx.say(sums["receive()"] == sums["receive_into()"])
+        }
+    }
+_EOC_
+--- request
+GET /t
+--- response_body
+true
+--- error_log
+tcp socket receive with receive():
+tcp socket receive with receive_into():
+--- no_error_log
+[error]
+--- timeout: 60
@@ -0,0 +1,374 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+# The last test times sendfile() against reading the file in Lua and
+# sending it with send(), e.g.
+#
+#   TEST_NGINX_SENDFILE_SIZE=104857600 TEST_NGINX_SENDFILE_LOOPS=20 \
+#       prove t/191-tcp-socket-sendfile.t
+#
+# and compare the "tcp socket send" lines in t/servroot/logs/error.log.
+
+$ENV{TEST_NGINX_SENDFILE_SIZE} ||= 4194304;
+$ENV{TEST_NGINX_SENDFILE_LOOPS} ||= 10;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3 + 4);
+
+no_long_string();
+#no_diff();
+
+add_block_preprocessor(sub {
+    my $block = shift;
+
+    my $http_config = $block->http_config || '';
+    $block->set_value("http_config", $http_config . <<'_EOC_');
+    client_body_buffer_size 128m;
+    client_max_body_size 128m;
+
+    server {
+        listen unix:$TEST_NGINX_HTML_DIR/nginx.sock ssl;
+        server_name test.com;
+        ssl_certificate $TEST_NGINX_CERT_DIR/cert/test.crt;
+        ssl_certificate_key $TEST_NGINX_CERT_DIR/cert/test.key;
+
+        client_body_buffer_size 128m;
+        client_max_body_size 128m;
+
+        location = /echo {
+            content_by_lua_block {
+                ngx.req.read_body()
+                local body = ngx.req.get_body_data() or ""
+                ngx.print(#body, " ", ngx.md5(body))
+            }
+        }
+    }
+
+    init_by_lua_block {
+        function make_file(name, size)
+            local bytes = {}
+            for i = 0, 255 do
+                bytes[i + 1] = string.char(i)
+            end
+
+            local data = string.rep(table.concat(bytes), math.ceil(size / 256))
+            data = data:sub(1, size)
+
+            local path = "$TEST_NGINX_HTML_DIR/" .. name
+            local f = assert(io.open(path, "w"))
+            f:write(data)
+            f:close()
+
+            return path, data
+        end
+
+        function post(tls, len, send_body)
+            local sock = ngx.socket.tcp()
+            local ok, err
+
+            if tls then
+                ok, err = sock:connect("unix:$TEST_NGINX_HTML_DIR/nginx.sock")
+                if ok then
+                    ok, err = sock:sslhandshake(nil, "test.com")
+                end
+
+            else
+                ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            end
+
+            if not ok then
+                return nil, err
+            end
+
+            local bytes, err = sock:send("POST /echo HTTP/1.0\r\n"
+                                         .. "Host: test.com\r\n"
+                                         .. "Content-Length: " .. len
+                                         .. "\r\n\r\n")
+            if not bytes then
+                return nil, err
+            end
+
+            bytes, err = send_body(sock)
+            if not bytes then
+                return nil, err
+            end
+
+            local res, err = sock:receive("*a")
+            sock:close()
+
+            if not res then
+                return nil, err
+            end
+
+            return bytes, res:match("\r\n\r\n(.*)")
+        end
+    }
+_EOC_
+
+    my $config = $block->config;
+    $block->set_value("config", $config . <<'_EOC_');
+    location = /echo {
+        content_by_lua_block {
+            ngx.req.read_body()
+            local body = ngx.req.get_body_data() or ""
+            ngx.print(#body, " ", ngx.md5(body))
+        }
+    }
+_EOC_
+});
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: a whole file by path
+--- config
+    location = /t {
+        content_by_lua_block {
+            local path, data = make_file("data.bin", 3000000)
+
+            local bytes, res = post(false, #data, function (sock)
+                return sock:sendfile(path)
+            end)
+
+            ngx.say("sent: ", bytes)
+            ngx.say("echo: ", res == #data .. " " .. ngx.md5(data))
+        }
+    }
+--- request
+GET /t
+--- response_body
+sent: 3000000
+echo: true
+--- log_level: debug
+--- error_log eval
+qr/lua tcp socket sendfile 3000000 bytes at 0 of "\S+data\.bin", sendfile:1/
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: ranges of the file mixed with send()
+--- config
+    location = /t {
+        content_by_lua_block {
+            local path, data = make_file("data.bin", 100000)
+
+            local all = data:sub(101, 1100) .. "middle"
+                        .. data:sub(#data - 9) .. data:sub(99001)
+
+            local bytes, res = post(false, #all, function (sock)
+                local sizes = {}
+
+                sizes[1] = sock:sendfile(path, 100, 1000)
+                sizes[2] = sock:send("middle")
+
+                -- the ranges are cut at the end of the file
+                sizes[3] = sock:sendfile(path, #data - 10, 100)
+                sizes[4] = sock:sendfile(path, #data + 10)
+                sizes[5] = sock:sendfile(path, 99000, nil)
+
+                return table.concat(sizes, " ")
+            end)
+
+            ngx.say("sent: ", bytes)
+            ngx.say("echo: ", res == #all .. " " .. ngx.md5(all))
+        }
+    }
+--- request
+GET /t
+--- response_body
+sent: 1000 6 10 0 1000
+echo: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: a file descriptor stays open
+--- config
+    location = /t {
+        content_by_lua_block {
+            local ffi = require "ffi"
+
+            ffi.cdef[[
+                int open(const char *path, int flags);
+                int close(int fd);
+            ]]
+
+            local path, data = make_file("data.bin", 10000)
+
+            local fd = ffi.C.open(path, 0)
+
+            local all = data:sub(1, 4096) .. data
+
+            local bytes, res = post(false, #all, function (sock)
+                local n1 = sock:sendfile(fd, 0, 4096)
+                local n2 = sock:sendfile(fd)
+                return n1 + n2
+            end)
+
+            ngx.say("sent: ", bytes)
+            ngx.say("echo: ", res == #all .. " " .. ngx.md5(all))
+            ngx.say("close: ", ffi.C.close(fd))
+        }
+    }
+--- request
+GET /t
+--- response_body
+sent: 14096
+echo: true
+close: 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: read and send over TLS
+--- config
+    location = /t {
+        content_by_lua_block {
+            local path, data = make_file("data.bin", 3000000)
+
+            local bytes, res = post(true, #data, function (sock)
+                return sock:sendfile(path, 0, #data)
+            end)
+
+            ngx.say("sent: ", bytes)
+            ngx.say("echo: ", res == #data .. " " .. ngx.md5(data))
+        }
+    }
+--- request
+GET /t
+--- response_body
+sent: 3000000
+echo: true
+--- log_level: debug
+--- error_log eval
+qr/lua tcp socket sendfile 3000000 bytes at 0 of "\S+data\.bin", sendfile:0/
+--- no_error_log
+[error]
+--- timeout: 10
+
+
+
+=== TEST 5: bad files and bad arguments
+--- config
+    location = /t {
+        content_by_lua_block {
+            local sock = ngx.socket.tcp()
+
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say(sock:sendfile("$TEST_NGINX_HTML_DIR/no-such-file"))
+            ngx.say(pcall(function () return sock:sendfile({}) end))
+            ngx.say(pcall(function () return sock:sendfile("a", -1) end))
+            ngx.say(pcall(function () return sock:sendfile("a", 0, "b") end))
+
+            sock:close()
+
+            ngx.say(sock:sendfile("$TEST_NGINX_HTML_DIR/no-such-file"))
+        }
+    }
+--- request
+GET /t
+--- response_body
+nilno such file or directory
+falsebad argument #1 to 'sendfile' (string or number expected)
+falsebad argument #2 to 'sendfile' (bad offset argument)
+falsebad argument #3 to 'sendfile' (bad len argument)
+nilclosed
+--- no_error_log
+[crit]
+
+
+
+=== TEST 6: sendfile_max_chunk does not stall the sending
+--- config
+    sendfile_max_chunk 8k;
+    lua_socket_send_timeout 3s;
+
+    location = /t {
+        content_by_lua_block {
+            local path, data = make_file("data.bin", 1000000)
+
+            local bytes, res = post(false, #data, function (sock)
+                return sock:sendfile(path)
+            end)
+
+            ngx.say("sent: ", bytes)
+            ngx.say("echo: ", res == #data .. " " .. ngx.md5(data))
+        }
+    }
+--- request
+GET /t
+--- response_body
+sent: 1000000
+echo: true
+--- no_error_log
+[error]
+
+
+
+=== TEST 7: sendfile() vs reading the file in Lua
+--- config
+    location = /t {
+        content_by_lua_block {
+            local size = $TEST_NGINX_SENDFILE_SIZE
+            local loops = $TEST_NGINX_SENDFILE_LOOPS
+
+            local path = make_file("data.bin", size)
+
+            local function read_and_send(sock)
+                local f = assert(io.open(path))
+                local data = f:read("*a")
+                f:close()
+
+                return sock:send(data)
+            end
+
+            local function sendfile(sock)
+                return sock:sendfile(path)
+            end
+
+            for _, send in ipairs({ read_and_send, sendfile }) do
+                local name = send == sendfile and "sendfile()"
+                             or "io.open() and send()"
+
+                ngx.update_time()
+                local begin = ngx.now()
+
+                for _ = 1, loops do
+                    local bytes, err = post(false, size, send)
+                    if not bytes then
+                        ngx.log(ngx.ERR, "failed to post: ", err)
+                        return
+                    end
+                end
+
+                ngx.update_time()
+
+                ngx.log(ngx.WARN, "tcp socket send with ", name, ": ",
+                        (ngx.now() - begin) * 1000 / loops, " msec per ",
+                        size, " bytes")
+            end
+
+            ngx.say("done")
+        }
+    }
+--- request
+GET /t
+--- response_body
+done
+--- error_log
+tcp socket send with io.open() and send():
+tcp socket send with sendfile():
+--- no_error_log
+[error]
+--- timeout: 60
@@ -0,0 +1,78 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+our $SkipReason;
+
+BEGIN {
+    if ($ENV{TEST_NGINX_CHECK_LEAK}) {
+        $SkipReason = "unavailable for the hup tests";
+
+    } else {
+        $ENV{TEST_NGINX_USE_HUP} = 1;
+        undef $ENV{TEST_NGINX_USE_STAP};
+    }
+}
+
+use Test::Nginx::Socket::Lua $SkipReason ? (skip_all => $SkipReason) : ();
+
+#worker_connections(1014);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 4);
+
+#no_diff();
+no_long_string();
+master_on();
+workers(2);
+
+no_shuffle();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: watch a prefix before the HUP reload
+--- http_config
+    lua_shared_dict dogs 1m events=64;
+--- config
+    location = /test {
+        content_by_lua_block {
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:watch("user:"))
+            dogs:set("user:1", "foo")
+        }
+    }
+--- request
+GET /test
+--- response_body
+true
+--- no_error_log
+[error]
+[alert]
+
+
+
+=== TEST 2: the old workers exit without leaving their eventfd open
+--- http_config
+    lua_shared_dict dogs 1m events=64;
+--- config
+    location = /test {
+        content_by_lua_block {
+            -- leaves the old workers the time to exit
+            ngx.sleep(0.5)
+
+            local dogs = ngx.shared.dogs
+
+            ngx.say(dogs:watch("user:"))
+            dogs:set("user:2", "bar")
+        }
+    }
+--- request
+GET /test
+--- response_body
+true
+--- no_error_log
+[alert]
+open socket
@@ -0,0 +1,240 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+
+use Test::Nginx::Socket::Lua;
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 3);
+
+no_long_string();
+#no_diff();
+
+$ENV{TEST_NGINX_DNS_PORT} ||= 1953;
+
+# the A record of any name, 127.0.0.1 with the given TTL, or the given
+# error code
+our $DnsReply = sub {
+    my ($ttl, $rcode) = @_;
+
+    return sub {
+        my $req = shift;
+
+        my $res = substr($req, 0, 2)
+                  . pack("nnnnn", 0x8180 | $rcode, 1, $rcode ? 0 : 1, 0, 0)
+                  . substr($req, 12);
+
+        if (!$rcode) {
+            $res .= pack("nnnNnC4", 0xc00c, 1, 1, $ttl, 4, 127, 0, 0, 1);
+        }
+
+        return $res;
+    };
+};
+
+add_block_preprocessor(sub {
+    my $block = shift;
+
+    my $http_config = $block->http_config || '';
+    $block->set_value("http_config", $http_config . <<'_EOC_');
+    init_by_lua_block {
+        function connect(n)
+            local res = {}
+
+            for i = 1, n do
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("dns.test",
+                                             $TEST_NGINX_SERVER_PORT)
+                res[i] = ok and "ok" or err
+                sock:close()
+            end
+
+            return table.concat(res, ", ")
+        end
+
+        function stats()
+            local st, err = ngx.socket.dns_cache_stats()
+            if not st then
+                return err
+            end
+
+            return string.format("hits: %d, stale: %d, negative: %d, "
+                                 .. "misses: %d, entries: %d", st.hits,
+                                 st.stale, st.negative, st.misses,
+                                 st.entries)
+        end
+    }
+_EOC_
+
+    if (!defined $block->udp_listen) {
+        $block->set_value("udp_listen", $ENV{TEST_NGINX_DNS_PORT});
+    }
+});
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: the answers are cached
+--- config
+    location = /t {
+        resolver 127.0.0.1:$TEST_NGINX_DNS_PORT ipv6=off;
+        lua_socket_dns_cache 100;
+
+        content_by_lua_block {
+            ngx.say(connect(3))
+            ngx.say(stats())
+        }
+    }
+--- udp_reply eval: $::DnsReply->(60, 0)
+--- request
+GET /t
+--- response_body
+ok, ok, ok
+hits: 2, stale: 0, negative: 0, misses: 1, entries: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: negative answers are cached
+--- config
+    location = /t {
+        resolver 127.0.0.1:$TEST_NGINX_DNS_PORT ipv6=off;
+        lua_socket_dns_cache 100 negative=30s;
+
+        content_by_lua_block {
+            ngx.say(connect(2))
+            ngx.say(stats())
+        }
+    }
+--- udp_reply eval: $::DnsReply->(60, 3)
+--- request
+GET /t
+--- response_body
+dns.test could not be resolved (3: Host not found), dns.test could not be resolved (3: Host not found)
+hits: 0, stale: 0, negative: 1, misses: 1, entries: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: the stale answer is used while it is refreshed
+--- config
+    location = /t {
+        resolver 127.0.0.1:$TEST_NGINX_DNS_PORT ipv6=off;
+        lua_socket_dns_cache 100 valid=1s stale=10s;
+
+        content_by_lua_block {
+            ngx.say(connect(1))
+
+            ngx.sleep(1.1)
+            ngx.say(connect(1))
+
+            ngx.sleep(0.1)
+            ngx.say(connect(1))
+
+            ngx.say(stats())
+        }
+    }
+--- udp_reply eval: $::DnsReply->(60, 0)
+--- request
+GET /t
+--- response_body
+ok
+ok
+ok
+hits: 1, stale: 1, negative: 0, misses: 1, entries: 1
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: the cache of each location, and turned off
+--- http_config
+    resolver 127.0.0.1:$TEST_NGINX_DNS_PORT ipv6=off;
+    lua_socket_dns_cache 100;
+--- config
+    location = /t {
+        content_by_lua_block {
+            ngx.say(connect(2))
+            ngx.say(stats())
+
+            local res = ngx.location.capture("/other")
+            ngx.print(res.body)
+
+            res = ngx.location.capture("/off")
+            ngx.print(res.body)
+        }
+    }
+
+    location = /other {
+        lua_socket_dns_cache 10;
+
+        content_by_lua_block {
+            ngx.say(connect(1))
+            ngx.say(stats())
+        }
+    }
+
+    location = /off {
+        lua_socket_dns_cache off;
+
+        content_by_lua_block {
+            ngx.say(connect(1))
+            ngx.say(stats())
+        }
+    }
+--- udp_reply eval: $::DnsReply->(60, 0)
+--- request
+GET /t
+--- response_body
+ok, ok
+hits: 1, stale: 0, negative: 0, misses: 1, entries: 1
+ok
+hits: 0, stale: 0, negative: 0, misses: 1, entries: 1
+ok
+dns cache disabled
+--- no_error_log
+[error]
+
+
+
+=== TEST 5: the answers are shared through a lua_shared_dict
+--- http_config
+    resolver 127.0.0.1:$TEST_NGINX_DNS_PORT ipv6=off;
+    lua_shared_dict dns 1m;
+--- config
+    location = /t {
+        lua_socket_dns_cache 100 shared=dns;
+
+        content_by_lua_block {
+            ngx.say(connect(1))
+            ngx.say(stats())
+
+            -- another cache, as the one of another worker
+            local res = ngx.location.capture("/other")
+            ngx.print(res.body)
+
+            ngx.say("stored: ", ngx.shared.dns:get("dns:dns.test") ~= nil)
+        }
+    }
+
+    location = /other {
+        lua_socket_dns_cache 100 shared=dns;
+
+        content_by_lua_block {
+            ngx.say(connect(1))
+            ngx.say(stats())
+        }
+    }
+--- udp_reply eval: $::DnsReply->(60, 0)
+--- request
+GET /t
+--- response_body
+ok
+hits: 0, stale: 0, negative: 0, misses: 1, entries: 1
+ok
+hits: 1, stale: 0, negative: 0, misses: 0, entries: 1
+stored: true
+--- no_error_log
+[error]